@@ -39,6 +39,11 @@ cases = {
         "GC_INITIAL_HEAP_SIZE=10g",
         *cases['rebuild'](build),
     ],
+    "rebuild_arena": lambda build: [
+        *cases['rebuild'](build),
+        "--eval-allocator",
+        "arena",
+    ],
     "parse": lambda build: [
         f"{build}/bin/nix",
         *flake_args,
@@ -46,6 +51,45 @@ cases = {
         "-f",
         "bench/nixpkgs/pkgs/development/haskell-modules/hackage-packages.nix",
     ],
+    "parse_arena": lambda build: [
+        *cases['parse'](build),
+        "--eval-allocator",
+        "arena",
+    ],
+    "log_json": lambda build: [
+        f"{build}/bin/nix",
+        *flake_args,
+        "eval",
+        "--log-format",
+        "internal-json",
+        "--expr",
+        "builtins.foldl' (a: i: builtins.trace i a) 0 (builtins.genList (x: x) 200000)",
+    ],
+    "log_binary": lambda build: [
+        f"{build}/bin/nix",
+        *flake_args,
+        "eval",
+        "--log-format",
+        "internal-binary",
+        "--expr",
+        "builtins.foldl' (a: i: builtins.trace i a) 0 (builtins.genList (x: x) 200000)",
+    ],
+    "regex": lambda build: [
+        f"{build}/bin/nix",
+        *flake_args,
+        "--extra-experimental-features",
+        "linear-regex",
+        "eval",
+        "--expr",
+        textwrap.dedent(r"""
+            let
+              text = builtins.readFile ./bench/nixpkgs/pkgs/development/haskell-modules/hackage-packages.nix;
+              lines = builtins.filter builtins.isString (builtins.split "\n" text);
+              versions = map (builtins.match ".*version = \"([0-9]+)\\.([0-9.]+)(-r[0-9]+)?\";.*") lines;
+            in
+              builtins.length (builtins.filter (v: v != null) versions)
+        """).replace("\n", " "),
+    ],
 }
 
 arg_parser = argparse.ArgumentParser()
@@ -189,13 +233,17 @@ def bench_memory(env):
             subprocess.run(commandline, env=env, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
             with open(path) as fd:
                 stats = json.load(fd)
+            # the arena allocator reports its own heap instead of the GC's
+            heap = stats['gc']
+            if 'arena' in stats:
+                heap = {'heapSize': stats['arena']['reserved'], 'totalBytes': stats['arena']['bytes']}
             results.setdefault(case, []).append((case_command, MemoryStatistics(
                 envBytes=stats['envs']['bytes'],
                 listBytes=stats['list']['bytes'],
                 setBytes=stats['sets']['bytes'],
                 valueBytes=stats['values']['bytes'],
-                heapSize=stats['gc']['heapSize'],
-                heapBytes=stats['gc']['totalBytes'],
+                heapSize=heap['heapSize'],
+                heapBytes=heap['totalBytes'],
             )))
 
     print("Benchmarks summary\n---\n")
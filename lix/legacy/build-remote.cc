@@ -1,4 +1,5 @@
 #include "lix/libstore/path.hh"
+#include "lix/libutil/async-collect.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/c-calls.hh"
 #include "lix/libutil/error.hh"
@@ -16,10 +17,14 @@
 #include <exception>
 #include <kj/async.h>
 #include <kj/time.h>
+#include <map>
+#include <numeric>
+#include <optional>
 #include <set>
 #include <memory>
 #include <string>
 #include <tuple>
+#include <vector>
 #if __APPLE__
 #include <sys/time.h>
 #endif
@@ -46,10 +51,32 @@
 namespace nix {
 
 namespace {
+/**
+ * Stores of remote builders this hook has already connected to. A hook
+ * serves many builds over its lifetime; keeping the stores around keeps
+ * their connections (and thus their ssh sessions) open between builds.
+ */
+using BuilderStores = std::map<std::string, ref<Store>>;
+
 struct Instance final : rpc::build_remote::HookInstance::Server
 {
     unsigned int maxBuildJobs;
-    bool initialized = false, used = false;
+    bool initialized = false;
+
+    /**
+     * Set while a build request is being decided or an accepted build is
+     * running. Hooks are reused for further builds once a build has been
+     * finished, but only run one build at a time since build logs are sent
+     * through the process-global logger. Shared with the `AcceptedBuild`.
+     */
+    std::shared_ptr<bool> busy = std::make_shared<bool>(false);
+
+    std::optional<ref<Store>> store;
+    /**
+     * Shared with the `AcceptedBuild` so that it can drop the store of its
+     * builder if the build failed because the builder went away.
+     */
+    std::shared_ptr<BuilderStores> builderStores = std::make_shared<BuilderStores>();
 
     kj::Promise<void> init(InitContext context) override;
 
@@ -83,20 +110,84 @@ static AutoCloseFD openSlotLock(const rust::Ref<Machine> m, uint64_t slot)
     );
 }
 
+static std::string builderStoreKey(rust::Ref<Machine> m)
+{
+    return to_std_string(m.uri.as_str()) + '\0' + to_std_string(m.ssh_key.as_str()) + '\0'
+        + to_std_string(m.ssh_public_host_key.as_str());
+}
+
+/**
+ * Whether the connection of a builder store still answers. Builders may go
+ * away while a hook is idle or while a build is running on them, and stores
+ * only notice a dead connection when a request on it fails.
+ */
+static kj::Promise<Result<bool>> isBuilderStoreAlive(Store & store)
+try {
+    auto reply = co_await store.queryValidPaths({});
+    co_return reply.has_value();
+} catch (...) {
+    co_return result::current_exception();
+}
+
+static kj::Promise<Result<ref<Store>>> openBuilderStore(BuilderStores & stores, rust::Ref<Machine> m)
+try {
+    auto key = builderStoreKey(m);
+    if (auto cached = get(stores, key)) {
+        auto store = *cached;
+        if (TRY_AWAIT(isBuilderStoreAlive(*store))) {
+            co_return store;
+        }
+        debug("connection to '%s' was lost, reconnecting", to_std_string(m.uri.as_str()));
+        stores.erase(key);
+    }
+    auto store = TRY_AWAIT(openStore(m));
+    stores.insert_or_assign(key, store);
+    co_return store;
+} catch (...) {
+    co_return result::current_exception();
+}
+
 static bool allSupportedLocally(Store & store, const std::set<std::string>& requiredFeatures) {
     for (auto & feature : requiredFeatures)
         if (!store.config().systemFeatures.get().count(feature)) return false;
     return true;
 }
 
-static std::tuple<bool, rust::RefMut<Machine>, AutoCloseFD> selectBestMachine(
+namespace {
+struct MachineCandidate
+{
+    rust::RefMut<Machine> machine;
+    AutoCloseFD slotLock;
+    uint64_t load;
+    float speedFactor;
+};
+}
+
+static bool betterByLoad(const MachineCandidate & a, const MachineCandidate & b)
+{
+    auto aLoad = a.load / a.speedFactor;
+    auto bLoad = b.load / b.speedFactor;
+    if (aLoad != bLoad) {
+        return aLoad < bLoad;
+    }
+    if (a.speedFactor != b.speedFactor) {
+        return a.speedFactor > b.speedFactor;
+    }
+    return a.load < b.load;
+}
+
+/**
+ * Find all machines that could build the derivation and have a free slot,
+ * holding one free slot lock on each of them. The returned candidates are
+ * ordered best-first by load; the bool is whether any machine of the right
+ * type exists at all, regardless of whether it currently has a free slot.
+ */
+static std::tuple<bool, std::vector<MachineCandidate>> selectCandidateMachines(
     Machines & machines, const std::string & neededSystem, const std::set<std::string> & requiredFeatures
 )
 {
     bool rightType = false;
-    rust::RefMut<Machine> bestMachine;
-    AutoCloseFD bestSlotLock;
-    uint64_t bestLoad = 0;
+    std::vector<MachineCandidate> candidates;
     auto needed_system_rust = rust::to_string(neededSystem);
     auto required_features_rs = rust::to_hash_set(requiredFeatures);
 
@@ -119,29 +210,133 @@ static std::tuple<bool, rust::RefMut<Machine>, AutoCloseFD> selectBestMachine(
             if (!free) {
                 continue;
             }
-            bool best = false;
-            if (!bestSlotLock) {
-                best = true;
-            } else if (load / m.speed_factor < bestLoad / bestMachine.speed_factor) {
-                best = true;
-            } else if (load / m.speed_factor == bestLoad / bestMachine.speed_factor) {
-                if (m.speed_factor > bestMachine.speed_factor) {
-                    best = true;
-                } else if (m.speed_factor == bestMachine.speed_factor) {
-                    if (load < bestLoad) {
-                        best = true;
-                    }
-                }
-            }
-            if (best) {
-                bestLoad = load;
-                bestSlotLock = std::move(free);
-                bestMachine = m;
+            candidates.push_back({m, std::move(free), load, m.speed_factor});
+        }
+    }
+
+    // stable, so machines that compare equal keep their configured order
+    std::stable_sort(candidates.begin(), candidates.end(), betterByLoad);
+
+    return {rightType, std::move(candidates)};
+}
+
+static size_t countEligibleMachines(
+    const Machines & machines, const std::string & neededSystem, const std::set<std::string> & requiredFeatures
+)
+{
+    auto needed_system_rust = rust::to_string(neededSystem);
+    auto required_features_rs = rust::to_hash_set(requiredFeatures);
+    size_t count = 0;
+    for (auto m : machines.iter()) {
+        if (m.is_eligible(needed_system_rust, required_features_rs)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Compute the input closure of `drvPath` as the remote builder will need it,
+ * together with the NAR size of every path in it.
+ */
+static kj::Promise<Result<std::map<StorePath, uint64_t>>>
+queryInputClosureSizes(Store & store, const StorePath & drvPath)
+try {
+    auto drv = TRY_AWAIT(store.readDerivation(drvPath));
+
+    StorePathSet inputs = drv.inputSrcs;
+    for (auto & [inputDrv, wantedOutputs] : drv.inputDrvs) {
+        auto outputs = TRY_AWAIT(store.queryDerivationOutputMap(inputDrv));
+        for (auto & outputName : wantedOutputs) {
+            if (auto output = get(outputs, outputName)) {
+                inputs.insert(*output);
             }
         }
     }
 
-    return {rightType, bestMachine, std::move(bestSlotLock)};
+    StorePathSet closure;
+    TRY_AWAIT(store.computeFSClosure(inputs, closure));
+
+    std::map<StorePath, uint64_t> sizes;
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+    TRY_AWAIT(asyncSpread(closure, [&](const StorePath & path) -> kj::Promise<Result<void>> {
+        try {
+            sizes.emplace(path, TRY_AWAIT(store.queryPathInfo(path))->narSize);
+            co_return result::success();
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    }));
+    co_return sizes;
+} catch (...) {
+    co_return result::current_exception();
+}
+
+namespace {
+struct ProbedCandidate
+{
+    std::shared_ptr<Store> sshStore;
+    uint64_t missingBytes = 0;
+};
+}
+
+/**
+ * Connect to every candidate and ask it which of the inputs it already has.
+ * Candidates that cannot be reached are disabled and left without a store.
+ */
+static kj::Promise<Result<std::vector<ProbedCandidate>>> probeCandidates(
+    BuilderStores & builderStores,
+    std::vector<MachineCandidate> & candidates,
+    const std::map<StorePath, uint64_t> & inputSizes
+)
+try {
+    StorePathSet inputs;
+    for (auto & [path, size] : inputSizes) {
+        inputs.insert(path);
+    }
+
+    std::vector<ProbedCandidate> probed(candidates.size());
+    std::vector<size_t> indices(candidates.size());
+    std::iota(indices.begin(), indices.end(), 0);
+
+    TRY_AWAIT(asyncSpread(indices, [&](size_t i) -> kj::Promise<Result<void>> {
+        auto & machine = candidates[i].machine;
+        auto machineName = to_std_string(machine.name.as_str());
+        try {
+            auto act = logger->startActivity(
+                lvlTalkative, actUnknown, fmt("querying inputs present on '%s'", machineName)
+            );
+            std::shared_ptr<Store> sshStore = TRY_AWAIT(openBuilderStore(builderStores, machine));
+            auto present = TRY_AWAIT(sshStore->queryValidPaths(inputs));
+            uint64_t missingBytes = 0;
+            for (auto & [path, size] : inputSizes) {
+                if (!present.contains(path)) {
+                    missingBytes += size;
+                }
+            }
+            debug(
+                "remote machine '%s' is missing %d of %d input bytes",
+                machineName,
+                missingBytes,
+                std::accumulate(
+                    inputSizes.begin(),
+                    inputSizes.end(),
+                    uint64_t(0),
+                    [](uint64_t sum, auto & entry) { return sum + entry.second; }
+                )
+            );
+            probed[i] = {sshStore, missingBytes};
+        } catch (std::exception & e) { // NOLINT(lix-foreign-exceptions)
+            printError("cannot build on '%s': %s", machineName, e.what());
+            builderStores.erase(builderStoreKey(machine));
+            machine.disable();
+        }
+        co_return result::success();
+    }));
+
+    co_return probed;
+} catch (...) {
+    co_return result::current_exception();
 }
 
 static void printSelectionFailureMessage(
@@ -180,6 +375,7 @@ struct BuilderConnection
     AutoCloseFD slotLock;
     std::shared_ptr<Store> sshStore;
     std::string storeUri;
+    std::string storeKey;
 };
 
 struct AcceptedBuild final : rpc::build_remote::HookInstance::AcceptedBuild::Server
@@ -187,24 +383,45 @@ struct AcceptedBuild final : rpc::build_remote::HookInstance::AcceptedBuild::Ser
     ref<Store> store;
     StorePath drvPath;
     BuilderConnection builder;
+    std::shared_ptr<BuilderStores> builderStores;
+    std::shared_ptr<bool> busy;
     bool used = false;
     Logger * oldLogger = nullptr;
 
-    AcceptedBuild(ref<Store> store, StorePath drvPath, BuilderConnection builder)
+    AcceptedBuild(
+        ref<Store> store,
+        StorePath drvPath,
+        BuilderConnection builder,
+        std::shared_ptr<BuilderStores> builderStores,
+        std::shared_ptr<bool> busy
+    )
         : store(store)
         , drvPath(drvPath)
         , builder(std::move(builder))
+        , builderStores(std::move(builderStores))
+        , busy(std::move(busy))
     {
     }
 
     ~AcceptedBuild()
+    {
+        release();
+    }
+
+    /**
+     * Give up the builder slot and make the hook available for another build.
+     */
+    void release()
     {
         // revert to previous logger as rpc logger will go away during teardown.
         // dangling pointers tend to have deleterious effects on program health.
         if (oldLogger) {
             std::swap(logger, oldLogger);
             delete oldLogger;
+            oldLogger = nullptr;
         }
+        builder.slotLock.reset();
+        *busy = false;
     }
 
     kj::Promise<Result<void>> runImpl(RunContext context);
@@ -217,6 +434,7 @@ enum class BuildRejected { Temporarily, Permanently };
 static kj::Promise<Result<std::variant<BuildRejected, BuilderConnection>>> connectToBuilder(
     const ref<Store> & store,
     const StorePath & drvPath,
+    BuilderStores & builderStores,
     Machines & machines,
     const unsigned int maxBuildJobs,
     const bool amWilling,
@@ -238,15 +456,32 @@ try {
     /* Error ignored here, will be caught later */
     (void) sys::mkdir(currentLoad, 0777);
 
+    /* Computed before any slot is locked, and only if there can be more
+       than one machine to choose from. Machines are chosen by load alone
+       if it is not known. */
+    const uint64_t localityBytes = settings.buildersInputLocality;
+    std::optional<std::map<StorePath, uint64_t>> inputSizes;
+    if (localityBytes != 0 && countEligibleMachines(machines, neededSystem, requiredFeatures) > 1) {
+        try {
+            inputSizes = TRY_AWAIT(queryInputClosureSizes(*store, drvPath));
+        } catch (Error & e) {
+            printTaggedWarning(
+                "not preferring remote machines by input locality for '%s': %s",
+                store->printStorePath(drvPath),
+                e.msg()
+            );
+        }
+    }
+
     while (true) {
         bestSlotLock.reset();
         AutoCloseFD lock = openLockFile(currentLoad + "/main-lock", true);
         TRY_AWAIT(lockFileAsync(lock.get(), ltWrite));
 
-        auto [rightType, bestMachine, slotLock] = selectBestMachine(machines, neededSystem, requiredFeatures);
-        bestSlotLock = std::move(slotLock);
+        auto [rightType, candidates] =
+            selectCandidateMachines(machines, neededSystem, requiredFeatures);
 
-        if (!bestSlotLock) {
+        if (candidates.empty()) {
             if (rightType && !canBuildLocally) {
                 co_return BuildRejected::Temporarily;
             } else {
@@ -262,28 +497,82 @@ try {
             }
         }
 
+        if (!inputSizes || candidates.size() == 1) {
+            candidates.erase(candidates.begin() + 1, candidates.end());
+        }
+
+        for (auto & candidate : candidates) {
 #if __APPLE__
-        futimes(bestSlotLock.get(), nullptr);
+            futimes(candidate.slotLock.get(), nullptr);
 #else
-        futimens(bestSlotLock.get(), nullptr);
+            futimens(candidate.slotLock.get(), nullptr);
 #endif
+        }
 
         lock.reset();
 
-        std::shared_ptr<Store> sshStore;
-        auto machineName = to_std_string(bestMachine.name.as_str());
+        if (candidates.size() == 1) {
+            auto & bestMachine = candidates[0].machine;
+            bestSlotLock = std::move(candidates[0].slotLock);
 
-        try {
-            auto act =
-                logger->startActivity(lvlTalkative, actUnknown, fmt("connecting to '%s'", machineName));
+            std::shared_ptr<Store> sshStore;
+            auto machineName = to_std_string(bestMachine.name.as_str());
+
+            try {
+                auto act = logger->startActivity(
+                    lvlTalkative, actUnknown, fmt("connecting to '%s'", machineName)
+                );
+
+                sshStore = TRY_AWAIT(openBuilderStore(builderStores, bestMachine));
+                co_return BuilderConnection{
+                    std::move(bestSlotLock),
+                    sshStore,
+                    to_std_string(bestMachine.uri.as_str()),
+                    builderStoreKey(bestMachine)
+                };
+            } catch (std::exception & e) { // NOLINT(lix-foreign-exceptions)
+                printError("cannot build on '%s': %s", machineName, e.what());
+                builderStores.erase(builderStoreKey(bestMachine));
+                bestMachine.disable();
+            }
+            continue;
+        }
+
+        /* Several machines could take this build right now. Prefer the one
+           that needs the fewest input bytes copied to it, trading every
+           `builders-input-locality` missing bytes against one job that is
+           already running on the machine. */
+        auto probed = TRY_AWAIT(probeCandidates(builderStores, candidates, *inputSizes));
 
-            sshStore = TRY_AWAIT(openStore(bestMachine));
+        std::optional<size_t> best;
+        double bestCost = 0;
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            if (!probed[i].sshStore) {
+                continue;
+            }
+            auto & candidate = candidates[i];
+            double cost = candidate.load / candidate.speedFactor
+                + double(probed[i].missingBytes) / localityBytes;
+            debug(
+                "remote machine '%s' has locality-adjusted cost %f",
+                to_std_string(candidate.machine.name.as_str()),
+                cost
+            );
+            // candidates are sorted by load, so ties keep the old preference
+            if (!best || cost < bestCost) {
+                best = i;
+                bestCost = cost;
+            }
+        }
+
+        if (best) {
+            auto & bestMachine = candidates[*best].machine;
             co_return BuilderConnection{
-                std::move(bestSlotLock), sshStore, to_std_string(bestMachine.uri.as_str())
+                std::move(candidates[*best].slotLock),
+                probed[*best].sshStore,
+                to_std_string(bestMachine.uri.as_str()),
+                builderStoreKey(bestMachine)
             };
-        } catch (std::exception & e) { // NOLINT(lix-foreign-exceptions)
-            printError("cannot build on '%s': %s", machineName, e.what());
-            bestMachine.disable();
         }
     }
 } catch (...) {
@@ -342,12 +631,14 @@ try {
     }
 
     // FIXME this does not open a daemon connection for historical reasons.
-    // we may create a lot of build hook instances, and having each of them
-    // also create a daemon instance is inefficient and wasteful. in future
-    // versions of the build hook (where we don't need one hook process per
-    // build) we should change this to using a daemon connection, ideally a
-    // daemon connection provided by the parent via file descriptor passing
-    auto store = TRY_AWAIT(openStore(settings.storeUri, {}, AllowDaemon::Disallow));
+    // hooks are reused for many builds now, but there may still be as many
+    // hooks as there are concurrent remote builds. in future versions we
+    // should change this to using a daemon connection, ideally a daemon
+    // connection provided by the parent via file descriptor passing
+    if (!this->store) {
+        this->store = TRY_AWAIT(openStore(settings.storeUri, {}, AllowDaemon::Disallow));
+    }
+    auto store = *this->store;
 
     /* It would be more appropriate to use $XDG_RUNTIME_DIR, since
        that gets cleared on reboot, but it wouldn't work on macOS. */
@@ -374,7 +665,14 @@ try {
         rpc::to<std::set<std::string>>(context.getParams().getRequiredFeatures());
 
     auto result = TRY_AWAIT(connectToBuilder(
-        store, drvPath, machines, maxBuildJobs, amWilling, neededSystem, requiredFeatures
+        store,
+        drvPath,
+        *builderStores,
+        machines,
+        maxBuildJobs,
+        amWilling,
+        neededSystem,
+        requiredFeatures
     ));
 
     if (auto immediateResponse = std::get_if<BuildRejected>(&result)) {
@@ -392,7 +690,9 @@ try {
     assert(builder);
 
     auto ac = context.getResults().initResult().initAccept();
-    ac.setMachine(kj::heap<AcceptedBuild>(store, drvPath, std::move(*builder)));
+    ac.setMachine(
+        kj::heap<AcceptedBuild>(store, drvPath, std::move(*builder), builderStores, busy)
+    );
 
     co_return result::success();
 } catch (...) {
@@ -402,12 +702,13 @@ try {
 kj::Promise<void> Instance::build(BuildContext context)
 {
     return RPC_IMPL({
-        if (used) {
-            throw Error("build hooks can only accept a single job");
+        if (*busy) {
+            throw Error("build hook is still busy with another build");
         }
-        used = true; // lock out other rpc calls during processing
+        *busy = true; // lock out other rpc calls during processing
         auto result = co_await buildImpl(context);
-        used = result.has_value() && context.getResults().getResult().isAccept();
+        // an accepted build keeps the hook busy until it has finished running
+        *busy = result.has_value() && context.getResults().getResult().isAccept();
         result.value();
     });
 }
@@ -424,7 +725,17 @@ kj::Promise<void> AcceptedBuild::run(RunContext context)
         used = true;
         this->oldLogger = oldLogger;
         auto result = co_await runImpl(context);
+        // don't hand a dead connection to the next build if this one failed
+        // because the builder went away.
+        if (!result.has_value() && !TRY_AWAIT(isBuilderStoreAlive(*builder.sshStore))) {
+            builderStores->erase(builder.storeKey);
+        }
+        // send all logs of this build before reporting it as finished, the
+        // parent may hand this hook its next build as soon as we return.
+        auto flushed = co_await logger->flush();
+        release();
         result.value();
+        flushed.value();
     });
 }
 
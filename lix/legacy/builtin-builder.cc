@@ -5,6 +5,7 @@
 #include "lix/libutil/error.hh"
 #include "lix/libutil/file-system.hh"
 #include "lix/libutil/logging.hh"
+#include "lix/libutil/logging-rpc.hh"
 #include "lix/libutil/strings.hh"
 #include "lix/libutil/types.hh"
 #include <string_view>
@@ -51,6 +52,10 @@ static int main_builtin_builder(AsyncIoRoot & aio, std::string programName, Stri
         globalConfig.set(arg.substr(2), value);
     }
 
+    if (loggerSettings.binaryInternalLogs) {
+        logger = rpc::log::makeFramedLogger();
+    }
+
     while (argvIt != argvEnd) {
         const auto key = getArg("builder argument");
         if (!key.starts_with("--")) {
@@ -13,6 +13,9 @@
 #include "lix/libutil/monitor-fd.hh"
 #include "lix/libstore/serve-protocol.hh"
 #include "lix/libstore/serve-protocol-impl.hh" // IWYU pragma: keep
+#include "lix/libstore/transport-compression.hh"
+#include "lix/libutil/compression.hh"
+#include "lix/libutil/environment-variables.hh"
 #include "lix/libmain/shared.hh"
 #include "graphml.hh"
 #include "lix/libcmd/legacy.hh"
@@ -337,7 +340,7 @@ opQuery(std::shared_ptr<Store> store, AsyncIoRoot & aio, Strings opFlags, String
     enum QueryType
         { qOutputs, qRequisites, qReferences, qReferrers
         , qReferrersClosure, qDeriver, qValidDerivers, qBinding, qHash, qSize
-        , qTree, qGraph, qGraphML, qResolve, qRoots };
+        , qClosureSize, qUniqueSize, qTree, qGraph, qGraphML, qResolve, qRoots };
     std::optional<QueryType> query;
     bool useOutput = false;
     bool includeOutputs = false;
@@ -362,6 +365,8 @@ opQuery(std::shared_ptr<Store> store, AsyncIoRoot & aio, Strings opFlags, String
         }
         else if (i == "--hash") query = qHash;
         else if (i == "--size") query = qSize;
+        else if (i == "--closure-size") query = qClosureSize;
+        else if (i == "--unique-size") query = qUniqueSize;
         else if (i == "--tree") query = qTree;
         else if (i == "--graph") query = qGraph;
         else if (i == "--graphml") query = qGraphML;
@@ -482,6 +487,25 @@ opQuery(std::shared_ptr<Store> store, AsyncIoRoot & aio, Strings opFlags, String
             }
             break;
 
+        case qClosureSize:
+        case qUniqueSize: {
+            StorePaths paths;
+            for (auto & i : opArgs) {
+                for (auto & j : aio.blockOn(
+                         maybeUseOutputs(store, store->followLinksToStorePath(i), useOutput, forceRealise)
+                     ))
+                {
+                    paths.push_back(j);
+                }
+            }
+            auto sizes = aio.blockOn(store->getClosureSizes({paths.begin(), paths.end()}));
+            for (auto & path : paths) {
+                auto & size = sizes.at(path);
+                pager << fmt("%d\n", query == qClosureSize ? size.narSize : size.uniqueSize);
+            }
+            break;
+        }
+
         case qTree: {
             StorePathSet done;
             for (auto & i : opArgs) {
@@ -931,10 +955,28 @@ opServe(std::shared_ptr<Store> store, AsyncIoRoot & aio, Strings opFlags, String
     /* Exchange the greeting. */
     unsigned int magic = readNum<unsigned>(in);
     if (magic != SERVE_MAGIC_1) throw Error("protocol mismatch");
-    out << SERVE_MAGIC_2 << SERVE_PROTOCOL_VERSION;
+    out << SERVE_MAGIC_2
+        << (SERVE_PROTOCOL_VERSION
+            | SERVE_TRANSPORT_COMPRESSION_FLAG
+            | SERVE_BULK_QUERIES_FLAG);
     out.flush();
     ServeProto::Version clientVersion = readNum<unsigned>(in);
 
+    /* Clients that want bulk queries echo the flag we always offer. */
+    bool bulkQueries = clientVersion & SERVE_BULK_QUERIES_FLAG;
+
+    /* Clients that want transport compression echo its flag too, followed
+       by their offer, which we always accept. */
+    std::optional<TransportCompression> transportCompression;
+    if (clientVersion & SERVE_TRANSPORT_COMPRESSION_FLAG) {
+        auto offer = readNum<uint32_t>(in);
+        transportCompression = TransportCompression::decode(offer);
+        if (!transportCompression) {
+            throw Error("invalid transport compression offer %x", offer);
+        }
+    }
+    clientVersion &= ~(SERVE_TRANSPORT_COMPRESSION_FLAG | SERVE_BULK_QUERIES_FLAG);
+
     ServeProto::ReadConn rconn {
         .from = in,
         .store = *store,
@@ -975,6 +1017,24 @@ opServe(std::shared_ptr<Store> store, AsyncIoRoot & aio, Strings opFlags, String
         }
     };
 
+    auto writePathInfos = [&](const StorePathSet & paths) {
+        for (auto & i : paths) {
+            try {
+                auto info = aio.blockOn(store->queryPathInfo(i));
+                out << store->printStorePath(info->path);
+                out << ServeProto::write(wconn, static_cast<const UnkeyedValidPathInfo &>(*info));
+            } catch (InvalidPath &) {
+            }
+        }
+        out << "";
+    };
+
+    auto requireBulkQueries = [&](ServeProto::Command cmd) {
+        if (!bulkQueries) {
+            throw Error("unknown serve command %1%", cmd);
+        }
+    };
+
     while (true) {
         ServeProto::Command cmd;
         try {
@@ -1003,24 +1063,26 @@ opServe(std::shared_ptr<Store> store, AsyncIoRoot & aio, Strings opFlags, String
             }
 
             case ServeProto::Command::QueryPathInfos: {
-                auto paths = ServeProto::Serialise<StorePathSet>::read(rconn);
-                // !!! Maybe we want a queryPathInfos?
-                for (auto & i : paths) {
-                    try {
-                        auto info = aio.blockOn(store->queryPathInfo(i));
-                        out << store->printStorePath(info->path);
-                        out << ServeProto::write(wconn, static_cast<const UnkeyedValidPathInfo &>(*info));
-                    } catch (InvalidPath &) {
-                    }
-                }
-                out << "";
+                writePathInfos(ServeProto::Serialise<StorePathSet>::read(rconn));
                 break;
             }
 
-            case ServeProto::Command::DumpStorePath:
-                aio.blockOn(aio.blockOn(store->narFromPath(store->parseStorePath(readString(in))))
-                                ->drainInto(out));
+            case ServeProto::Command::DumpStorePath: {
+                auto nar = aio.blockOn(store->narFromPath(store->parseStorePath(readString(in))));
+                if (transportCompression) {
+                    auto sink = makeFramedCompressionSink(
+                        transportCompression->method,
+                        out,
+                        transportCompression->parallel,
+                        transportCompression->level
+                    );
+                    aio.blockOn(nar->drainInto(*sink));
+                    sink->finish();
+                } else {
+                    aio.blockOn(nar->drainInto(out));
+                }
                 break;
+            }
 
             case ServeProto::Command::ImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
@@ -1088,6 +1150,37 @@ opServe(std::shared_ptr<Store> store, AsyncIoRoot & aio, Strings opFlags, String
                 break;
             }
 
+            case ServeProto::Command::QueryClosurePathInfos: {
+                requireBulkQueries(cmd);
+                bool includeOutputs = readNum<unsigned>(in);
+                StorePathSet closure;
+                aio.blockOn(store->computeFSClosure(
+                    ServeProto::Serialise<StorePathSet>::read(rconn),
+                    closure,
+                    false,
+                    includeOutputs
+                ));
+                writePathInfos(closure);
+                break;
+            }
+
+            case ServeProto::Command::QueryValidPathInfos: {
+                requireBulkQueries(cmd);
+                bool lock = readNum<unsigned>(in);
+                bool substitute = readNum<unsigned>(in);
+                auto paths = ServeProto::Serialise<StorePathSet>::read(rconn);
+                if (lock && writeAllowed)
+                    for (auto & path : paths)
+                        aio.blockOn(store->addTempRoot(path));
+
+                if (substitute && writeAllowed) {
+                    aio.blockOn(store->substitutePaths(paths));
+                }
+
+                writePathInfos(aio.blockOn(store->queryValidPaths(paths)));
+                break;
+            }
+
             case ServeProto::Command::AddToStoreNar: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
 
@@ -1137,13 +1230,22 @@ opServe(std::shared_ptr<Store> store, AsyncIoRoot & aio, Strings opFlags, String
                     }
                 };
 
-                SizedSource sizedSource(in, info.narSize);
+                std::unique_ptr<FramedDecompressionSource> decompressed;
+                if (transportCompression) {
+                    decompressed =
+                        makeFramedDecompressionSource(transportCompression->method, in);
+                }
+
+                SizedSource sizedSource(decompressed ? *decompressed : in, info.narSize);
                 AsyncSourceInputStream stream{sizedSource};
 
                 aio.blockOn(store->addToStore(info, stream, NoRepair, NoCheckSigs));
 
                 // consume all the data that has been sent before continuing.
                 sizedSource.drainAll();
+                if (decompressed) {
+                    decompressed->finish();
+                }
 
                 out << 1; // indicate success
 
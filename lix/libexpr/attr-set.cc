@@ -28,8 +28,33 @@ void BindingsBuilder::insert(std::string_view name, Value value, PosIdx pos)
     return insert(symbols.create(name), value, pos);
 }
 
+BindingsShape::BindingsShape(std::vector<Symbol> names) : names(std::move(names))
+{
+    assert(std::is_sorted(this->names.begin(), this->names.end()));
+
+    // at most half full, so probe sequences stay short
+    uint32_t bits = 1;
+    while ((size_t(1) << bits) < 2 * this->names.size()) {
+        bits++;
+    }
+    shift = 32 - bits;
+    slots.resize(size_t(1) << bits);
+
+    for (uint32_t n = 0; n < this->names.size(); n++) {
+        const uint32_t mask = slots.size() - 1;
+        auto i = slot(this->names[n]);
+        while (slots[i]) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = n + 1;
+    }
+}
+
 void Bindings::sort()
 {
-    if (size_) std::sort(begin(), end());
+    if (size_) {
+        shape_ = nullptr;
+        std::sort(begin(), end());
+    }
 }
 }
@@ -38,6 +38,56 @@ static_assert(sizeof(Attr) == 2 * sizeof(uint32_t) + sizeof(Value *),
     "avoid introducing any padding into Attr if at all possible, and do not "
     "introduce new fields that need not be present for almost every instance.");
 
+/**
+ * The attribute names shared by all sets that one `ExprSet` produces when it
+ * has no dynamic attributes, in the order they are stored in, with a hash
+ * index over them. Sets with the same shape have the same names at the same
+ * positions, so lookups in them need not search, and `//` and `==` on two
+ * of them need not compare names.
+ */
+class BindingsShape
+{
+    std::vector<Symbol> names;
+
+    /**
+     * Open addressing table of indices into `names`, plus one. Zero marks
+     * an empty slot.
+     */
+    std::vector<uint32_t> slots;
+    uint32_t shift;
+
+    uint32_t slot(Symbol name) const
+    {
+        // Fibonacci hashing, symbols are dense small integers
+        return (name.id * 0x9e3779b9U) >> shift;
+    }
+
+public:
+    /**
+     * @param names must be sorted.
+     */
+    explicit BindingsShape(std::vector<Symbol> names);
+
+    uint32_t size() const { return names.size(); }
+
+    /**
+     * The index of `name`, or `size()` if it is not part of the shape.
+     */
+    uint32_t find(Symbol name) const
+    {
+        const uint32_t mask = slots.size() - 1;
+        for (uint32_t i = slot(name);; i = (i + 1) & mask) {
+            auto index = slots[i];
+            if (index == 0) {
+                return size();
+            }
+            if (names[index - 1] == name) {
+                return index - 1;
+            }
+        }
+    }
+};
+
 /**
  * Bindings contains all the attributes of an attribute set. It is defined
  * by its size and its capacity, the capacity being the number of Attr
@@ -54,6 +104,11 @@ public:
 
 private:
     Size size_ = 0;
+    /**
+     * Set for sets built by an `ExprSet`, see `BindingsShape`. Does not
+     * cost any memory in practice since allocations are 16-byte granular.
+     */
+    const BindingsShape * shape_ = nullptr;
     Attr attrs[0];
 
     Bindings() = default;
@@ -69,10 +124,32 @@ public:
     void push_back(const Attr & attr)
     {
         attrs[size_++] = attr;
+        shape_ = nullptr;
+    }
+
+    const BindingsShape * shape() const { return shape_; }
+
+    void setShape(const BindingsShape & shape)
+    {
+        assert(shape.size() == size_);
+        shape_ = &shape;
+    }
+
+    /**
+     * Whether both sets have the same attribute names at the same positions
+     * according to their shapes. `false` does not imply the opposite.
+     */
+    bool sameShape(const Bindings & other) const
+    {
+        return shape_ && shape_ == other.shape_;
     }
 
     const Attr * get(Symbol name)
     {
+        if (shape_) {
+            auto i = shape_->find(name);
+            return i < size_ ? &attrs[i] : nullptr;
+        }
         iterator i = std::lower_bound(begin(), end(), name, [](const Attr & value, const Symbol & compare) {
             return value.name < compare;
         });
@@ -1,12 +1,24 @@
 #include "lix/libexpr/eval-cache.hh"
+#include "lix/libstore/pathlocks.hh"
 #include "lix/libstore/sqlite.hh"
 #include "lix/libexpr/eval.hh"
+#include "lix/libexpr/eval-settings.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/users.hh"
 
+#include <fcntl.h>
+#include <list>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 namespace nix::eval_cache {
 
+/**
+ * Another process is writing the cache we were asked to open.
+ */
+MakeError(EvalCacheBusy, Error);
+
 static const char * schema = R"sql(
 create table if not exists Attributes (
     parent      integer not null,
@@ -18,70 +30,564 @@ create table if not exists Attributes (
 );
 )sql";
 
-struct AttrDb
+/**
+ * A row of the attribute table, with values in their textual form.
+ */
+struct AttrRow
 {
-    std::atomic_bool failed{false};
+    AttrId id;
+    AttrType type;
+    std::optional<std::string> value;
+    std::optional<std::string> context;
+};
+
+/**
+ * Storage engine of an evaluation cache: a table of attributes keyed by
+ * their parent's id and their name, in which inserting an existing key
+ * replaces the row and gives it a new id.
+ */
+struct AttrStorage
+{
+    virtual ~AttrStorage() = default;
+
+    virtual AttrId insert(
+        const AttrKey & key,
+        AttrType type,
+        std::optional<std::string> value = std::nullopt,
+        std::optional<std::string> context = std::nullopt
+    ) = 0;
+
+    virtual std::optional<AttrRow> lookup(const AttrKey & key) = 0;
+
+    /**
+     * The names of all children of `parent` in order. Implementations are
+     * expected to make looking up these children cheap afterwards.
+     */
+    virtual std::vector<std::string> children(AttrId parent) = 0;
+
+    /**
+     * Make all inserted rows persistent.
+     */
+    virtual void commit() = 0;
+
+    /**
+     * Called after a group of rows that is only meaningful as a whole,
+     * such as a set and the placeholders of its attributes, was inserted.
+     * Storage that writes rows out before `commit()` may only do so here.
+     */
+    virtual void endGroup() {}
+};
+
+/**
+ * Number of inserted rows that are buffered before they are written.
+ */
+static constexpr size_t ATTR_FLUSH_THRESHOLD = 4096;
+
+/**
+ * Number of rows written by a single multi-row insert statement.
+ */
+static constexpr size_t ATTR_INSERT_BATCH = 64;
+
+/**
+ * Attributes stored in an SQLite database. Everything happens in one long
+ * transaction, so row ids can be assigned here instead of by SQLite, which
+ * lets inserts be buffered and written in batches. Reading an attribute's
+ * children prefetches their rows in the same query.
+ */
+struct SQLiteAttrStorage : AttrStorage
+{
+    SQLite db;
+    SQLiteStmt insertAttribute;
+    SQLiteStmt insertAttributes;
+    SQLiteStmt queryAttribute;
+    SQLiteStmt queryAttributes;
+    std::unique_ptr<SQLiteTxn> txn;
+
+    AttrId nextId = 1;
+
+    /**
+     * Rows that were inserted but not written yet, and rows prefetched
+     * with their siblings.
+     */
+    std::map<AttrKey, AttrRow> rows;
+    std::vector<AttrKey> pending;
+
+    explicit SQLiteAttrStorage(const Path & dbPath)
+    {
+        db = SQLite(dbPath);
+        db.isCache();
+        db.exec(schema, always_progresses);
+
+        static constexpr const char * insert =
+            "insert or replace into Attributes(rowid, parent, name, type, value, context) values ";
+        static constexpr const char * row = "(?, ?, ?, ?, ?, ?)";
+
+        insertAttribute = db.create(std::string(insert) + row);
+
+        std::string batch = insert;
+        for (size_t i = 0; i < ATTR_INSERT_BATCH; i++) {
+            batch += i ? ", " : "";
+            batch += row;
+        }
+        insertAttributes = db.create(batch);
+
+        queryAttribute = db.create(
+            "select rowid, type, value, context from Attributes where parent = ? and name = ?");
+
+        queryAttributes = db.create(
+            "select rowid, name, type, value, context from Attributes where parent = ? order by name");
+
+        txn = std::make_unique<SQLiteTxn>(db.beginTransaction());
+
+        // Nobody else can commit while this transaction is open, so ids
+        // from here on are ours.
+        auto maxId(db.create("select coalesce(max(rowid), 0) from Attributes"));
+        auto query(maxId.use());
+        if (query.next()) {
+            nextId = query.getInt(0) + 1;
+        }
+    }
+
+    AttrId insert(
+        const AttrKey & key,
+        AttrType type,
+        std::optional<std::string> value,
+        std::optional<std::string> context
+    ) override
+    {
+        auto id = nextId++;
+        auto [row, inserted] = rows.insert_or_assign(
+            key, AttrRow{id, type, std::move(value), std::move(context)}
+        );
+        pending.push_back(key);
+        if (pending.size() >= ATTR_FLUSH_THRESHOLD) {
+            flush();
+        }
+        return id;
+    }
+
+    std::optional<AttrRow> lookup(const AttrKey & key) override
+    {
+        if (auto row = rows.find(key); row != rows.end()) {
+            return row->second;
+        }
 
-    struct State
+        auto query(queryAttribute.use()(key.first)(key.second));
+        if (!query.next()) {
+            return std::nullopt;
+        }
+        return AttrRow{
+            .id = (AttrId) query.getInt(0),
+            .type = (AttrType) query.getInt(1),
+            .value = query.getStrNullable(2),
+            .context = query.getStrNullable(3),
+        };
+    }
+
+    std::vector<std::string> children(AttrId parent) override
     {
-        SQLite db;
-        SQLiteStmt insertAttribute;
-        SQLiteStmt insertAttributeWithContext;
-        SQLiteStmt queryAttribute;
-        SQLiteStmt queryAttributes;
-        std::unique_ptr<SQLiteTxn> txn;
+        flush();
+
+        std::vector<std::string> names;
+        auto query(queryAttributes.use()(parent));
+        while (query.next()) {
+            auto & name = names.emplace_back(query.getStr(1));
+            rows.insert_or_assign(
+                AttrKey{parent, name},
+                AttrRow{
+                    .id = (AttrId) query.getInt(0),
+                    .type = (AttrType) query.getInt(2),
+                    .value = query.getStrNullable(3),
+                    .context = query.getStrNullable(4),
+                }
+            );
+        }
+        return names;
+    }
+
+    void flush()
+    {
+        if (pending.empty()) {
+            return;
+        }
+
+        // only the latest row of every key is written
+        std::sort(pending.begin(), pending.end());
+        pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+
+        auto bind = [&](SQLiteStmt::Use & use, const AttrKey & key) {
+            auto & row = rows.at(key);
+            use(row.id)(key.first)(key.second)(row.type);
+            if (row.value) {
+                use(*row.value);
+            } else {
+                use.bind();
+            }
+            if (row.context) {
+                use(*row.context);
+            } else {
+                use.bind();
+            }
+        };
+
+        size_t i = 0;
+        for (; i + ATTR_INSERT_BATCH <= pending.size(); i += ATTR_INSERT_BATCH) {
+            auto use(insertAttributes.use());
+            for (size_t j = i; j < i + ATTR_INSERT_BATCH; j++) {
+                bind(use, pending[j]);
+            }
+            use.exec();
+        }
+        for (; i < pending.size(); i++) {
+            auto use(insertAttribute.use());
+            bind(use, pending[i]);
+            use.exec();
+        }
+
+        for (auto & key : pending) {
+            rows.erase(key);
+        }
+        pending.clear();
+    }
+
+    void commit() override
+    {
+        flush();
+        txn->commit();
+    }
+};
+
+/**
+ * Attributes stored in an append-only binary file, read through a memory
+ * mapping. All rows are indexed when the file is opened, after which
+ * lookups and listing children never touch the disk. Later rows replace
+ * earlier rows with the same key.
+ *
+ * Only one process can write to the file at a time. Others share it for
+ * reading, and their inserted rows only last as long as the process.
+ */
+namespace {
+/**
+ * Reads the fields of a record, failing on truncated data.
+ */
+struct RecordReader
+{
+    std::string_view data;
+
+    template<typename T>
+    std::optional<T> number()
+    {
+        if (data.size() < sizeof(T)) {
+            return std::nullopt;
+        }
+        T n;
+        memcpy(&n, data.data(), sizeof(T));
+        data.remove_prefix(sizeof(T));
+        return n;
+    }
+
+    std::optional<std::string_view> string()
+    {
+        auto size = number<uint32_t>();
+        if (!size || data.size() < *size) {
+            return std::nullopt;
+        }
+        auto s = data.substr(0, *size);
+        data.remove_prefix(*size);
+        return s;
+    }
+};
+}
+
+struct BinaryAttrStorage : AttrStorage
+{
+    static constexpr std::string_view MAGIC = "lix-attrs-2\n";
+
+    /**
+     * Records are a 32-bit length followed by the id, parent id, type and
+     * presence flags of a row, then its name, value and context, each a
+     * 32-bit length followed by that many bytes. All numbers are in host
+     * byte order; the cache is never shared between machines.
+     *
+     * A record of length 0 marks the end of a write. Records after the last
+     * marker may be missing siblings or children and are ignored.
+     */
+    enum : uint8_t { HAS_VALUE = 1, HAS_CONTEXT = 2 };
+
+    struct Entry
+    {
+        AttrId id;
+        AttrType type;
+        std::optional<std::string_view> value;
+        std::optional<std::string_view> context;
     };
 
-    std::unique_ptr<Sync<State>> _state;
+    AutoCloseFD fd;
+    bool writable = false;
 
-    AttrDb(const Hash & fingerprint)
-        : _state(std::make_unique<Sync<State>>())
+    const char * mapping = nullptr;
+    size_t mappingSize = 0;
+
+    /**
+     * Keys and values point into the mapping or into `arena`.
+     */
+    std::map<std::pair<AttrId, std::string_view>, Entry> index;
+    std::list<std::string> arena;
+
+    AttrId nextId = 1;
+    std::string buffer;
+
+    explicit BinaryAttrStorage(const Path & path)
     {
-        auto state(_state->lock());
+        fd = AutoCloseFD{open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666)};
+        if (!fd) {
+            throw SysError("opening evaluation cache '%s'", path);
+        }
 
-        Path cacheDir = getCacheDir() + "/nix/eval-cache-v5";
-        createDirs(cacheDir);
+        if (tryLockFile(fd.get(), ltWrite)) {
+            writable = true;
+        } else if (!tryLockFile(fd.get(), ltRead)) {
+            throw EvalCacheBusy("evaluation cache '%s' is being written by another process", path);
+        }
+
+        struct stat st;
+        if (fstat(fd.get(), &st) == -1) {
+            throw SysError("statting evaluation cache '%s'", path);
+        }
 
-        Path dbPath = cacheDir + "/" + base16Encode(fingerprint) + ".sqlite";
+        if (st.st_size == 0) {
+            if (writable) {
+                writeFull(fd.get(), MAGIC);
+            }
+            return;
+        }
 
-        state->db = SQLite(dbPath);
-        state->db.isCache();
-        state->db.exec(schema, always_progresses);
+        mappingSize = st.st_size;
+        auto p = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        if (p == MAP_FAILED) {
+            throw SysError("mapping evaluation cache '%s'", path);
+        }
+        mapping = static_cast<const char *>(p);
 
-        state->insertAttribute = state->db.create(
-            "insert or replace into Attributes(parent, name, type, value) values (?, ?, ?, ?)");
+        std::string_view data{mapping, mappingSize};
+        if (!data.starts_with(MAGIC)) {
+            throw Error("evaluation cache '%s' has an unknown format", path);
+        }
 
-        state->insertAttributeWithContext = state->db.create(
-            "insert or replace into Attributes(parent, name, type, value, context) values (?, ?, ?, ?, ?)");
+        auto end = scan(data, MAGIC.size());
+        if (end != data.size()) {
+            // the tail of a write that was interrupted when its writer died
+            debug("ignoring %d trailing bytes of evaluation cache '%s'", data.size() - end, path);
+            if (writable && ftruncate(fd.get(), end) == -1) {
+                throw SysError("truncating evaluation cache '%s'", path);
+            }
+        }
+    }
 
-        state->queryAttribute = state->db.create(
-            "select rowid, type, value, context from Attributes where parent = ? and name = ?");
+    ~BinaryAttrStorage()
+    {
+        if (mapping) {
+            munmap(const_cast<char *>(mapping), mappingSize);
+        }
+    }
 
-        state->queryAttributes = state->db.create(
-            "select name from Attributes where parent = ?");
+    /**
+     * Index the records in `data` from `pos` on, returning the end of the
+     * last complete write.
+     */
+    size_t scan(std::string_view data, size_t pos)
+    {
+        std::vector<std::pair<std::pair<AttrId, std::string_view>, Entry>> staged;
+        size_t end = pos;
+        while (pos < data.size()) {
+            RecordReader header{data.substr(pos)};
+            auto size = header.number<uint32_t>();
+            if (!size || header.data.size() < *size) {
+                break;
+            }
+            if (*size == 0) {
+                for (auto & [key, entry] : staged) {
+                    index.insert_or_assign(key, entry);
+                }
+                staged.clear();
+                pos += sizeof(uint32_t);
+                end = pos;
+                continue;
+            }
+
+            RecordReader record{header.data.substr(0, *size)};
+            auto id = record.number<uint64_t>();
+            auto parent = record.number<uint64_t>();
+            auto type = record.number<uint8_t>();
+            auto flags = record.number<uint8_t>();
+            auto name = record.string();
+            if (!id || !parent || !type || !flags || !name) {
+                break;
+            }
+            Entry entry{.id = *id, .type = (AttrType) *type};
+            if ((*flags & HAS_VALUE) && !(entry.value = record.string())) {
+                break;
+            }
+            if ((*flags & HAS_CONTEXT) && !(entry.context = record.string())) {
+                break;
+            }
+
+            staged.push_back({{*parent, *name}, entry});
+            nextId = std::max(nextId, *id + 1);
+            pos += sizeof(uint32_t) + *size;
+        }
+        return end;
+    }
+
+    AttrId insert(
+        const AttrKey & key,
+        AttrType type,
+        std::optional<std::string> value,
+        std::optional<std::string> context
+    ) override
+    {
+        auto id = nextId++;
+
+        auto store = [&](std::string_view s) -> std::string_view {
+            return arena.emplace_back(s);
+        };
+        Entry entry{.id = id, .type = type};
+        if (value) {
+            entry.value = store(*value);
+        }
+        if (context) {
+            entry.context = store(*context);
+        }
+        index.insert_or_assign({key.first, store(key.second)}, entry);
+
+        if (writable) {
+            auto writeInt = [&](auto n) {
+                buffer.append(reinterpret_cast<const char *>(&n), sizeof(n));
+            };
+            auto writeString = [&](std::string_view s) {
+                writeInt(uint32_t(s.size()));
+                buffer.append(s);
+            };
+
+            auto start = buffer.size();
+            writeInt(uint32_t(0));
+            writeInt(uint64_t(id));
+            writeInt(uint64_t(key.first));
+            writeInt(uint8_t(type));
+            writeInt(uint8_t((value ? HAS_VALUE : 0) | (context ? HAS_CONTEXT : 0)));
+            writeString(key.second);
+            if (value) {
+                writeString(*value);
+            }
+            if (context) {
+                writeString(*context);
+            }
+            uint32_t size = buffer.size() - start - sizeof(uint32_t);
+            memcpy(buffer.data() + start, &size, sizeof(size));
+        }
 
-        state->txn = std::make_unique<SQLiteTxn>(state->db.beginTransaction());
+        return id;
+    }
+
+    std::optional<AttrRow> lookup(const AttrKey & key) override
+    {
+        auto entry = index.find({key.first, key.second});
+        if (entry == index.end()) {
+            return std::nullopt;
+        }
+        return toRow(entry->second);
+    }
+
+    std::vector<std::string> children(AttrId parent) override
+    {
+        std::vector<std::string> names;
+        for (auto entry = index.lower_bound({parent, ""});
+             entry != index.end() && entry->first.first == parent;
+             ++entry)
+        {
+            names.emplace_back(entry->first.second);
+        }
+        return names;
+    }
+
+    void commit() override
+    {
+        if (!buffer.empty()) {
+            buffer.append(sizeof(uint32_t), '\0');
+            writeFull(fd.get(), buffer);
+            buffer.clear();
+        }
+    }
+
+    void endGroup() override
+    {
+        if (buffer.size() >= ATTR_FLUSH_THRESHOLD * 64) {
+            commit();
+        }
+    }
+
+    static AttrRow toRow(const Entry & entry)
+    {
+        return {
+            .id = entry.id,
+            .type = entry.type,
+            .value = entry.value.transform([](auto s) { return std::string(s); }),
+            .context = entry.context.transform([](auto s) { return std::string(s); }),
+        };
+    }
+};
+
+struct AttrDb
+{
+    std::atomic_bool failed{false};
+
+    std::unique_ptr<Sync<std::unique_ptr<AttrStorage>>> _storage;
+
+    AttrDb(const Hash & fingerprint)
+        : _storage(std::make_unique<Sync<std::unique_ptr<AttrStorage>>>())
+    {
+        auto storage(_storage->lock());
+
+        Path cacheDir = getCacheDir() + "/nix/eval-cache-v5";
+        createDirs(cacheDir);
+
+        auto format = evalSettings.evalCacheFormat.get();
+        if (format == "binary") {
+            *storage = std::make_unique<BinaryAttrStorage>(
+                cacheDir + "/" + base16Encode(fingerprint) + ".attrs"
+            );
+        } else {
+            if (format != "sqlite") {
+                printTaggedWarning("unknown evaluation cache format '%s', using 'sqlite'", format);
+            }
+            *storage = std::make_unique<SQLiteAttrStorage>(
+                cacheDir + "/" + base16Encode(fingerprint) + ".sqlite"
+            );
+        }
     }
 
     ~AttrDb()
     {
         try {
-            auto state(_state->lock());
+            auto storage(_storage->lock());
             if (!failed)
-                state->txn->commit();
-            state->txn.reset();
+                (*storage)->commit();
+            storage->reset();
         } catch (...) {
             ignoreExceptionInDestructor();
         }
     }
 
     template<typename F>
-    AttrId doSQLite(F && fun)
+    AttrId doStorage(F && fun)
     {
         if (failed) return 0;
         try {
-            return fun();
-        } catch (SQLiteError &) {
+            auto storage(_storage->lock());
+            auto id = fun(**storage);
+            (*storage)->endGroup();
+            return id;
+        } catch (Error &) {
             ignoreExceptionExceptInterrupt();
             failed = true;
             return 0;
@@ -92,25 +598,12 @@ struct AttrDb
         AttrKey key,
         const fullattr_t & attrs)
     {
-        return doSQLite([&]()
+        return doStorage([&](AttrStorage & storage)
         {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::FullAttrs)
-                (0, false).exec();
-
-            AttrId rowId = state->db.getLastInsertedRowId();
-            assert(rowId);
+            AttrId rowId = storage.insert(key, AttrType::FullAttrs);
 
             for (auto & attr : attrs.p)
-                state->insertAttribute.use()
-                    (rowId)
-                    (attr)
-                    (AttrType::Placeholder)
-                    (0, false).exec();
+                storage.insert({rowId, attr}, AttrType::Placeholder);
 
             return rowId;
         });
@@ -121,31 +614,17 @@ struct AttrDb
         std::string_view s,
         const char * * context = nullptr)
     {
-        return doSQLite([&]()
+        return doStorage([&](AttrStorage & storage)
         {
-            auto state(_state->lock());
-
+            std::optional<std::string> ctx;
             if (context) {
-                std::string ctx;
+                ctx.emplace();
                 for (const char * * p = context; *p; ++p) {
-                    if (p != context) ctx.push_back(' ');
-                    ctx.append(*p);
+                    if (p != context) ctx->push_back(' ');
+                    ctx->append(*p);
                 }
-                state->insertAttributeWithContext.use()
-                    (key.first)
-                    (key.second)
-                    (AttrType::String)
-                    (s)
-                    (ctx).exec();
-            } else {
-                state->insertAttribute.use()
-                    (key.first)
-                    (key.second)
-                    (AttrType::String)
-                (s).exec();
             }
-
-            return state->db.getLastInsertedRowId();
+            return storage.insert(key, AttrType::String, std::string(s), std::move(ctx));
         });
     }
 
@@ -153,35 +632,17 @@ struct AttrDb
         AttrKey key,
         bool b)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Bool)
-                (b ? 1 : 0).exec();
-
-            return state->db.getLastInsertedRowId();
+        return doStorage([&](AttrStorage & storage) {
+            return storage.insert(key, AttrType::Bool, b ? "1" : "0");
         });
     }
 
     AttrId setInt(
         AttrKey key,
-        int n)
+        int64_t n)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Int)
-                (n).exec();
-
-            return state->db.getLastInsertedRowId();
+        return doStorage([&](AttrStorage & storage) {
+            return storage.insert(key, AttrType::Int, std::to_string(n));
         });
     }
 
@@ -189,118 +650,67 @@ struct AttrDb
         AttrKey key,
         const std::vector<std::string> & l)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::ListOfStrings)
-                (concatStringsSep("\t", l)).exec();
-
-            return state->db.getLastInsertedRowId();
+        return doStorage([&](AttrStorage & storage) {
+            return storage.insert(key, AttrType::ListOfStrings, concatStringsSep("\t", l));
         });
     }
 
     AttrId setPlaceholder(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Placeholder)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
+        return doStorage([&](AttrStorage & storage) {
+            return storage.insert(key, AttrType::Placeholder);
         });
     }
 
     AttrId setMissing(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Missing)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
+        return doStorage([&](AttrStorage & storage) {
+            return storage.insert(key, AttrType::Missing);
         });
     }
 
     AttrId setMisc(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Misc)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
+        return doStorage([&](AttrStorage & storage) {
+            return storage.insert(key, AttrType::Misc);
         });
     }
 
     AttrId setFailed(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Failed)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
+        return doStorage([&](AttrStorage & storage) {
+            return storage.insert(key, AttrType::Failed);
         });
     }
 
     std::optional<std::pair<AttrId, AttrValue>> getAttr(AttrKey key)
     {
-        auto state(_state->lock());
+        auto storage(_storage->lock());
 
-        auto queryAttribute(state->queryAttribute.use()(key.first)(key.second));
-        if (!queryAttribute.next()) return {};
+        auto row = (*storage)->lookup(key);
+        if (!row) return {};
 
-        auto rowId = (AttrId) queryAttribute.getInt(0);
-        auto type = (AttrType) queryAttribute.getInt(1);
+        auto rowId = row->id;
+        auto value = [&]() -> std::string { return row->value.value_or(""); };
 
-        switch (type) {
+        switch (row->type) {
             case AttrType::Placeholder:
                 return {{rowId, placeholder_t()}};
-            case AttrType::FullAttrs: {
-                // FIXME: expensive, should separate this out.
-                fullattr_t attrs;
-                auto queryAttributes(state->queryAttributes.use()(rowId));
-                while (queryAttributes.next())
-                    attrs.p.emplace_back(queryAttributes.getStr(0));
-                return {{rowId, attrs}};
-            }
+            case AttrType::FullAttrs:
+                return {{rowId, fullattr_t{(*storage)->children(rowId)}}};
             case AttrType::String: {
                 NixStringContext context;
-                if (!queryAttribute.isNull(3))
-                    for (auto & s : tokenizeString<std::vector<std::string>>(queryAttribute.getStr(3), ";"))
+                if (row->context)
+                    for (auto & s : tokenizeString<std::vector<std::string>>(*row->context, ";"))
                         context.insert(NixStringContextElem::parse(s));
-                return {{rowId, string_t{queryAttribute.getStr(2), context}}};
+                return {{rowId, string_t{value(), context}}};
             }
             case AttrType::Bool:
-                return {{rowId, queryAttribute.getInt(2) != 0}};
+                return {{rowId, string2Int<int64_t>(value()).value_or(0) != 0}};
             case AttrType::Int:
-                return {{rowId, int_t{NixInt{queryAttribute.getInt(2)}}}};
+                return {{rowId, int_t{NixInt{string2Int<int64_t>(value()).value_or(0)}}}};
             case AttrType::ListOfStrings:
-                return {{rowId, tokenizeString<std::vector<std::string>>(queryAttribute.getStr(2), "\t")}};
+                return {{rowId, tokenizeString<std::vector<std::string>>(value(), "\t")}};
             case AttrType::Missing:
                 return {{rowId, missing_t()}};
             case AttrType::Misc:
@@ -317,7 +727,11 @@ static std::shared_ptr<AttrDb> makeAttrDb(const Hash & fingerprint)
 {
     try {
         return std::make_shared<AttrDb>(fingerprint);
-    } catch (SQLiteError &) {
+    } catch (EvalCacheBusy & e) {
+        // another evaluation of the same flake is filling the cache
+        debug("not using the evaluation cache: %s", e.what());
+        return nullptr;
+    } catch (Error &) {
         ignoreExceptionExceptInterrupt();
         return nullptr;
     }
@@ -339,6 +753,9 @@ EvalCache::EvalCache(
     : db(useCache ? makeAttrDb(*useCache) : nullptr)
     , rootLoader(rootLoader)
 {
+    if (useCache) {
+        fingerprint = useCache->get();
+    }
 }
 
 Value & EvalCache::getRootValue(EvalState & state)
@@ -421,6 +838,11 @@ std::string AttrCursor::getAttrPathStr(EvalState & state, std::string_view name)
     return concatStringsSep(".", getAttrPath(state, name));
 }
 
+std::optional<Hash> AttrCursor::getCacheFingerprint() const
+{
+    return root->fingerprint;
+}
+
 Value & AttrCursor::forceValue(EvalState & state)
 {
     debug("evaluating uncached attribute '%s'", getAttrPathStr(state));
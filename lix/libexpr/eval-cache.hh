@@ -42,6 +42,11 @@ class EvalCache : public std::enable_shared_from_this<EvalCache>
     RootLoader rootLoader;
     RootValue value;
 
+    /**
+     * The fingerprint the cache is stored under, if it is persistent.
+     */
+    std::optional<Hash> fingerprint;
+
     Value & getRootValue(EvalState & state);
 
 public:
@@ -117,6 +122,12 @@ public:
 
     std::string getAttrPathStr(EvalState & state, std::string_view name) const;
 
+    /**
+     * The fingerprint of the persistent evaluation cache this cursor
+     * belongs to. Everything below the cursor is determined by it.
+     */
+    std::optional<Hash> getCacheFingerprint() const;
+
     Suggestions getSuggestionsForAttr(EvalState & state, const std::string & name);
 
     std::shared_ptr<AttrCursor> maybeGetAttr(EvalState & state, const std::string & name);
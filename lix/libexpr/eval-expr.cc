@@ -153,6 +153,20 @@ Value ExprSet::eval(EvalState & state, Env & env)
         }
     }
 
+    /* Without dynamic attributes, the set has exactly the names in `attrs`
+       in the same order, unless `__overrides` added some. */
+    if (dynamicAttrs.empty() && !attrs.empty() && v.attrs()->size() == attrs.size()) {
+        if (!shape) {
+            std::vector<Symbol> names;
+            names.reserve(attrs.size());
+            for (auto & i : attrs) {
+                names.push_back(i.first);
+            }
+            shape = std::make_shared<BindingsShape>(std::move(names));
+        }
+        v.attrs()->setShape(*shape);
+    }
+
     /* Dynamic attrs apply *after* rec and __overrides. */
     for (auto & i : dynamicAttrs) {
         /* Before evaluating dynamic attrs, we blackhole the output attrset and only restore it after the operation.
@@ -54,6 +54,10 @@ inline Value::Value(lambda_t, EvalMemory & mem, Env & env, ExprLambda & lambda)
 [[gnu::always_inline]]
 void * EvalMemory::allocBytes(size_t size)
 {
+    if (arena::enabled) {
+        return arena::alloc(size);
+    }
+
 #if HAVE_BOEHMGC
     /* We use the boehm batch allocator to speed up allocations of Values (of which there are many).
        GC_malloc_many returns a linked list of objects of the given size, where the first word
@@ -0,0 +1,224 @@
+#include "lix/libexpr/eval-profiler.hh"
+#include "lix/libexpr/nixexpr.hh"
+#include "lix/libexpr/pos-table.hh"
+#include "lix/libexpr/symbol-table.hh"
+#include "lix/libutil/compression.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/strings.hh"
+
+#include <sstream>
+
+namespace nix {
+
+EvalProfiler::EvalProfiler(unsigned frequency)
+    : interval(std::chrono::nanoseconds(std::chrono::seconds(1)) / std::max(1U, frequency))
+    , created(std::chrono::system_clock::now())
+{
+}
+
+EvalProfiler::~EvalProfiler()
+{
+    stop();
+}
+
+void EvalProfiler::start()
+{
+    if (timer.joinable()) {
+        return;
+    }
+
+    stopTimer = false;
+    started = std::chrono::steady_clock::now();
+    timer = std::thread([this] {
+        std::unique_lock lock(timerLock);
+        while (!timerWakeup.wait_for(lock, interval, [&] { return stopTimer; })) {
+            ticks.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+}
+
+void EvalProfiler::stop()
+{
+    if (!timer.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard lock(timerLock);
+        stopTimer = true;
+    }
+    timerWakeup.notify_one();
+    timer.join();
+
+    sampledTime += std::chrono::steady_clock::now() - started;
+    sample();
+}
+
+void EvalProfiler::sample()
+{
+    if (auto n = ticks.exchange(0, std::memory_order_relaxed)) {
+        samples[stack] += n;
+    }
+}
+
+static std::string frameName(
+    const EvalProfiler::Frame & frame, const PosTable & positions, const SymbolTable & symbols
+)
+{
+    if (frame.primOp) {
+        return "builtins." + frame.primOp->name;
+    }
+    std::ostringstream name;
+    name << frame.lambda->getName(symbols) << " at " << positions[frame.lambda->pos];
+    return name.str();
+}
+
+std::string EvalProfiler::collapsed(const PosTable & positions, const SymbolTable & symbols)
+{
+    std::map<EvalProfiler::Frame, std::string> names;
+    std::string out;
+    for (auto & [stack, count] : samples) {
+        std::string line = "«toplevel»";
+        for (auto & frame : stack) {
+            auto [name, inserted] = names.try_emplace(frame);
+            if (inserted) {
+                name->second = replaceStrings(
+                    replaceStrings(frameName(frame, positions, symbols), ";", ":"), "\n", " "
+                );
+            }
+            line += ";" + name->second;
+        }
+        out += fmt("%s %d\n", line, count);
+    }
+    return out;
+}
+
+namespace {
+/**
+ * Just enough of the protocol buffers wire format to write a pprof profile,
+ * see https://github.com/google/pprof/blob/main/proto/profile.proto.
+ */
+struct ProtoWriter
+{
+    std::string out;
+
+    void varint(uint64_t n)
+    {
+        while (n >= 0x80) {
+            out += char(n | 0x80);
+            n >>= 7;
+        }
+        out += char(n);
+    }
+
+    void integer(uint32_t field, uint64_t n)
+    {
+        varint(field << 3);
+        varint(n);
+    }
+
+    void bytes(uint32_t field, std::string_view data)
+    {
+        varint((field << 3) | 2);
+        varint(data.size());
+        out += data;
+    }
+};
+}
+
+std::string EvalProfiler::pprof(const PosTable & positions, const SymbolTable & symbols)
+{
+    ProtoWriter profile;
+
+    std::vector<std::string> strings{""};
+    std::map<std::string, uint64_t> stringIds{{"", 0}};
+    auto string = [&](const std::string & s) {
+        auto [it, inserted] = stringIds.try_emplace(s, strings.size());
+        if (inserted) {
+            strings.push_back(s);
+        }
+        return it->second;
+    };
+
+    auto valueType = [&](std::string_view type, std::string_view unit) {
+        ProtoWriter vt;
+        vt.integer(1, string(std::string(type)));
+        vt.integer(2, string(std::string(unit)));
+        return vt.out;
+    };
+
+    // sample_type
+    profile.bytes(1, valueType("samples", "count"));
+    profile.bytes(1, valueType("wall", "nanoseconds"));
+
+    // every frame is both a function and the location of its only line
+    std::map<EvalProfiler::Frame, uint64_t> ids;
+    for (auto & [stack, count] : samples) {
+        ProtoWriter sample, locationIds, values;
+        for (auto frame = stack.rbegin(); frame != stack.rend(); ++frame) {
+            auto [id, inserted] = ids.try_emplace(*frame, ids.size() + 1);
+            locationIds.varint(id->second);
+            if (!inserted) {
+                continue;
+            }
+
+            ProtoWriter function, location, line;
+            function.integer(1, id->second);
+            function.integer(2, string(frameName(*frame, positions, symbols)));
+            uint32_t startLine = 0;
+            if (frame->lambda) {
+                auto pos = positions[frame->lambda->pos];
+                if (auto path = std::get_if<CheckedSourcePath>(&pos.origin)) {
+                    function.integer(4, string(path->to_string()));
+                }
+                startLine = pos.line;
+                function.integer(5, startLine);
+            }
+            profile.bytes(5, function.out);
+
+            line.integer(1, id->second);
+            line.integer(2, startLine);
+            location.integer(1, id->second);
+            location.bytes(4, line.out);
+            profile.bytes(4, location.out);
+        }
+        values.varint(count);
+        values.varint(count * interval.count());
+        sample.bytes(1, locationIds.out);
+        sample.bytes(2, values.out);
+        profile.bytes(2, sample.out);
+    }
+
+    profile.integer(
+        9,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(created.time_since_epoch()).count()
+    );
+    auto duration = sampledTime;
+    if (timer.joinable()) {
+        duration += std::chrono::steady_clock::now() - started;
+    }
+    profile.integer(10, duration.count());
+    profile.bytes(11, valueType("wall", "nanoseconds"));
+    profile.integer(12, interval.count());
+
+    // the string table is written last, after everything has been interned
+    for (auto & s : strings) {
+        profile.bytes(6, s);
+    }
+
+    return compress("gzip", profile.out);
+}
+
+void EvalProfiler::write(const Path & path, const PosTable & positions, const SymbolTable & symbols)
+{
+    sample();
+    if (path.ends_with(".pprof") || path.ends_with(".pb.gz")) {
+        writeFile(path, pprof(positions, symbols));
+    } else {
+        writeFile(path, collapsed(positions, symbols));
+    }
+    printInfo("wrote evaluation profile to '%s'", path);
+}
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+///@file
+
+#include "lix/libexpr/value.hh"
+#include "lix/libutil/types.hh"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nix {
+
+struct ExprLambda;
+class PosTable;
+class SymbolTable;
+
+/**
+ * Sampling profiler for the Nix-level call stack, enabled by the
+ * `eval-profile` setting.
+ *
+ * The evaluator maintains a shadow stack of the lambdas and primops being
+ * called. A timer thread only bumps a tick counter; the evaluator checks
+ * it whenever it enters or leaves a call and attributes the elapsed ticks
+ * to the stack as it was until then. Nothing else happens per call, and
+ * with the profiler off calls only test whether it exists.
+ */
+class EvalProfiler
+{
+public:
+    struct Frame
+    {
+        const ExprLambda * lambda = nullptr;
+        const PrimOp * primOp = nullptr;
+
+        auto operator<=>(const Frame &) const = default;
+    };
+
+    /**
+     * Enters a call for as long as it lives, if `profiler` is set.
+     */
+    class Scope
+    {
+        EvalProfiler * profiler;
+
+    public:
+        Scope(EvalProfiler * profiler, const ExprLambda & lambda) : profiler(profiler)
+        {
+            if (profiler) {
+                profiler->enter({.lambda = &lambda});
+            }
+        }
+
+        Scope(EvalProfiler * profiler, const PrimOp & primOp) : profiler(profiler)
+        {
+            if (profiler) {
+                profiler->enter({.primOp = &primOp});
+            }
+        }
+
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+
+        ~Scope()
+        {
+            if (profiler) {
+                profiler->leave();
+            }
+        }
+    };
+
+    /**
+     * Prepare to sample `frequency` times per second of wall-clock time.
+     */
+    explicit EvalProfiler(unsigned frequency);
+    ~EvalProfiler();
+
+    /**
+     * Start and stop sampling. The evaluator samples only while an
+     * evaluation is active, so the timer thread does not keep running
+     * once the evaluation is done.
+     */
+    void start();
+    void stop();
+
+    EvalProfiler(const EvalProfiler &) = delete;
+    EvalProfiler & operator=(const EvalProfiler &) = delete;
+
+    void enter(Frame frame)
+    {
+        if (ticks.load(std::memory_order_relaxed)) {
+            sample();
+        }
+        stack.push_back(frame);
+    }
+
+    void leave()
+    {
+        if (ticks.load(std::memory_order_relaxed)) {
+            sample();
+        }
+        stack.pop_back();
+    }
+
+    /**
+     * Write the samples taken so far to `path`: as a gzipped pprof profile
+     * if it ends in `.pprof` or `.pb.gz`, or otherwise as collapsed stacks
+     * (one `outermost;...;innermost count` line per stack) for flame graph
+     * tools.
+     */
+    void write(const Path & path, const PosTable & positions, const SymbolTable & symbols);
+
+private:
+    std::vector<Frame> stack;
+    std::map<std::vector<Frame>, uint64_t> samples;
+
+    std::atomic<uint32_t> ticks = 0;
+    std::chrono::nanoseconds interval;
+    std::chrono::system_clock::time_point created;
+    /**
+     * Total time sampled by previous `start()`/`stop()` pairs, and when the
+     * current one started.
+     */
+    std::chrono::nanoseconds sampledTime{0};
+    std::chrono::steady_clock::time_point started;
+
+    std::mutex timerLock;
+    std::condition_variable timerWakeup;
+    bool stopTimer = false;
+    std::thread timer;
+
+    void sample();
+
+    std::string collapsed(const PosTable & positions, const SymbolTable & symbols);
+    std::string pprof(const PosTable & positions, const SymbolTable & symbols);
+};
+
+}
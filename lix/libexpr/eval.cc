@@ -198,11 +198,19 @@ void initLibExpr()
 
     GC_INIT();
 
-    // Enable parallel marking
-    GC_start_mark_threads();
-
     GC_set_oom_fn(oomHandler);
 
+    /* Nothing is collected with the arena allocator, so don't bother with
+       mark threads and a big heap. This only sees the setting from
+       configuration files and NIX_CONFIG; with a command line flag the
+       arena is only enabled once the first evaluator is created. */
+    bool useArena = evalSettings.evalAllocator.get() == "arena";
+
+    // Enable parallel marking
+    if (!useArena) {
+        GC_start_mark_threads();
+    }
+
     /* Set the initial heap size to something fairly big (25% of
        physical RAM, up to a maximum of 384 MiB) so that in most cases
        we don't need to garbage collect at all.  (Collection has a
@@ -212,7 +220,7 @@ void initLibExpr()
        that GC_expand_hp() causes a lot of virtual, but not physical
        (resident) memory to be allocated.  This might be a problem on
        systems that don't overcommit. */
-    if (!getEnv("GC_INITIAL_HEAP_SIZE")) {
+    if (!useArena && !getEnv("GC_INITIAL_HEAP_SIZE")) {
         int64_t size = 32l * 1024 * 1024;
 #if HAVE_SYSCONF && defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
         int64_t maxSize = 384l * 1024 * 1024;
@@ -240,6 +248,20 @@ EvalMemory::EvalMemory()
 #if HAVE_BOEHMGC
     GC_add_roots(static_cast<void *>(gcCache), static_cast<void *>(gcCache + CACHES));
 #endif
+
+    auto allocator = evalSettings.evalAllocator.get();
+    auto limit = evalSettings.evalMemoryLimit.get();
+    if (allocator == "arena") {
+        enableEvalArena(limit);
+        return;
+    } else if (allocator != "gc") {
+        printTaggedWarning("unknown evaluation allocator '%s', using 'gc'", allocator);
+    }
+#if HAVE_BOEHMGC
+    if (limit) {
+        GC_set_max_heap_size(limit);
+    }
+#endif
 }
 
 EvalMemory::~EvalMemory()
@@ -386,6 +408,10 @@ Evaluator::Evaluator(
 {
     stats.countCalls = getEnv("NIX_COUNT_CALLS").value_or("0") != "0";
 
+    if (!evalSettings.evalProfile.get().empty()) {
+        profiler = std::make_unique<EvalProfiler>(evalSettings.evalProfileFrequency.get());
+    }
+
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
 }
 
@@ -405,10 +431,16 @@ box_ptr<EvalState> Evaluator::begin(AsyncIoRoot & aio)
 EvalState::EvalState(AsyncIoRoot & aio, Evaluator & ctx) : ctx(ctx), aio(aio)
 {
     ctx.activeEval = this;
+    if (ctx.profiler) {
+        ctx.profiler->start();
+    }
 }
 
 EvalState::~EvalState()
 {
+    if (ctx.profiler) {
+        ctx.profiler->stop();
+    }
     ctx.activeEval = nullptr;
 }
 
@@ -1155,6 +1187,7 @@ Value EvalState::callFunction(Value & fun, std::span<Value> args, const PosIdx p
 
             /* Evaluate the body. */
             try {
+                EvalProfiler::Scope profile(ctx.profiler.get(), lambda);
                 vCur = lambda.body->eval(*this, env2);
             } catch (Error & e) {
                 if (loggerSettings.showTrace.get()) {
@@ -1189,6 +1222,7 @@ Value EvalState::callFunction(Value & fun, std::span<Value> args, const PosIdx p
                     for (unsigned i = 0; i < argsLeft; i++) {
                         pargs[i] = &args[i];
                     }
+                    EvalProfiler::Scope profile(ctx.profiler.get(), *fn);
                     vCur = fn->fun(*this, pargs.data());
                 } catch (ThrownError & e) {
                     // Distinguish between an error that simply happened while "throw"
@@ -1250,6 +1284,7 @@ Value EvalState::callFunction(Value & fun, std::span<Value> args, const PosIdx p
                     // 1. Unify this and above code. Heavily redundant.
                     // 2. Create a fake env (arg1, arg2, etc.) and a fake expr (arg1: arg2: etc: builtins.name arg1 arg2 etc)
                     //    so the debugger allows to inspect the wrong parameters passed to the builtin.
+                    EvalProfiler::Scope profile(ctx.profiler.get(), *fn);
                     vCur = fn->fun(*this, vArgs.data());
                 } catch (Error & e) {
                     if (fn->name != "addErrorContext") {
@@ -1363,6 +1398,10 @@ Value EvalState::updateAttrs(const Value & v1, const Value & v2)
     if (v2.attrs()->size() == 0) {
         return v1;
     }
+    /* Every attribute of the first set is overridden by the second. */
+    if (v1.attrs()->sameShape(*v2.attrs())) {
+        return v2;
+    }
 
     auto attrs = ctx.buildBindings(v1.attrs()->size() + v2.attrs()->size());
 
@@ -1914,6 +1953,15 @@ bool EvalState::eqValues(Value & v1, Value & v2, const PosIdx pos, std::string_v
 
             /* Otherwise, compare the attributes one by one. */
             Bindings::iterator i, j;
+            if (v1.attrs()->sameShape(*v2.attrs())) {
+                for (i = v1.attrs()->begin(), j = v2.attrs()->begin(); i != v1.attrs()->end(); ++i, ++j) {
+                    if (!eqValues(i->value, j->value, pos, errorCtx)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
             for (i = v1.attrs()->begin(), j = v2.attrs()->begin(); i != v1.attrs()->end(); ++i, ++j)
             {
                 if (i->name != j->name || !eqValues(i->value, j->value, pos, errorCtx)) {
@@ -1942,6 +1990,9 @@ bool EvalState::eqValues(Value & v1, Value & v2, const PosIdx pos, std::string_v
 }
 
 bool Evaluator::fullGC() {
+    if (arena::enabled) {
+        return false;
+    }
 #if HAVE_BOEHMGC
     GC_gcollect();
     // Check that it ran. We might replace this with a version that uses more
@@ -1962,12 +2013,22 @@ void Evaluator::maybePrintStats()
     if (showStats) {
         // Make the final heap size more deterministic.
 #if HAVE_BOEHMGC
-        if (!fullGC()) {
+        if (!arena::enabled && !fullGC()) {
             printTaggedWarning("failed to perform a full GC before reporting stats");
         }
 #endif
         printStatistics();
     }
+
+    if (profiler) {
+        // this runs on the way out of commands, don't let a bad profile path
+        // turn a finished evaluation into a crash.
+        try {
+            profiler->write(evalSettings.evalProfile.get(), positions, symbols);
+        } catch (Error & e) {
+            printTaggedWarning("could not write the evaluation profile: %s", e.msg());
+        }
+    }
 }
 
 void Evaluator::printStatistics()
@@ -2035,6 +2096,13 @@ void Evaluator::printStatistics()
         {"totalBytes", totalBytes},
     };
 #endif
+    if (arena::enabled) {
+        auto arenaStats = arena::getStatistics();
+        topObj["arena"] = {
+            {"bytes", arenaStats.allocated},
+            {"reserved", arenaStats.reserved},
+        };
+    }
 
     if (stats.countCalls) {
         topObj["primops"] = stats.primOpCalls;
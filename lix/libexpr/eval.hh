@@ -3,6 +3,7 @@
 
 #include "lix/libexpr/attr-set.hh"
 #include "lix/libexpr/eval-error.hh"
+#include "lix/libexpr/eval-profiler.hh"
 #include "lix/libexpr/gc-alloc.hh"
 #include "lix/libutil/box_ptr.hh"
 #include "lix/libutil/generator.hh"
@@ -488,6 +489,11 @@ public:
     EvalBuiltins builtins;
     EvalStatistics stats;
 
+    /**
+     * Samples the call stack if the `eval-profile` setting is set.
+     */
+    std::unique_ptr<EvalProfiler> profiler;
+
     /**
      * If set, force copying files to the Nix store even if they
      * already exist there.
@@ -586,7 +592,7 @@ public:
     }
 
     /**
-     * Print statistics, if enabled.
+     * Print statistics and write the evaluation profile, if enabled.
      *
      * Performs a full memory GC before printing the statistics, so that the
      * GC statistics are more accurate.
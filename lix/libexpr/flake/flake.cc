@@ -6,6 +6,7 @@
 #include "lix/libstore/store-api.hh"
 #include "lix/libfetchers/fetchers.hh"
 #include "lix/libutil/async.hh"
+#include "lix/libutil/async-semaphore.hh"
 #include "lix/libutil/finally.hh"
 #include "lix/libfetchers/fetch-settings.hh"
 #include "lix/libutil/terminal.hh"
@@ -78,6 +79,79 @@ try {
     co_return result::current_exception();
 }
 
+/**
+ * Fetches flake inputs in the background, at most `max-flake-fetch-jobs` at
+ * a time, while the lock file is computed. The fetched trees only go into
+ * the flake cache. Before the lock file computation fetches an input itself
+ * it must `wait()` for the prefetch of that input, which rethrows the fetch
+ * error (if any) so that it is reported with the proper traces without
+ * fetching the input a second time.
+ */
+class InputPrefetcher
+{
+    Evaluator & state;
+    FlakeCache & flakeCache;
+    AsyncSemaphore jobs;
+    std::vector<std::pair<std::pair<FlakeRef, bool>, kj::ForkedPromise<Result<void>>>> inFlight;
+
+    kj::ForkedPromise<Result<void>> * find(const FlakeRef & ref, bool allowLookup)
+    {
+        for (auto & [key, promise] : inFlight) {
+            if (key.first == ref && key.second == allowLookup) {
+                return &promise;
+            }
+        }
+        return nullptr;
+    }
+
+    kj::Promise<Result<void>> fetch(FlakeRef ref, bool allowLookup)
+    try {
+        auto token = co_await jobs.acquire();
+        /* The input may have been fetched by the lock file computation
+           while we were waiting for a job slot. */
+        if (!lookupInFlakeCache(flakeCache, ref)) {
+            TRY_AWAIT(fetchOrSubstituteTree(state, ref, allowLookup, flakeCache));
+        }
+        co_return result::success();
+    } catch (...) {
+        co_return result::current_exception();
+    }
+
+public:
+    InputPrefetcher(Evaluator & state, FlakeCache & flakeCache)
+        : state(state)
+        , flakeCache(flakeCache)
+        , jobs(std::max(1U, fetchSettings.maxFlakeFetchJobs.get()))
+    {
+    }
+
+    /**
+     * Start fetching `ref` unless it is already being fetched or cached.
+     * Path inputs are left alone since they are resolved relative to the
+     * flake that declares them, and are cheap to fetch anyway.
+     */
+    void start(const FlakeRef & ref, bool allowLookup)
+    {
+        if (fetchSettings.maxFlakeFetchJobs.get() == 0 || ref.input.getType() == "path"
+            || find(ref, allowLookup) || lookupInFlakeCache(flakeCache, ref))
+        {
+            return;
+        }
+        inFlight.emplace_back(std::pair(ref, allowLookup), fetch(ref, allowLookup).fork());
+    }
+
+    /**
+     * Wait for the prefetch of `ref` to finish, if one was started.
+     */
+    kj::Promise<Result<void>> wait(const FlakeRef & ref, bool allowLookup)
+    {
+        if (auto promise = find(ref, allowLookup)) {
+            return promise->addBranch();
+        }
+        return {result::success()};
+    }
+};
+
 /** Force a value that cannot contain any function calls */
 static void forceTrivialValue(EvalState & state, Value & value, const PosIdx pos)
 {
@@ -567,6 +641,103 @@ LockedFlake lockFlake(
 
         std::vector<FlakeRef> parents;
 
+        InputPrefetcher prefetcher(state.ctx, flakeCache);
+
+        /* What computeLocks does with an input. This is shared with the
+           prefetching so that exactly the inputs that computeLocks will
+           fetch are prefetched. */
+        struct InputPlan
+        {
+            /* The input with the overrides from the ancestors applied. */
+            const FlakeInput & input;
+            bool hasOverride;
+            /* The entry of the input in the existing lock file, if any. */
+            std::shared_ptr<LockedNode> oldLock;
+            /* Whether `oldLock` is copied to the new lock file, and if so
+               whether its flake must still be fetched to update it. */
+            bool keepOldLock = false;
+            bool mustRefetch = false;
+            /* The ref computeLocks fetches, and whether registry lookups
+               are allowed for it. */
+            std::optional<std::pair<FlakeRef, bool>> fetch;
+        };
+
+        auto planInput = [&](const FlakeId & id,
+                             const FlakeInput & input2,
+                             const InputPath & inputPath,
+                             std::shared_ptr<const Node> oldNode,
+                             bool trustLock) -> InputPlan {
+            /* Do we have an override for this input from one of the
+               ancestors? */
+            auto i = overrides.find(inputPath);
+            bool hasOverride = i != overrides.end();
+            if (hasOverride) {
+                // Respect the “flakeness” of the input even if we
+                // override it
+                i->second.isFlake = input2.isFlake;
+                if (!i->second.ref)
+                    i->second.ref = input2.ref;
+                if (!i->second.follows)
+                    i->second.follows = input2.follows;
+                // Note that `input.overrides` is not used in the following,
+                // so no need to merge it here (already done by `updateOverrides`)
+            }
+
+            InputPlan plan{
+                .input = hasOverride ? i->second : input2,
+                .hasOverride = hasOverride,
+            };
+            auto & input = plan.input;
+
+            if (input.follows)
+                return plan;
+
+            assert(input.ref);
+
+            /* Do we have an entry in the existing lock file?
+               And the input is not in updateInputs? */
+            if (oldNode && !lockFlags.inputUpdates.count(inputPath))
+                if (auto oldLock2 = get(oldNode->inputs, id))
+                    if (auto oldLock3 = std::get_if<0>(&*oldLock2))
+                        plan.oldLock = *oldLock3;
+
+            if (plan.oldLock && plan.oldLock->originalRef == *input.ref && !hasOverride) {
+                plan.keepOldLock = true;
+
+                /* If we have this input in updateInputs, then we
+                   must fetch the flake to update it. */
+                auto lb = lockFlags.inputUpdates.lower_bound(inputPath);
+
+                plan.mustRefetch =
+                    lb != lockFlags.inputUpdates.end()
+                    && lb->size() > inputPath.size()
+                    && std::equal(inputPath.begin(), inputPath.end(), lb->begin());
+
+                if (!plan.mustRefetch && !trustLock) {
+                    // It is possible that the flake has changed,
+                    // so we must confirm all the follows that are in the lock file are also in the flake.
+                    for (auto & [id2, input3] : plan.oldLock->inputs) {
+                        if (!std::get_if<1>(&input3))
+                            continue;
+                        auto overridePath(inputPath);
+                        overridePath.push_back(id2);
+                        // If the override disappeared, we have to refetch the flake,
+                        // since some of the inputs may not be present in the lock file.
+                        if (!overrides.count(overridePath)) {
+                            plan.mustRefetch = true;
+                            break;
+                        }
+                    }
+                }
+
+                if (plan.mustRefetch)
+                    plan.fetch = {plan.oldLock->lockedRef, false};
+            } else if (lockFlags.allowUnlocked || input.ref->input.isLocked())
+                plan.fetch = {*input.ref, useRegistries};
+
+            return plan;
+        };
+
         std::function<void(
             const FlakeInputs & flakeInputs,
             ref<Node> node,
@@ -616,6 +787,18 @@ LockedFlake lockFlake(
                     );
             }
 
+            /* Start fetching all inputs of this node that need to be
+               fetched below. The fetches continue while the loop below
+               and the recursive calls lock the inputs in order, so the
+               lock file does not depend on the order the fetches finish
+               in. */
+            for (auto & [id, input2] : flakeInputs) {
+                auto inputPath(inputPathPrefix);
+                inputPath.push_back(id);
+                if (auto fetch = planInput(id, input2, inputPath, oldNode, trustLock).fetch)
+                    prefetcher.start(fetch->first, fetch->second);
+            }
+
             /* Go over the flake inputs, resolve/fetch them if
                necessary (i.e. if they're new or the flakeref changed
                from what's in the lock file). */
@@ -627,23 +810,10 @@ LockedFlake lockFlake(
 
                 try {
 
-                    /* Do we have an override for this input from one of the
-                       ancestors? */
-                    auto i = overrides.find(inputPath);
-                    bool hasOverride = i != overrides.end();
-                    if (hasOverride) {
+                    auto plan = planInput(id, input2, inputPath, oldNode, trustLock);
+                    if (plan.hasOverride)
                         overridesUsed.insert(inputPath);
-                        // Respect the “flakeness” of the input even if we
-                        // override it
-                        i->second.isFlake = input2.isFlake;
-                        if (!i->second.ref)
-                            i->second.ref = input2.ref;
-                        if (!i->second.follows)
-                            i->second.follows = input2.follows;
-                        // Note that `input.overrides` is not used in the following,
-                        // so no need to merge it here (already done by `updateOverrides`)
-                    }
-                    auto & input = hasOverride ? i->second : input2;
+                    auto & input = plan.input;
 
                     /* Resolve 'follows' later (since it may refer to an input
                        path we haven't processed yet. */
@@ -659,20 +829,14 @@ LockedFlake lockFlake(
 
                     assert(input.ref);
 
-                    /* Do we have an entry in the existing lock file?
-                       And the input is not in updateInputs? */
-                    std::shared_ptr<LockedNode> oldLock;
-
                     updatesUsed.insert(inputPath);
 
-                    if (oldNode && !lockFlags.inputUpdates.count(inputPath))
-                        if (auto oldLock2 = get(oldNode->inputs, id))
-                            if (auto oldLock3 = std::get_if<0>(&*oldLock2))
-                                oldLock = *oldLock3;
+                    auto & oldLock = plan.oldLock;
 
-                    if (oldLock
-                        && oldLock->originalRef == *input.ref
-                        && !hasOverride)
+                    if (plan.fetch)
+                        state.aio.blockOn(prefetcher.wait(plan.fetch->first, plan.fetch->second));
+
+                    if (plan.keepOldLock)
                     {
                         debug("keeping existing input '%s'", inputPathS);
 
@@ -684,14 +848,7 @@ LockedFlake lockFlake(
 
                         node->inputs.insert_or_assign(id, childNode);
 
-                        /* If we have this input in updateInputs, then we
-                           must fetch the flake to update it. */
-                        auto lb = lockFlags.inputUpdates.lower_bound(inputPath);
-
-                        auto mustRefetch =
-                            lb != lockFlags.inputUpdates.end()
-                            && lb->size() > inputPath.size()
-                            && std::equal(inputPath.begin(), inputPath.end(), lb->begin());
+                        auto mustRefetch = plan.mustRefetch;
 
                         FlakeInputs fakeInputs;
 
@@ -707,21 +864,6 @@ LockedFlake lockFlake(
                                         .isFlake = (*lockedNode)->isFlake,
                                     });
                                 } else if (auto follows = std::get_if<1>(&i.second)) {
-                                    if (!trustLock) {
-                                        // It is possible that the flake has changed,
-                                        // so we must confirm all the follows that are in the lock file are also in the flake.
-                                        auto overridePath(inputPath);
-                                        overridePath.push_back(i.first);
-                                        auto o = overrides.find(overridePath);
-                                        // If the override disappeared, we have to refetch the flake,
-                                        // since some of the inputs may not be present in the lock file.
-                                        if (o == overrides.end()) {
-                                            mustRefetch = true;
-                                            // There's no point populating the rest of the fake inputs,
-                                            // since we'll refetch the flake anyways.
-                                            break;
-                                        }
-                                    }
                                     auto absoluteFollows(lockRootPath);
                                     absoluteFollows.insert(absoluteFollows.end(), follows->begin(), follows->end());
                                     fakeInputs.emplace(i.first, FlakeInput {
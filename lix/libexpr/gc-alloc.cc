@@ -1,7 +1,14 @@
 #include "lix/libexpr/gc-alloc.hh"
+#include "lix/libutil/error.hh"
 
+#include <atomic>
 #include <cstring>
 #include <string_view>
+#include <sys/mman.h>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
 
 namespace nix
 {
@@ -20,4 +27,76 @@ char const * gcCopyStringIfNeeded(std::string_view toCopyFrom)
     return cstr;
 }
 
+namespace arena
+{
+
+bool enabled = false;
+thread_local Chunk current;
+
+/// Size of the chunks small allocations are carved from. Larger allocations
+/// get a mapping of their own.
+static constexpr size_t CHUNK_SIZE = 32 * 1024 * 1024;
+
+static uint64_t limit = 0;
+static std::atomic<uint64_t> reserved = 0;
+/// Bytes left unused at the end of retired chunks.
+static std::atomic<uint64_t> wasted = 0;
+
+static char * mapChunk(size_t size)
+{
+    if (auto total = reserved.fetch_add(size) + size; limit && total > limit) {
+        reserved.fetch_sub(size);
+        throw Error(
+            "evaluation needs more than the %d bytes of memory allowed by 'eval-memory-limit'",
+            limit
+        );
+    }
+
+    auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        reserved.fetch_sub(size);
+        throw std::bad_alloc();
+    }
+    return static_cast<char *>(p);
+}
+
+void * allocSlow(size_t n)
+{
+    if (n > CHUNK_SIZE / 4) {
+        return mapChunk(n);
+    }
+
+    auto chunk = mapChunk(CHUNK_SIZE);
+    wasted += current.end - current.next;
+    current = {chunk + n, chunk + CHUNK_SIZE};
+    return chunk;
+}
+
+Statistics getStatistics()
+{
+    auto mapped = reserved.load();
+    return {
+        .allocated = mapped - wasted.load() - (current.end - current.next),
+        .reserved = mapped,
+    };
+}
+
+}
+
+void enableEvalArena(uint64_t limit)
+{
+    if (arena::enabled) {
+        return;
+    }
+
+#if HAVE_BOEHMGC
+    // objects allocated so far may now be referenced only from the arena,
+    // which the collector does not scan
+    GC_disable();
+#endif
+
+    arena::limit = limit;
+    arena::enabled = true;
+}
+
 }
@@ -3,6 +3,7 @@
 /// if Lix is compiled with BoehmGC enabled.
 
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <list>
 #include <map>
@@ -62,6 +63,59 @@ using TraceableAllocator = std::allocator<T>;
 namespace nix
 {
 
+/// Bump-pointer allocation for the `arena` evaluation allocator. Arena
+/// memory is never freed, and it comes zeroed from the kernel. Once enabled
+/// by @ref enableEvalArena, every GC allocation below is served from the
+/// arena instead.
+namespace arena
+{
+
+struct Chunk
+{
+    char * next = nullptr;
+    char * end = nullptr;
+};
+
+extern bool enabled;
+extern thread_local Chunk current;
+
+constexpr size_t ALIGN = alignof(std::max_align_t);
+
+/// Allocates from a new chunk when the current one is exhausted.
+void * allocSlow(size_t n);
+
+[[gnu::always_inline]]
+inline void * alloc(size_t n)
+{
+    size_t rounded = (n + ALIGN - 1) & ~(ALIGN - 1);
+    if (rounded < n) {
+        throw std::bad_alloc();
+    }
+    if (size_t(current.end - current.next) >= rounded) {
+        void * p = current.next;
+        current.next += rounded;
+        return p;
+    }
+    return allocSlow(rounded);
+}
+
+struct Statistics
+{
+    /// Bytes handed out, including alignment padding.
+    uint64_t allocated;
+    /// Bytes mapped for chunks.
+    uint64_t reserved;
+};
+
+Statistics getStatistics();
+
+}
+
+/// Switches all further GC allocations of this process to the arena and
+/// stops garbage collection for good. Allocating more than @ref limit bytes
+/// (if not zero) from the arena throws an `Error`.
+void enableEvalArena(uint64_t limit);
+
 /// Alias for std::map which uses BoehmGC's allocator conditional on this Lix
 /// build having GC enabled.
 template<typename KeyT, typename ValueT>
@@ -85,6 +139,10 @@ using GcList = std::list<ItemT, TraceableAllocator<ItemT>>;
 [[gnu::always_inline]]
 inline void * gcAllocBytes(size_t n)
 {
+    if (arena::enabled) {
+        return arena::alloc(n);
+    }
+
     // Note: various places expect the allocated memory to be zero.
     // Hence: calloc().
     void * ptr = LIX_GC_CALLOC(n);
@@ -130,6 +188,10 @@ inline T * gcAllocType(size_t howMany = 1)
 /// pointers.
 inline char * gcAllocString(size_t size)
 {
+    if (arena::enabled) {
+        return static_cast<char *>(arena::alloc(size));
+    }
+
     char * cstr = static_cast<char *>(LIX_GC_MALLOC_ATOMIC(size));
     if (cstr == nullptr) {
         throw std::bad_alloc();
@@ -17,6 +17,7 @@ namespace nix {
 
 struct Env;
 struct Value;
+class BindingsShape;
 class Evaluator;
 struct ExprWith;
 struct StaticEnv;
@@ -406,6 +407,11 @@ struct ExprAttrs
 struct ExprSet : Expr, ExprAttrs {
     bool recursive = false;
 
+    /**
+     * Shape of the sets this expression produces, created on first use.
+     */
+    std::shared_ptr<const BindingsShape> shape;
+
     ExprSet(const PosIdx &pos, bool recursive = false) : Expr(pos), recursive(recursive) { };
     ExprSet() { };
     JSON toJSON(const SymbolTable & symbols) const override;
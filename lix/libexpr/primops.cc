@@ -2900,19 +2900,88 @@ static Value prim_hashString(EvalState & state, Value ** args)
     return {NewValueAs::string, base16Encode(hashString(*ht, s))};
 }
 
+/* A regex compiled for builtins.match and builtins.split. std::regex is used
+   unless the linear-regex experimental feature is enabled: the new engine finds
+   leftmost-longest matches where std::regex sometimes does not, which would
+   change the results of evaluations (and the hashes of derivations). */
+struct CompiledRegex
+{
+    const regex::Program * program = nullptr;
+    const std::regex * legacy = nullptr;
+
+    std::optional<regex::Match> match(std::string_view subject) const
+    {
+        if (program) {
+            return program->match(subject);
+        }
+        std::cmatch match;
+        if (!std::regex_match(subject.data(), subject.data() + subject.size(), match, *legacy)) {
+            return std::nullopt;
+        }
+        return fromStd(match, subject);
+    }
+
+    std::vector<regex::Match> searchAll(std::string_view subject) const
+    {
+        if (program) {
+            return program->searchAll(subject);
+        }
+        std::vector<regex::Match> result;
+        auto begin = std::cregex_iterator(subject.data(), subject.data() + subject.size(), *legacy);
+        for (auto i = begin; i != std::cregex_iterator(); ++i) {
+            result.push_back(fromStd(*i, subject));
+        }
+        return result;
+    }
+
+private:
+    static regex::Match fromStd(const std::cmatch & match, std::string_view subject)
+    {
+        regex::Match result;
+        result.offsets.reserve(2 * match.size());
+        for (auto & group : match) {
+            if (group.matched) {
+                result.offsets.push_back(group.first - subject.data());
+                result.offsets.push_back(group.second - subject.data());
+            } else {
+                result.offsets.push_back(std::string_view::npos);
+                result.offsets.push_back(std::string_view::npos);
+            }
+        }
+        return result;
+    }
+};
+
 struct RegexCache
 {
     // TODO use C++20 transparent comparison when available
-    std::unordered_map<std::string_view, std::regex> cache;
+    std::unordered_map<std::string_view, std::shared_ptr<const regex::Program>> programs;
+    std::unordered_map<std::string_view, std::regex> legacy;
     std::list<std::string> keys;
 
-    std::regex get(std::string_view re)
+    CompiledRegex get(std::string_view re)
+    {
+        if (featureSettings.isEnabled(Xp::LinearRegex)) {
+            auto it = programs.find(re);
+            if (it == programs.end()) {
+                auto program = regex::cached(re);
+                it = programs.emplace(key(re), std::move(program)).first;
+            }
+            return {.program = it->second.get()};
+        } else {
+            auto it = legacy.find(re);
+            if (it == legacy.end()) {
+                auto & k = key(re);
+                it = legacy.emplace(k, regex::parse(k, std::regex::extended)).first;
+            }
+            return {.legacy = &it->second};
+        }
+    }
+
+private:
+    const std::string & key(std::string_view re)
     {
-        auto it = cache.find(re);
-        if (it != cache.end())
-            return it->second;
-        keys.emplace_back(re);
-        return cache.emplace(keys.back(), regex::parse(keys.back(), std::regex::extended)).first->second;
+        return keys.emplace_back(re);
     }
 };
 
@@ -2935,19 +3004,19 @@ Value prim_match(EvalState & state, Value ** args)
         NixStringContext context;
         const auto str = state.forceString(*args[1], context, noPos, "while evaluating the second argument passed to builtins.match");
 
-        std::cmatch match;
-        if (!std::regex_match(str.begin(), str.end(), match, regex)) {
+        auto match = regex.match(str);
+        if (!match) {
             return Value::VNULL;
         }
 
         // the first match is the whole string
-        const size_t len = match.size() - 1;
+        const size_t len = match->groups() - 1;
         auto result = state.ctx.mem.newList(len);
         for (size_t i = 0; i < len; ++i) {
-            if (!match[i+1].matched)
+            if (!match->matched(i + 1))
                 result->elems[i] = Value::VNULL;
             else
-                result->elems[i] = {NewValueAs::string, match[i + 1].str()};
+                result->elems[i] = {NewValueAs::string, match->str(str, i + 1)};
         }
 
         return {NewValueAs::list, result};
@@ -2969,11 +3038,10 @@ Value prim_split(EvalState & state, Value ** args)
         NixStringContext context;
         const auto str = state.forceString(*args[1], context, noPos, "while evaluating the second argument passed to builtins.split");
 
-        auto begin = std::cregex_iterator(str.begin(), str.end(), regex);
-        auto end = std::cregex_iterator();
+        auto matches = regex.searchAll(str);
 
         // Any matches results are surrounded by non-matching results.
-        const size_t len = std::distance(begin, end);
+        const size_t len = matches.size();
         auto result = state.ctx.mem.newList(2 * len + 1);
         Value v = {NewValueAs::list, result};
         size_t idx = 0;
@@ -2983,30 +3051,33 @@ Value prim_split(EvalState & state, Value ** args)
             return v;
         }
 
-        for (auto i = begin; i != end; ++i) {
+        size_t prefixStart = 0;
+        for (auto & match : matches) {
             assert(idx <= 2 * len + 1 - 3);
-            auto match = *i;
 
             // Add a string for non-matched characters.
-            result->elems[idx++] = {NewValueAs::string, match.prefix().str()};
+            result->elems[idx++] = {
+                NewValueAs::string, str.substr(prefixStart, match.position() - prefixStart)
+            };
+            prefixStart = match.position() + match.length();
 
             // Add a list for matched substrings.
-            const size_t slen = match.size() - 1;
+            const size_t slen = match.groups() - 1;
             auto & elem = result->elems[idx++];
 
             // Start at 1, beacause the first match is the whole string.
             auto content = state.ctx.mem.newList(slen);
             elem = {NewValueAs::list, content};
             for (size_t si = 0; si < slen; ++si) {
-                if (!match[si + 1].matched)
+                if (!match.matched(si + 1))
                     content->elems[si] = Value::VNULL;
                 else
-                    content->elems[si] = {NewValueAs::string, match[si + 1].str()};
+                    content->elems[si] = {NewValueAs::string, match.str(str, si + 1)};
             }
 
             // Add a string for non-matched suffix characters.
             if (idx == 2 * len) {
-                result->elems[idx++] = {NewValueAs::string, match.suffix().str()};
+                result->elems[idx++] = {NewValueAs::string, str.substr(prefixStart)};
             }
         }
 
@@ -98,6 +98,7 @@ public:
 class Symbol
 {
     friend class SymbolTable;
+    friend class BindingsShape;
 
 private:
     uint32_t id;
@@ -2,6 +2,7 @@
 #include "libutil/file-system.hh"
 #include "lix/libutil/archive.hh"
 #include "lix/libutil/async.hh"
+#include "lix/libutil/charptr-cast.hh"
 #include "lix/libutil/error.hh"
 #include "lix/libfetchers/fetchers.hh"
 #include "lix/libfetchers/cache.hh"
@@ -162,6 +163,270 @@ bool isNotDotGitDirectory(const Path & path)
     return baseNameOf(path) != ".git";
 }
 
+/**
+ * Reads objects from a repository through one `git cat-file --batch`
+ * process instead of spawning a process per object.
+ */
+class GitObjectReader
+{
+    RunningProgram proc;
+    AutoCloseFD toGit, fromGitFd;
+    std::unique_ptr<FdSource> fromGit;
+
+public:
+    GitObjectReader(const Path & repoDir, const Path & gitDir)
+    {
+        Pipe in, out;
+        in.create();
+        out.create();
+        proc = runProgram2({
+            .program = "git",
+            .args = {"-C", repoDir, "--git-dir", gitDir, "cat-file", "--batch"},
+            .redirections =
+                {{.dup = STDIN_FILENO, .from = in.readSide.get()},
+                 {.dup = STDOUT_FILENO, .from = out.writeSide.get()}},
+        });
+        toGit = std::move(in.writeSide);
+        fromGitFd = std::move(out.readSide);
+        fromGit = std::make_unique<FdSource>(fromGitFd.get());
+    }
+
+    ~GitObjectReader()
+    {
+        try {
+            // close both ends, git may be blocked writing an object we
+            // did not read completely.
+            toGit.close();
+            fromGit.reset();
+            fromGitFd.close();
+            (void) proc.wait();
+        } catch (...) {
+            ignoreExceptionInDestructor();
+        }
+    }
+
+    struct Header
+    {
+        std::string hash;
+        std::string type;
+        uint64_t size;
+    };
+
+    /**
+     * Request an object. The caller must read exactly `size` bytes of its
+     * contents with `contents()` or `read()` before the next request.
+     */
+    Header request(std::string_view object)
+    {
+        writeFull(toGit.get(), std::string(object) + "\n");
+
+        std::string line;
+        while (true) {
+            char c;
+            (*fromGit)(&c, 1);
+            if (c == '\n') {
+                break;
+            }
+            line += c;
+        }
+
+        auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+        std::optional<uint64_t> size;
+        if (fields.size() == 3) {
+            size = string2Int<uint64_t>(fields[2]);
+        }
+        if (!size) {
+            throw Error("cannot read git object '%s': %s", object, line);
+        }
+        return {fields[0], fields[1], *size};
+    }
+
+    std::string read(uint64_t size)
+    {
+        std::string data(size, 0);
+        (*fromGit)(data.data(), size);
+        finishObject();
+        return data;
+    }
+
+    Generator<Bytes> contents(uint64_t size)
+    {
+        std::vector<char> buf(65536);
+        while (size > 0) {
+            auto n = fromGit->read(buf.data(), std::min<uint64_t>(size, buf.size()));
+            size -= n;
+            co_yield std::span{buf.data(), n};
+        }
+        finishObject();
+    }
+
+private:
+    void finishObject()
+    {
+        char c;
+        (*fromGit)(&c, 1);
+        if (c != '\n') {
+            throw Error("unexpected output from 'git cat-file --batch'");
+        }
+    }
+};
+
+/**
+ * `git archive` applies `.gitattributes` (`export-ignore`, `export-subst`,
+ * line ending conversion and filters) and `core.autocrlf`. Trees reading
+ * any of those must still be fetched with `git archive` to produce the same
+ * store paths as before.
+ */
+MakeError(GitArchiveConversionNeeded, Error);
+
+struct GitTreeEntry
+{
+    std::string mode;
+    std::string hash;
+};
+
+static std::map<std::string, GitTreeEntry>
+readGitTree(GitObjectReader & reader, const std::string & hash)
+{
+    auto header = reader.request(hash);
+    if (header.type != "tree") {
+        throw Error("git object '%s' is a %s, not a tree", hash, header.type);
+    }
+    auto hashSize = header.hash.size() / 2;
+    auto data = reader.read(header.size);
+
+    std::map<std::string, GitTreeEntry> entries;
+    std::string_view rest = data;
+    while (!rest.empty()) {
+        auto space = rest.find(' ');
+        auto nul = rest.find('\0', space);
+        if (space == rest.npos || nul == rest.npos || rest.size() < nul + 1 + hashSize) {
+            throw Error("git tree '%s' is corrupt", hash);
+        }
+        entries.emplace(
+            std::string(rest.substr(space + 1, nul - space - 1)),
+            GitTreeEntry{
+                .mode = std::string(rest.substr(0, space)),
+                .hash = base16Encode(std::span{
+                    charptr_cast<const uint8_t *>(rest.data() + nul + 1), hashSize
+                }),
+            }
+        );
+        rest.remove_prefix(nul + 1 + hashSize);
+    }
+    return entries;
+}
+
+/**
+ * Throw `GitArchiveConversionNeeded` if any tree below `hash` contains a
+ * `.gitattributes` file. Only reads tree objects.
+ */
+static void checkNoGitAttributes(GitObjectReader & reader, const std::string & hash)
+{
+    for (auto & [name, entry] : readGitTree(reader, hash)) {
+        if (name == ".gitattributes") {
+            throw GitArchiveConversionNeeded("tree '%s' has a .gitattributes file", hash);
+        }
+        if (entry.mode == "40000") {
+            checkNoGitAttributes(reader, entry.hash);
+        }
+    }
+}
+
+/**
+ * Whether any attributes outside of the tree could apply to `git archive`.
+ */
+static kj::Promise<Result<bool>>
+gitArchiveConversionConfigured(const Path & repoDir, const Path & gitDir)
+try {
+    for (auto & attributes :
+         {gitDir + "/info/attributes",
+          getConfigDir() + "/git/attributes",
+          Path("/etc/gitattributes")})
+    {
+        if (pathExists(attributes.starts_with("/") ? attributes : repoDir + "/" + attributes)) {
+            co_return true;
+        }
+    }
+
+    auto [status, output] = TRY_AWAIT(runProgram(RunOptions{
+        .program = "git",
+        .args =
+            {"-C",
+             repoDir,
+             "--git-dir",
+             gitDir,
+             "config",
+             "--get-regexp",
+             "^core\\.(autocrlf|attributesfile)$"},
+    }));
+    for (auto & line : tokenizeString<std::vector<std::string>>(output, "\n")) {
+        if (line != "core.autocrlf false" && line != "core.autocrlf input") {
+            co_return true;
+        }
+    }
+    co_return false;
+} catch (...) {
+    co_return result::current_exception();
+}
+
+static nar::Entry gitObjectToNar(GitObjectReader & reader, const GitTreeEntry & entry)
+{
+    if (entry.mode == "40000") {
+        auto contents = [](GitObjectReader & reader, std::string hash
+                        ) -> Generator<std::pair<const std::string &, nar::Entry>> {
+            for (auto & [name, child] : readGitTree(reader, hash)) {
+                co_yield std::pair(std::cref(name), gitObjectToNar(reader, child));
+            }
+        };
+        return nar::Directory(contents(reader, entry.hash));
+    } else if (entry.mode == "160000") {
+        // git archive represents submodules as empty directories
+        return nar::Directory([]() -> Generator<std::pair<const std::string &, nar::Entry>> {
+            co_return;
+        }());
+    }
+
+    auto header = reader.request(entry.hash);
+    if (header.type != "blob") {
+        throw Error("git object '%s' is a %s, not a blob", entry.hash, header.type);
+    }
+    if (entry.mode == "120000") {
+        return nar::Symlink{reader.read(header.size)};
+    }
+    return nar::File{
+        .executable = entry.mode == "100755",
+        .size = header.size,
+        .contents = reader.contents(header.size),
+    };
+}
+
+/**
+ * Add the git tree `treeHash` to the store by reading its objects directly,
+ * producing the same store path as `git archive` and `addToStoreRecursive`.
+ * The caller must have checked `gitArchiveConversionConfigured` already.
+ */
+static kj::Promise<Result<StorePath>> addGitTreeToStore(
+    ref<Store> store,
+    const Path & repoDir,
+    const Path & gitDir,
+    const std::string & treeHash,
+    std::string_view name
+)
+try {
+    GitObjectReader reader(repoDir, gitDir);
+    checkNoGitAttributes(reader, treeHash);
+
+    AsyncGeneratorInputStream nar{
+        nar::dump(gitObjectToNar(reader, {.mode = "40000", .hash = treeHash}))
+    };
+    co_return TRY_AWAIT(
+        store->addToStoreFromDump(nar, name, FileIngestionMethod::Recursive, HashType::SHA256)
+    );
+} catch (...) {
+    co_return result::current_exception();
+}
+
 struct WorkdirInfo
 {
     bool clean = false;
@@ -906,6 +1171,8 @@ struct GitInputScheme : InputScheme
             );
         }
 
+        std::optional<StorePath> storePath;
+
         if (submodules) {
             Path tmpGitDir = createTempDir();
             AutoDelete delTmpGitDir(tmpGitDir, true);
@@ -986,7 +1253,41 @@ struct GitInputScheme : InputScheme
             }
 
             filter = isNotDotGitDirectory;
-        } else {
+        } else if (result.second.starts_with("tree ")
+                   && !TRY_AWAIT(gitArchiveConversionConfigured(repoDir, gitDir)))
+        {
+            /* Commits that only change metadata keep their tree, and trees
+               are content-addressed just like the store path we produce.
+               Only trees without a .gitattributes file are cached, so the
+               tree hash covers everything `git archive` would apply except
+               the attributes and config of the repo, which we just checked
+               to be absent. Repos that have them always use `git archive`. */
+            auto treeHash = result.second.substr(5, result.second.find('\n') - 5);
+            Attrs treeAttrs({
+                {"type", "git-tree"},
+                {"tree", treeHash},
+                {"name", name},
+            });
+
+            if (auto res = TRY_AWAIT(TRY_AWAIT(getCache())->lookup(store, treeAttrs))) {
+                debug("using cached import of git tree %s", treeHash);
+                storePath = std::move(res->second);
+            } else {
+                try {
+                    storePath =
+                        TRY_AWAIT(addGitTreeToStore(store, repoDir, gitDir, treeHash, name));
+                } catch (GitArchiveConversionNeeded & e) {
+                    debug("falling back to git archive: %s", e.msg());
+                }
+                if (storePath) {
+                    auto narHash = TRY_AWAIT(store->queryPathInfo(*storePath))->narHash;
+                    Attrs treeInfo({{"narHash", narHash.to_string(HashFormat::SRI, true)}});
+                    TRY_AWAIT(TRY_AWAIT(getCache())->add(store, treeAttrs, treeInfo, *storePath, true));
+                }
+            }
+        }
+
+        if (!storePath && !submodules) {
             auto proc = runProgram2({
                 .program = "git",
                 .args = {"-C", repoDir, "--git-dir", gitDir, "archive", base16Encode(*input.getRev())},
@@ -997,9 +1298,11 @@ struct GitInputScheme : InputScheme
             TRY_AWAIT(unpackTarfile(_input.toURLString(), *proc.getStdout(), tmpDir));
         }
 
-        auto storePath = TRY_AWAIT(
-            store->addToStoreRecursive(name, *prepareDump(tmpDir, filter), HashType::SHA256)
-        );
+        if (!storePath) {
+            storePath = TRY_AWAIT(
+                store->addToStoreRecursive(name, *prepareDump(tmpDir, filter), HashType::SHA256)
+            );
+        }
 
         auto lastModified = std::stoull(TRY_AWAIT(runProgram(
             "git",
@@ -1031,11 +1334,11 @@ struct GitInputScheme : InputScheme
             );
 
         if (!_input.getRev())
-            TRY_AWAIT(TRY_AWAIT(getCache())->add(store, unlockedAttrs, infoAttrs, storePath, false));
+            TRY_AWAIT(TRY_AWAIT(getCache())->add(store, unlockedAttrs, infoAttrs, *storePath, false));
 
-        TRY_AWAIT(TRY_AWAIT(getCache())->add(store, getLockedAttrs(), infoAttrs, storePath, true));
+        TRY_AWAIT(TRY_AWAIT(getCache())->add(store, getLockedAttrs(), infoAttrs, *storePath, true));
 
-        co_return makeResult(infoAttrs, std::move(storePath));
+        co_return makeResult(infoAttrs, std::move(*storePath));
     } catch (...) {
         co_return result::current_exception();
     }
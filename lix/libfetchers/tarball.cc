@@ -1,5 +1,6 @@
 #include "lix/libfetchers/fetchers.hh"
 #include "lix/libfetchers/cache.hh"
+#include "lix/libfetchers/fetch-settings.hh"
 #include "lix/libstore/content-address.hh"
 #include "lix/libstore/filetransfer.hh"
 #include "lix/libstore/globals.hh"
@@ -159,6 +160,17 @@ try {
     co_return result::current_exception();
 }
 
+/**
+ * Spill file for `readTarball`, deleted right away since it is only
+ * accessed through its file descriptor.
+ */
+static AutoCloseFD createUnlinkedTempFile()
+{
+    auto [fd, path] = createTempFile("nix-tarball");
+    deletePath(path);
+    return std::move(fd);
+}
+
 kj::Promise<Result<DownloadTarballResult>> downloadTarball(
     ref<Store> store,
     const std::string & url,
@@ -181,42 +193,92 @@ try {
             .immutableUrl = maybeGetStrAttr(cached->infoAttrs, "immutableUrl"),
         };
 
-    auto res = TRY_AWAIT(downloadFile(store, url, name, locked, headers));
-
     std::optional<StorePath> unpackedStorePath;
     time_t lastModified;
+    std::string etag;
+    std::optional<std::string> immutableUrl;
+
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+    auto addTree = [&](const TarballTree & tree) -> kj::Promise<Result<void>> {
+        try {
+            lastModified = tree.lastModified();
+            AsyncGeneratorInputStream nar{tree.dump()};
+            unpackedStorePath = TRY_AWAIT(store->addToStoreFromDump(
+                nar, name, FileIngestionMethod::Recursive, HashType::SHA256, NoRepair
+            ));
+            co_return result::success();
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    };
 
-    if (cached && res.etag != "" && getStrAttr(cached->infoAttrs, "etag") == res.etag) {
+    auto useCached = [&]() {
         unpackedStorePath = std::move(cached->storePath);
         lastModified = getIntAttr(cached->infoAttrs, "lastModified");
+    };
+
+    if (fetchSettings.keepTarballs) {
+        auto res = TRY_AWAIT(downloadFile(store, url, name, locked, headers));
+        etag = res.etag;
+        immutableUrl = res.immutableUrl;
+
+        if (cached && res.etag != "" && getStrAttr(cached->infoAttrs, "etag") == res.etag) {
+            useCached();
+        } else {
+            auto tree =
+                readTarball(url, store->toRealPath(res.storePath), createUnlinkedTempFile);
+            TRY_AWAIT(addTree(tree));
+        }
     } else {
-        Path tmpDir = createTempDir();
-        AutoDelete autoDelete(tmpDir, true);
-        unpackTarfile(url, store->toRealPath(res.storePath), tmpDir);
-        auto members = readDirectory(tmpDir);
-        if (members.size() != 1)
-            throw nix::Error("tarball '%s' contains an unexpected number of top-level files", url);
-        auto topDir = tmpDir + "/" + members.begin()->name;
-        lastModified = lstat(topDir).st_mtime;
-        unpackedStorePath = TRY_AWAIT(
-            store->addToStoreRecursive(name, *prepareDump(topDir), HashType::SHA256, NoRepair)
-        );
+        auto requestHeaders = headers;
+        if (cached) {
+            requestHeaders.emplace_back("If-None-Match", getStrAttr(cached->infoAttrs, "etag"));
+        }
+
+        std::optional<std::pair<FileTransferResult, box_ptr<AsyncInputStream>>> download;
+        try {
+            download = TRY_AWAIT(getFileTransfer()->download(url, {requestHeaders}));
+        } catch (FileTransferError & e) {
+            if (!cached) {
+                throw;
+            }
+            printTaggedWarning("%s; using cached version", Uncolored(e.msg()));
+        }
+
+        if (download) {
+            auto & [res, content] = *download;
+            etag = res.etag;
+            immutableUrl = res.immutableUrl;
+            if (cached
+                && (res.cached
+                    || (res.etag != "" && getStrAttr(cached->infoAttrs, "etag") == res.etag)))
+            {
+                useCached();
+            } else {
+                auto tree = TRY_AWAIT(readTarball(url, *content, createUnlinkedTempFile));
+                TRY_AWAIT(addTree(tree));
+            }
+        } else {
+            etag = getStrAttr(cached->infoAttrs, "etag");
+            immutableUrl = maybeGetStrAttr(cached->infoAttrs, "immutableUrl");
+            useCached();
+        }
     }
 
     Attrs infoAttrs({
         {"lastModified", uint64_t(lastModified)},
-        {"etag", res.etag},
+        {"etag", etag},
     });
 
-    if (res.immutableUrl)
-        infoAttrs.emplace("immutableUrl", *res.immutableUrl);
+    if (immutableUrl)
+        infoAttrs.emplace("immutableUrl", *immutableUrl);
 
     TRY_AWAIT(TRY_AWAIT(getCache())->add(store, inAttrs, infoAttrs, *unpackedStorePath, locked));
 
     co_return DownloadTarballResult{
         .tree = Tree { .actualPath = store->toRealPath(*unpackedStorePath), .storePath = std::move(*unpackedStorePath) },
         .lastModified = lastModified,
-        .immutableUrl = res.immutableUrl,
+        .immutableUrl = immutableUrl,
     };
 } catch (...) {
     co_return result::current_exception();
@@ -2,6 +2,7 @@
 #include "lix/libmain/loggers.hh"
 #include "lix/libmain/progress-bar.hh"
 #include "lix/libutil/log-format.hh"
+#include "lix/libutil/logging-rpc.hh"
 #include "lix/libutil/config-impl.hh" // IWYU pragma: keep
 
 namespace nix {
@@ -31,6 +32,8 @@ Logger * getLoggerByFormat(LogFormat logFormat)
         return makeSimpleLogger(true);
     case LogFormat::InternalJson:
         return makeJSONLogger(*makeSimpleLogger(true));
+    case LogFormat::InternalBinary:
+        return rpc::log::makeFramedLogger();
     case LogFormat::Bar:
         return makeProgressBar();
     case LogFormat::BarWithLogs: {
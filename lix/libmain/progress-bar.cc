@@ -19,6 +19,10 @@ constexpr const auto A_LONG_TIME = std::chrono::duration_cast<std::chrono::milli
     100 * 365 * std::chrono::seconds(86400)
 );
 
+/* How many activities that are too new to be shown a frame may skip while
+   looking for activities to show. */
+constexpr size_t maxTooNewActivities = 100;
+
 using namespace std::literals::chrono_literals;
 
 static std::string_view getS(const std::vector<Logger::Field> & fields, size_t n)
@@ -42,6 +46,13 @@ static std::string_view storePathToName(std::string_view path)
     return i == std::string::npos ? base.substr(0, 0) : base.substr(i + 1);
 }
 
+/* Whether an activity belongs into `State::activities` rather than into
+   `State::hiddenActivities`. */
+static bool isShown(const ProgressBar::ActInfo & info)
+{
+    return info.visible && (!info.s.empty() || !info.lastLine.empty());
+}
+
 ProgressBar::ProgressBar(bool isTTY)
     : isTTY(isTTY)
 {
@@ -140,43 +151,37 @@ Logger::BufferState ProgressBar::startActivityImpl(
     ActivityId parent
 )
 {
-    auto state(state_.lock());
-
-    if (lvl <= getVerbosity() && !s.empty() && type != actBuildWaiting) {
-        (void) log(*state, lvl, s + "...");
-    }
-
-    state->activities.emplace_back(ActInfo {
+    /* Everything that does not need the state is done before locking it,
+       so that threads starting many activities do not hold up each other
+       or the renderer. */
+    ActInfo info{
         .s = s,
         .type = type,
         .parent = parent,
         .startTime = std::chrono::steady_clock::now()
-    });
-    auto i = std::prev(state->activities.end());
-    state->its.emplace(act, i);
-    state->activitiesByType[type].its.emplace(act, i);
+    };
 
     if (type == actBuild) {
         std::string name(storePathToName(getS(fields, 0)));
         if (name.ends_with(".drv"))
             name = name.substr(0, name.size() - 4);
-        i->s = fmt("building " ANSI_BOLD "%s" ANSI_NORMAL, name);
+        info.s = fmt("building " ANSI_BOLD "%s" ANSI_NORMAL, name);
         auto machineName = getS(fields, 1);
         if (machineName != "")
-            i->s += fmt(" on " ANSI_BOLD "%s" ANSI_NORMAL, machineName);
+            info.s += fmt(" on " ANSI_BOLD "%s" ANSI_NORMAL, machineName);
 
         // Used to be curRound and nrRounds, but the
         // implementation was broken for a long time.
         if (getI(fields, 2) != 1 || getI(fields, 3) != 1) {
             throw Error("log message indicated repeating builds, but this is not currently implemented");
         }
-        i->name = DrvName(name).name;
+        info.name = DrvName(name).name;
     }
 
     if (type == actSubstitute) {
         auto name = storePathToName(getS(fields, 0));
         auto sub = getS(fields, 1);
-        i->s = fmt(
+        info.s = fmt(
             sub.starts_with("local")
             ? "copying " ANSI_BOLD "%s" ANSI_NORMAL " from %s"
             : "fetching " ANSI_BOLD "%s" ANSI_NORMAL " from %s",
@@ -187,22 +192,32 @@ Logger::BufferState ProgressBar::startActivityImpl(
         auto name = storePathToName(getS(fields, 0));
         if (name.ends_with(".drv"))
             name = name.substr(0, name.size() - 4);
-        i->s = fmt("post-build " ANSI_BOLD "%s" ANSI_NORMAL, name);
-        i->name = DrvName(name).name;
+        info.s = fmt("post-build " ANSI_BOLD "%s" ANSI_NORMAL, name);
+        info.name = DrvName(name).name;
     }
 
     if (type == actQueryPathInfo) {
         auto name = storePathToName(getS(fields, 0));
-        i->s = fmt("querying " ANSI_BOLD "%s" ANSI_NORMAL " on %s", name, getS(fields, 1));
+        info.s = fmt("querying " ANSI_BOLD "%s" ANSI_NORMAL " on %s", name, getS(fields, 1));
+    }
+
+    auto state(state_.lock());
+
+    if (lvl <= getVerbosity() && !s.empty() && type != actBuildWaiting) {
+        (void) log(*state, lvl, s + "...");
     }
 
     if ((type == actFileTransfer && hasAncestor(*state, actCopyPath, parent))
         || (type == actFileTransfer && hasAncestor(*state, actQueryPathInfo, parent))
         || (type == actCopyPath && hasAncestor(*state, actSubstitute, parent)) || (s == "daemon connection"))
     {
-        i->visible = false;
+        info.visible = false;
     }
 
+    auto & list = isShown(info) ? state->activities : state->hiddenActivities;
+    list.push_back(std::move(info));
+    state->its.emplace(act, std::prev(list.end()));
+
     update(*state);
     return BufferState::HasSpace;
 }
@@ -226,16 +241,20 @@ Logger::BufferState ProgressBar::stopActivityImpl(ActivityId act)
 
     auto i = state->its.find(act);
     if (i != state->its.end()) {
+        auto & info = *i->second;
 
-        auto & actByType = state->activitiesByType[i->second->type];
-        actByType.done += i->second->done;
-        actByType.failed += i->second->failed;
+        auto & actByType = state->activitiesByType[info.type];
+        actByType.done += info.done;
+        actByType.failed += info.failed;
+        actByType.liveDone -= info.done;
+        actByType.liveExpected -= info.expected;
+        actByType.liveRunning -= info.running;
+        actByType.liveFailed -= info.failed;
 
-        for (auto & j : i->second->expectedByType)
+        for (auto & j : info.expectedByType)
             state->activitiesByType[j.first].expected -= j.second;
 
-        actByType.its.erase(act);
-        state->activities.erase(i->second);
+        (isShown(info) ? state->activities : state->hiddenActivities).erase(i->second);
         state->its.erase(i);
     }
 
@@ -246,6 +265,11 @@ Logger::BufferState ProgressBar::stopActivityImpl(ActivityId act)
 Logger::BufferState
 ProgressBar::resultImpl(ActivityId act, ResultType type, const std::vector<Field> & fields)
 {
+    std::string lastLine;
+    if (type == resBuildLogLine || type == resPostBuildLogLine) {
+        lastLine = chomp(getS(fields, 0));
+    }
+
     auto state(state_.lock());
 
     if (type == resFileLinked) {
@@ -255,11 +279,10 @@ ProgressBar::resultImpl(ActivityId act, ResultType type, const std::vector<Field
     }
 
     else if (type == resBuildLogLine || type == resPostBuildLogLine) {
-        auto lastLine = chomp(getS(fields, 0));
         if (!lastLine.empty()) {
             auto i = state->its.find(act);
             assert(i != state->its.end());
-            ActInfo info = *i->second;
+            ActInfo & info = *i->second;
             if (printBuildLogs || type == resPostBuildLogLine) {
                 auto suffix = "> ";
                 if (type == resPostBuildLogLine) {
@@ -271,13 +294,14 @@ ProgressBar::resultImpl(ActivityId act, ResultType type, const std::vector<Field
                     ANSI_FAINT + info.name.value_or("unnamed") + suffix + ANSI_NORMAL + lastLine
                 );
             } else {
-                if (!printMultiline) {
-                    state->activities.erase(i->second);
-                    info.lastLine = lastLine;
-                    state->activities.emplace_back(info);
-                    i->second = std::prev(state->activities.end());
-                } else {
-                    i->second->lastLine = lastLine;
+                /* In single-line mode the activity that logged last is
+                   shown, so it moves to the end of its list. Activities
+                   that were hidden only for lack of text become shown. */
+                auto & from = isShown(info) ? state->activities : state->hiddenActivities;
+                info.lastLine = std::move(lastLine);
+                auto & to = isShown(info) ? state->activities : state->hiddenActivities;
+                if (!printMultiline || &from != &to) {
+                    to.splice(to.end(), from, i->second);
                 }
                 update(*state);
             }
@@ -305,6 +329,13 @@ ProgressBar::resultImpl(ActivityId act, ResultType type, const std::vector<Field
         auto i = state->its.find(act);
         assert(i != state->its.end());
         ActInfo & actInfo = *i->second;
+        auto & actByType = state->activitiesByType[actInfo.type];
+        // unsigned arithmetic wraps around, so the sums stay correct
+        // even when an activity reports less progress than before.
+        actByType.liveDone += getI(fields, 0) - actInfo.done;
+        actByType.liveExpected += getI(fields, 1) - actInfo.expected;
+        actByType.liveRunning += getI(fields, 2) - actInfo.running;
+        actByType.liveFailed += getI(fields, 3) - actInfo.failed;
         actInfo.done = getI(fields, 0);
         actInfo.expected = getI(fields, 1);
         actInfo.running = getI(fields, 2);
@@ -329,8 +360,12 @@ ProgressBar::resultImpl(ActivityId act, ResultType type, const std::vector<Field
 
 void ProgressBar::update(State & state)
 {
-    state.haveUpdate = true;
-    updateCV.notify_one();
+    // the renderer only waits while there is no update, so it only needs to
+    // be woken by the first update after it has rendered a frame.
+    if (!state.haveUpdate) {
+        state.haveUpdate = true;
+        updateCV.notify_one();
+    }
 }
 
 void ProgressBar::eraseProgressDisplay(State & state)
@@ -361,6 +396,9 @@ std::chrono::milliseconds ProgressBar::restoreProgressDisplay(State & state)
 
     state.lastLines = 0;
 
+    // written at once, so that the frame costs as few writes as possible
+    std::string frame;
+
     std::string line;
     std::string status = getStatus(state);
     if (!status.empty()) {
@@ -369,58 +407,76 @@ std::chrono::milliseconds ProgressBar::restoreProgressDisplay(State & state)
         line += "]";
     }
     if (printMultiline && !line.empty()) {
-        writeLogsToStderr(filterANSIEscapes(line, false, width) + ANSI_NORMAL "\n");
+        frame += filterANSIEscapes(line, false, width) + ANSI_NORMAL "\n";
         state.lastLines++;
     }
 
     auto height = windowSize.first > 0 ? windowSize.first : 25;
-    auto moreActivities = 0;
+    size_t moreActivities = 0;
     auto now = std::chrono::steady_clock::now();
 
+    /* Only as many activities are looked at as can be shown, plus a few that
+       are too new to be shown, so that a frame costs the same no matter how
+       many activities are running. In multi-line mode the oldest activities
+       are shown, otherwise the last one, which is the one that logged last. */
+    size_t maxScanned = (printMultiline ? std::max(height - 1 - state.lastLines, 0) : 1)
+        + maxTooNewActivities;
+    size_t scanned = 0;
+
     std::string activity_line;
-    if (!state.activities.empty()) {
-        for (auto i = state.activities.begin(); i != state.activities.end(); ++i) {
-            if (!(i->visible && (!i->s.empty() || !i->lastLine.empty()))) {
-                continue;
-            }
-            /* Don't show activities until some time has
-               passed, to avoid displaying very short
-               activities. */
-            auto delay = std::chrono::milliseconds(10);
-            if (i->startTime + delay >= now) {
-                nextWakeup = std::min(
-                    nextWakeup,
-                    std::chrono::duration_cast<std::chrono::milliseconds>(
-                        delay - (now - i->startTime)
-                        )
-                    );
-                continue;
-            }
+    auto renderActivity = [&](const ActInfo & info) {
+        /* Don't show activities until some time has
+           passed, to avoid displaying very short
+           activities. */
+        auto delay = std::chrono::milliseconds(10);
+        if (info.startTime + delay >= now) {
+            nextWakeup = std::min(
+                nextWakeup,
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    delay - (now - info.startTime)
+                    )
+                );
+            return;
+        }
 
-            activity_line = i->s;
+        activity_line = info.s;
 
-            if (!i->phase.empty()) {
-                activity_line += " (";
-                activity_line += i->phase;
-                activity_line += ")";
-            }
-            if (!i->lastLine.empty()) {
-                if (!i->s.empty())
-                    activity_line += ": ";
-                activity_line += i->lastLine;
-            }
+        if (!info.phase.empty()) {
+            activity_line += " (";
+            activity_line += info.phase;
+            activity_line += ")";
+        }
+        if (!info.lastLine.empty()) {
+            if (!info.s.empty())
+                activity_line += ": ";
+            activity_line += info.lastLine;
+        }
 
-            if (printMultiline) {
-                if (state.lastLines < (height -1)) {
-                    writeLogsToStderr(filterANSIEscapes(activity_line, false, width) + ANSI_NORMAL "\n");
-                    state.lastLines++;
-                } else moreActivities++;
-            }
+        if (printMultiline) {
+            frame += filterANSIEscapes(activity_line, false, width) + ANSI_NORMAL "\n";
+            state.lastLines++;
+        }
+    };
+
+    if (printMultiline) {
+        for (auto i = state.activities.begin();
+             i != state.activities.end() && state.lastLines < height - 1 && scanned < maxScanned;
+             ++i, ++scanned)
+        {
+            renderActivity(*i);
+        }
+        moreActivities = state.activities.size() - scanned;
+    } else {
+        for (auto i = state.activities.rbegin();
+             i != state.activities.rend() && activity_line.empty() && scanned < maxScanned;
+             ++i, ++scanned)
+        {
+            renderActivity(*i);
         }
     }
 
     if (printMultiline && moreActivities)
-        writeLogsToStderr(fmt("And %d more...", moreActivities));
+        frame += fmt("And %d more...", moreActivities);
 
     if (!printMultiline) {
         if (!line.empty()) {
@@ -428,11 +484,12 @@ std::chrono::milliseconds ProgressBar::restoreProgressDisplay(State & state)
         }
         line += activity_line;
         if (!line.empty()) {
-            writeLogsToStderr(filterANSIEscapes(line, false, width) + ANSI_NORMAL);
+            frame += filterANSIEscapes(line, false, width) + ANSI_NORMAL;
         }
     }
 
-    writeLogsToStderr("\e[?2026l"); // end synchronized update
+    frame += "\e[?2026l"; // end synchronized update
+    writeLogsToStderr(frame);
 
     return nextWakeup;
 }
@@ -445,13 +502,10 @@ std::string ProgressBar::getStatus(State & state)
 
     auto renderActivity = [&](ActivityType type, const std::string & itemFmt, const std::string & numberFmt = "%d", double unit = 1) {
         auto & act = state.activitiesByType[type];
-        uint64_t done = act.done, expected = act.done, running = 0, failed = act.failed;
-        for (auto & [actId, infoIt] : act.its) {
-            done += infoIt->done;
-            expected += infoIt->expected;
-            running += infoIt->running;
-            failed += infoIt->failed;
-        }
+        uint64_t done = act.done + act.liveDone;
+        uint64_t expected = act.done + act.liveExpected;
+        uint64_t running = act.liveRunning;
+        uint64_t failed = act.failed + act.liveFailed;
 
         expected = std::max(expected, act.expected);
 
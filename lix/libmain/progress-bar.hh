@@ -2,7 +2,9 @@
 ///@file
 
 #include <chrono>
+#include <list>
 #include <thread>
+#include <unordered_map>
 
 #include "lix/libutil/logging.hh"
 #include "lix/libutil/sync.hh"
@@ -30,16 +32,30 @@ struct ProgressBar : public Logger
 
     struct ActivitiesByType
     {
-        std::map<ActivityId, std::list<ActInfo>::iterator> its;
+        /// progress of the stopped activities of this type.
         uint64_t done = 0;
-        uint64_t expected = 0;
         uint64_t failed = 0;
+
+        /// sum of the expected counts of this type set by other activities.
+        uint64_t expected = 0;
+
+        /// sums of the progress of the running activities of this type. they
+        /// are updated with every progress result, so that rendering the status
+        /// does not need to look at the activities themselves.
+        uint64_t liveDone = 0;
+        uint64_t liveExpected = 0;
+        uint64_t liveRunning = 0;
+        uint64_t liveFailed = 0;
     };
 
     struct State
     {
+        /// activities that may be shown, in the order they are shown in.
         std::list<ActInfo> activities;
-        std::map<ActivityId, std::list<ActInfo>::iterator> its;
+        /// activities that are never shown, because they are not visible or
+        /// have no text. keeping them apart means they cost nothing to render.
+        std::list<ActInfo> hiddenActivities;
+        std::unordered_map<ActivityId, std::list<ActInfo>::iterator> its;
 
         std::map<ActivityType, ActivitiesByType> activitiesByType;
 
@@ -27,6 +27,66 @@
 
 namespace nix {
 
+namespace {
+/**
+ * Compresses its input in independent chunks of `FRAMED_COMPRESSION_CHUNK_SIZE`
+ * bytes and remembers where each compressed chunk starts. Concatenated zstd
+ * frames are a valid zstd stream, so readers that do not know about the chunks
+ * decompress the result as usual, while readers that know the offsets can get
+ * any range of the input by decompressing only the chunks that cover it.
+ */
+struct SeekableCompressionSink : CompressionSink
+{
+    std::string method;
+    Sink & nextSink;
+    bool parallel;
+    int level;
+    std::string chunk;
+
+    /**
+     * Offsets of all chunks in the compressed output, followed by its size.
+     */
+    std::vector<uint64_t> offsets{0};
+
+    SeekableCompressionSink(std::string method, Sink & nextSink, bool parallel, int level)
+        : method(std::move(method))
+        , nextSink(nextSink)
+        , parallel(parallel)
+        , level(level)
+    {
+    }
+
+    void finish() override
+    {
+        flush();
+        if (!chunk.empty()) {
+            writeChunk();
+        }
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        while (!data.empty()) {
+            auto n = std::min(data.size(), FRAMED_COMPRESSION_CHUNK_SIZE - chunk.size());
+            chunk.append(data.substr(0, n));
+            data.remove_prefix(n);
+            if (chunk.size() == FRAMED_COMPRESSION_CHUNK_SIZE) {
+                writeChunk();
+            }
+        }
+    }
+
+    void writeChunk()
+    {
+        checkInterrupt();
+        auto compressed = compress(method, chunk, parallel, level);
+        nextSink(compressed);
+        offsets.push_back(offsets.back() + compressed.size());
+        chunk.clear();
+    }
+};
+}
+
 BinaryCacheStore::BinaryCacheStore(MustCallInit &, const BinaryCacheStoreConfig & config)
 {
     if (config.secretKeyFile != "")
@@ -95,6 +155,13 @@ try {
     co_return result::current_exception();
 }
 
+kj::Promise<Result<std::optional<std::string>>> BinaryCacheStore::getFileRange(
+    const std::string & path, uint64_t offset, uint64_t length, const Activity * context
+)
+{
+    return {std::optional<std::string>{}};
+}
+
 std::string BinaryCacheStore::narInfoFileFor(const StorePath & storePath)
 {
     return std::string(storePath.hashPart()) + ".narinfo";
@@ -140,20 +207,37 @@ try {
     HashSink fileHashSink { HashType::SHA256 };
     nar_index::Entry narIndex;
     HashSink narHashSink { HashType::SHA256 };
+    std::optional<std::vector<uint64_t>> chunkOffsets;
     {
         FdSink fileSink(fdTemp.get());
         TeeSink teeSinkCompressed { fileSink, fileHashSink };
-        auto compressionSink = makeCompressionSink(
-            config().compression,
-            teeSinkCompressed,
-            config().parallelCompression,
-            config().compressionLevel
-        );
+        std::shared_ptr<SeekableCompressionSink> seekableSink;
+        if (config().seekableCompression && config().writeNARListing
+            && config().compression == "zstd")
+        {
+            seekableSink = std::make_shared<SeekableCompressionSink>(
+                config().compression,
+                teeSinkCompressed,
+                config().parallelCompression,
+                config().compressionLevel
+            );
+        }
+        auto compressionSink = seekableSink
+            ? ref<CompressionSink>::unsafeFromPtr(seekableSink)
+            : makeCompressionSink(
+                  config().compression,
+                  teeSinkCompressed,
+                  config().parallelCompression,
+                  config().compressionLevel
+              );
         TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
         AsyncTeeInputStream teeSource { narSource, teeSinkUncompressed };
         narIndex = TRY_AWAIT(nar_index::create(teeSource));
         compressionSink->finish();
         fileSink.flush();
+        if (seekableSink) {
+            chunkOffsets = std::move(seekableSink->offsets);
+        }
     }
 
     auto now2 = std::chrono::steady_clock::now();
@@ -199,6 +283,17 @@ try {
             {"root", listNar(narIndex)},
         };
 
+        /* Clients use the chunk offsets to read parts of the NAR without
+           fetching all of it. They are only valid for this exact file. */
+        if (chunkOffsets) {
+            j["chunks"] = {
+                {"url", narInfo->url},
+                {"compression", narInfo->compression},
+                {"size", FRAMED_COMPRESSION_CHUNK_SIZE},
+                {"offsets", *chunkOffsets},
+            };
+        }
+
         try {
             TRY_AWAIT(
                 upsertFile(std::string(info.path.hashPart()) + ".ls", j.dump(), "application/json", context)
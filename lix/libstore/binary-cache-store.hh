@@ -30,6 +30,15 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     const Setting<bool> writeNARListing{this, false, "write-nar-listing",
         "Whether to write a JSON file that lists the files in each NAR."};
 
+    const Setting<bool> seekableCompression{this, false, "seekable-compression",
+        R"(
+          Whether to compress NARs in independent chunks of 1 MiB and record the chunk
+          offsets in the NAR listing written by `write-nar-listing`. Clients can then read
+          single files from a NAR by fetching only the chunks that contain them. The
+          result is still a valid compressed file, but usually slightly larger.
+          This is currently only available for `zstd`.
+        )"};
+
     const Setting<bool> writeDebugInfo{this, false, "index-debug-info",
         R"(
           Whether to index DWARF debug info files by build ID. This allows [`dwarffs`](https://github.com/edolstra/dwarffs) to
@@ -114,6 +123,27 @@ public:
     virtual kj::Promise<Result<std::optional<std::string>>>
     getFileContents(const std::string & path, const Activity * context = nullptr);
 
+    /**
+     * Read `length` bytes starting at `offset` from the specified file.
+     * Returns `std::nullopt` if the store cannot read parts of files, in
+     * which case callers must fetch the whole file instead.
+     */
+    virtual kj::Promise<Result<std::optional<std::string>>> getFileRange(
+        const std::string & path,
+        uint64_t offset,
+        uint64_t length,
+        const Activity * context = nullptr
+    );
+
+    /**
+     * Whether `getFileRange()` can return anything at all. Even if it can,
+     * individual requests may still return `std::nullopt`.
+     */
+    virtual bool supportsFileRanges()
+    {
+        return false;
+    }
+
 protected:
 
     kj::Promise<Result<void>> init();
@@ -0,0 +1,125 @@
+#include "lix/libstore/build/build-admission.hh"
+#include "lix/libstore/globals.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/strings.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace nix {
+
+#if __linux__
+static void readMemInfo(SystemResources & resources)
+{
+    for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/meminfo"), "\n")) {
+        auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+        if (fields.size() < 2) {
+            continue;
+        }
+        auto kib = string2Int<uint64_t>(fields[1]);
+        if (!kib) {
+            continue;
+        }
+        if (fields[0] == "MemTotal:") {
+            resources.memoryTotal = *kib * 1024;
+        } else if (fields[0] == "MemAvailable:") {
+            resources.memoryAvailable = *kib * 1024;
+        }
+    }
+}
+
+static void readMemoryPressure(SystemResources & resources)
+{
+    /* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 */
+    for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/pressure/memory"), "\n")) {
+        if (!line.starts_with("some ")) {
+            continue;
+        }
+        for (auto & field : tokenizeString<std::vector<std::string>>(line, " ")) {
+            if (field.starts_with("avg10=")) {
+                resources.memoryPressure = string2Float<double>(field.substr(6));
+            }
+        }
+    }
+}
+#endif
+
+SystemResources readSystemResources()
+{
+    SystemResources resources;
+    resources.cores = settings.getDefaultCores();
+
+    double load;
+    if (getloadavg(&load, 1) == 1) {
+        resources.loadAverage = load;
+    }
+
+#if __linux__
+    try {
+        readMemInfo(resources);
+    } catch (SysError & e) {
+        debug("could not read the available memory: %s", e.what());
+    }
+
+    /* Pressure stall information needs Linux 4.20 and may be disabled. */
+    try {
+        readMemoryPressure(resources);
+    } catch (SysError & e) {
+        debug("could not read the memory pressure: %s", e.what());
+    }
+#endif
+
+    return resources;
+}
+
+std::optional<BuildAdmission::Token> BuildAdmission::tryAdmit(
+    const SystemResources & resources,
+    uint64_t expectedMemory,
+    unsigned maxCores,
+    unsigned maxMemoryPressure,
+    std::chrono::steady_clock::time_point now
+)
+{
+    const unsigned limit = maxCores == 0 ? resources.cores : std::min(maxCores, resources.cores);
+
+    if (admitted.empty()) {
+        return Token{*this, admitted.insert(admitted.end(), {expectedMemory, limit, now})};
+    }
+
+    if (maxMemoryPressure > 0 && resources.memoryPressure
+        && *resources.memoryPressure >= maxMemoryPressure)
+    {
+        return std::nullopt;
+    }
+
+    uint64_t reservedMemory = 0;
+    unsigned reservedCores = 0, recentCores = 0;
+    for (auto & build : admitted) {
+        reservedMemory += build.memory;
+        reservedCores += build.cores;
+        if (now - build.since < coreReservationTime) {
+            recentCores += build.cores;
+        }
+    }
+
+    if (resources.memoryAvailable && expectedMemory > *resources.memoryAvailable) {
+        return std::nullopt;
+    }
+    if (resources.memoryTotal && reservedMemory + expectedMemory > *resources.memoryTotal) {
+        return std::nullopt;
+    }
+
+    /* The load average only catches up with new builds after a while, so
+       cores handed out recently count as busy on top of it. Without a load
+       average all cores of running builds count as busy. */
+    const double busy =
+        resources.loadAverage ? *resources.loadAverage + recentCores : double(reservedCores);
+    const double idle = std::max(0.0, double(resources.cores) - busy);
+    const unsigned cores = std::clamp(unsigned(std::floor(idle)), 1u, std::max(limit, 1u));
+
+    return Token{*this, admitted.insert(admitted.end(), {expectedMemory, cores, now})};
+}
+
+}
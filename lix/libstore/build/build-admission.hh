@@ -0,0 +1,139 @@
+#pragma once
+///@file
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <optional>
+
+namespace nix {
+
+/**
+ * A snapshot of the resources of the machine, as far as the platform lets
+ * us know about them.
+ */
+struct SystemResources
+{
+    /**
+     * Number of cores builds may use.
+     */
+    unsigned cores = 1;
+
+    /**
+     * Load average over the last minute.
+     */
+    std::optional<double> loadAverage;
+
+    /**
+     * Total and currently available memory in bytes.
+     */
+    std::optional<uint64_t> memoryTotal, memoryAvailable;
+
+    /**
+     * Percentage of the last ten seconds in which at least one task was
+     * stalled on memory (the `some avg10` value of `/proc/pressure/memory`).
+     */
+    std::optional<double> memoryPressure;
+};
+
+SystemResources readSystemResources();
+
+/**
+ * Decides when builds may start and how many cores they get, based on the
+ * free resources of the machine and the builds that were already admitted.
+ *
+ * Memory pressure and the load average react to new builds only after some
+ * time, so admitted builds also reserve the memory they are expected to use
+ * and the cores they were given. A build is always admitted if no other
+ * build is running, so builds that are larger than the machine still run.
+ */
+class BuildAdmission
+{
+    struct Admitted
+    {
+        uint64_t memory;
+        unsigned cores;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    std::list<Admitted> admitted;
+
+public:
+    /**
+     * Cores given to a build stay reserved for this long, after which the
+     * load average is expected to account for them.
+     */
+    static constexpr std::chrono::seconds coreReservationTime{60};
+
+    class Token
+    {
+        friend class BuildAdmission;
+
+        BuildAdmission * admission = nullptr;
+        std::list<Admitted>::iterator pos;
+
+        Token(BuildAdmission & admission, std::list<Admitted>::iterator pos)
+            : admission(&admission)
+            , pos(pos)
+        {
+        }
+
+    public:
+        Token() = default;
+        Token(Token && other) : admission(other.admission), pos(other.pos)
+        {
+            other.admission = nullptr;
+        }
+        Token & operator=(Token && other)
+        {
+            Token(std::move(other)).swap(*this);
+            return *this;
+        }
+        ~Token()
+        {
+            if (admission) {
+                admission->admitted.erase(pos);
+            }
+        }
+
+        void swap(Token & other)
+        {
+            std::swap(admission, other.admission);
+            std::swap(pos, other.pos);
+        }
+
+        bool valid() const
+        {
+            return admission != nullptr;
+        }
+
+        /**
+         * The number of cores the build may use.
+         */
+        unsigned cores() const
+        {
+            return pos->cores;
+        }
+    };
+
+    /**
+     * Admit a build that is expected to use `expectedMemory` bytes of memory
+     * if the machine can take it, giving it up to `maxCores` cores (or all
+     * free cores if `0`). Builds are refused while memory pressure is at
+     * least `maxMemoryPressure` percent (no limit if `0`).
+     */
+    std::optional<Token> tryAdmit(
+        const SystemResources & resources,
+        uint64_t expectedMemory,
+        unsigned maxCores,
+        unsigned maxMemoryPressure,
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()
+    );
+
+    size_t running() const
+    {
+        return admitted.size();
+    }
+};
+
+}
@@ -0,0 +1,125 @@
+#include "lix/libstore/build/build-history.hh"
+#include "lix/libstore/names.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/users.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists Builds (
+    name      text primary key not null,
+    duration  integer not null,
+    timestamp integer not null
+);
+
+create table if not exists BuildMemory (
+    name       text primary key not null,
+    peakMemory integer not null,
+    timestamp  integer not null
+);
+
+)sql";
+
+static std::string historyKey(const StorePath & drvPath)
+{
+    auto name = drvPath.name();
+    if (name.ends_with(drvExtension)) {
+        name.remove_suffix(drvExtension.size());
+    }
+    return DrvName(name).name;
+}
+
+BuildHistory::BuildHistory(const Path & dbPath)
+{
+    auto state(_state.lock());
+
+    createDirs(dirOf(dbPath));
+
+    state->db = SQLite(dbPath);
+
+    state->db.isCache();
+
+    state->db.exec(schema, always_progresses);
+
+    state->queryDuration = state->db.create("select duration from Builds where name = ?");
+
+    state->recordDuration = state->db.create(
+        "insert into Builds(name, duration, timestamp) values (?1, ?2, ?3) "
+        "on conflict (name) do update set duration = (duration + ?2) / 2, timestamp = ?3"
+    );
+
+    state->queryPeakMemory = state->db.create("select peakMemory from BuildMemory where name = ?");
+
+    state->recordPeakMemory = state->db.create(
+        "insert into BuildMemory(name, peakMemory, timestamp) values (?1, ?2, ?3) "
+        "on conflict (name) do update set peakMemory = (peakMemory + ?2) / 2, timestamp = ?3"
+    );
+}
+
+std::optional<std::chrono::milliseconds> BuildHistory::estimateDuration(const StorePath & drvPath)
+{
+    try {
+        auto state(_state.lock());
+        auto query(state->queryDuration.use()(historyKey(drvPath)));
+        if (!query.next()) {
+            return std::nullopt;
+        }
+        return std::chrono::milliseconds(query.getInt(0));
+    } catch (SQLiteError & e) {
+        debug("could not query the build history: %s", e.what());
+        return std::nullopt;
+    }
+}
+
+void BuildHistory::recordDuration(const StorePath & drvPath, std::chrono::milliseconds duration)
+{
+    try {
+        auto state(_state.lock());
+        state->recordDuration.use()(historyKey(drvPath))(duration.count())(time(0)).exec();
+    } catch (SQLiteError & e) {
+        debug("could not update the build history: %s", e.what());
+    }
+}
+
+std::optional<uint64_t> BuildHistory::estimatePeakMemory(const StorePath & drvPath)
+{
+    try {
+        auto state(_state.lock());
+        auto query(state->queryPeakMemory.use()(historyKey(drvPath)));
+        if (!query.next()) {
+            return std::nullopt;
+        }
+        return query.getInt(0);
+    } catch (SQLiteError & e) {
+        debug("could not query the build history: %s", e.what());
+        return std::nullopt;
+    }
+}
+
+void BuildHistory::recordPeakMemory(const StorePath & drvPath, uint64_t bytes)
+{
+    try {
+        auto state(_state.lock());
+        state->recordPeakMemory.use()(historyKey(drvPath))(static_cast<int64_t>(bytes))(time(0))
+            .exec();
+    } catch (SQLiteError & e) {
+        debug("could not update the build history: %s", e.what());
+    }
+}
+
+std::shared_ptr<BuildHistory> getBuildHistory()
+{
+    static std::shared_ptr<BuildHistory> history = []() -> std::shared_ptr<BuildHistory> {
+        try {
+            return std::make_shared<BuildHistory>(getCacheDir() + "/nix/build-history.sqlite");
+        } catch (Error & e) {
+            debug("not using the build history: %s", e.what());
+            return nullptr;
+        }
+    }();
+    return history;
+}
+
+}
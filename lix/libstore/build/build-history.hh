@@ -0,0 +1,65 @@
+#pragma once
+///@file
+
+#include "lix/libstore/path.hh"
+#include "lix/libstore/sqlite.hh"
+#include "lix/libutil/sync.hh"
+#include "lix/libutil/types.hh"
+
+#include <chrono>
+#include <memory>
+#include <optional>
+
+namespace nix {
+
+/**
+ * Statistics about past builds, used to schedule future builds. Entries are
+ * keyed by the name of the derivation without its version, so that new
+ * versions of a package inherit the history of the old ones.
+ *
+ * The history is only a scheduling hint. Errors while reading or updating
+ * it are logged and otherwise ignored.
+ */
+class BuildHistory
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt queryDuration, recordDuration, queryPeakMemory, recordPeakMemory;
+    };
+
+    Sync<State> _state;
+
+public:
+    explicit BuildHistory(const Path & dbPath);
+
+    /**
+     * How long building `drvPath` took in the past, if it was built before.
+     */
+    std::optional<std::chrono::milliseconds> estimateDuration(const StorePath & drvPath);
+
+    /**
+     * Remember that building `drvPath` took `duration`. Repeated builds are
+     * averaged, giving recent builds the most weight.
+     */
+    void recordDuration(const StorePath & drvPath, std::chrono::milliseconds duration);
+
+    /**
+     * How much memory building `drvPath` used at most in the past, in bytes.
+     */
+    std::optional<uint64_t> estimatePeakMemory(const StorePath & drvPath);
+
+    /**
+     * Remember that building `drvPath` used at most `bytes` of memory.
+     * Repeated builds are averaged like durations.
+     */
+    void recordPeakMemory(const StorePath & drvPath, uint64_t bytes);
+};
+
+/**
+ * The build history of the current user, or `nullptr` if it could not be
+ * opened.
+ */
+std::shared_ptr<BuildHistory> getBuildHistory();
+
+}
@@ -8,6 +8,7 @@
 #include "lix/libstore/build/worker.hh"
 #include "lix/libutil/finally.hh"
 #include "lix/libutil/compression.hh"
+#include "lix/libstore/indexed-log.hh"
 #include "lix/libutil/json.hh"
 #include "lix/libstore/common-protocol.hh"
 #include "lix/libstore/common-protocol-impl.hh" // IWYU pragma: keep
@@ -93,6 +94,7 @@ DerivationGoal::DerivationGoal(const StorePath & drvPath,
         DerivedPath::Built { makeConstantStorePath(drvPath), wantedOutputs }.to_string(worker.store));
     trace("created");
 
+    estimatedBuildTime = criticalPath = worker.estimateBuildTime(drvPath);
     mcExpectedBuilds = worker.expectedBuilds.addTemporarily(1);
 }
 
@@ -112,6 +114,7 @@ DerivationGoal::DerivationGoal(DrvHasRoot, const StorePath & drvPath, const Basi
         DerivedPath::Built { makeConstantStorePath(drvPath), drv.outputNames() }.to_string(worker.store));
     trace("created");
 
+    estimatedBuildTime = criticalPath = worker.estimateBuildTime(drvPath);
     mcExpectedBuilds = worker.expectedBuilds.addTemporarily(1);
 }
 
@@ -146,6 +149,7 @@ kj::Promise<Result<Goal::WorkResult>> DerivationGoal::workImpl() noexcept
     KJ_DEFER({
         actLock.reset();
         slotToken = {};
+        admissionToken = {};
     });
 
     BOOST_OUTCOME_CO_TRY(auto result, co_await (useDerivation ? getDerivation() : haveDerivation()));
@@ -153,6 +157,20 @@ kj::Promise<Result<Goal::WorkResult>> DerivationGoal::workImpl() noexcept
     co_return result;
 }
 
+void DerivationGoal::raiseCriticalPath(uint64_t waiterPath)
+{
+    if (estimatedBuildTime + waiterPath <= criticalPath) {
+        return;
+    }
+    criticalPath = estimatedBuildTime + waiterPath;
+
+    for (auto & input : inputGoals) {
+        if (auto goal = input.lock()) {
+            goal->raiseCriticalPath(criticalPath);
+        }
+    }
+}
+
 bool DerivationGoal::addWantedOutputs(const OutputsSpec & outputs)
 {
     if (isDone) {
@@ -399,15 +417,19 @@ try {
 
     /* The inputs must be built before we can build this goal. */
     inputDrvOutputs.clear();
+    worker.noteCriticalPath(drvPath, criticalPath);
     if (useDerivation) {
         auto addWaiteeDerivedPath = [&](DerivedPathOpaque inputDrv, const StringSet & inputNode) {
-            if (!inputNode.empty())
-                dependencies.add(worker.goalFactory().makeGoal(
-                    DerivedPath::Built {
-                        .drvPath = inputDrv,
-                        .outputs = inputNode,
-                    },
-                    buildMode == bmRepair ? bmRepair : bmNormal));
+            if (!inputNode.empty()) {
+                auto input = worker.goalFactory().makeDerivationGoal(
+                    inputDrv.path, inputNode, buildMode == bmRepair ? bmRepair : bmNormal
+                );
+                /* Inputs are on every chain of builds that we are on, so
+                   they are at least as urgent as we are. */
+                input.first->raiseCriticalPath(criticalPath);
+                inputGoals.push_back(input.first);
+                dependencies.add(std::move(input));
+            }
         };
 
         for (const auto & [inputDrvPath, inputNode] : dynamic_cast<Derivation *>(drv.get())->inputDrvs) {
@@ -816,7 +838,10 @@ void replaceValidPath(const Path & storePath, const Path & tmpPath)
 
 int DerivationGoal::getChildStatus()
 {
-    return hook->kill();
+    // hooks that reported the outcome of their build stay alive to serve more
+    // builds, so there is no process status to collect. any other hook has
+    // crashed or dropped the connection, and its status says what happened.
+    return hook && !hookReusable ? hook->kill() : 0;
 }
 
 void DerivationGoal::closeReadPipes() {}
@@ -950,6 +975,7 @@ try {
     trace("build done");
 
     slotToken = {};
+    admissionToken = {};
     Finally releaseBuildUser([&](){ this->cleanupHookFinally(); });
 
     cleanupPreChildKill();
@@ -960,10 +986,10 @@ try {
        kill it. */
     int rawStatus = getChildStatus();
     const auto [exited, exitCode, exitMsg] = [&]() -> std::tuple<bool, int, std::string> {
-        // override exit status with 1 if we received an exception via rpc for
-        // historical reasons: the build hook used to turn build errors into a
-        // log line and an `exit(1)` previously, now it returns the full error
-        if (remoteError) {
+        // override exit status with 1 if a live hook sent an exception via rpc
+        // for historical reasons: the build hook used to turn build errors into
+        // a log line and an `exit(1)` previously, now it returns the full error
+        if (remoteError && rawStatus == 0) {
             return {true, 1, "failed on remote builder"};
         } else {
             if (WIFEXITED(rawStatus)) {
@@ -1023,6 +1049,13 @@ try {
            (unlinked) lock files. */
         outputLocks.reset();
 
+        worker.recordBuildTime(
+            drvPath, std::chrono::seconds(buildResult.stopTime - buildResult.startTime)
+        );
+        if (peakMemory) {
+            worker.recordPeakMemory(drvPath, *peakMemory);
+        }
+
         co_return done(BuildResult::Built, std::move(builtOutputs));
     } catch (BuildError & e) {
         outputLocks.reset();
@@ -1100,13 +1133,13 @@ try {
     debug("hook reply is '%1%'", buildResp.toString().flatten().cStr());
 
     if (buildResp.isDecline()) {
-        worker.hook.instances.push_back(std::move(hook));
+        worker.hook.returnInstance(std::move(hook));
         co_return HookResult::Decline{};
     } else if (buildResp.isDeclinePermanently()) {
         worker.hook.available = false;
         co_return HookResult::Decline{};
     } else if (buildResp.isPostpone()) {
-        worker.hook.instances.push_back(std::move(hook));
+        worker.hook.returnInstance(std::move(hook));
         co_return HookResult::Postpone{};
     } else if (!buildResp.isAccept()) {
         throw Error("bad hook reply '%s'", buildResp.which());
@@ -1138,7 +1171,21 @@ try {
         RPC_FILL(runReq, initWantedOutputs, missingOutputs);
     }
 
-    auto runPromise = LIX_WRAP_RPC_PROMISE_V1(runReq.send());
+    // failed builds are reported by the hook as regular errors, after which the
+    // hook is ready for the next build. anything else (e.g. the hook crashing and
+    // dropping the connection) arrives as a plain rpc error, making it unusable.
+    using RunResponse = capnp::Response<rpc::build_remote::HookInstance::AcceptedBuild::RunResults>;
+    hookReusable = false;
+    auto runPromise = LIX_WRAP_RPC_PROMISE_V1(runReq.send().then(
+        [&](RunResponse response) {
+            hookReusable = true;
+            return response;
+        },
+        [&](kj::Exception && e) -> RunResponse {
+            hookReusable = rpc::error::v1::tryDecode(e.getDescription().cStr()).has_value();
+            kj::throwFatalException(kj::mv(e));
+        }
+    ));
 
     // build via hook is now properly running. wait for it to finish
     actLock.reset();
@@ -1153,9 +1200,6 @@ try {
                     remoteError = std::make_shared<Error>(detail::wrap_exception_as_lix(result.error()));
                     logErrorInfo(remoteError->info().level, remoteError->info());
                 }
-                // close the rpc connection to have the hook exit
-                hook->rpc = nullptr;
-                hook->wait();
                 return buildDone(remoteError);
             } catch (...) {
                 return {result::current_exception()};
@@ -1163,6 +1207,12 @@ try {
         }))
     );
 
+    // the hook has finished this build and can take the next one, keeping its
+    // connections to the remote builders open.
+    if (hookReusable && hook) {
+        worker.hook.returnInstance(std::move(hook));
+    }
+
     co_return HookResult::Accept{std::move(result)};
 } catch (...) {
     co_return result::current_exception();
@@ -1183,7 +1233,11 @@ kj::Promise<Result<SingleDrvOutputs>> DerivationGoal::registerOutputs()
 DerivationGoal::LogSink::LogSink(AutoCloseFD fd, ref<BufferedSink> file, bool compress, uint64_t limit)
     : fd(std::move(fd))
     , file(file)
-    , target(compress ? makeCompressionSink("bzip2", *file) : file)
+    , target(
+          !compress                 ? ref<Sink>(file)
+          : settings.indexBuildLogs ? ref<Sink>(make_ref<IndexedLogSink>(*file))
+                                    : ref<Sink>(makeCompressionSink("bzip2", *file))
+      )
     , limit(limit)
 {
 }
@@ -1226,8 +1280,11 @@ Path DerivationGoal::openLogFile()
     Path dir = fmt("%s/%s/%s/", logDir, LocalFSStore::drvsLogDir, baseName.substr(0, 2));
     createDirs(dir);
 
-    Path logFileName = fmt("%s/%s%s", dir, baseName.substr(2),
-        settings.compressLog ? ".bz2" : "");
+    std::string_view extension = !settings.compressLog ? ""
+        : settings.indexBuildLogs                        ? INDEXED_LOG_EXTENSION
+                                                         : ".bz2";
+    Path logFileName = fmt("%s/%s%s", dir, baseName.substr(2), extension);
+    LocalFSStore::removeOtherBuildLogs(dir + baseName.substr(2), extension);
 
     auto fdLogFile = sys::open(logFileName, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError("creating log file '%1%'", logFileName);
@@ -7,6 +7,7 @@
 #include "lix/libstore/outputs-spec.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libstore/pathlocks.hh"
+#include "lix/libstore/build/build-admission.hh"
 #include "lix/libstore/build/goal.hh"
 #include <kj/time.h>
 #include <optional>
@@ -80,7 +81,8 @@ struct DerivationGoal : public Goal
     struct LogSink : FinishSink
     {
         AutoCloseFD fd;
-        ref<BufferedSink> file, target;
+        ref<BufferedSink> file;
+        ref<Sink> target;
         const uint64_t limit;
         uint64_t writtenSoFar = 0;
 
@@ -219,6 +221,12 @@ struct DerivationGoal : public Goal
      */
     std::unique_ptr<HookInstance> hook;
 
+    /**
+     * Whether the hook reported the outcome of its build through rpc and can
+     * serve further builds. Hooks that did not are killed when the build ends.
+     */
+    bool hookReusable = false;
+
     /**
      * The sort of derivation we are building.
      */
@@ -226,6 +234,24 @@ struct DerivationGoal : public Goal
 
     BuildMode buildMode;
 
+    /**
+     * Estimated build time of this derivation in milliseconds, and that of
+     * the longest chain of builds starting with it and ending in a goal that
+     * waits for it. Goals on the longest remaining chain get slots first.
+     */
+    uint64_t estimatedBuildTime = 0, criticalPath = 0;
+
+    /**
+     * The input derivation goals of this goal, to pass on increases of
+     * `criticalPath`.
+     */
+    std::vector<std::weak_ptr<DerivationGoal>> inputGoals;
+
+    /**
+     * Peak memory use of the local build in bytes, if the platform measured it.
+     */
+    std::optional<uint64_t> peakMemory;
+
     NotifyingCounter<uint64_t>::Bump mcExpectedBuilds, mcRunningBuilds;
 
     /**
@@ -253,6 +279,12 @@ struct DerivationGoal : public Goal
      */
     bool addWantedOutputs(const OutputsSpec & outputs);
 
+    /**
+     * Note that a goal waiting for this one ends a chain of builds that
+     * takes `waiterPath` ms, and pass the new length on to our inputs.
+     */
+    void raiseCriticalPath(uint64_t waiterPath);
+
     /**
      * The states.
      */
@@ -308,6 +340,7 @@ struct DerivationGoal : public Goal
 
 protected:
     AsyncSemaphore::Token slotToken;
+    BuildAdmission::Token admissionToken;
 
     kj::TimePoint lastChildActivity = kj::minValue;
 
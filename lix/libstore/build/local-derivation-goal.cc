@@ -2,6 +2,7 @@
 #include "derivation-goal.hh"
 #include "libutil/async-collect.hh"
 #include "libutil/logging.hh"
+#include "lix/libutil/logging-rpc.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/current-process.hh"
@@ -222,13 +223,13 @@ retry:
             }
 
             if (worker.localJobs.capacity() > 0) {
-                slotToken = co_await worker.localJobs.acquire();
+                slotToken = co_await worker.localJobs.acquire(criticalPath);
                 co_return co_await tryToBuild();
             }
         }
 
         if (worker.builds.capacity() > 0) {
-            slotToken = co_await worker.builds.acquire();
+            slotToken = co_await worker.builds.acquire(criticalPath);
             co_return co_await tryToBuild();
         }
 
@@ -252,6 +253,23 @@ retry:
     // when cgroups are configured requires the system to be set up in a certain way).
     worker.requireBuildSupport();
 
+    if (settings.buildAdmissionControl && !admissionToken.valid()) {
+        if (auto token = worker.tryAdmitBuild(drvPath)) {
+            admissionToken = std::move(*token);
+            actLock.reset();
+        } else {
+            if (!actLock)
+                actLock = logger->startActivity(
+                    lvlWarn,
+                    actBuildWaiting,
+                    fmt("waiting for free memory to build '%s'",
+                        Magenta(worker.store.printStorePath(drvPath)))
+                );
+            co_await waitForAWhile();
+            goto retry;
+        }
+    }
+
     /* Are we doing a chroot build? */
     {
         auto noChroot = parsedDrv->getBoolAttr("__noChroot");
@@ -1221,7 +1239,8 @@ void LocalDerivationGoal::initEnv()
     env["NIX_STORE"] = worker.store.config().storeDir;
 
     /* The maximum number of cores to utilize for parallel building. */
-    env["NIX_BUILD_CORES"] = fmt("%d", settings.buildCores);
+    env["NIX_BUILD_CORES"] =
+        fmt("%d", admissionToken.valid() ? admissionToken.cores() : settings.buildCores.get());
 
     initTmpDir();
 
@@ -2339,8 +2358,9 @@ try {
     );
 
     auto flushLine = [&](const std::string & line) {
-        if (const auto state =
-                handleJSONLogMessage(line, act, builderActivities, "the derivation builder"))
+        if (const auto state = rpc::log::handleStructuredLogMessage(
+                line, act, builderActivities, "the derivation builder"
+            ))
         {
             return *state;
         } else {
@@ -3,6 +3,7 @@
 #include "lix/libutil/async.hh"
 #include "lix/libutil/charptr-cast.hh"
 #include "lix/libstore/build/worker.hh"
+#include "lix/libstore/build/build-history.hh"
 #include "lix/libutil/finally.hh"
 #include "lix/libstore/build/substitution-goal.hh"
 #include "lix/libstore/build/local-derivation-goal.hh"
@@ -43,6 +44,10 @@ Worker::Worker(Store & store, Store & evalStore, AvailableNamespaces namespaces)
     , namespaces(namespaces)
 {
     /* Debugging: prevent recursive workers. */
+
+    if (settings.buildHistory) {
+        buildHistory = getBuildHistory();
+    }
 }
 
 void Worker::requireBuildSupport()
@@ -149,6 +154,63 @@ void Worker::requireBuildSupport()
     buildSupportEnsured = true;
 }
 
+/* Derivations that were never built are assumed to take a second, so that
+   longer chains of unknown derivations are still built first. */
+static constexpr uint64_t defaultBuildTimeMs = 1000;
+
+uint64_t Worker::estimateBuildTime(const StorePath & drvPath)
+{
+    if (buildHistory) {
+        if (auto duration = buildHistory->estimateDuration(drvPath)) {
+            return duration->count();
+        }
+    }
+    return defaultBuildTimeMs;
+}
+
+void Worker::recordBuildTime(const StorePath & drvPath, std::chrono::milliseconds duration)
+{
+    if (buildHistory) {
+        buildHistory->recordDuration(drvPath, duration);
+    }
+}
+
+void Worker::recordPeakMemory(const StorePath & drvPath, uint64_t bytes)
+{
+    if (buildHistory) {
+        buildHistory->recordPeakMemory(drvPath, bytes);
+    }
+}
+
+std::optional<BuildAdmission::Token> Worker::tryAdmitBuild(const StorePath & drvPath)
+{
+    uint64_t expectedMemory = 0;
+    if (buildHistory) {
+        expectedMemory = buildHistory->estimatePeakMemory(drvPath).value_or(0);
+    }
+    return admission.tryAdmit(
+        readSystemResources(),
+        expectedMemory,
+        settings.buildCores.get(),
+        settings.maxMemoryPressure.get()
+    );
+}
+
+void Worker::noteCriticalPath(const StorePath & drvPath, uint64_t criticalPath)
+{
+    if (!longestCriticalPath || criticalPath > longestCriticalPath->first) {
+        longestCriticalPath = {criticalPath, drvPath};
+    }
+}
+
+void Worker::HookState::returnInstance(std::unique_ptr<HookInstance> hook)
+{
+    const size_t limit = std::max<size_t>(settings.maxBuildJobs, maxWaitingInstances);
+    if (instances.size() < limit) {
+        instances.push_back(std::move(hook));
+    }
+}
+
 Worker::~Worker()
 {
     /* Explicitly get rid of all strong pointers now.  After this all
@@ -352,6 +414,8 @@ kj::Promise<Result<Worker::Results>> Worker::runImpl(Targets topGoals)
 try {
     debug("entered goal loop");
 
+    auto started = std::chrono::steady_clock::now();
+
     kj::Vector<std::pair<size_t, kj::Promise<Result<Goal::WorkResult>>>> promises(topGoals.size());
     for (auto && [idx, gp] : enumerate(topGoals)) {
         promises.add(idx, std::move(gp.second));
@@ -378,6 +442,20 @@ try {
        --keep-going *is* set, then they must all be finished now. */
     assert(!settings.keepGoing || children.isEmpty());
 
+    if (longestCriticalPath) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started
+        );
+        printMsg(
+            lvlTalkative,
+            "the longest chain of builds started with '%s' and was estimated to take %.1fs; "
+            "building took %.1fs",
+            store.printStorePath(longestCriticalPath->second),
+            longestCriticalPath->first / 1000.0,
+            elapsed.count() / 1000.0
+        );
+    }
+
     results.failingExitStatus = [&] {
         // See API docs in header for explanation
         unsigned int mask = 0;
@@ -11,6 +11,7 @@
 #include "lix/libutil/types.hh"
 #include "lix/libstore/lock.hh"
 #include "lix/libstore/store-api.hh"
+#include "lix/libstore/build/build-admission.hh"
 #include "lix/libstore/build/goal.hh"
 #include "lix/libstore/realisation.hh"
 
@@ -24,6 +25,7 @@ namespace nix {
 struct DerivationGoal;
 struct PathSubstitutionGoal;
 class LocalStore;
+class BuildHistory;
 
 typedef std::chrono::time_point<std::chrono::steady_clock> steady_time_point;
 
@@ -161,6 +163,22 @@ private:
      */
     bool checkMismatch = false;
 
+    /**
+     * Durations of past builds, if `build-history` is enabled.
+     */
+    std::shared_ptr<BuildHistory> buildHistory;
+
+    /**
+     * The longest estimated chain of builds in this run and the derivation it
+     * starts with, for the build summary.
+     */
+    std::optional<std::pair<uint64_t, StorePath>> longestCriticalPath;
+
+    /**
+     * Local builds admitted by `tryAdmitBuild`.
+     */
+    BuildAdmission admission;
+
     /**
       * Pass current stats counters to the logger for progress bar updates.
       */
@@ -209,9 +227,22 @@ public:
         // make sure we never have too many remote build hook processes waiting. they are
         // expensive to start and may be requested in great numbers for wide build trees.
         // the original implementation only allowed a single process, we allow some more.
-        AsyncSemaphore instancesSem{4};
+        static constexpr unsigned maxWaitingInstances = 4;
+        AsyncSemaphore instancesSem{maxWaitingInstances};
+        /**
+         * Idle hook processes. Hooks go back here after declining or postponing a build
+         * and after finishing an accepted build, so wide build trees reuse a few hook
+         * processes (and their connections to the remote builders) for all builds.
+         */
         std::list<std::unique_ptr<HookInstance>> instances;
 
+        /**
+         * Put an idle hook back into `instances` unless the pool is already full. The
+         * pool holds at most `max-jobs` hooks, or `maxWaitingInstances` if that is more.
+         * Hooks beyond that are shut down along with their builder connections.
+         */
+        void returnInstance(std::unique_ptr<HookInstance> hook);
+
         /**
          * Whether to ask the build hook if it can build a derivation. If
          * it answers with "decline-permanently", we don't try again.
@@ -242,6 +273,35 @@ public:
      */
     void requireBuildSupport();
 
+    /**
+     * How long building `drvPath` is expected to take in milliseconds. Used
+     * to give build slots to the goals on the longest chain of builds first.
+     */
+    uint64_t estimateBuildTime(const StorePath & drvPath);
+
+    /**
+     * Record the build time of a successful build for future estimates.
+     */
+    void recordBuildTime(const StorePath & drvPath, std::chrono::milliseconds duration);
+
+    /**
+     * Record the peak memory use of a successful build for admission control.
+     */
+    void recordPeakMemory(const StorePath & drvPath, uint64_t bytes);
+
+    /**
+     * Note that a goal will build `drvPath`, and that the longest chain of
+     * builds starting with it is estimated to take `criticalPath` ms.
+     */
+    void noteCriticalPath(const StorePath & drvPath, uint64_t criticalPath);
+
+    /**
+     * Admit a local build of `drvPath` if the machine has the memory for it,
+     * or return nothing if the build should wait. The token holds the number
+     * of cores the build may use. Only used with `build-admission-control`.
+     */
+    std::optional<BuildAdmission::Token> tryAdmitBuild(const StorePath & drvPath);
+
 private:
     Worker(Store & store, Store & evalStore, AvailableNamespaces namespaces);
     ~Worker();
@@ -2,9 +2,12 @@
 #include "lix/libstore/crypto.hh"
 #include "lix/libutil/file-system.hh"
 #include "lix/libstore/globals.hh"
+#include "lix/libstore/signature-cache.hh"
 #include "lix/libutil/strings.hh"
+#include "lix/libutil/thread-pool.hh"
 
 #include <openssl/err.h>
+#include <thread>
 
 namespace nix {
 
@@ -142,10 +145,11 @@ bool PublicKey::verifyDetached(std::string_view data, std::string_view sig) cons
     if (!ctx)
         throw Error("signature verification failed: %s", openssl_error());
     EvpPkeyCtxPtr pctx(ctx);
-    EVP_SIGNATURE *alg = EVP_SIGNATURE_fetch(nullptr, "ED25519", nullptr);
-    if (!alg)
+    /* Fetching the algorithm takes about as long as verifying a signature,
+       so it is only done once. */
+    static EvpSignaturePtr palg(EVP_SIGNATURE_fetch(nullptr, "ED25519", nullptr));
+    if (!palg)
         throw Error("signature verification failed: %s", openssl_error());
-    EvpSignaturePtr palg(alg);
     if (EVP_PKEY_verify_message_init(pctx.get(), palg.get(), nullptr) != 1)
         throw Error("signature verification failed: %s", openssl_error());
 
@@ -213,7 +217,119 @@ bool verifyDetached(const std::string & data, const std::string & sig,
     auto key = publicKeys.find(std::string(name));
     if (key == publicKeys.end()) return false;
 
-    return key->second.verifyDetached(data, sig2);
+    auto cache = getSignatureCache();
+    std::string cacheKey;
+    if (cache) {
+        cacheKey = SignatureCache::key(key->second.to_string(), sig, data);
+        if (cache->isVerified({cacheKey}).front())
+            return true;
+    }
+
+    if (!key->second.verifyDetached(data, sig2))
+        return false;
+
+    if (cache)
+        cache->markVerified({cacheKey});
+    return true;
+}
+
+/* Signatures are only verified on several threads if each thread gets at
+   least this many of them. */
+constexpr size_t MIN_SIGNATURES_PER_THREAD = 64;
+
+std::vector<bool> verifyDetached(const std::vector<DetachedSignature> & sigs,
+    const PublicKeys & publicKeys)
+{
+    auto cache = getSignatureCache();
+
+    std::map<std::string_view, std::string> printedKeys;
+    if (cache) {
+        for (auto & [name, key] : publicKeys)
+            printedKeys.emplace(name, key.to_string());
+    }
+
+    struct Check
+    {
+        size_t index;
+        const PublicKey * key;
+        std::string sig;
+        std::string cacheKey;
+    };
+
+    std::vector<Check> checks;
+    for (auto && [i, sig] : enumerate(sigs)) {
+        try {
+            auto [name, sig2] = split(sig.sig);
+            auto key = publicKeys.find(std::string(name));
+            if (key == publicKeys.end())
+                continue;
+            checks.push_back({
+                .index = i,
+                .key = &key->second,
+                .sig = std::move(sig2),
+                .cacheKey = cache
+                    ? SignatureCache::key(printedKeys.at(key->first), sig.sig, sig.data)
+                    : "",
+            });
+        } catch (Error &) {
+        }
+    }
+
+    std::vector<uint8_t> verified(sigs.size(), false);
+
+    if (cache) {
+        std::vector<std::string> keys;
+        for (auto & check : checks)
+            keys.push_back(check.cacheKey);
+        auto cached = cache->isVerified(keys);
+        std::vector<Check> misses;
+        for (size_t i = 0; i < checks.size(); i++) {
+            if (cached[i])
+                verified[checks[i].index] = true;
+            else
+                misses.push_back(std::move(checks[i]));
+        }
+        checks = std::move(misses);
+    }
+
+    auto verifyRange = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            auto & check = checks[i];
+            try {
+                verified[check.index] =
+                    check.key->verifyDetached(sigs[check.index].data, check.sig);
+            } catch (...) {
+                /* the caller will see the error when checking this
+                   signature on its own */
+            }
+        }
+    };
+
+    size_t threads = std::min<size_t>(
+        std::max(1U, std::thread::hardware_concurrency()),
+        checks.size() / MIN_SIGNATURES_PER_THREAD
+    );
+    if (threads <= 1) {
+        verifyRange(0, checks.size());
+    } else {
+        ThreadPool pool{"signature verification pool", threads};
+        size_t perThread = (checks.size() + threads - 1) / threads;
+        for (size_t begin = 0; begin < checks.size(); begin += perThread)
+            pool.enqueue([&, begin] {
+                verifyRange(begin, std::min(begin + perThread, checks.size()));
+            });
+        pool.process();
+    }
+
+    if (cache) {
+        std::vector<std::string> keys;
+        for (auto & check : checks)
+            if (verified[check.index])
+                keys.push_back(check.cacheKey);
+        cache->markVerified(keys);
+    }
+
+    return {verified.begin(), verified.end()};
 }
 
 PublicKeys getDefaultPublicKeys()
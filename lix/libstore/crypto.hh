@@ -5,6 +5,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <openssl/evp.h>
 
@@ -74,6 +75,25 @@ typedef std::map<std::string, PublicKey> PublicKeys;
 bool verifyDetached(const std::string & data, const std::string & sig,
     const PublicKeys & publicKeys);
 
+/**
+ * A signature ‘sig’ over ‘data’, as checked by verifyDetached().
+ */
+struct DetachedSignature
+{
+    std::string data;
+    std::string sig;
+};
+
+/**
+ * Check many signatures at once. Signatures that are not in the verified
+ * signature cache are verified on several threads, and malformed signatures
+ * are reported as invalid instead of throwing.
+ *
+ * @return whether each of ‘sigs’ is correct.
+ */
+std::vector<bool> verifyDetached(const std::vector<DetachedSignature> & sigs,
+    const PublicKeys & publicKeys);
+
 PublicKeys getDefaultPublicKeys();
 
 }
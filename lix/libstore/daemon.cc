@@ -7,6 +7,7 @@
 #include "libutil/result.hh"
 #include "libutil/repair-flag.hh"
 #include "lix/libutil/async-io.hh"
+#include "lix/libutil/c-calls.hh"
 #include "lix/libutil/monitor-fd.hh"
 #include "lix/libstore/worker-protocol.hh"
 #include "lix/libstore/worker-protocol-impl.hh"
@@ -16,6 +17,11 @@
 #include "lix/libstore/gc-store.hh"
 #include "lix/libstore/log-store.hh"
 #include "lix/libstore/indirect-root-store.hh"
+#include "lix/libstore/transport-compression.hh"
+#include "lix/libstore/nar-delta.hh"
+#include "lix/libstore/temporary-dir.hh"
+#include "lix/libutil/binary-delta.hh"
+#include "lix/libutil/compression.hh"
 #include "lix/libstore/path-with-outputs.hh"
 #include "lix/libutil/finally.hh"
 #include "lix/libutil/archive.hh"
@@ -281,6 +287,7 @@ struct ClientSettings
 
 static void performOp(AsyncIoRoot & aio, TunnelLogger * logger, ref<Store> store,
     TrustedFlag trusted, WorkerProto::Version clientVersion,
+    const TransportOffer & transport,
     Source & from, BufferedSink & to, WorkerProto::Op op)
 {
     WorkerProto::ReadConn rconn{from, *store, clientVersion};
@@ -466,10 +473,74 @@ static void performOp(AsyncIoRoot & aio, TunnelLogger * logger, ref<Store> store
                     WorkerProto::ReadConn{source, *store, clientVersion}
                 );
                 info.ultimate = false; // duplicated in RemoteStore::addMultipleToStore
-                AsyncSourceInputStream stream{source};
-                aio.blockOn(store->addToStore(
-                    info, stream, RepairFlag{repair}, dontCheckSigs ? NoCheckSigs : CheckSigs
-                ));
+
+                std::optional<StorePath> deltaBase;
+                std::optional<Hash> deltaBaseHash;
+                if (transport.narDeltas) {
+                    auto kind = readNum<uint64_t>(source);
+                    if (kind == LIX_NAR_DELTA) {
+                        deltaBase = store->parseStorePath(readString(source));
+                        deltaBaseHash = Hash::parseAnyPrefixed(readString(source));
+                    } else if (kind != LIX_NAR_FULL) {
+                        throw Error("unknown NAR transfer kind %d", kind);
+                    }
+                }
+
+                std::unique_ptr<FramedDecompressionSource> decompressed;
+                if (transport.compression) {
+                    decompressed =
+                        makeFramedDecompressionSource(transport.compression->method, source);
+                }
+                Source & payload = decompressed ? *decompressed : source;
+
+                if (deltaBase) {
+                    auto baseInfo = aio.blockOn(store->queryPathInfo(*deltaBase));
+                    if (baseInfo->narHash != *deltaBaseHash) {
+                        throw Error(
+                            "delta base '%s' of '%s' does not match the copy on this machine",
+                            store->printStorePath(*deltaBase),
+                            store->printStorePath(info.path)
+                        );
+                    }
+                    // the client chooses the base, so don't trust it to respect the limit
+                    if (baseInfo->narSize > MAX_NAR_DELTA_BASE_SIZE) {
+                        throw Error(
+                            "delta base '%s' of '%s' is larger than the limit of %d bytes",
+                            store->printStorePath(*deltaBase),
+                            store->printStorePath(info.path),
+                            MAX_NAR_DELTA_BASE_SIZE
+                        );
+                    }
+                    // spill the base to an unlinked temporary file instead of keeping it in
+                    // memory, the decoder only reads the blocks the delta refers to.
+                    auto [baseFd, baseFile] = createTempFile("nix-delta-base");
+                    sys::unlink(baseFile);
+                    {
+                        FdSink baseSink(baseFd.get());
+                        aio.blockOn(aio.blockOn(store->narFromPath(*deltaBase))->drainInto(baseSink));
+                        baseSink.flush();
+                    }
+                    // addToStore checks the hash of the reconstructed nar as usual
+                    auto nar = makeDeltaDecodingSource(baseFd.get(), baseInfo->narSize, payload);
+                    AsyncSourceInputStream stream{*nar};
+                    aio.blockOn(store->addToStore(
+                        info, stream, RepairFlag{repair}, dontCheckSigs ? NoCheckSigs : CheckSigs
+                    ));
+                    if (!nar->drain().empty()) {
+                        throw BadDelta(
+                            "delta for '%s' has trailing data", store->printStorePath(info.path)
+                        );
+                    }
+                } else {
+                    AsyncSourceInputStream stream{payload};
+                    aio.blockOn(store->addToStore(
+                        info, stream, RepairFlag{repair}, dontCheckSigs ? NoCheckSigs : CheckSigs
+                    ));
+                }
+
+                if (decompressed) {
+                    decompressed->finish();
+                }
             }
         }
         logger->stopWork();
@@ -799,7 +870,18 @@ static void performOp(AsyncIoRoot & aio, TunnelLogger * logger, ref<Store> store
         auto path = store->parseStorePath(readString(from));
         logger->startWork();
         logger->stopWork();
-        to << dumpPath(store->toRealPath(path));
+        if (auto & compression = transport.compression) {
+            auto sink = makeFramedCompressionSink(
+                compression->method,
+                to,
+                compression->parallel,
+                compression->level
+            );
+            *sink << dumpPath(store->toRealPath(path));
+            sink->finish();
+        } else {
+            to << dumpPath(store->toRealPath(path));
+        }
         break;
     }
 
@@ -892,7 +974,8 @@ static void processLegacyRequests(
     FdSource & from,
     FdSink & to,
     TrustedFlag trusted,
-    WorkerProto::Version clientVersion
+    WorkerProto::Version clientVersion,
+    const TransportOffer & transport
 )
 {
     unsigned int opCount = 0;
@@ -917,7 +1000,9 @@ static void processLegacyRequests(
 
         try {
             KJ_DEFER(aio.blockOn(logger->flush()));
-            performOp(aio, tunnelLogger, store, trusted, clientVersion, from, to, op);
+            performOp(
+                aio, tunnelLogger, store, trusted, clientVersion, transport, from, to, op
+            );
         } catch (Error & e) {
             /* If we're not in a state where we can send replies, then
                something went wrong processing the input of the
@@ -962,9 +1047,12 @@ void processLegacyConnection(
     logger = tunnelLogger;
 
     // FIXME: what is *supposed* to be in this even?
+    TransportOffer transport;
     if (readNum<unsigned>(from)) {
-        // Obsolete CPU affinity.
-        readNum<unsigned>(from);
+        // Obsolete CPU affinity, reused by Lix clients to offer transport features.
+        if (auto offer = TransportOffer::decode(readNum<uint32_t>(from))) {
+            transport = *offer;
+        }
     }
 
     readNum<unsigned>(from); // obsolete reserveSpace
@@ -983,10 +1071,15 @@ void processLegacyConnection(
     tunnelLogger->startWork();
 
     try {
+        if (!transport.empty()) {
+            to << STDERR_LIX_TRANSPORT_COMPRESSION << transport.encode();
+        }
         tunnelLogger->stopWork();
         to.flush();
 
-        processLegacyRequests(aio, prevLogger, tunnelLogger, store, from, to, trusted, clientVersion);
+        processLegacyRequests(
+            aio, prevLogger, tunnelLogger, store, from, to, trusted, clientVersion, transport
+        );
     } catch (Error & e) {
         tunnelLogger->stopWork(&e);
         to.flush();
@@ -27,6 +27,9 @@ extern FileTransferSettings fileTransferSettings;
 struct FileTransferResult
 {
     bool cached = false;
+    /* Whether the server answered a range request with only the requested
+       part of the resource (HTTP 206). */
+    bool partial = false;
     std::string etag;
     std::string effectiveUri;
     /* An "immutable" URL for this resource (i.e. one whose contents
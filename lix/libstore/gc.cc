@@ -687,6 +687,7 @@ try {
         results.paths.insert(path);
 
         uint64_t bytesFreed;
+        forgetReflinkSources(realPath);
         deletePath(realPath, bytesFreed);
         results.bytesFreed += bytesFreed;
 
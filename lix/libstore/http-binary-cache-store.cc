@@ -154,6 +154,50 @@ try {
     co_return result::current_exception();
 }
 
+kj::Promise<Result<std::optional<std::string>>> HttpBinaryCacheStore::getFileRange(
+    const std::string & path, uint64_t offset, uint64_t length, const Activity * context
+)
+try {
+    checkEnabled();
+    if (length == 0) {
+        co_return std::string();
+    }
+    try {
+        auto [transfer, data] = TRY_AWAIT(getFileTransfer()->download(
+            makeURI(path),
+            makeOptions({{"Range", fmt("bytes=%d-%d", offset, offset + length - 1)}}),
+            context
+        ));
+        /* Servers may ignore the range and send the whole file, and other
+           protocols have no notion of ranges at all. Dropping the stream
+           cancels the transfer, the caller fetches the whole file instead. */
+        if (!transfer.partial) {
+            co_return std::nullopt;
+        }
+        auto bytes = TRY_AWAIT(data->drain());
+        if (bytes.size() != length) {
+            throw Error(
+                "range request for '%s' in binary cache '%s' returned %d bytes instead of %d",
+                path,
+                getUri(),
+                bytes.size(),
+                length
+            );
+        }
+        co_return bytes;
+    } catch (FileTransferError & e) {
+        if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden) {
+            throw NoSuchBinaryCacheFile(
+                "file '%s' does not exist in binary cache '%s'", path, getUri()
+            );
+        }
+        maybeDisable();
+        throw;
+    }
+} catch (...) {
+    co_return result::current_exception();
+}
+
 void registerHttpBinaryCacheStore() {
     bool forceHttp = getEnv("_NIX_FORCE_HTTP") == "1";
     auto schemes = std::set<std::string>({"http", "https"});
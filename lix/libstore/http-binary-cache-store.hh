@@ -93,6 +93,13 @@ protected:
         const Activity * context
     ) override;
     kj::Promise<Result<box_ptr<AsyncInputStream>>> getFile(const std::string & path, const Activity * context) override;
+    kj::Promise<Result<std::optional<std::string>>> getFileRange(
+        const std::string & path, uint64_t offset, uint64_t length, const Activity * context
+    ) override;
+    bool supportsFileRanges() override
+    {
+        return true;
+    }
 
     std::string makeURI(const std::string & path)
     {
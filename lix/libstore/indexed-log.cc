@@ -0,0 +1,356 @@
+#include "lix/libstore/indexed-log.hh"
+#include "lix/libutil/c-calls.hh"
+#include "lix/libutil/compression.hh"
+#include "lix/libutil/error.hh"
+#include "lix/libutil/file-descriptor.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+/**
+ * Frames are cut at the first line boundary after this many bytes.
+ */
+static constexpr size_t LOG_FRAME_SIZE = 1024 * 1024;
+
+/**
+ * Lines longer than this are split over several frames.
+ */
+static constexpr size_t MAX_LOG_FRAME_SIZE = 16 * LOG_FRAME_SIZE;
+
+/**
+ * One of the sixteen magic numbers zstd reserves for skippable frames.
+ */
+static constexpr uint32_t SKIPPABLE_FRAME_MAGIC = 0x184D2A5C;
+static constexpr uint32_t INDEX_MAGIC = 0x4c49584c; // "LXIL"
+static constexpr uint32_t INDEX_VERSION = 1;
+
+/**
+ * compressed size, size, newlines, flags (u32 each) and timestamp (u64).
+ */
+static constexpr size_t INDEX_ENTRY_SIZE = 24;
+/**
+ * number of frames, version and magic (u32 each).
+ */
+static constexpr size_t INDEX_FOOTER_SIZE = 12;
+
+static constexpr uint32_t FRAME_ENDS_LINE = 1;
+
+template<typename T>
+static void putLittleEndian(std::string & out, T value)
+{
+    for (size_t i = 0; i < sizeof(T); i++) {
+        out.push_back(char(value >> (8 * i)));
+    }
+}
+
+template<typename T>
+static T getLittleEndian(std::string_view in)
+{
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        value |= T(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+namespace {
+/**
+ * Applies a `BuildLogSelection` to a log fed to it piece by piece. Every
+ * piece must start at the beginning of a line.
+ */
+struct LineSelector
+{
+    const BuildLogSelection & selection;
+    std::string result;
+    std::deque<std::string> tailLines;
+
+    explicit LineSelector(const BuildLogSelection & selection) : selection(selection) {}
+
+    /**
+     * Returns false once all lines before `selection.endLine` were seen.
+     */
+    bool feed(std::string_view text, uint64_t line)
+    {
+        while (!text.empty()) {
+            if (selection.endLine && line >= *selection.endLine) {
+                return false;
+            }
+
+            auto nl = text.find('\n');
+            auto current = text.substr(0, nl == std::string_view::npos ? nl : nl + 1);
+            text.remove_prefix(current.size());
+
+            if (line++ < selection.firstLine) {
+                continue;
+            }
+            if (selection.grep && current.find(*selection.grep) == std::string_view::npos) {
+                continue;
+            }
+            if (selection.tail) {
+                if (*selection.tail == 0) {
+                    continue;
+                }
+                tailLines.emplace_back(current);
+                if (tailLines.size() > *selection.tail) {
+                    tailLines.pop_front();
+                }
+            } else {
+                result += current;
+            }
+        }
+        return true;
+    }
+
+    std::string finish()
+    {
+        for (auto & line : tailLines) {
+            result += line;
+        }
+        return std::move(result);
+    }
+};
+}
+
+std::string selectLogLines(std::string_view log, const BuildLogSelection & selection)
+{
+    if (selection.selectsAll()) {
+        return std::string(log);
+    }
+    LineSelector selector(selection);
+    selector.feed(log, 0);
+    return selector.finish();
+}
+
+void IndexedLogSink::operator()(std::string_view data)
+{
+    assert(!finished);
+
+    while (!data.empty()) {
+        if (pending.empty()) {
+            pendingTimestamp = time(nullptr);
+        }
+
+        auto chunk = data.substr(0, MAX_LOG_FRAME_SIZE - pending.size());
+        pending += chunk;
+        data.remove_prefix(chunk.size());
+
+        if (pending.size() < LOG_FRAME_SIZE) {
+            continue;
+        }
+
+        auto lastNewline = pending.rfind('\n');
+        if (lastNewline != std::string::npos) {
+            writeFrame(std::string_view(pending).substr(0, lastNewline + 1));
+            pending.erase(0, lastNewline + 1);
+            // the rest still belongs to the same write, keep its timestamp
+        } else if (pending.size() >= MAX_LOG_FRAME_SIZE) {
+            writeFrame(pending);
+            pending.clear();
+        }
+    }
+}
+
+void IndexedLogSink::writeFrame(std::string_view data)
+{
+    auto compressed = compress("zstd", data);
+    out(compressed);
+    frames.push_back({
+        .compressedSize = uint32_t(compressed.size()),
+        .size = uint32_t(data.size()),
+        .newlines = uint32_t(std::count(data.begin(), data.end(), '\n')),
+        .endsLine = data.ends_with('\n'),
+        .timestamp = pendingTimestamp,
+    });
+}
+
+void IndexedLogSink::finish()
+{
+    if (finished) {
+        return;
+    }
+    finished = true;
+
+    if (!pending.empty()) {
+        writeFrame(pending);
+        pending.clear();
+    }
+
+    std::string index;
+    putLittleEndian<uint32_t>(index, SKIPPABLE_FRAME_MAGIC);
+    putLittleEndian<uint32_t>(
+        index, uint32_t(frames.size() * INDEX_ENTRY_SIZE + INDEX_FOOTER_SIZE)
+    );
+    for (auto & frame : frames) {
+        putLittleEndian<uint32_t>(index, frame.compressedSize);
+        putLittleEndian<uint32_t>(index, frame.size);
+        putLittleEndian<uint32_t>(index, frame.newlines);
+        putLittleEndian<uint32_t>(index, frame.endsLine ? FRAME_ENDS_LINE : 0);
+        putLittleEndian<uint64_t>(index, frame.timestamp);
+    }
+    putLittleEndian<uint32_t>(index, uint32_t(frames.size()));
+    putLittleEndian<uint32_t>(index, INDEX_VERSION);
+    putLittleEndian<uint32_t>(index, INDEX_MAGIC);
+    out(index);
+}
+
+IndexedLogReader::IndexedLogReader(AutoCloseFD fd, std::vector<IndexedLogSink::Frame> frames)
+    : fd(std::move(fd))
+    , frames_(std::move(frames))
+{
+    uint64_t offset = 0, lines = 0;
+    for (auto & frame : frames_) {
+        offsets.push_back(offset);
+        firstLines.push_back(lines);
+        offset += frame.compressedSize;
+        lines += frame.newlines;
+    }
+    offsets.push_back(offset);
+    firstLines.push_back(lines);
+}
+
+static std::string readAt(int fd, uint64_t offset, size_t size)
+{
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        throw SysError("seeking in build log");
+    }
+    std::string buf(size, 0);
+    readFull(fd, buf.data(), size);
+    return buf;
+}
+
+std::optional<IndexedLogReader> IndexedLogReader::open(const Path & path)
+{
+    auto fd = sys::open(path, O_RDONLY | O_CLOEXEC);
+    if (!fd) {
+        throw SysError("opening build log '%s'", path);
+    }
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1) {
+        throw SysError("getting status of '%s'", path);
+    }
+    uint64_t fileSize = st.st_size;
+
+    if (fileSize < 8 + INDEX_FOOTER_SIZE) {
+        return std::nullopt;
+    }
+
+    auto footer = readAt(fd.get(), fileSize - INDEX_FOOTER_SIZE, INDEX_FOOTER_SIZE);
+    auto frameCount = getLittleEndian<uint32_t>(footer);
+    if (getLittleEndian<uint32_t>(footer.substr(8)) != INDEX_MAGIC
+        || getLittleEndian<uint32_t>(footer.substr(4)) != INDEX_VERSION)
+    {
+        return std::nullopt;
+    }
+
+    uint64_t indexSize = uint64_t(frameCount) * INDEX_ENTRY_SIZE + INDEX_FOOTER_SIZE;
+    if (fileSize < 8 + indexSize) {
+        return std::nullopt;
+    }
+
+    auto index = readAt(fd.get(), fileSize - indexSize - 8, indexSize + 8);
+    if (getLittleEndian<uint32_t>(index) != SKIPPABLE_FRAME_MAGIC
+        || getLittleEndian<uint32_t>(index.substr(4)) != indexSize)
+    {
+        return std::nullopt;
+    }
+
+    std::vector<IndexedLogSink::Frame> frames;
+    uint64_t totalSize = 0;
+    for (uint32_t i = 0; i < frameCount; i++) {
+        auto entry = std::string_view(index).substr(8 + i * INDEX_ENTRY_SIZE, INDEX_ENTRY_SIZE);
+        frames.push_back({
+            .compressedSize = getLittleEndian<uint32_t>(entry),
+            .size = getLittleEndian<uint32_t>(entry.substr(4)),
+            .newlines = getLittleEndian<uint32_t>(entry.substr(8)),
+            .endsLine = (getLittleEndian<uint32_t>(entry.substr(12)) & FRAME_ENDS_LINE) != 0,
+            .timestamp = getLittleEndian<uint64_t>(entry.substr(16)),
+        });
+        totalSize += frames.back().compressedSize;
+    }
+
+    if (totalSize + indexSize + 8 != fileSize) {
+        return std::nullopt;
+    }
+
+    return IndexedLogReader(std::move(fd), std::move(frames));
+}
+
+std::string IndexedLogReader::readFrame(size_t frame)
+{
+    auto data = decompress(
+        "zstd", readAt(fd.get(), offsets[frame], frames_[frame].compressedSize)
+    );
+    if (data.size() != frames_[frame].size) {
+        throw Error("build log frame %d has unexpected size %d", frame, data.size());
+    }
+    return data;
+}
+
+std::string IndexedLogReader::read(const BuildLogSelection & selection)
+{
+    const size_t count = frames_.size();
+
+    // frames holding a line that started in an earlier frame cannot be read
+    // on their own, we must start from the frame that holds its beginning.
+    auto alignToLine = [&](size_t frame) {
+        while (frame > 0 && !frames_[frame - 1].endsLine) {
+            frame--;
+        }
+        return frame;
+    };
+
+    // the last frame before the first selected line is completed
+    size_t begin = std::upper_bound(
+                       firstLines.begin(), firstLines.begin() + count, selection.firstLine
+                   )
+        - firstLines.begin();
+    begin = alignToLine(begin > 0 ? begin - 1 : 0);
+
+    // the first frame that starts after the last selected line is completed
+    size_t end = count;
+    if (selection.endLine) {
+        end = std::lower_bound(firstLines.begin(), firstLines.end(), *selection.endLine)
+            - firstLines.begin();
+        end = std::min(end, count);
+    }
+
+    // without grep only the frames holding the last `tail` lines are needed.
+    // the last frame may end in an unterminated line, so count one extra.
+    if (selection.tail && !selection.grep) {
+        uint64_t lineEnd = firstLines[end] + 1;
+        if (selection.endLine) {
+            lineEnd = std::min(lineEnd, *selection.endLine);
+        }
+        size_t start = end;
+        while (start > begin && lineEnd - firstLines[start] < *selection.tail + 1) {
+            start--;
+        }
+        begin = std::max(begin, alignToLine(start));
+    }
+
+    LineSelector selector(selection);
+    std::string chunk;
+    size_t chunkStart = begin;
+    for (size_t frame = begin; frame < end; frame++) {
+        chunk += readFrame(frame);
+        if (frames_[frame].endsLine || frame + 1 == end) {
+            if (!selector.feed(chunk, firstLines[chunkStart])) {
+                break;
+            }
+            chunk.clear();
+            chunkStart = frame + 1;
+        }
+    }
+
+    return selector.finish();
+}
+
+}
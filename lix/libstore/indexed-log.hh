@@ -0,0 +1,131 @@
+#pragma once
+///@file
+
+#include "lix/libutil/file-descriptor.hh"
+#include "lix/libutil/serialise.hh"
+#include "lix/libutil/types.hh"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nix {
+
+/**
+ * Selects a part of a build log. Lines are numbered from zero. The line
+ * range is applied first, then `grep`, then `tail`.
+ */
+struct BuildLogSelection
+{
+    uint64_t firstLine = 0;
+    std::optional<uint64_t> endLine;
+    /**
+     * Only keep lines containing this string.
+     */
+    std::optional<std::string> grep;
+    /**
+     * Only keep the last this many of the remaining lines.
+     */
+    std::optional<uint64_t> tail;
+
+    bool selectsAll() const
+    {
+        return firstLine == 0 && !endLine && !grep && !tail;
+    }
+};
+
+/**
+ * Apply `selection` to a complete log held in memory.
+ */
+std::string selectLogLines(std::string_view log, const BuildLogSelection & selection);
+
+/**
+ * File name extension of indexed build logs.
+ */
+constexpr std::string_view INDEXED_LOG_EXTENSION = ".zst";
+
+/**
+ * Sink that writes a build log as a sequence of independently compressed
+ * zstd frames of about a megabyte each, cut at line boundaries, followed
+ * by an index of all frames stored in a zstd skippable frame. The result
+ * is an ordinary zstd file that `zstd -d` can decompress, but a reader
+ * that knows the index can decompress just the frames holding the lines
+ * it is interested in.
+ *
+ * The index is only written by `finish()`. Logs of builds that were
+ * interrupted before can still be read by decompressing them in full.
+ */
+class IndexedLogSink : public FinishSink
+{
+public:
+    struct Frame
+    {
+        uint32_t compressedSize;
+        uint32_t size;
+        /**
+         * Number of newlines in the frame.
+         */
+        uint32_t newlines;
+        /**
+         * Whether the frame ends with a newline. Frames are only cut in
+         * the middle of a line if that line is too long to buffer.
+         */
+        bool endsLine;
+        /**
+         * When the first byte of the frame was written, in seconds since
+         * the epoch.
+         */
+        uint64_t timestamp;
+    };
+
+    explicit IndexedLogSink(Sink & out) : out(out) {}
+
+    void operator()(std::string_view data) override;
+    void finish() override;
+
+private:
+    Sink & out;
+    std::string pending;
+    uint64_t pendingTimestamp = 0;
+    std::vector<Frame> frames;
+    bool finished = false;
+
+    void writeFrame(std::string_view data);
+};
+
+/**
+ * Reads (parts of) build logs written by `IndexedLogSink`.
+ */
+class IndexedLogReader
+{
+public:
+    /**
+     * Open an indexed log. Returns `std::nullopt` if the file has no
+     * valid index, e.g. because the build writing it was interrupted.
+     */
+    static std::optional<IndexedLogReader> open(const Path & path);
+
+    std::string read(const BuildLogSelection & selection);
+
+    const std::vector<IndexedLogSink::Frame> & frames() const
+    {
+        return frames_;
+    }
+
+private:
+    AutoCloseFD fd;
+    std::vector<IndexedLogSink::Frame> frames_;
+    /**
+     * Offset of each frame in the file and the number of complete lines
+     * before it, with one extra entry past the last frame.
+     */
+    std::vector<uint64_t> offsets, firstLines;
+
+    IndexedLogReader(AutoCloseFD fd, std::vector<IndexedLogSink::Frame> frames);
+
+    std::string readFrame(size_t frame);
+};
+
+}
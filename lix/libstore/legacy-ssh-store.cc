@@ -1,6 +1,7 @@
 #include "lix/libstore/legacy-ssh-store.hh"
 #include "libutil/error.hh"
 #include "libutil/logging.hh"
+#include "lix/libutil/logging-rpc.hh"
 #include "libutil/sync.hh"
 #include "lix/libutil/archive.hh"
 #include "lix/libutil/async-io.hh"
@@ -14,6 +15,8 @@
 #include "lix/libstore/path-with-outputs.hh"
 #include "lix/libstore/ssh.hh"
 #include "lix/libstore/ssh-store.hh"
+#include "lix/libstore/transport-compression.hh"
+#include "lix/libutil/compression.hh"
 #include "lix/libutil/result.hh"
 #include "lix/libutil/serialise.hh"
 #include "lix/libutil/strings.hh"
@@ -36,6 +39,15 @@ struct QueryPathInfoResult
     UnkeyedValidPathInfo info;
 };
 
+/**
+ * The replies of the bulk path info queries, which can contain any number
+ * of paths.
+ */
+struct PathInfosResult
+{
+    std::vector<QueryPathInfoResult> infos;
+};
+
 struct BuildPathsResult
 {
     BuildResult result;
@@ -46,6 +58,8 @@ struct BuildPathsResult
 template<>
 DECLARE_SERVE_SERIALISER(QueryPathInfoResult);
 template<>
+DECLARE_SERVE_SERIALISER(PathInfosResult);
+template<>
 DECLARE_SERVE_SERIALISER(BuildPathsResult);
 
 QueryPathInfoResult ServeProto::Serialise<QueryPathInfoResult>::read(ServeProto::ReadConn conn)
@@ -65,6 +79,24 @@ QueryPathInfoResult ServeProto::Serialise<QueryPathInfoResult>::read(ServeProto:
     return {std::move(p), std::move(info)};
 }
 
+PathInfosResult ServeProto::Serialise<PathInfosResult>::read(ServeProto::ReadConn conn)
+{
+    PathInfosResult result;
+    while (true) {
+        auto p = readString(conn.from);
+        if (p.empty()) {
+            return result;
+        }
+        auto info = ServeProto::Serialise<UnkeyedValidPathInfo>::read(conn);
+
+        if (info.narHash == Hash::dummy) {
+            throw Error("NAR hash is now mandatory");
+        }
+
+        result.infos.push_back({std::move(p), std::move(info)});
+    }
+}
+
 BuildPathsResult ServeProto::Serialise<BuildPathsResult>::read(ServeProto::ReadConn conn)
 {
     BuildResult result;
@@ -119,6 +151,8 @@ struct LegacySSHStore final : public Store
         ref<IoBuffer> fromBuf{make_ref<IoBuffer>()};
         std::unique_ptr<SSH::Connection> sshConn;
         ServeProto::Version remoteVersion;
+        std::optional<TransportCompression> transportCompression;
+        bool bulkQueries = false;
         Store * store = nullptr;
         bool good = true;
 
@@ -152,7 +186,10 @@ struct LegacySSHStore final : public Store
             LogLineSplitter splitter;
 
             auto flushLine = [&](const std::string & line) {
-                if (const auto state = handleJSONLogMessage(line, act.back(), activities, storeUri)) {
+                if (const auto state = rpc::log::handleStructuredLogMessage(
+                        line, act.back(), activities, storeUri
+                    ))
+                {
                     return *state;
                 } else {
                     return act.back().result(resBuildLogLine, line);
@@ -286,6 +323,7 @@ struct LegacySSHStore final : public Store
         }
 
         *conn = {};
+        auto offer = TransportCompression::fromConfig(config_);
         conn->sshConn = ssh.startCommand(
             fmt("%s --serve --write", config_.remoteProgram)
             + (config_.remoteStore.get() == "" ? "" : " --store " + shellEscape(config_.remoteStore.get()))
@@ -297,7 +335,7 @@ struct LegacySSHStore final : public Store
             conn->store = this;
 
             try {
-                to << SERVE_MAGIC_1 << SERVE_PROTOCOL_VERSION;
+                to << SERVE_MAGIC_1;
                 to.flush();
 
                 uint64_t magic = readNum<uint64_t>(from);
@@ -305,6 +343,12 @@ struct LegacySSHStore final : public Store
                     throw Error("'nix-store --serve' protocol mismatch from '%s'", host);
                 }
                 conn->remoteVersion = readNum<unsigned>(from);
+                if (offer && (conn->remoteVersion & SERVE_TRANSPORT_COMPRESSION_FLAG)) {
+                    conn->transportCompression = offer;
+                    debug("'%s' accepted %s transport compression", host, offer->method);
+                }
+                conn->bulkQueries = conn->remoteVersion & SERVE_BULK_QUERIES_FLAG;
+                conn->remoteVersion &= ~(SERVE_TRANSPORT_COMPRESSION_FLAG | SERVE_BULK_QUERIES_FLAG);
                 if (GET_PROTOCOL_MAJOR(conn->remoteVersion) != 0x200) {
                     throw Error("unsupported 'nix-store --serve' protocol version on '%s'", host);
                 }
@@ -314,6 +358,16 @@ struct LegacySSHStore final : public Store
                     throw Error("remote '%s' is too old (protocol version %x)", host, conn->remoteVersion);
                 }
 
+                /* Echoing the flags enables the features on the server, and
+                   transport compression also needs our offer. */
+                to << (SERVE_PROTOCOL_VERSION
+                       | (conn->transportCompression ? SERVE_TRANSPORT_COMPRESSION_FLAG : 0)
+                       | (conn->bulkQueries ? SERVE_BULK_QUERIES_FLAG : 0));
+                if (conn->transportCompression) {
+                    to << conn->transportCompression->encode();
+                }
+                to.flush();
+
             } catch (EndOfFile & e) {
                 throw Error("cannot connect to '%1%'", host);
             }
@@ -355,6 +409,28 @@ struct LegacySSHStore final : public Store
         co_return result::current_exception();
     }
 
+    /**
+     * Put the infos returned by a bulk query into the path info cache, so
+     * the `queryPathInfo` calls that usually follow these queries do not
+     * need another round trip each. Returns the paths they belong to.
+     */
+    kj::Promise<Result<StorePathSet>> cachePathInfos(PathInfosResult reply)
+    try {
+        StorePathSet paths;
+        auto state_(co_await state.lock());
+        for (auto & [p, info] : reply.infos) {
+            auto path = parseStorePath(p);
+            state_->pathInfoCache.upsert(
+                std::string(path.to_string()),
+                PathInfoCacheValue{.value = std::make_shared<ValidPathInfo>(path, std::move(info))}
+            );
+            paths.insert(std::move(path));
+        }
+        co_return paths;
+    } catch (...) {
+        co_return result::current_exception();
+    }
+
     kj::Promise<Result<void>> addToStore(
         const ValidPathInfo & info,
         AsyncInputStream & source,
@@ -369,6 +445,12 @@ struct LegacySSHStore final : public Store
         unsigned result;
 
         if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 5) {
+            auto nar = copyNAR(source);
+            if (auto & compression = conn->transportCompression) {
+                nar = makeFramedCompressionStream(
+                    compression->method, std::move(nar), compression->parallel, compression->level
+                );
+            }
             result = TRY_AWAIT(conn->sendCommand<unsigned>(
                 ServeProto::Command::AddToStoreNar,
                 printStorePath(info.path),
@@ -380,7 +462,7 @@ struct LegacySSHStore final : public Store
                 info.ultimate,
                 info.sigs,
                 renderContentAddress(info.ca),
-                copyNAR(source)
+                std::move(nar)
             ));
         } else {
             result = TRY_AWAIT(conn->sendCommand<unsigned>(
@@ -426,7 +508,33 @@ struct LegacySSHStore final : public Store
             }
         };
 
+        struct CompressedNarStream : AsyncInputStream
+        {
+            Sync<Connection, AsyncMutex>::Lock conn;
+            AsyncFdIoStream stream{AsyncFdIoStream::shared_fd{}, conn->sshConn->socket.get()};
+            AsyncBufferedInputStream buffered{stream, conn->fromBuf};
+            AsyncFramedDecompressionStream decompressed{conn->transportCompression->method, buffered};
+            box_ptr<AsyncInputStream> copier{copyNAR(decompressed)};
+
+            CompressedNarStream(Sync<Connection, AsyncMutex>::Lock conn) : conn(std::move(conn)) {}
+
+            kj::Promise<Result<std::optional<size_t>>> read(void * buffer, size_t size) override
+            try {
+                auto got = TRY_AWAIT(copier->read(buffer, size));
+                if (!got) {
+                    // the nar ends before the frames do, consume the terminator
+                    TRY_AWAIT(decompressed.finish());
+                }
+                co_return got;
+            } catch (...) {
+                co_return result::current_exception();
+            }
+        };
+
         TRY_AWAIT(conn->sendCommand(ServeProto::Command::DumpStorePath, printStorePath(path)));
+        if (conn->transportCompression) {
+            co_return make_box_ptr<CompressedNarStream>(std::move(conn));
+        }
         co_return make_box_ptr<NarStream>(std::move(conn));
     } catch (...) {
         co_return result::current_exception();
@@ -576,6 +684,15 @@ public:
 
         auto conn(TRY_AWAIT(getConnection()));
 
+        if (conn->bulkQueries) {
+            out.merge(TRY_AWAIT(cachePathInfos(TRY_AWAIT(conn->sendCommand<PathInfosResult>(
+                ServeProto::Command::QueryClosurePathInfos,
+                includeOutputs,
+                ServeProto::write(*conn, paths)
+            )))));
+            co_return result::success();
+        }
+
         out.merge(TRY_AWAIT(conn->sendCommand<StorePathSet>(
             ServeProto::Command::QueryClosure, includeOutputs, ServeProto::write(*conn, paths)
         )));
@@ -590,6 +707,15 @@ public:
     try {
         auto conn(TRY_AWAIT(getConnection()));
 
+        if (conn->bulkQueries) {
+            co_return TRY_AWAIT(cachePathInfos(TRY_AWAIT(conn->sendCommand<PathInfosResult>(
+                ServeProto::Command::QueryValidPathInfos,
+                false, // lock
+                maybeSubstitute,
+                ServeProto::write(*conn, paths)
+            ))));
+        }
+
         co_return TRY_AWAIT(conn->sendCommand<StorePathSet>(
             ServeProto::Command::QueryValidPaths,
             false, // lock
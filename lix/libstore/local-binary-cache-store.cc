@@ -108,6 +108,26 @@ protected:
         return {result::current_exception()};
     }
 
+    kj::Promise<Result<std::optional<std::string>>> getFileRange(
+        const std::string & path, uint64_t offset, uint64_t length, const Activity * context
+    ) override
+    try {
+        try {
+            return {readFileRange(binaryCacheDir + "/" + path, offset, length)};
+        } catch (SysError & e) {
+            if (e.errNo == ENOENT)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
+            throw;
+        }
+    } catch (...) {
+        return {result::current_exception()};
+    }
+
+    bool supportsFileRanges() override
+    {
+        return true;
+    }
+
     kj::Promise<Result<StorePathSet>> queryAllValidPaths() override
     try {
         StorePathSet paths;
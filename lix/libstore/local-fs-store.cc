@@ -2,6 +2,7 @@
 #include "lix/libstore/fs-accessor.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libstore/local-fs-store.hh"
+#include "lix/libstore/indexed-log.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/c-calls.hh"
 #include "lix/libutil/compression.hh"
@@ -102,25 +103,56 @@ try {
 
 const std::string LocalFSStore::drvsLogDir = "drvs";
 
+void LocalFSStore::removeOtherBuildLogs(const Path & logPathBase, std::string_view keep)
+{
+    for (std::string_view ext : {std::string_view(""), INDEXED_LOG_EXTENSION, std::string_view(".bz2")}) {
+        if (ext != keep) {
+            deletePath(logPathBase + std::string(ext));
+        }
+    }
+}
+
 kj::Promise<Result<std::optional<std::string>>>
 LocalFSStore::getBuildLogExact(const StorePath & path)
+{
+    return getBuildLogLinesExact(path, {});
+}
+
+kj::Promise<Result<std::optional<std::string>>>
+LocalFSStore::getBuildLogLinesExact(const StorePath & path, const BuildLogSelection & selection)
 try {
     auto baseName = path.to_string();
 
+    auto select = [&](std::string log) {
+        return selection.selectsAll() ? log : selectLogLines(log, selection);
+    };
+
     for (int j = 0; j < 2; j++) {
 
         Path logPath =
             j == 0
             ? fmt("%s/%s/%s/%s", config().logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2))
             : fmt("%s/%s/%s", config().logDir, drvsLogDir, baseName);
+        Path logZstPath = logPath + std::string(INDEXED_LOG_EXTENSION);
         Path logBz2Path = logPath + ".bz2";
 
         if (pathExists(logPath))
-            co_return readFile(logPath);
+            co_return select(readFile(logPath));
+
+        else if (pathExists(logZstPath)) {
+            try {
+                if (auto reader = IndexedLogReader::open(logZstPath)) {
+                    co_return reader->read(selection);
+                }
+                // the build writing this log is still running or was interrupted
+                // before it could write the index. the frames are still valid.
+                co_return select(decompress("zstd", readFile(logZstPath)));
+            } catch (Error &) { }
+        }
 
         else if (pathExists(logBz2Path)) {
             try {
-                co_return decompress("bzip2", readFile(logBz2Path));
+                co_return select(decompress("bzip2", readFile(logBz2Path)));
             } catch (Error &) { }
         }
 
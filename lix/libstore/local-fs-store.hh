@@ -41,6 +41,13 @@ public:
 
     const static std::string drvsLogDir;
 
+    /**
+     * Delete the build log at `logPathBase` in every format but the one with
+     * extension `keep`, so that a stale log in another format cannot shadow
+     * the one being written.
+     */
+    static void removeOtherBuildLogs(const Path & logPathBase, std::string_view keep);
+
     LocalFSStoreConfig & config() override = 0;
     const LocalFSStoreConfig & config() const override = 0;
 
@@ -75,6 +82,9 @@ public:
 
     kj::Promise<Result<std::optional<std::string>>> getBuildLogExact(const StorePath & path) override;
 
+    kj::Promise<Result<std::optional<std::string>>>
+    getBuildLogLinesExact(const StorePath & path, const BuildLogSelection & selection) override;
+
 };
 
 struct LocalStoreAccessor : public FSAccessor
@@ -1,11 +1,13 @@
 #include "lix/libstore/local-store.hh"
 #include "lix/libstore/globals.hh"
+#include "lix/libstore/indexed-log.hh"
 #include "lix/libutil/archive.hh"
 #include "lix/libstore/pathlocks.hh"
 #include "lix/libstore/temporary-dir.hh"
 #include "lix/libstore/worker-protocol.hh"
 #include "lix/libstore/derivations.hh"
 #include "lix/libstore/nar-info.hh"
+#include "lix/libstore/signature-cache.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/c-calls.hh"
@@ -73,6 +75,10 @@ struct LocalStore::DBState::Stmts {
     SQLiteStmt QueryDerivationOutputs;
     SQLiteStmt QueryPathFromHashPart;
     SQLiteStmt QueryValidPaths;
+    SQLiteStmt QueryValidPathsLike;
+    SQLiteStmt QueryUnoptimisedPaths;
+    SQLiteStmt MarkOptimised;
+    SQLiteStmt UnmarkOptimised;
 };
 
 int getSchema(Path schemaPath)
@@ -287,6 +293,21 @@ void LocalStore::initDB(DBState & state)
 
     else openDB(state, false);
 
+    /* The paths that optimiseStore() has already processed. This is
+       not part of the schema since that cannot change anymore (see
+       nixSchemaVersion). Implementations that do not know the table
+       ignore it, and the foreign key still removes its rows when they
+       invalidate a path. */
+    if (!config_.readOnly) {
+        state.db.exec(
+            "create table if not exists OptimisedPaths ("
+            "    id integer primary key not null,"
+            "    foreign key (id) references ValidPaths(id) on delete cascade"
+            ");",
+            always_progresses
+        );
+    }
+
     prepareStatements(state);
 }
 
@@ -318,6 +339,16 @@ void LocalStore::prepareStatements(DBState & state)
     state.stmts->QueryPathFromHashPart = state.db.create(
         "select path from ValidPaths where path >= ? limit 1;");
     state.stmts->QueryValidPaths = state.db.create("select path from ValidPaths");
+    state.stmts->QueryValidPathsLike = state.db.create(
+        "select path from ValidPaths where path like ? escape '\\';");
+    if (!config_.readOnly) {
+        state.stmts->QueryUnoptimisedPaths = state.db.create(
+            "select path from ValidPaths where id not in (select id from OptimisedPaths);");
+        state.stmts->MarkOptimised = state.db.create(
+            "insert or ignore into OptimisedPaths (id) select id from ValidPaths where path = ?;");
+        state.stmts->UnmarkOptimised = state.db.create(
+            "delete from OptimisedPaths where id = (select id from ValidPaths where path = ?);");
+    }
 }
 
 AutoCloseFD LocalStore::openGCLock()
@@ -688,7 +719,15 @@ try {
 kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>>
 LocalStore::queryPathInfoUncached(const StorePath & path, const Activity * context)
 try {
-    co_return TRY_AWAIT(
+    auto shared = getSharedPathInfoCache(true);
+    if (shared) {
+        if (auto info = shared->lookup(path)) {
+            co_return *info;
+        }
+    }
+    const auto generation = shared ? shared->generation() : 0;
+
+    auto info = TRY_AWAIT(
         // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
         retrySQLite([&]() -> kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>> {
             try {
@@ -699,6 +738,11 @@ try {
             }
         })
     );
+
+    if (shared) {
+        shared->insert(path, info, generation);
+    }
+    co_return info;
 } catch (...) {
     co_return result::current_exception();
 }
@@ -784,8 +828,16 @@ bool LocalStore::isValidPath_(DBState & state, const StorePath & path)
 kj::Promise<Result<bool>>
 LocalStore::isValidPathUncached(const StorePath & path, const Activity * context)
 try {
+    auto shared = getSharedPathInfoCache(true);
+    if (shared) {
+        if (auto info = shared->lookup(path)) {
+            co_return *info != nullptr;
+        }
+    }
+    const auto generation = shared ? shared->generation() : 0;
+
     // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
-    co_return TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<bool>> {
+    const bool valid = TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<bool>> {
         try {
             auto state = co_await _dbState.lock();
             co_return isValidPath_(*state, path);
@@ -793,6 +845,12 @@ try {
             co_return result::current_exception();
         }
     }));
+
+    /* Only the info of valid paths can be cached. */
+    if (shared && !valid) {
+        shared->insert(path, nullptr, generation);
+    }
+    co_return valid;
 } catch (...) {
     co_return result::current_exception();
 }
@@ -829,6 +887,91 @@ try {
 }
 
 
+kj::Promise<Result<StorePathSet>> LocalStore::queryValidPathsWithNamePrefix(std::string_view prefix)
+try {
+    // `_` matches any character of the hash part. sqlite still scans the table for
+    // this, but only the matching paths are returned and parsed.
+    std::string pattern =
+        config_.storeDir + "/" + std::string(StorePath::HASH_PART_LEN, '_') + "-";
+    for (char c : prefix) {
+        if (c == '%' || c == '_' || c == '\\') {
+            pattern += '\\';
+        }
+        pattern += c;
+    }
+    pattern += '%';
+
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+    co_return TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<StorePathSet>> {
+        try {
+            auto state = co_await _dbState.lock();
+            auto use(state->stmts->QueryValidPathsLike.use()(pattern));
+            StorePathSet res;
+            while (use.next()) {
+                auto path = parseStorePath(use.getStr(0));
+                // like is case-insensitive
+                if (path.name().starts_with(prefix)) {
+                    res.insert(std::move(path));
+                }
+            }
+            co_return res;
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    }));
+} catch (...) {
+    co_return result::current_exception();
+}
+
+
+kj::Promise<Result<StorePathSet>> LocalStore::queryUnoptimisedPaths()
+try {
+    if (config_.readOnly) {
+        co_return TRY_AWAIT(queryAllValidPaths());
+    }
+
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+    co_return TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<StorePathSet>> {
+        try {
+            auto state = co_await _dbState.lock();
+            auto use(state->stmts->QueryUnoptimisedPaths.use());
+            StorePathSet res;
+            while (use.next()) res.insert(parseStorePath(use.getStr(0)));
+            co_return res;
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    }));
+} catch (...) {
+    co_return result::current_exception();
+}
+
+
+kj::Promise<Result<void>> LocalStore::markOptimised(const StorePathSet & paths)
+try {
+    if (config_.readOnly || paths.empty()) {
+        co_return result::success();
+    }
+
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+    co_return co_await retrySQLite([&]() -> kj::Promise<Result<void>> {
+        try {
+            auto state = co_await _dbState.lock();
+            SQLiteTxn txn = state->db.beginTransaction(SQLiteTxnType::Immediate);
+            for (auto & path : paths) {
+                state->stmts->MarkOptimised.use()(printStorePath(path)).exec();
+            }
+            txn.commit();
+            co_return result::success();
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    });
+} catch (...) {
+    co_return result::current_exception();
+}
+
+
 void LocalStore::queryReferrers(DBState & state, const StorePath & path, StorePathSet & referrers)
 {
     auto useQueryReferrers(state.stmts->QueryReferrers.use()(printStorePath(path)));
@@ -986,8 +1129,16 @@ try {
        registering operation. */
     if (settings.syncBeforeRegistering) sync();
 
+    StorePathSet optimised;
+    {
+        auto autoOptimised(_autoOptimised.lock());
+        for (auto & [path, _] : infos) {
+            if (autoOptimised->erase(path)) optimised.insert(path);
+        }
+    }
+
     // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
-    co_return co_await retrySQLite([&]() -> kj::Promise<Result<void>> {
+    TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<void>> {
         try {
             auto state = co_await _dbState.lock();
 
@@ -996,11 +1147,21 @@ try {
 
             for (auto & [_, i] : infos) {
                 assert(i.narHash.type == HashType::SHA256);
-                if (isValidPath_(*state, i.path))
+                bool wasValid = isValidPath_(*state, i.path);
+                if (wasValid)
                     updatePathInfo(*state, i);
                 else
                     TRY_AWAIT(addValidPath(*state, i, false));
                 paths.insert(i.path);
+
+                /* Re-registered paths may have new contents, so they
+                   only count as optimised if optimisePath() just did
+                   its work on them. */
+                if (optimised.contains(i.path)) {
+                    state->stmts->MarkOptimised.use()(printStorePath(i.path)).exec();
+                } else if (wasValid) {
+                    state->stmts->UnmarkOptimised.use()(printStorePath(i.path)).exec();
+                }
             }
 
             for (auto & [_, i] : infos) {
@@ -1041,12 +1202,21 @@ try {
                          }})
             );
 
+            invalidateSharedPathInfo(paths);
             txn.commit();
             co_return result::success();
         } catch (...) {
             co_return result::current_exception();
         }
-    });
+    }));
+
+    StorePathSet paths;
+    for (auto & [path, _] : infos) {
+        paths.insert(path);
+    }
+    invalidateSharedPathInfo(paths);
+
+    co_return result::success();
 } catch (...) {
     co_return result::current_exception();
 }
@@ -1081,11 +1251,72 @@ const PublicKeys & LocalStore::getPublicKeys()
     return *publicKeys;
 }
 
+std::shared_ptr<SharedPathInfoCache> LocalStore::getSharedPathInfoCache(bool forReading)
+{
+    if (config_.readOnly || (forReading && !settings.sharedPathInfoCache)) {
+        return nullptr;
+    }
+
+    auto state(_sharedPathInfoCache.lock());
+    if (!state->cache && !(forReading && state->failed)) {
+        Path path = dbDir + "/path-info-cache";
+        try {
+            state->cache = SharedPathInfoCache::open(path, settings.sharedPathInfoCache);
+        } catch (Error & e) {
+            /* Other processes may still be reading the cache, so changes
+               that cannot be invalidated in it must not happen at all. */
+            if (!forReading) {
+                e.addTrace(
+                    nullptr,
+                    "while opening the shared path info cache; delete '%s' if it is broken",
+                    path
+                );
+                throw;
+            }
+            debug("not using the shared path info cache: %s", e.what());
+            state->failed = true;
+        }
+    }
+    return state->cache;
+}
+
+void LocalStore::invalidateSharedPathInfo(const StorePathSet & paths)
+{
+    if (auto shared = getSharedPathInfoCache(false)) {
+        shared->invalidate(paths);
+    }
+}
+
+void LocalStore::clearSharedPathInfoCache()
+{
+    if (auto shared = getSharedPathInfoCache(false)) {
+        shared->clear();
+    }
+}
+
 bool LocalStore::pathInfoIsUntrusted(const ValidPathInfo & info)
 {
     return config_.requireSigs && !info.checkSignatures(*this, getPublicKeys());
 }
 
+void LocalStore::prepareTrustChecks(const std::vector<const ValidPathInfo *> & infos)
+{
+    /* Without the cache the results would be lost. */
+    if (!config_.requireSigs || !getSignatureCache())
+        return;
+
+    std::vector<DetachedSignature> sigs;
+    for (auto info : infos) {
+        if (info->sigs.empty())
+            continue;
+        auto fingerprint = info->fingerprint(*this);
+        for (auto & sig : info->sigs)
+            sigs.push_back({fingerprint, sig});
+    }
+
+    verifyDetached(sigs, getPublicKeys());
+}
+
 kj::Promise<Result<void>> LocalStore::addToStore(
     const ValidPathInfo & info,
     AsyncInputStream & source,
@@ -1440,12 +1671,14 @@ try {
                 TRY_AWAIT(invalidatePath(*state, path));
             }
 
+            invalidateSharedPathInfo({path});
             txn.commit();
             co_return result::success();
         } catch (...) {
             co_return result::current_exception();
         }
     }));
+    invalidateSharedPathInfo({path});
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();
@@ -1567,8 +1800,12 @@ try {
                     }
 
                     if (update) {
-                        auto state(co_await _dbState.lock());
-                        updatePathInfo(*state, *info);
+                        invalidateSharedPathInfo({i});
+                        {
+                            auto state(co_await _dbState.lock());
+                            updatePathInfo(*state, *info);
+                        }
+                        invalidateSharedPathInfo({i});
                     }
 
                 }
@@ -1622,8 +1859,12 @@ try {
 
         if (canInvalidate) {
             printInfo("path '%s' disappeared, removing from database...", physicalPathS);
-            auto state(co_await _dbState.lock());
-            TRY_AWAIT(invalidatePath(*state, path));
+            invalidateSharedPathInfo({path});
+            {
+                auto state(co_await _dbState.lock());
+                TRY_AWAIT(invalidatePath(*state, path));
+            }
+            invalidateSharedPathInfo({path});
         } else {
             printError("path '%s' disappeared, but it still has valid referrers!", physicalPathS);
             if (repair)
@@ -1672,12 +1913,14 @@ try {
 
             updatePathInfo(*state, *info);
 
+            invalidateSharedPathInfo({storePath});
             txn.commit();
             co_return result::success();
         } catch (...) {
             co_return result::current_exception();
         }
     }));
+    invalidateSharedPathInfo({storePath});
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();
@@ -1737,9 +1980,11 @@ try {
 
     auto baseName = drvPath.to_string();
 
-    auto logPath =
-        fmt("%s/%s/%s/%s.bz2", config_.logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2)
-        );
+    auto logPathBase =
+        fmt("%s/%s/%s/%s", config_.logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2));
+
+    std::string_view extension = settings.indexBuildLogs ? INDEXED_LOG_EXTENSION : ".bz2";
+    auto logPath = logPathBase + std::string(extension);
 
     if (pathExists(logPath)) co_return result::success();
 
@@ -1747,9 +1992,18 @@ try {
 
     auto tmpFile = makeTempSiblingPath(logPath);
 
-    writeFileExcl(tmpFile, compress("bzip2", log));
+    if (settings.indexBuildLogs) {
+        StringSink compressed;
+        IndexedLogSink logSink(compressed);
+        logSink(log);
+        logSink.finish();
+        writeFileExcl(tmpFile, compressed.s);
+    } else {
+        writeFileExcl(tmpFile, compress("bzip2", log));
+    }
 
     renameFile(tmpFile, logPath);
+    removeOtherBuildLogs(logPathBase, extension);
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();}
@@ -5,6 +5,7 @@
 
 #include "lix/libstore/store-api.hh"
 #include "lix/libstore/indirect-root-store.hh"
+#include "lix/libstore/shared-path-info-cache.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/sync.hh"
 #include "lix/libutil/types.hh"
@@ -136,6 +137,42 @@ private:
 
     Sync<GCState> _gcState;
 
+    /**
+     * Store paths that `optimisePath()` optimised before they were
+     * registered. `registerValidPaths()` records them as optimised.
+     */
+    Sync<StorePathSet> _autoOptimised;
+
+    /**
+     * How files are deduplicated, resolved from `optimise-method` on
+     * first use.
+     */
+    enum class DedupMethod { Hardlink, Reflink };
+    std::optional<DedupMethod> dedupMethod_;
+    std::once_flag dedupMethodFlag;
+
+    /**
+     * Maps file contents to a file with those contents when files are
+     * deduplicated with reflinks. Opened on first use.
+     */
+    struct ReflinkIndex;
+    Sync<std::shared_ptr<ReflinkIndex>> _reflinkIndex;
+
+    /**
+     * The path info cache shared with other processes using this store.
+     * Opened on first use, see `getSharedPathInfoCache()`.
+     */
+    struct SharedCacheState
+    {
+        std::shared_ptr<SharedPathInfoCache> cache;
+        /**
+         * Opening the cache failed, so this process does not read it.
+         * Writers still try to open it to invalidate their changes.
+         */
+        bool failed = false;
+    };
+    Sync<SharedCacheState> _sharedPathInfoCache;
+
     std::optional<AssociatedCredentials> association;
 
 public:
@@ -161,6 +198,12 @@ public:
         association = {user, group};
     }
 
+    /**
+     * Invalidate everything in the shared path info cache, for example
+     * when the daemon starts.
+     */
+    void clearSharedPathInfoCache();
+
     bool isThreadSafe() const override
     {
         return true;
@@ -170,6 +213,21 @@ private:
 
     const PublicKeys & getPublicKeys();
 
+    /**
+     * The shared path info cache, if it can be used. Changes to path infos
+     * must be invalidated in it even if `shared-path-info-cache` is disabled
+     * in this process, so `forReading` tells whether it is about to be read.
+     * Errors opening an existing cache are only ignored when reading.
+     */
+    std::shared_ptr<SharedPathInfoCache> getSharedPathInfoCache(bool forReading);
+
+    /**
+     * Invalidate `paths` in the shared path info cache. Must be called
+     * both before and after the transaction that changes them is
+     * committed.
+     */
+    void invalidateSharedPathInfo(const StorePathSet & paths);
+
 protected:
 
     /**
@@ -208,6 +266,8 @@ public:
 
     kj::Promise<Result<StorePathSet>> queryAllValidPaths() override;
 
+    kj::Promise<Result<StorePathSet>> queryValidPathsWithNamePrefix(std::string_view prefix) override;
+
     kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>>
     queryPathInfoUncached(const StorePath & path, const Activity * context) override;
 
@@ -226,6 +286,8 @@ public:
 
     bool pathInfoIsUntrusted(const ValidPathInfo &) override;
 
+    void prepareTrustChecks(const std::vector<const ValidPathInfo *> & infos) override;
+
     kj::Promise<Result<void>> addToStore(
         const ValidPathInfo & info,
         AsyncInputStream & source,
@@ -307,6 +369,19 @@ public:
      */
     kj::Promise<Result<void>> optimisePath(const Path & path, RepairFlag repair);
 
+    /**
+     * The valid paths that `optimiseStore()` has not optimised yet, and
+     * that were not optimised by `auto-optimise-store` when they were
+     * added.
+     */
+    kj::Promise<Result<StorePathSet>> queryUnoptimisedPaths();
+
+    /**
+     * Record that the given valid paths are optimised, so that
+     * `optimiseStore()` skips them from now on.
+     */
+    kj::Promise<Result<void>> markOptimised(const StorePathSet & paths);
+
     kj::Promise<Result<bool>> verifyStore(bool checkContents, RepairFlag repair) override;
 
     /**
@@ -399,16 +474,38 @@ private:
     typedef std::unordered_set<ino_t> InodeHash;
     struct OptimizeState
     {
-        InodeHash inodeHash;
-        std::deque<Path> paths;
+        /**
+         * Inodes of the files in the links directory. Shared by all
+         * threads of a parallel `optimiseStore()`.
+         */
+        Sync<InodeHash> inodeHash;
     };
 
+    DedupMethod dedupMethod();
+
     InodeHash loadInodeHash();
-    Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
+    Strings readDirectoryIgnoringInodes(const Path & path, OptimizeState & state);
     /// Returns the stat data of `path` if it was optimized, `nullopt` otherwise.
     std::optional<struct ::stat> optimisePath_(
-        OptimiseStats & stats, const Path & path, OptimizeState & state, RepairFlag repair
+        OptimiseStats & stats,
+        const Path & path,
+        OptimizeState & state,
+        std::deque<Path> & queue,
+        RepairFlag repair
     );
+    /**
+     * Share the data blocks of `path` with an earlier file that has the
+     * same contents, according to the reflink index. Returns the stat
+     * data of `path` if it was deduplicated, `nullopt` otherwise.
+     */
+    std::optional<struct ::stat> reflinkFile_(
+        OptimiseStats & stats, const Path & path, const struct ::stat & st
+    );
+    /**
+     * Remove the files below `path` from the reflink index, as they
+     * are about to be deleted.
+     */
+    void forgetReflinkSources(const Path & path);
     kj::Promise<Result<void>> optimiseTree_(
         Activity * act,
         OptimiseStats & stats,
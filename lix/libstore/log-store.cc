@@ -12,4 +12,26 @@ try {
     co_return result::current_exception();
 }
 
+kj::Promise<Result<std::optional<std::string>>>
+LogStore::getBuildLogLines(const StorePath & path, const BuildLogSelection & selection)
+try {
+    auto maybePath = TRY_AWAIT(getBuildDerivationPath(path));
+    if (!maybePath)
+        co_return std::nullopt;
+    co_return TRY_AWAIT(getBuildLogLinesExact(maybePath.value(), selection));
+} catch (...) {
+    co_return result::current_exception();
+}
+
+kj::Promise<Result<std::optional<std::string>>>
+LogStore::getBuildLogLinesExact(const StorePath & path, const BuildLogSelection & selection)
+try {
+    auto log = TRY_AWAIT(getBuildLogExact(path));
+    if (!log)
+        co_return std::nullopt;
+    co_return selectLogLines(*log, selection);
+} catch (...) {
+    co_return result::current_exception();
+}
+
 }
@@ -1,6 +1,7 @@
 #pragma once
 ///@file
 
+#include "lix/libstore/indexed-log.hh"
 #include "lix/libstore/store-api.hh"
 
 
@@ -18,6 +19,19 @@ struct LogStore : public virtual Store
 
     virtual kj::Promise<Result<std::optional<std::string>>> getBuildLogExact(const StorePath & path) = 0;
 
+    /**
+     * Like `getBuildLog`, but only return the lines picked by `selection`.
+     */
+    kj::Promise<Result<std::optional<std::string>>>
+    getBuildLogLines(const StorePath & path, const BuildLogSelection & selection);
+
+    /**
+     * Stores that can read parts of a log without loading all of it
+     * override this. The default filters the result of `getBuildLogExact`.
+     */
+    virtual kj::Promise<Result<std::optional<std::string>>>
+    getBuildLogLinesExact(const StorePath & path, const BuildLogSelection & selection);
+
     virtual kj::Promise<Result<void>> addBuildLog(const StorePath & path, std::string_view log) = 0;
 
     static LogStore & require(Store & store);
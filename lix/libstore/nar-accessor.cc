@@ -136,7 +136,7 @@ struct NarAccessor : public FSAccessor
         if (!file)
             throw Error("path '%1%' inside NAR file is not a regular file", path);
 
-        if (getNarBytes) co_return getNarBytes(file->offset, file->size);
+        if (getNarBytes) co_return TRY_AWAIT(getNarBytes(file->offset, file->size));
 
         assert(nar);
         co_return std::string(*nar, file->offset, file->size);
@@ -0,0 +1,143 @@
+#include "lix/libstore/nar-delta.hh"
+#include "lix/libstore/names.hh"
+#include "lix/libstore/store-api.hh"
+#include "lix/libutil/async.hh"
+#include "lix/libutil/logging.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <vector>
+
+namespace nix {
+
+/**
+ * Paths smaller than this are always sent in full, a delta would not save
+ * enough to be worth reading the base.
+ */
+static constexpr uint64_t MIN_NAR_DELTA_SIZE = 64 * 1024;
+
+/**
+ * How many candidates to ask the receiver about for every missing path.
+ */
+static constexpr size_t MAX_NAR_DELTA_CANDIDATES = 3;
+
+/**
+ * Paths are only compared to paths with the same key: the package name and,
+ * for outputs other than `out`, the output name (`hello-2.12-man` should not
+ * be sent as a delta against `hello-2.11`).
+ */
+static std::string deltaKey(const DrvName & name)
+{
+    auto key = name.name;
+    auto dash = name.version.rfind('-');
+    if (dash != std::string::npos && dash + 1 < name.version.size()
+        && !isdigit(static_cast<unsigned char>(name.version[dash + 1])))
+    {
+        key += name.version.substr(dash);
+    }
+    return key;
+}
+
+kj::Promise<Result<std::map<StorePath, StorePath>>>
+chooseNarDeltaBases(Store & srcStore, Store & dstStore, const StorePathSet & missing)
+try {
+    // only look for bases of paths that are large enough to benefit from a delta,
+    // and only among the paths with the same name as one of them.
+    StorePathSet large;
+    std::map<std::string, std::string> namesByKey;
+    for (auto & path : missing) {
+        auto info = TRY_AWAIT(srcStore.queryPathInfo(path));
+        if (info->narSize >= MIN_NAR_DELTA_SIZE) {
+            DrvName name(path.name());
+            large.insert(path);
+            namesByKey.emplace(deltaKey(name), name.name);
+        }
+    }
+
+    std::map<std::string, std::vector<std::pair<std::string, StorePath>>> byKey;
+    for (auto & [key, name] : namesByKey) {
+        StorePathSet sameName;
+        try {
+            sameName = TRY_AWAIT(srcStore.queryValidPathsWithNamePrefix(name));
+        } catch (Unsupported &) {
+            co_return std::map<StorePath, StorePath>{};
+        }
+        for (auto & path : sameName) {
+            if (missing.contains(path)) {
+                continue;
+            }
+            DrvName candidateName(path.name());
+            if (deltaKey(candidateName) == key) {
+                byKey[key].emplace_back(candidateName.version, path);
+            }
+        }
+    }
+
+    std::map<StorePath, std::vector<StorePath>> candidates;
+    StorePathSet allCandidates;
+    for (auto & path : large) {
+        DrvName name(path.name());
+        auto it = byKey.find(deltaKey(name));
+        if (it == byKey.end()) {
+            continue;
+        }
+
+        std::vector<StorePath> same, older, newer;
+        auto versions = it->second;
+        std::sort(versions.begin(), versions.end(), [](auto & a, auto & b) {
+            return compareVersions(a.first, b.first) < 0;
+        });
+        for (auto & [version, candidate] : versions) {
+            auto order = compareVersions(version, name.version);
+            if (order == 0) {
+                same.push_back(candidate);
+            } else if (order < 0) {
+                older.insert(older.begin(), candidate);
+            } else {
+                newer.push_back(candidate);
+            }
+        }
+
+        auto & chosen = candidates[path];
+        for (auto * group : {&same, &older, &newer}) {
+            for (auto & candidate : *group) {
+                if (chosen.size() < MAX_NAR_DELTA_CANDIDATES) {
+                    chosen.push_back(candidate);
+                    allCandidates.insert(candidate);
+                }
+            }
+        }
+    }
+
+    if (allCandidates.empty()) {
+        co_return std::map<StorePath, StorePath>{};
+    }
+
+    auto validInDst = TRY_AWAIT(dstStore.queryValidPaths(allCandidates));
+
+    std::map<StorePath, StorePath> bases;
+    for (auto & [path, choices] : candidates) {
+        for (auto & candidate : choices) {
+            if (!validInDst.contains(candidate)) {
+                continue;
+            }
+            auto baseInfo = TRY_AWAIT(srcStore.queryPathInfo(candidate));
+            if (baseInfo->narSize > MAX_NAR_DELTA_BASE_SIZE) {
+                continue;
+            }
+            debug(
+                "sending '%s' as a delta against '%s'",
+                srcStore.printStorePath(path),
+                srcStore.printStorePath(candidate)
+            );
+            bases.emplace(path, candidate);
+            break;
+        }
+    }
+
+    co_return bases;
+} catch (...) {
+    co_return result::current_exception();
+}
+
+}
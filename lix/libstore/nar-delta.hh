@@ -0,0 +1,59 @@
+#pragma once
+///@file
+
+#include "lix/libstore/path.hh"
+#include "lix/libutil/async-io.hh"
+#include "lix/libutil/box_ptr.hh"
+#include "lix/libutil/hash.hh"
+#include "lix/libutil/result.hh"
+
+#include <kj/async.h>
+#include <map>
+
+namespace nix {
+
+class Store;
+
+/**
+ * The largest NAR that may be used as a delta base. The sender holds the
+ * base in memory while encoding, the receiver spills it to a temporary
+ * file; both sides check this limit.
+ */
+constexpr uint64_t MAX_NAR_DELTA_BASE_SIZE = 512 * 1024 * 1024;
+
+/**
+ * Content of a store path sent as a binary delta against the NAR of another
+ * store path, `base`, instead of as a NAR. Only stores whose
+ * `acceptsNarDeltas()` returns true can be sent such streams.
+ */
+struct NarDeltaStream : AsyncInputStream
+{
+    StorePath base;
+    Hash baseNarHash;
+    box_ptr<AsyncInputStream> delta;
+
+    NarDeltaStream(StorePath base, Hash baseNarHash, box_ptr<AsyncInputStream> delta)
+        : base(std::move(base))
+        , baseNarHash(baseNarHash)
+        , delta(std::move(delta))
+    {
+    }
+
+    kj::Promise<Result<std::optional<size_t>>> read(void * buffer, size_t size) override
+    {
+        return delta->read(buffer, size);
+    }
+};
+
+/**
+ * Choose a delta base for each of the `missing` paths that are to be copied
+ * from `srcStore` to `dstStore`. A base must be valid in both stores and
+ * have the same package name as the path it is used for; paths of the same
+ * version are preferred, then the closest older version, then the closest
+ * newer one. Paths that are too small to benefit from a delta or for which
+ * no base was found are not included in the result.
+ */
+kj::Promise<Result<std::map<StorePath, StorePath>>>
+chooseNarDeltaBases(Store & srcStore, Store & dstStore, const StorePathSet & missing);
+
+}
@@ -1,5 +1,6 @@
 #include "lix/libstore/local-store.hh"
 #include "lix/libstore/globals.hh"
+#include "lix/libstore/sqlite.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/c-calls.hh"
 #include "lix/libutil/logging.hh"
@@ -7,6 +8,7 @@
 #include "lix/libutil/result.hh"
 #include "lix/libutil/signals.hh"
 #include "lix/libutil/strings.hh"
+#include "lix/libutil/thread-pool.hh"
 
 #include <cstring>
 #include <sys/types.h>
@@ -18,6 +20,11 @@
 #include <regex>
 #endif
 
+#if __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
 namespace nix {
 
 
@@ -46,6 +53,222 @@ struct MakeReadOnly
 };
 
 
+struct LocalStore::ReflinkIndex
+{
+    SQLite db;
+    SQLiteStmt claim, lookup, replace, forget;
+
+    explicit ReflinkIndex(const Path & path) : db(path)
+    {
+        /* Only a cache: losing it merely loses deduplication chances
+           for files that are already in the store. */
+        db.isCache();
+        db.exec(
+            "create table if not exists Files ("
+            "    hash text primary key not null," // base-32 SHA-256 of the contents
+            "    path text not null"
+            ");"
+            "create index if not exists IndexFilesPath on Files(path);",
+            always_progresses
+        );
+        claim = db.create("insert or ignore into Files (hash, path) values (?, ?);");
+        lookup = db.create("select path from Files where hash = ?;");
+        replace = db.create("update Files set path = ? where hash = ? and path = ?;");
+        forget = db.create("delete from Files where path = ? or (path >= ? and path < ?);");
+    }
+};
+
+
+/**
+ * Whether files in `dir` can share data blocks, checked by cloning a
+ * scratch file in a private temporary directory below `dir`.
+ */
+static bool canReflink(const Path & dir)
+{
+#if __linux__
+    AutoDelete tmpDir(createTempSubdir(dir, "reflink-probe", 0700));
+    Path src = (Path) tmpDir + "/src";
+    Path dst = (Path) tmpDir + "/dst";
+
+    AutoCloseFD srcFd{sys::open(src, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)};
+    if (!srcFd) throw SysError("creating '%1%'", src);
+    writeFull(srcFd.get(), std::string(4096, 'x'));
+
+    AutoCloseFD dstFd{sys::open(dst, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)};
+    if (!dstFd) throw SysError("creating '%1%'", dst);
+
+    return ioctl(dstFd.get(), FICLONE, srcFd.get()) == 0;
+#else
+    return false;
+#endif
+}
+
+
+LocalStore::DedupMethod LocalStore::dedupMethod()
+{
+    std::call_once(dedupMethodFlag, [&] {
+        const auto & method = settings.optimiseMethod.get();
+        if (method == "reflink") {
+            if (!canReflink(linksDir)) {
+                throw Error(
+                    "'optimise-method' is set to 'reflink', but the file system of '%s' "
+                    "does not support reflinks",
+                    config().realStoreDir.get()
+                );
+            }
+            dedupMethod_ = DedupMethod::Reflink;
+        } else if (method == "auto") {
+            dedupMethod_ = canReflink(linksDir) ? DedupMethod::Reflink : DedupMethod::Hardlink;
+        } else {
+            if (method != "hardlink") {
+                printTaggedWarning("unknown optimise method '%s', using 'hardlink'", method);
+            }
+            dedupMethod_ = DedupMethod::Hardlink;
+        }
+        debug(
+            "deduplicating files with %s",
+            *dedupMethod_ == DedupMethod::Reflink ? "reflinks" : "hard links"
+        );
+    });
+    return *dedupMethod_;
+}
+
+
+std::optional<struct ::stat> LocalStore::reflinkFile_(
+    OptimiseStats & stats, const Path & path, const struct ::stat & st
+)
+{
+#if __linux__
+    /* Only data blocks can be shared, and empty files have none. */
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        return std::nullopt;
+    }
+
+    /* Unlike with hard links, files with different permissions can
+       share their data, so only the contents are hashed. */
+    auto hash = base32Encode(hashFile(HashType::SHA256, path));
+
+    /* Claiming the contents and reading back whoever owns them happens
+       under one lock, so concurrent workers hashing the same contents
+       agree on a single source instead of overwriting each other. */
+    std::optional<Path> source;
+    try {
+        auto index(_reflinkIndex.lock());
+        if (!*index) {
+            *index = std::make_shared<ReflinkIndex>(dbDir + "/reflinks.sqlite");
+        }
+        (*index)->claim.use()(hash)(path).exec();
+        auto use((*index)->lookup.use()(hash));
+        if (use.next()) {
+            source = use.getStr(0);
+        }
+    } catch (SQLiteError & e) {
+        debug("cannot look up '%s' in the reflink index: %s", path, e.msg());
+        return std::nullopt;
+    }
+
+    if (!source || *source == path) {
+        return std::nullopt;
+    }
+
+    /* Takes over a stale entry, unless another worker already did. */
+    const auto remember = [&] {
+        try {
+            auto index(_reflinkIndex.lock());
+            (*index)->replace.use()(path)(hash)(*source).exec();
+        } catch (SQLiteError & e) {
+            debug("cannot add '%s' to the reflink index: %s", path, e.msg());
+        }
+    };
+
+    /* The file the index points to may have been deleted or changed
+       since; make this file the new source for its contents then. */
+    auto stSource = maybeLstat(*source);
+    if (!stSource || !S_ISREG(stSource->st_mode) || stSource->st_size != st.st_size) {
+        remember();
+        return std::nullopt;
+    }
+    if (stSource->st_dev == st.st_dev && stSource->st_ino == st.st_ino) {
+        return std::nullopt;
+    }
+
+    AutoCloseFD srcFd{sys::open(*source, O_RDONLY | O_CLOEXEC)};
+    if (!srcFd) throw SysError("opening '%1%'", *source);
+    AutoCloseFD dstFd{sys::open(path, O_RDONLY | O_CLOEXEC)};
+    if (!dstFd) throw SysError("opening '%1%'", path);
+
+    /* The kernel compares the contents before sharing any blocks, so a
+       stale index entry can never corrupt `path`. Some file systems
+       limit how much is deduplicated per call. */
+    alignas(struct file_dedupe_range)
+        std::byte buf[sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info)] = {};
+    auto & range = *reinterpret_cast<struct file_dedupe_range *>(buf);
+    auto & info = range.info[0];
+    const uint64_t size = st.st_size;
+    uint64_t offset = 0;
+    while (offset < size) {
+        checkInterrupt();
+        range.src_offset = offset;
+        range.src_length = std::min<uint64_t>(size - offset, 16 * 1024 * 1024);
+        range.dest_count = 1;
+        info.dest_fd = dstFd.get();
+        info.dest_offset = offset;
+        info.bytes_deduped = 0;
+        info.status = 0;
+
+        if (ioctl(srcFd.get(), FIDEDUPERANGE, &range) == -1) {
+            debug("cannot deduplicate '%s' with '%s': %s", path, *source, strerror(errno));
+            return std::nullopt;
+        }
+        if (info.status == FILE_DEDUPE_RANGE_DIFFERS) {
+            remember();
+            return std::nullopt;
+        }
+        if (info.status < 0) {
+            debug("cannot deduplicate '%s' with '%s': %s", path, *source, strerror(-info.status));
+            return std::nullopt;
+        }
+        if (info.bytes_deduped == 0) {
+            break;
+        }
+        offset += info.bytes_deduped;
+    }
+
+    if (offset == 0) {
+        return std::nullopt;
+    }
+
+    printMsg(lvlTalkative, "sharing the data of '%1%' with '%2%'", path, *source);
+
+    stats.filesLinked++;
+    stats.bytesFreed += offset;
+    stats.blocksFreed += st.st_blocks;
+    return st;
+#else
+    return std::nullopt;
+#endif
+}
+
+
+void LocalStore::forgetReflinkSources(const Path & path)
+{
+    try {
+        auto index(_reflinkIndex.lock());
+        if (!*index) {
+            Path indexPath = dbDir + "/reflinks.sqlite";
+            if (!pathExists(indexPath)) {
+                return;
+            }
+            *index = std::make_shared<ReflinkIndex>(indexPath);
+        }
+        /* '0' is the character after '/'. */
+        (*index)->forget.use()(path)(path + "/")(path + "0").exec();
+    } catch (SQLiteError & e) {
+        debug("cannot remove '%s' from the reflink index: %s", path, e.msg());
+    }
+}
+
+
 LocalStore::InodeHash LocalStore::loadInodeHash()
 {
     debug("loading hash inodes in memory");
@@ -68,9 +291,9 @@ LocalStore::InodeHash LocalStore::loadInodeHash()
 }
 
 
-Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash)
+Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, OptimizeState & state)
 {
-    Strings names;
+    std::vector<std::pair<std::string, ino_t>> entries;
 
     AutoCloseDir dir(sys::opendir(path));
     if (!dir) throw SysError("opening directory '%1%'", path);
@@ -79,22 +302,33 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
     while (errno = 0, dirent = readdir(dir.get())) { /* sic */
         checkInterrupt();
 
-        if (inodeHash.count(dirent->d_ino)) {
-            debug("'%1%' is already linked", dirent->d_name);
-            continue;
-        }
-
         std::string name = dirent->d_name;
         if (name == "." || name == "..") continue;
-        names.push_back(name);
+        entries.emplace_back(std::move(name), dirent->d_ino);
     }
     if (errno) throw SysError("reading directory '%1%'", path);
 
+    /* Only hold the lock for the lookups, not for the readdir, so other
+       workers are not blocked on the file system. */
+    Strings names;
+    auto inodeHash(state.inodeHash.lock());
+    for (auto & [name, ino] : entries) {
+        if (inodeHash->count(ino)) {
+            debug("'%1%' is already linked", name);
+            continue;
+        }
+        names.push_back(std::move(name));
+    }
+
     return names;
 }
 
 std::optional<struct ::stat> LocalStore::optimisePath_(
-    OptimiseStats & stats, const Path & path, OptimizeState & state, RepairFlag repair
+    OptimiseStats & stats,
+    const Path & path,
+    OptimizeState & state,
+    std::deque<Path> & queue,
+    RepairFlag repair
 )
 {
     checkInterrupt();
@@ -116,9 +350,9 @@ std::optional<struct ::stat> LocalStore::optimisePath_(
 #endif
 
     if (S_ISDIR(st.st_mode)) {
-        Strings names = readDirectoryIgnoringInodes(path, state.inodeHash);
+        Strings names = readDirectoryIgnoringInodes(path, state);
         for (auto & i : names) {
-            state.paths.push_back(path + "/" + i);
+            queue.push_back(path + "/" + i);
         }
         return std::nullopt;
     }
@@ -140,8 +374,12 @@ std::optional<struct ::stat> LocalStore::optimisePath_(
         return std::nullopt;
     }
 
+    if (dedupMethod() == DedupMethod::Reflink) {
+        return reflinkFile_(stats, path, st);
+    }
+
     /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && state.inodeHash.count(st.st_ino)) {
+    if (st.st_nlink > 1 && state.inodeHash.lock()->count(st.st_ino)) {
         debug("'%s' is already linked, with %d other file(s)", path, st.st_nlink - 2);
         return std::nullopt;
     }
@@ -183,7 +421,7 @@ std::optional<struct ::stat> LocalStore::optimisePath_(
     if (!stLinkOpt) {
         /* Nope, create a hard link in the links directory. */
         if (sys::link(path, linkPath) == 0) {
-            state.inodeHash.insert(st.st_ino);
+            state.inodeHash.lock()->insert(st.st_ino);
             return std::nullopt;
         }
 
@@ -218,7 +456,9 @@ std::optional<struct ::stat> LocalStore::optimisePath_(
 
     /* Make the containing directory writable, but only if it's not
        the store itself (we don't want or need to mess with its
-       permissions). */
+       permissions). Every other directory belongs to a single store
+       path, and optimiseStore() never gives one store path to more
+       than one thread, so no other thread toggles it meanwhile. */
     const Path dirOfPath(dirOf(path));
     bool mustToggle = dirOfPath != config().realStoreDir.get();
     if (mustToggle) makeWritable(dirOfPath);
@@ -273,13 +513,13 @@ kj::Promise<Result<void>> LocalStore::optimiseTree_(
     RepairFlag repair
 )
 try {
-    assert(state.paths.empty());
+    std::deque<Path> queue;
 
-    state.paths.push_back(path);
-    while (!state.paths.empty()) {
-        auto path = std::move(state.paths.front());
-        state.paths.pop_front();
-        const auto optimized = optimisePath_(stats, path, state, repair);
+    queue.push_back(path);
+    while (!queue.empty()) {
+        auto path = std::move(queue.front());
+        queue.pop_front();
+        const auto optimized = optimisePath_(stats, path, state, queue, repair);
         if (act && optimized) {
             ACTIVITY_RESULT(*act, resFileLinked, optimized->st_size, optimized->st_blocks);
         }
@@ -289,35 +529,88 @@ try {
     co_return result::current_exception();
 }
 
+/**
+ * How many store paths `optimiseStore()` optimises before it records
+ * them as done, so that an interrupted run loses little work.
+ */
+static constexpr size_t OPTIMISE_BATCH_SIZE = 1024;
+
 kj::Promise<Result<void>> LocalStore::optimiseStore(OptimiseStats & stats)
 try {
     auto act = logger->startActivity(actOptimiseStore);
 
-    auto paths = TRY_AWAIT(queryAllValidPaths());
-    OptimizeState state{.inodeHash = loadInodeHash()};
+    /* Paths optimised by earlier runs or by auto-optimise-store only
+       need to be looked at again if they were re-registered since. */
+    auto paths = TRY_AWAIT(queryUnoptimisedPaths());
 
     ACTIVITY_PROGRESS(act, 0, paths.size());
 
-    uint64_t done = 0;
+    if (paths.empty()) {
+        co_return result::success();
+    }
 
-    for (auto & i : paths) {
-        TRY_AWAIT(addTempRoot(i));
-        if (!TRY_AWAIT(isValidPath(i))) continue; /* path was GC'ed, probably */
-        {
-            auto act = logger->startActivity(
-                lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i))
-            );
-            TRY_AWAIT(optimiseTree_(
-                &act,
-                stats,
-                config().realStoreDir + "/" + std::string(i.to_string()),
-                state,
-                NoRepair
-            ));
+    OptimizeState state;
+    if (dedupMethod() == DedupMethod::Hardlink) {
+        *state.inodeHash.lock() = loadInodeHash();
+    }
+
+    Sync<OptimiseStats> totals;
+    std::atomic<uint64_t> done = 0;
+
+    std::vector<StorePath> pending(paths.begin(), paths.end());
+    for (size_t start = 0; start < pending.size(); start += OPTIMISE_BATCH_SIZE) {
+        const auto batchEnd = std::min(pending.size(), start + OPTIMISE_BATCH_SIZE);
+
+        StorePathSet batch;
+        for (size_t n = start; n < batchEnd; n++) {
+            auto & i = pending[n];
+            TRY_AWAIT(addTempRoot(i));
+            if (!TRY_AWAIT(isValidPath(i))) { /* path was GC'ed, probably */
+                done++;
+                continue;
+            }
+            batch.insert(i);
         }
-        done++;
+
+        /* Hash and link the files of different store paths in parallel.
+           The links directory is safe to share between threads just as
+           it is safe to share between processes. */
+        ThreadPool pool{"optimise pool"};
+        for (auto & i : batch) {
+            pool.enqueueWithAio([&, path{i}](AsyncIoRoot & aio) {
+                OptimiseStats pathStats;
+                {
+                    auto pathAct = logger->startActivity(
+                        lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(path))
+                    );
+                    aio.blockOn(optimiseTree_(
+                        &pathAct,
+                        pathStats,
+                        config().realStoreDir + "/" + std::string(path.to_string()),
+                        state,
+                        NoRepair
+                    ));
+                }
+                {
+                    auto totals_(totals.lock());
+                    totals_->filesLinked += pathStats.filesLinked;
+                    totals_->bytesFreed += pathStats.bytesFreed;
+                    totals_->blocksFreed += pathStats.blocksFreed;
+                }
+                ACTIVITY_PROGRESS_SYNC(aio, act, ++done, paths.size());
+            });
+        }
+        TRY_AWAIT(pool.processAsync());
+
+        TRY_AWAIT(markOptimised(batch));
         ACTIVITY_PROGRESS(act, done, paths.size());
+
+        auto totals_(totals.lock());
+        stats.filesLinked += std::exchange(totals_->filesLinked, 0);
+        stats.bytesFreed += std::exchange(totals_->bytesFreed, 0);
+        stats.blocksFreed += std::exchange(totals_->blocksFreed, 0);
     }
+
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();
@@ -344,6 +637,12 @@ try {
 
     if (settings.autoOptimiseStore) {
         TRY_AWAIT(optimiseTree_(nullptr, stats, path, state, repair));
+
+        /* Let registerValidPaths() record that optimiseStore() need not
+           look at this path again. */
+        if (dirOf(path) == config().realStoreDir.get()) {
+            _autoOptimised.lock()->insert(StorePath(baseNameOf(path)));
+        }
     }
     co_return result::success();
 } catch (...) {
@@ -1532,6 +1532,7 @@ void LinuxLocalDerivationGoal::killSandbox(bool getStats)
             auto stats = context.cgroup->getStatistics();
             buildResult.cpuUser = stats.cpuUser;
             buildResult.cpuSystem = stats.cpuSystem;
+            peakMemory = stats.memoryPeak;
         }
         /* It may be desireable to destroy the cgroup here
          * but we may be calling this at the start of the build
@@ -1,14 +1,131 @@
 #include "lix/libstore/remote-fs-accessor.hh"
+#include "lix/libstore/binary-cache-store.hh"
 #include "lix/libstore/nar-accessor.hh"
-#include "lix/libutil/c-calls.hh"
+#include "lix/libstore/nar-info.hh"
+#include "lix/libutil/compression.hh"
 #include "lix/libutil/json.hh"
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <functional>
 
 namespace nix {
 
+namespace {
+/**
+ * Reads parts of a NAR in a binary cache using range requests. Compressed
+ * NARs can only be read this way if they were written in independently
+ * compressed chunks, which the NAR listing then records. Falls back to
+ * fetching the whole NAR if a cache that supports ranges still refuses a
+ * range request, for example an HTTP server that ignores them.
+ */
+struct NarRangeReader
+{
+    ref<BinaryCacheStore> cache;
+    StorePath storePath;
+    std::string url;
+
+    /**
+     * Chunk layout of compressed NARs. `chunkOffsets` is empty for
+     * uncompressed NARs, otherwise it holds the offset of each chunk in the
+     * compressed file followed by the size of the file.
+     */
+    std::string compression;
+    uint64_t chunkSize = 0;
+    std::vector<uint64_t> chunkOffsets;
+
+    /**
+     * The chunks decompressed by the last read, starting at `cachedStart`.
+     * Files inside a NAR are usually read in order, so the next read often
+     * hits the same chunk.
+     */
+    uint64_t cachedStart = 0;
+    std::string cached;
+
+    /**
+     * The whole NAR, once range requests were found to be unsupported.
+     */
+    std::optional<std::string> nar;
+
+    /**
+     * Called with the whole NAR once it was fetched, to keep it in the
+     * local NAR cache like NARs that were never read by ranges.
+     */
+    std::function<void(const std::string &)> onWholeNar;
+
+    NarRangeReader(ref<BinaryCacheStore> cache, StorePath storePath, std::string url)
+        : cache(cache)
+        , storePath(std::move(storePath))
+        , url(std::move(url))
+    {
+    }
+
+    kj::Promise<Result<std::optional<std::string>>> readRange(uint64_t offset, uint64_t length)
+    try {
+        if (chunkOffsets.empty()) {
+            co_return TRY_AWAIT(cache->getFileRange(url, offset, length));
+        }
+
+        if (length == 0) {
+            co_return std::string();
+        }
+
+        auto first = offset / chunkSize;
+        auto last = (offset + length - 1) / chunkSize;
+        if (last + 1 >= chunkOffsets.size()) {
+            throw Error(
+                "NAR listing of '%s' does not cover offset %d", cache->printStorePath(storePath), offset
+            );
+        }
+
+        if (cached.empty() || offset < cachedStart || offset + length > cachedStart + cached.size())
+        {
+            auto compressed = TRY_AWAIT(cache->getFileRange(
+                url, chunkOffsets[first], chunkOffsets[last + 1] - chunkOffsets[first]
+            ));
+            if (!compressed) {
+                co_return std::nullopt;
+            }
+            cached = decompress(compression, *compressed);
+            cachedStart = first * chunkSize;
+            if (offset + length > cachedStart + cached.size()) {
+                throw Error("compressed NAR of '%s' is truncated", cache->printStorePath(storePath));
+            }
+        }
+
+        co_return cached.substr(offset - cachedStart, length);
+    } catch (...) {
+        co_return result::current_exception();
+    }
+
+    kj::Promise<Result<std::string>> read(uint64_t offset, uint64_t length)
+    try {
+        if (!nar) {
+            if (auto bytes = TRY_AWAIT(readRange(offset, length))) {
+                co_return std::move(*bytes);
+            }
+
+            debug(
+                "binary cache '%s' does not support range requests, fetching the NAR of '%s'",
+                cache->getUri(),
+                cache->printStorePath(storePath)
+            );
+            StringSink sink;
+            TRY_AWAIT(TRY_AWAIT(cache->narFromPath(storePath, nullptr))->drainInto(sink));
+            nar = std::move(sink.s);
+            if (onWholeNar) {
+                onWholeNar(*nar);
+            }
+        }
+
+        if (offset + length > nar->size()) {
+            throw Error("NAR of '%s' is truncated", cache->printStorePath(storePath));
+        }
+        co_return nar->substr(offset, length);
+    } catch (...) {
+        co_return result::current_exception();
+    }
+};
+}
+
 RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir)
     : store(store)
     , cacheDir(cacheDir)
@@ -52,6 +169,75 @@ try {
     co_return result::current_exception();
 }
 
+kj::Promise<Result<std::optional<ref<FSAccessor>>>>
+RemoteFSAccessor::makeRangeAccessor(const StorePath & storePath)
+try {
+    auto cache = store.try_cast<BinaryCacheStore>();
+    if (!cache || !(*cache)->supportsFileRanges()) {
+        co_return std::nullopt;
+    }
+
+    auto info = TRY_AWAIT(store->queryPathInfo(storePath)).try_cast<const NarInfo>();
+    if (!info) {
+        co_return std::nullopt;
+    }
+
+    auto listing = TRY_AWAIT((*cache)->getFileContents(fmt("%s.ls", storePath.hashPart())));
+    if (!listing) {
+        co_return std::nullopt;
+    }
+
+    try {
+        JSON j = json::parse(std::move(*listing), "a nar content listing");
+        if (j["version"] != 1) {
+            co_return std::nullopt;
+        }
+
+        auto reader = std::make_shared<NarRangeReader>(*cache, storePath, (*info)->url);
+        if (cacheDir != "") {
+            reader->onWholeNar = [narFile{makeCacheFile(storePath.hashPart(), "nar")},
+                                  lsFile{makeCacheFile(storePath.hashPart(), "ls")},
+                                  root{j["root"].dump()}](const std::string & nar) {
+                try {
+                    writeFile(narFile, nar);
+                    writeFile(lsFile, root);
+                } catch (...) {
+                    ignoreExceptionExceptInterrupt();
+                }
+            };
+        }
+
+        if ((*info)->compression != "none") {
+            auto chunks = j.find("chunks");
+            if (chunks == j.end() || valueAt(*chunks, "url") != (*info)->url
+                || valueAt(*chunks, "compression") != (*info)->compression)
+            {
+                co_return std::nullopt;
+            }
+            reader->compression = (*info)->compression;
+            reader->chunkSize = ensureType(valueAt(*chunks, "size"), JSON::value_t::number_unsigned);
+            reader->chunkOffsets = valueAt(*chunks, "offsets").get<std::vector<uint64_t>>();
+            if (reader->chunkSize == 0 || reader->chunkOffsets.size() < 2) {
+                throw Error("invalid chunk layout");
+            }
+        }
+
+        co_return makeLazyNarAccessor(j["root"].dump(), [reader](uint64_t offset, uint64_t length) {
+            return reader->read(offset, length);
+        });
+    } catch (Error & e) {
+        printTaggedWarning(
+            "nar listing for %s on %s is bad (falling back to full nar download): %s",
+            store->printStorePath(storePath),
+            store->getUri(),
+            e.what()
+        );
+        co_return std::nullopt;
+    }
+} catch (...) {
+    co_return result::current_exception();
+}
+
 kj::Promise<Result<std::pair<ref<FSAccessor>, Path>>>
 RemoteFSAccessor::fetch(const Path & path_, bool requireValidPath)
 try {
@@ -73,20 +259,16 @@ try {
         try {
             listing = nix::readFile(makeCacheFile(storePath.hashPart(), "ls"));
 
-            auto narAccessor =
-                makeLazyNarAccessor(listing, [cacheFile](uint64_t offset, uint64_t length) {
-                    AutoCloseFD fd{sys::open(cacheFile, O_RDONLY | O_CLOEXEC)};
-                    if (!fd)
-                        throw SysError("opening NAR cache file '%s'", cacheFile);
-
-                    if (lseek(fd.get(), offset, SEEK_SET) != (off_t) offset)
-                        throw SysError("seeking in '%s'", cacheFile);
-
-                    std::string buf(length, 0);
-                    readFull(fd.get(), buf.data(), length);
-
-                    return buf;
-                });
+            auto narAccessor = makeLazyNarAccessor(
+                listing,
+                [cacheFile](uint64_t offset, uint64_t length) -> kj::Promise<Result<std::string>> {
+                    try {
+                        return {readFileRange(cacheFile, offset, length)};
+                    } catch (...) {
+                        return {result::current_exception()};
+                    }
+                }
+            );
 
             nars.emplace(storePath.hashPart(), narAccessor);
             co_return {narAccessor, restPath};
@@ -100,6 +282,11 @@ try {
         } catch (SysError &) { }
     }
 
+    if (auto narAccessor = TRY_AWAIT(makeRangeAccessor(storePath))) {
+        nars.emplace(storePath.hashPart(), *narAccessor);
+        co_return {*narAccessor, restPath};
+    }
+
     StringSink sink;
     TRY_AWAIT(TRY_AWAIT(store->narFromPath(storePath))->drainInto(sink));
     co_return {TRY_AWAIT(addToCache(storePath.hashPart(), std::move(sink.s))), restPath};
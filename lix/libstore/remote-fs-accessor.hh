@@ -24,6 +24,13 @@ class RemoteFSAccessor : public FSAccessor
 
     kj::Promise<Result<ref<FSAccessor>>> addToCache(std::string_view hashPart, std::string && nar);
 
+    /**
+     * Create an accessor that reads files from the NAR of `storePath` in a
+     * binary cache with range requests, using the NAR listing written by the
+     * cache. Returns `std::nullopt` if the NAR cannot be read in parts.
+     */
+    kj::Promise<Result<std::optional<ref<FSAccessor>>>> makeRangeAccessor(const StorePath & storePath);
+
 public:
 
     RemoteFSAccessor(ref<Store> store,
@@ -74,6 +74,16 @@ struct RemoteStore::Connection
      */
     std::optional<std::string> daemonNixVersion;
 
+    /**
+     * Compression the daemon agreed to use for NAR payloads, if any.
+     */
+    std::optional<TransportCompression> transportCompression;
+
+    /**
+     * Whether the daemon accepts `AddMultipleToStore` paths sent as deltas.
+     */
+    bool narDeltas = false;
+
     /**
      * Time this connection was established.
      */
@@ -4,6 +4,7 @@
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/box_ptr.hh"
+#include "lix/libutil/compression.hh"
 #include "lix/libutil/error.hh"
 #include "lix/libutil/file-descriptor.hh"
 #include "lix/libutil/result.hh"
@@ -12,6 +13,7 @@
 #include "lix/libutil/signals.hh"
 #include "lix/libstore/path-with-outputs.hh"
 #include "lix/libstore/gc-store.hh"
+#include "lix/libstore/nar-delta.hh"
 #include "lix/libstore/remote-fs-accessor.hh"
 #include "lix/libstore/build-result.hh"
 #include "lix/libstore/remote-store.hh"
@@ -76,7 +78,12 @@ try {
         {
             StringSink packet;
             packet << PROTOCOL_VERSION;
-            packet << 0;     // Obsolete CPU affinity.
+            // Obsolete CPU affinity, reused to offer transport features.
+            if (auto offer = transportOffer(); !offer.empty()) {
+                packet << 1 << offer.encode();
+            } else {
+                packet << 0;
+            }
             packet << false; // obsolete reserveSpace
             TRY_AWAIT(stream.writeFull(packet.s.data(), packet.s.size()));
         }
@@ -420,6 +427,8 @@ try {
     auto remoteVersion = TRY_AWAIT(getProtocol());
 
     auto conn(TRY_AWAIT(getConnection()));
+    auto compression = conn->transportCompression;
+    auto narDeltas = conn->narDeltas;
     TRY_AWAIT(conn.sendCommand(
         WorkerProto::Op::AddMultipleToStore,
         repair,
@@ -438,7 +447,31 @@ try {
                     TRY_AWAIT(send(WorkerProto::Serialise<ValidPathInfo>::write(
                         WorkerProto::WriteConn{*this, remoteVersion}, pathInfo
                     )));
-                    TRY_AWAIT(TRY_AWAIT(pathSource())->drainInto(stream));
+                    auto nar = TRY_AWAIT(pathSource());
+                    auto delta = dynamic_cast<NarDeltaStream *>(nar.get());
+                    if (narDeltas) {
+                        if (delta) {
+                            TRY_AWAIT(send(LIX_NAR_DELTA));
+                            TRY_AWAIT(send(printStorePath(delta->base)));
+                            TRY_AWAIT(send(delta->baseNarHash.to_string(HashFormat::Base32, true)));
+                        } else {
+                            TRY_AWAIT(send(LIX_NAR_FULL));
+                        }
+                    } else if (delta) {
+                        throw Error(
+                            "cannot send '%s' as a delta, the daemon does not support it",
+                            printStorePath(pathInfo.path)
+                        );
+                    }
+                    if (compression) {
+                        nar = makeFramedCompressionStream(
+                            compression->method,
+                            std::move(nar),
+                            compression->parallel,
+                            compression->level
+                        );
+                    }
+                    TRY_AWAIT(nar->drainInto(stream));
                 }
                 co_return result::success();
             } catch (...) {
@@ -722,6 +755,13 @@ try {
     co_return result::current_exception();
 }
 
+kj::Promise<Result<bool>> RemoteStore::acceptsNarDeltas()
+try {
+    co_return TRY_AWAIT(getConnection())->narDeltas;
+} catch (...) {
+    co_return result::current_exception();
+}
+
 kj::Promise<Result<box_ptr<AsyncInputStream>>>
 RemoteStore::narFromPath(const StorePath & path, const Activity * context)
 try {
@@ -745,8 +785,40 @@ try {
         }
     };
 
+    struct CompressedNarStream : AsyncInputStream
+    {
+        ConnectionHandle conn;
+        AsyncFdIoStream rawStream;
+        AsyncBufferedInputStream bufferedIn;
+        AsyncFramedDecompressionStream decompressed;
+        box_ptr<AsyncInputStream> narCopier;
+        CompressedNarStream(ConnectionHandle conn, const std::string & method)
+            : conn(std::move(conn))
+            , rawStream(AsyncFdIoStream::shared_fd{}, this->conn->getFD())
+            , bufferedIn(this->rawStream, this->conn->fromBuf)
+            , decompressed(method, bufferedIn)
+            , narCopier(copyNAR(decompressed))
+        {
+        }
+
+        kj::Promise<Result<std::optional<size_t>>> read(void * buffer, size_t size) override
+        try {
+            auto got = TRY_AWAIT(narCopier->read(buffer, size));
+            if (!got) {
+                // the nar ends before the frames do, consume the terminator
+                TRY_AWAIT(decompressed.finish());
+            }
+            co_return got;
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    };
+
     auto conn(TRY_AWAIT(getConnection()));
     TRY_AWAIT(conn.sendCommand(WorkerProto::Op::NarFromPath, printStorePath(path)));
+    if (auto compression = conn->transportCompression) {
+        co_return make_box_ptr<CompressedNarStream>(std::move(conn), compression->method);
+    }
     co_return make_box_ptr<NarStream>(std::move(conn));
 } catch (...) {
     co_return result::current_exception();
@@ -824,6 +896,16 @@ try {
                 continue;
             }
             ACTIVITY_RESULT(*act, type, fields);
+        } else if (msg == STDERR_LIX_TRANSPORT_COMPRESSION) {
+            auto accepted = TransportOffer::decode(TRY_AWAIT(readNum<uint32_t>(from)));
+            if (!accepted) {
+                throw Error("Nix daemon acknowledged unknown transport features");
+            }
+            transportCompression = accepted->compression;
+            narDeltas = accepted->narDeltas;
+            if (transportCompression) {
+                debug("the daemon accepted %s transport compression", transportCompression->method);
+            }
         } else if (msg == STDERR_LAST) {
             break;
         } else {
@@ -9,6 +9,7 @@
 #include "lix/libstore/store-api.hh"
 #include "lix/libstore/gc-store.hh"
 #include "lix/libstore/log-store.hh"
+#include "lix/libstore/transport-compression.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/types.hh"
 
@@ -25,6 +26,15 @@ template<typename T> class Pool;
 struct RemoteStoreConfig : virtual StoreConfig
 {
     using StoreConfig::StoreConfig;
+
+    const Setting<bool> narDeltas{this, false, "nar-deltas",
+        R"(
+          Whether to send store paths copied to this store as binary deltas
+          against similar paths (same name, closest version) the remote store
+          already has, if the remote side supports it. This saves bandwidth
+          when copying updated versions of paths, at the cost of reading and
+          indexing the NAR of the base path locally.
+        )"};
 };
 
 /**
@@ -180,6 +190,8 @@ public:
 
     kj::Promise<Result<std::optional<TrustedFlag>>> isTrustedClient() override;
 
+    kj::Promise<Result<bool>> acceptsNarDeltas() override;
+
     struct Connection;
 
 protected:
@@ -191,6 +203,15 @@ protected:
 
     virtual kj::Promise<Result<void>> setOptions(Connection & conn);
 
+    /**
+     * Transport features to offer to the daemon during the handshake. The
+     * daemon may decline, see `STDERR_LIX_TRANSPORT_COMPRESSION`.
+     */
+    virtual TransportOffer transportOffer()
+    {
+        return {.narDeltas = config().narDeltas};
+    }
+
     kj::Promise<Result<void>> setOptions() override;
 
     kj::Promise<Result<ConnectionHandle>> getConnection();
@@ -18,6 +18,25 @@ namespace nix {
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
+/**
+ * Transport compression for the serve protocol. Servers that support it
+ * always set this flag in the version they send; it is outside of the major
+ * and minor fields, so older clients ignore it. Clients that want compression
+ * set the flag in the version they send back and follow it with an encoded
+ * `TransportCompression`, which the server accepts. The NAR payloads of
+ * `DumpStorePath` and `AddToStoreNar` then use framed compression.
+ */
+#define SERVE_TRANSPORT_COMPRESSION_FLAG (1 << 16)
+
+/**
+ * Bulk path info queries, negotiated like transport compression. Servers that
+ * support the `QueryClosurePathInfos` and `QueryValidPathInfos` commands
+ * always set this flag in the version they send, and clients that want to use
+ * the commands set the flag in the version they send back. Neither command may
+ * be sent unless both versions carried the flag.
+ */
+#define SERVE_BULK_QUERIES_FLAG (1 << 17)
+
 
 class Store;
 struct Source;
@@ -120,6 +139,18 @@ enum struct ServeProto::Command : uint64_t
     QueryClosure = 7,
     BuildDerivation = 8,
     AddToStoreNar = 9,
+    /**
+     * Like `QueryClosure`, but replies with the info of every path in the
+     * closure in the same format as `QueryPathInfos`. Only available with
+     * `SERVE_BULK_QUERIES_FLAG`.
+     */
+    QueryClosurePathInfos = 10,
+    /**
+     * Like `QueryValidPaths`, but replies with the info of every valid
+     * path in the same format as `QueryPathInfos`. Only available with
+     * `SERVE_BULK_QUERIES_FLAG`.
+     */
+    QueryValidPathInfos = 11,
 };
 
 /**
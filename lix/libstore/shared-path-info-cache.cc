@@ -0,0 +1,416 @@
+#include "lix/libstore/shared-path-info-cache.hh"
+#include "lix/libstore/content-address.hh"
+#include "lix/libutil/c-calls.hh"
+#include "lix/libutil/error.hh"
+#include "lix/libutil/file-descriptor.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/serialise.hh"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if __APPLE__
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#endif
+
+namespace nix {
+
+/* Bump this whenever the layout or the encoding of entries changes. */
+static constexpr uint64_t cacheMagic = 0x3230434950584c4eULL; // "NLXPIC02"
+
+/* How often writers try to lock a slot before they give up and flush the
+   whole cache. This only happens if a process died while writing a slot or
+   was descheduled for a very long time. */
+static constexpr unsigned maxLockAttempts = 10000;
+
+struct SharedPathInfoCache::Header
+{
+    std::atomic<uint64_t> magic;
+    std::atomic<uint64_t> slots;
+
+    /**
+     * Bumped by every invalidation.
+     */
+    std::atomic<uint64_t> generation;
+
+    /**
+     * Bumped to invalidate all entries at once.
+     */
+    std::atomic<uint64_t> epoch;
+
+    /**
+     * The boot the entries of the current epoch were cached in.
+     */
+    std::atomic<uint64_t> boot;
+};
+
+struct SharedPathInfoCache::Slot
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> epoch;
+    std::atomic<uint64_t> key[StorePath::HASH_PART_LEN / 8];
+
+    /**
+     * Size of the entry in bytes, 0 if the slot is empty.
+     */
+    std::atomic<uint64_t> size;
+
+    std::atomic<uint64_t> data[(slotSize - (StorePath::HASH_PART_LEN + 3 * 8)) / 8];
+
+    static constexpr size_t maxSize = sizeof(data);
+};
+
+static_assert(sizeof(SharedPathInfoCache::Slot) == SharedPathInfoCache::slotSize);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+/* FNV-1a, which unlike std::hash is the same in every build. */
+static uint64_t fnv1a(std::string_view s)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : s) {
+        hash = (hash ^ uint8_t(c)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Identifies the current boot of the machine, or 0 if it cannot be told. */
+static uint64_t currentBoot()
+{
+#if __linux__
+    try {
+        return fnv1a(readFile("/proc/sys/kernel/random/boot_id"));
+    } catch (SysError &) {
+    }
+#elif __APPLE__
+    struct timeval bootTime;
+    size_t size = sizeof(bootTime);
+    if (sysctlbyname("kern.boottime", &bootTime, &size, nullptr, 0) == 0) {
+        return uint64_t(bootTime.tv_sec) * 1000000 + bootTime.tv_usec;
+    }
+#endif
+    return 0;
+}
+
+using Key = std::array<uint64_t, StorePath::HASH_PART_LEN / 8>;
+
+static Key makeKey(std::string_view hashPart)
+{
+    assert(hashPart.size() == StorePath::HASH_PART_LEN);
+    Key key;
+    memcpy(key.data(), hashPart.data(), sizeof(key));
+    return key;
+}
+
+static bool hasKey(const SharedPathInfoCache::Slot & slot, const Key & key)
+{
+    for (size_t i = 0; i < key.size(); i++) {
+        if (slot.key[i].load(std::memory_order_relaxed) != key[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool tryLock(SharedPathInfoCache::Slot & slot, uint64_t & seq)
+{
+    seq = slot.seq.load(std::memory_order_relaxed);
+    if (seq & 1 || !slot.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) {
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+static void unlock(SharedPathInfoCache::Slot & slot, uint64_t seq)
+{
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+std::shared_ptr<SharedPathInfoCache>
+SharedPathInfoCache::open(const Path & path, bool create, size_t slots)
+{
+    AutoCloseFD fd{sys::open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600)};
+    if (!fd) {
+        if (errno == ENOENT && !create) {
+            return nullptr;
+        }
+        throw SysError("opening '%s'", path);
+    }
+
+    struct stat st;
+    if (fstat(fd.get(), &st)) {
+        throw SysError("getting status of '%s'", path);
+    }
+
+    /* Zeroes are a valid empty table, so creating the table only needs to
+       size the file. Concurrent creators agree on the size. */
+    if (st.st_size == 0) {
+        if (!create) {
+            return nullptr;
+        }
+        st.st_size = (slots + 1) * slotSize;
+        if (ftruncate(fd.get(), st.st_size)) {
+            throw SysError("resizing '%s'", path);
+        }
+    }
+
+    if (st.st_size % slotSize || size_t(st.st_size) < 2 * slotSize) {
+        throw Error("'%s' has an unexpected size", path);
+    }
+    slots = st.st_size / slotSize - 1;
+
+    auto mapped = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+    if (mapped == MAP_FAILED) {
+        throw SysError("mapping '%s'", path);
+    }
+
+    std::shared_ptr<SharedPathInfoCache> cache{new SharedPathInfoCache(slots, mapped)};
+
+    auto & header = cache->header();
+    uint64_t magic = 0;
+    if (header.magic.load() == 0 && create) {
+        header.slots = slots;
+        header.magic.compare_exchange_strong(magic, cacheMagic);
+    }
+    magic = header.magic.load();
+    if (magic == 0) {
+        return nullptr;
+    }
+    if (magic != cacheMagic || header.slots.load() != slots) {
+        throw Error("'%s' is not a path info cache of this version of Lix", path);
+    }
+
+    /* The database may have been changed by something that does not know
+       about the cache while the machine was down, for example by restoring
+       a backup, so nothing cached before a reboot is trusted. The epoch is
+       bumped first so that nobody can see the new boot with old entries. */
+    if (auto boot = currentBoot(); header.boot.load() != boot) {
+        cache->clear();
+        header.boot = boot;
+    }
+
+    return cache;
+}
+
+SharedPathInfoCache::SharedPathInfoCache(size_t slots, void * mapped)
+    : slots(slots)
+    , mappedSize((slots + 1) * slotSize)
+    , mapped(mapped)
+{
+}
+
+SharedPathInfoCache::~SharedPathInfoCache()
+{
+    munmap(mapped, mappedSize);
+}
+
+SharedPathInfoCache::Header & SharedPathInfoCache::header()
+{
+    return *static_cast<Header *>(mapped);
+}
+
+SharedPathInfoCache::Slot & SharedPathInfoCache::slot(std::string_view hashPart, size_t probe)
+{
+    auto hash = fnv1a(hashPart);
+    auto table = reinterpret_cast<Slot *>(static_cast<char *>(mapped) + slotSize);
+    return table[(hash + probe) % slots];
+}
+
+uint64_t SharedPathInfoCache::generation()
+{
+    return header().generation.load();
+}
+
+std::optional<std::string> SharedPathInfoCache::find(std::string_view hashPart)
+{
+    auto key = makeKey(hashPart);
+    auto epoch = header().epoch.load();
+
+    for (size_t i = 0; i < probeLength; i++) {
+        auto & slot = this->slot(hashPart, i);
+
+        auto seq = slot.seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+        auto size = slot.size.load(std::memory_order_relaxed);
+        if (size == 0 || size > Slot::maxSize || slot.epoch.load(std::memory_order_relaxed) != epoch
+            || !hasKey(slot, key))
+        {
+            continue;
+        }
+
+        std::string data((size + 7) / 8 * 8, 0);
+        for (size_t word = 0; word < data.size() / 8; word++) {
+            auto value = slot.data[word].load(std::memory_order_relaxed);
+            memcpy(data.data() + word * 8, &value, 8);
+        }
+        data.resize(size);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == seq) {
+            return data;
+        }
+    }
+
+    return std::nullopt;
+}
+
+void SharedPathInfoCache::insertData(
+    std::string_view hashPart, std::string_view data, uint64_t generation
+)
+{
+    if (data.size() > Slot::maxSize) {
+        return;
+    }
+
+    auto key = makeKey(hashPart);
+    auto & header = this->header();
+
+    /* Prefer the slot that already has this path, then an empty one, and
+       otherwise evict one that changes with the generation. Slots from an
+       earlier epoch count as empty, since `clear()` only bumps the epoch. */
+    auto currentEpoch = header.epoch.load(std::memory_order_relaxed);
+    std::optional<size_t> target;
+    for (size_t i = 0; i < probeLength && !target; i++) {
+        if (hasKey(slot(hashPart, i), key)) {
+            target = i;
+        }
+    }
+    for (size_t i = 0; i < probeLength && !target; i++) {
+        auto & candidate = slot(hashPart, i);
+        if (candidate.size.load(std::memory_order_relaxed) == 0
+            || candidate.epoch.load(std::memory_order_relaxed) != currentEpoch)
+        {
+            target = i;
+        }
+    }
+    auto & slot = this->slot(hashPart, target.value_or(generation % probeLength));
+
+    uint64_t seq;
+    if (!tryLock(slot, seq)) {
+        return;
+    }
+
+    /* The epoch must be read before the generation is checked, so that a
+       flush that follows an invalidation we raced with cannot be missed. */
+    auto epoch = header.epoch.load();
+    if (header.generation.load() == generation) {
+        for (size_t i = 0; i < key.size(); i++) {
+            slot.key[i].store(key[i], std::memory_order_relaxed);
+        }
+        slot.epoch.store(epoch, std::memory_order_relaxed);
+        slot.size.store(data.size(), std::memory_order_relaxed);
+        for (size_t word = 0; word * 8 < data.size(); word++) {
+            uint64_t value = 0;
+            memcpy(&value, data.data() + word * 8, std::min<size_t>(8, data.size() - word * 8));
+            slot.data[word].store(value, std::memory_order_relaxed);
+        }
+    }
+
+    unlock(slot, seq);
+}
+
+void SharedPathInfoCache::clear()
+{
+    header().epoch++;
+}
+
+void SharedPathInfoCache::invalidate(const StorePathSet & paths)
+{
+    if (paths.empty()) {
+        return;
+    }
+
+    auto & header = this->header();
+    header.generation++;
+
+    for (auto & path : paths) {
+        auto key = makeKey(path.hashPart());
+
+        for (size_t i = 0; i < probeLength; i++) {
+            auto & slot = this->slot(path.hashPart(), i);
+
+            /* The slot must be locked even if it does not have the key yet,
+               since an insert that started before the generation was bumped
+               may be writing it right now. */
+            uint64_t seq;
+            unsigned attempts = 0;
+            while (!tryLock(slot, seq)) {
+                if (++attempts == maxLockAttempts) {
+                    debug("flushing the shared path info cache, a slot stayed locked");
+                    clear();
+                    return;
+                }
+                sched_yield();
+            }
+            if (hasKey(slot, key)) {
+                slot.size.store(0, std::memory_order_relaxed);
+            }
+            unlock(slot, seq);
+        }
+    }
+}
+
+std::optional<std::shared_ptr<const ValidPathInfo>>
+SharedPathInfoCache::lookup(const StorePath & path)
+{
+    auto data = find(path.hashPart());
+    if (!data) {
+        return std::nullopt;
+    }
+
+    try {
+        StringSource source{*data};
+        if (readString(source) != path.to_string()) {
+            return std::nullopt;
+        }
+        if (!readBool(source)) {
+            return nullptr;
+        }
+
+        auto info = std::make_shared<ValidPathInfo>(path, Hash::parseAnyPrefixed(readString(source)));
+        info->id = readNum<uint64_t>(source);
+        if (auto deriver = readString(source); !deriver.empty()) {
+            info->deriver = StorePath(deriver);
+        }
+        info->narSize = readNum<uint64_t>(source);
+        info->registrationTime = readNum<uint64_t>(source);
+        info->ultimate = readBool(source);
+        info->sigs = readStrings<StringSet>(source);
+        info->ca = ContentAddress::parseOpt(readString(source));
+        for (auto & reference : readStrings<Strings>(source)) {
+            info->references.insert(StorePath(reference));
+        }
+        return info;
+    } catch (Error & e) {
+        debug("ignoring broken shared path info cache entry for '%s': %s", path.to_string(), e.what());
+        return std::nullopt;
+    }
+}
+
+void SharedPathInfoCache::insert(
+    const StorePath & path, const std::shared_ptr<const ValidPathInfo> & info, uint64_t generation
+)
+{
+    StringSink sink;
+    sink << path.to_string() << uint64_t(info != nullptr);
+    if (info) {
+        Strings references;
+        for (auto & reference : info->references) {
+            references.emplace_back(reference.to_string());
+        }
+        sink << info->narHash.to_string(HashFormat::Base32, true) << info->id
+             << (info->deriver ? info->deriver->to_string() : "") << info->narSize
+             << uint64_t(info->registrationTime) << uint64_t(info->ultimate) << info->sigs
+             << renderContentAddress(info->ca) << references;
+    }
+    insertData(path.hashPart(), sink.s, generation);
+}
+
+}
@@ -0,0 +1,103 @@
+#pragma once
+///@file
+
+#include "lix/libstore/path-info.hh"
+#include "lix/libutil/types.hh"
+
+#include <atomic>
+#include <kj/common.h>
+#include <memory>
+#include <optional>
+
+namespace nix {
+
+/**
+ * A path info cache shared by all processes that use the same local store,
+ * such as the workers of a daemon. It is a fixed-size table in a memory
+ * mapped file, keyed by the hash part of store paths. Both valid and invalid
+ * paths are cached; entries that do not fit into a slot are not cached.
+ *
+ * Readers never take locks. Every slot is protected by a sequence number that
+ * is odd while the slot is written, and readers retry their lookup in the
+ * database if a slot changed while they read it.
+ *
+ * Processes that change the validity or the path info of paths must call
+ * `invalidate()` both before they start and after they committed their
+ * change. `invalidate()` bumps a generation counter, and `insert()` only
+ * inserts an entry if the generation did not change since the caller took its
+ * `generation()` snapshot, so that info read from the database before a change
+ * cannot be inserted after the change was invalidated.
+ *
+ * Entries cached before the last reboot are never used.
+ */
+class SharedPathInfoCache
+{
+public:
+    static constexpr size_t slotSize = 1024;
+    static constexpr size_t defaultSlots = 16384;
+
+    /**
+     * How many slots the entry of a path may be stored in.
+     */
+    static constexpr size_t probeLength = 8;
+
+    /**
+     * Layout of the mapped file: a header followed by the slots.
+     */
+    struct Header;
+    struct Slot;
+
+private:
+    size_t slots;
+    size_t mappedSize;
+    void * mapped;
+
+    SharedPathInfoCache(size_t slots, void * mapped);
+
+    Header & header();
+    Slot & slot(std::string_view hashPart, size_t probe);
+
+    std::optional<std::string> find(std::string_view hashPart);
+    void insertData(std::string_view hashPart, std::string_view data, uint64_t generation);
+
+public:
+    /**
+     * Open the cache at `path`. Returns `nullptr` if the file does not exist
+     * (yet) and `create` is false.
+     */
+    static std::shared_ptr<SharedPathInfoCache>
+    open(const Path & path, bool create, size_t slots = defaultSlots);
+
+    ~SharedPathInfoCache();
+
+    KJ_DISALLOW_COPY_AND_MOVE(SharedPathInfoCache);
+
+    /**
+     * The current generation. Take this before reading the info that is
+     * passed to `insert()` from the database.
+     */
+    uint64_t generation();
+
+    /**
+     * `std::nullopt` if `path` is not cached, `nullptr` if it is cached as
+     * invalid.
+     */
+    std::optional<std::shared_ptr<const ValidPathInfo>> lookup(const StorePath & path);
+
+    /**
+     * Cache the info of `path`, or `nullptr` if it is invalid. Does nothing
+     * if any path was invalidated since `generation` was taken.
+     */
+    void insert(
+        const StorePath & path, const std::shared_ptr<const ValidPathInfo> & info, uint64_t generation
+    );
+
+    void invalidate(const StorePathSet & paths);
+
+    /**
+     * Invalidate all entries.
+     */
+    void clear();
+};
+
+}
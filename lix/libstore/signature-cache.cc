@@ -0,0 +1,156 @@
+#include "lix/libstore/signature-cache.hh"
+#include "lix/libstore/globals.hh"
+#include "lix/libutil/c-calls.hh"
+#include "lix/libutil/file-descriptor.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/hash.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/serialise.hh"
+#include "lix/libutil/users.hh"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists VerifiedSignatures (
+    key       text primary key not null,
+    timestamp integer not null
+) without rowid;
+
+create table if not exists LastPurge (
+    dummy text primary key,
+    value integer
+);
+
+)sql";
+
+/* Verifications are forgotten after a while, so that the cache does not
+   grow forever. Forgotten signatures are simply verified again. */
+static constexpr time_t verifiedTTL = 30 * 24 * 3600;
+static constexpr time_t purgeInterval = 24 * 3600;
+
+SignatureCache::SignatureCache(const Path & dbPath)
+{
+    auto state(_state.lock());
+
+    auto dir = dirOf(dbPath);
+    createDirs(dir);
+
+    /* Anyone who can write to the cache can make us accept forged
+       signatures, which matters for example when running as root with the
+       `HOME` of another user. */
+    auto st = lstat(dir);
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+        throw Error("'%s' is not owned by the current user or writable by others", dir);
+
+    /* The same goes for the database itself, which we create first so
+       that SQLite does not create it according to the umask. */
+    AutoCloseFD fd{sys::open(dbPath, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)};
+    if (!fd) throw SysError("opening '%s'", dbPath);
+    if (fstat(fd.get(), &st) == -1) throw SysError("statting '%s'", dbPath);
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+        throw Error("'%s' is not owned by the current user or writable by others", dbPath);
+
+    state->db = SQLite(dbPath);
+
+    state->db.isCache();
+
+    state->db.exec(schema, always_progresses);
+
+    state->queryVerified = state->db.create("select 1 from VerifiedSignatures where key = ?");
+
+    state->insertVerified = state->db.create(
+        "insert or replace into VerifiedSignatures(key, timestamp) values (?, ?)"
+    );
+
+    retrySQLite([&]() {
+        auto now = time(0);
+
+        SQLiteStmt queryLastPurge = state->db.create("select value from LastPurge");
+        auto queryLastPurge_(queryLastPurge.use());
+
+        if (!queryLastPurge_.next() || queryLastPurge_.getInt(0) < now - purgeInterval) {
+            state->db.create("delete from VerifiedSignatures where timestamp < ?")
+                .use()(now - verifiedTTL)
+                .exec();
+
+            debug(
+                "deleted %d entries from the verified signature cache", state->db.getRowsChanged()
+            );
+
+            state->db.create("insert or replace into LastPurge(dummy, value) values ('', ?)")
+                .use()(now)
+                .exec();
+        }
+    }, always_progresses);
+}
+
+std::string
+SignatureCache::key(std::string_view publicKey, std::string_view sig, std::string_view data)
+{
+    HashSink sink(HashType::SHA256);
+    for (auto part : {publicKey, sig, data}) {
+        sink << uint64_t(part.size());
+        sink(part);
+    }
+    return sink.finish().first.to_string(HashFormat::Base32, false);
+}
+
+std::vector<bool> SignatureCache::isVerified(const std::vector<std::string> & keys)
+{
+    std::vector<bool> verified(keys.size(), false);
+    try {
+        auto state(_state.lock());
+        SQLiteTxn txn = state->db.beginTransaction();
+        for (size_t i = 0; i < keys.size(); i++) {
+            verified[i] = state->queryVerified.use()(keys[i]).next();
+        }
+        txn.commit();
+    } catch (SQLiteError & e) {
+        debug("could not query the verified signature cache: %s", e.what());
+    }
+    return verified;
+}
+
+void SignatureCache::markVerified(const std::vector<std::string> & keys)
+{
+    if (keys.empty()) {
+        return;
+    }
+    try {
+        auto state(_state.lock());
+        auto now = time(0);
+        SQLiteTxn txn = state->db.beginTransaction();
+        for (auto & key : keys) {
+            state->insertVerified.use()(key)(now).exec();
+        }
+        txn.commit();
+    } catch (SQLiteError & e) {
+        debug("could not update the verified signature cache: %s", e.what());
+    }
+}
+
+std::shared_ptr<SignatureCache> getSignatureCache()
+{
+    if (!settings.verifiedSignatureCache) {
+        return nullptr;
+    }
+
+    static std::shared_ptr<SignatureCache> cache = []() -> std::shared_ptr<SignatureCache> {
+        try {
+            return std::make_shared<SignatureCache>(
+                getCacheDir() + "/nix/verified-signatures.sqlite"
+            );
+        } catch (Error & e) {
+            debug("not using the verified signature cache: %s", e.what());
+            return nullptr;
+        }
+    }();
+    return cache;
+}
+
+}
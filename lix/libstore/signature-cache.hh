@@ -0,0 +1,60 @@
+#pragma once
+///@file
+
+#include "lix/libstore/sqlite.hh"
+#include "lix/libutil/sync.hh"
+#include "lix/libutil/types.hh"
+
+#include <memory>
+#include <vector>
+
+namespace nix {
+
+/**
+ * Signatures that were verified before, so that paths copied or substituted
+ * again do not need to be verified again. Entries are keyed by a hash of the
+ * public key, the signature and the signed data, and only successful
+ * verifications are stored.
+ *
+ * Since entries in this cache are trusted, the cache is only used if its
+ * directory belongs to the current user and nobody else can write to it.
+ * Errors while reading or updating the cache are logged and otherwise
+ * ignored.
+ */
+class SignatureCache
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt queryVerified, insertVerified;
+    };
+
+    Sync<State> _state;
+
+public:
+    explicit SignatureCache(const Path & dbPath);
+
+    /**
+     * Make the key of a signature `sig` over `data` made with `publicKey`,
+     * which is the printed form of the key.
+     */
+    static std::string key(std::string_view publicKey, std::string_view sig, std::string_view data);
+
+    /**
+     * Which of `keys` were verified before.
+     */
+    std::vector<bool> isVerified(const std::vector<std::string> & keys);
+
+    /**
+     * Remember that the signatures of `keys` were verified.
+     */
+    void markVerified(const std::vector<std::string> & keys);
+};
+
+/**
+ * The signature cache of the current user, or `nullptr` if it is disabled or
+ * could not be opened.
+ */
+std::shared_ptr<SignatureCache> getSignatureCache();
+
+}
@@ -156,6 +156,13 @@ protected:
         */
         return {result::success()};
     };
+
+    TransportOffer transportOffer() override
+    {
+        auto offer = RemoteStore::transportOffer();
+        offer.compression = TransportCompression::fromConfig(config_);
+        return offer;
+    }
 };
 
 kj::Promise<Result<void>> SSHStore::init()
@@ -22,6 +22,24 @@ struct CommonSSHStoreConfig : virtual StoreConfig
     const Setting<bool> compress{this, false, "compress",
         "Whether to enable SSH compression."};
 
+    const Setting<std::string> transportCompression{this, "none", "transport-compression",
+        R"(
+          Compression applied by the store protocol to store path contents
+          sent over this connection (`zstd` or `none`). Unlike `compress`
+          this only compresses NARs, and only if the remote side supports
+          it; older remotes transparently fall back to uncompressed transfers.
+        )"};
+
+    const Setting<int> transportCompressionLevel{this, 3, "transport-compression-level",
+        R"(
+          The compression level used with `transport-compression`. `-1`
+          selects the default level of the compression method, which favours
+          compression ratio over speed.
+        )"};
+
+    const Setting<bool> parallelTransportCompression{this, false, "parallel-transport-compression",
+        "Whether the sender of store path contents compresses the 1 MiB frames of `transport-compression` on multiple threads."};
+
     const Setting<std::string> remoteStore{this, "", "remote-store",
         R"(
           [Store URL](@docroot@/command-ref/new-cli/nix3-help-stores.md#store-url-format)
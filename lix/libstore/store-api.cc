@@ -2,11 +2,13 @@
 #include "lix/libstore/globals.hh"
 #include "lix/libstore/derivations.hh"
 #include "lix/libstore/store-api.hh"
+#include "lix/libstore/nar-delta.hh"
 #include "lix/libstore/nar-info-disk-cache.hh"
 #include "lix/libutil/async-collect.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/async-semaphore.hh"
 #include "lix/libutil/async.hh"
+#include "lix/libutil/binary-delta.hh"
 #include "lix/libutil/box_ptr.hh"
 #include "lix/libutil/c-calls.hh"
 #include "lix/libutil/hash.hh"
@@ -28,11 +30,14 @@
 #include "lix/libutil/users.hh"
 
 #include <algorithm>
+#include <bit>
 #include <functional>
 #include <kj/async.h>
 #include <memory>
 #include <mutex>
+#include <ranges>
 #include <regex>
+#include <unordered_map>
 
 namespace nix {
 
@@ -338,6 +343,15 @@ try {
 
 #define SHOW_PROGRESS() ACTIVITY_PROGRESS(act, nrDone, pathsToCopy.size(), nrRunning, nrFailed)
 
+    if (checkSigs) {
+        auto valid = TRY_AWAIT(queryValidPaths(storePathsToAdd));
+        std::vector<const ValidPathInfo *> infos;
+        for (auto & [info, _] : pathsToCopy)
+            if (!valid.contains(info.path))
+                infos.push_back(&info);
+        prepareTrustChecks(infos);
+    }
+
     TRY_AWAIT(processGraphAsync<StorePath>(
         storePathsToAdd,
 
@@ -874,6 +888,17 @@ try {
 
     JSON::array_t jsonList = JSON::array();
 
+    std::map<StorePath, ClosureSize> closureSizes;
+    if (showClosureSize) {
+        StorePathSet validPaths;
+        for (auto & storePath : storePaths) {
+            if (TRY_AWAIT(isValidPath(storePath))) {
+                validPaths.insert(storePath);
+            }
+        }
+        closureSizes = TRY_AWAIT(getClosureSizes(validPaths));
+    }
+
     for (auto & storePath : storePaths) {
         auto& jsonPath = jsonList.emplace_back(JSON::object());
 
@@ -882,11 +907,11 @@ try {
 
             jsonPath = basicPathInfoToJSON(*this, *info, hashFormat == HashFormat::SRI);
 
-            std::pair<uint64_t, uint64_t> closureSizes;
+            ClosureSize closureSize;
 
             if (showClosureSize) {
-                closureSizes = TRY_AWAIT(getClosureSize(info->path));
-                jsonPath["closureSize"] = closureSizes.first;
+                closureSize = closureSizes.at(info->path);
+                jsonPath["closureSize"] = closureSize.narSize;
             }
 
             if (includeImpureInfo) {
@@ -900,6 +925,10 @@ try {
                 if (info->ultimate)
                     jsonPath["ultimate"] = info->ultimate;
 
+                // depends on the other queried paths, so it is not pure
+                if (showClosureSize)
+                    jsonPath["uniqueClosureSize"] = closureSize.uniqueSize;
+
                 if (!info->sigs.empty()) {
                     for (auto & sig : info->sigs)
                         jsonPath["signatures"].push_back(sig);
@@ -916,7 +945,7 @@ try {
                     if (narInfo->fileSize)
                         jsonPath["downloadSize"] = narInfo->fileSize;
                     if (showClosureSize)
-                        jsonPath["closureDownloadSize"] = closureSizes.second;
+                        jsonPath["closureDownloadSize"] = closureSize.downloadSize;
                 }
             }
 
@@ -931,21 +960,163 @@ try {
 }
 
 
-kj::Promise<Result<std::pair<uint64_t, uint64_t>>>
-Store::getClosureSize(const StorePath & storePath)
+kj::Promise<Result<std::map<StorePath, ClosureSize>>>
+Store::getClosureSizes(const StorePathSet & storePaths)
 try {
-    uint64_t totalNarSize = 0, totalDownloadSize = 0;
     StorePathSet closure;
-    TRY_AWAIT(computeFSClosure(storePath, closure, false, false));
-    for (auto & p : closure) {
-        auto info = TRY_AWAIT(queryPathInfo(p));
-        totalNarSize += info->narSize;
-        auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-            std::shared_ptr<const ValidPathInfo>(info));
-        if (narInfo)
-            totalDownloadSize += narInfo->fileSize;
+    TRY_AWAIT(computeFSClosure(storePaths, closure));
+
+    /* Load the reference graph once. Node 0 is a virtual root that refers
+       to the queried paths that no other path refers to, which makes it the
+       root of the dominator tree used for unique sizes. */
+    struct Node
+    {
+        uint64_t narSize = 0, downloadSize = 0;
+        std::vector<uint32_t> references;
+    };
+
+    std::vector<Node> nodes(closure.size() + 1);
+    std::unordered_map<StorePath, uint32_t> indices;
+    std::vector<const StorePath *> paths{nullptr};
+    for (auto & path : closure) {
+        indices.emplace(path, paths.size());
+        paths.push_back(&path);
+    }
+
+    for (auto & [path, index] : indices) {
+        auto info = TRY_AWAIT(queryPathInfo(path));
+        auto & node = nodes[index];
+        node.narSize = info->narSize;
+        if (auto narInfo = info.try_cast_shared<const NarInfo>()) {
+            node.downloadSize = narInfo->fileSize;
+        }
+        for (auto & ref : info->references) {
+            if (ref != path) {
+                node.references.push_back(indices.at(ref));
+            }
+        }
+    }
+
+    std::vector<bool> referenced(nodes.size(), false);
+    for (auto & node : nodes) {
+        for (auto ref : node.references) {
+            referenced[ref] = true;
+        }
+    }
+    for (uint32_t node = 1; node < nodes.size(); node++) {
+        if (!referenced[node]) {
+            nodes[0].references.push_back(node);
+        }
+    }
+
+    std::vector<uint32_t> roots;
+    for (auto & path : storePaths) {
+        roots.push_back(indices.at(path));
+    }
+
+    /* Sort the graph topologically, so that every path comes after all
+       paths that refer to it. */
+    std::vector<uint32_t> order, position(nodes.size());
+    {
+        enum : uint8_t { unvisited, visiting, visited };
+        std::vector<uint8_t> state(nodes.size(), unvisited);
+        std::vector<std::pair<uint32_t, size_t>> stack{{0, 0}};
+        state[0] = visiting;
+        while (!stack.empty()) {
+            auto & [node, next] = stack.back();
+            if (next < nodes[node].references.size()) {
+                auto ref = nodes[node].references[next++];
+                if (state[ref] == visiting) {
+                    throw BuildError(
+                        "cycle detected in the references of '%s' from '%s'",
+                        printStorePath(*paths[ref]),
+                        printStorePath(*paths[node])
+                    );
+                } else if (state[ref] == unvisited) {
+                    state[ref] = visiting;
+                    stack.emplace_back(ref, 0);
+                }
+            } else {
+                state[node] = visited;
+                order.push_back(node);
+                stack.pop_back();
+            }
+        }
+        std::reverse(order.begin(), order.end());
+        for (auto [i, node] : enumerate(order)) {
+            position[node] = i;
+        }
     }
-    co_return {totalNarSize, totalDownloadSize};
+
+    std::map<StorePath, ClosureSize> closureSizes;
+
+    /* Closure sizes, 64 queried paths at a time: every path gets a bit set
+       for each of the queried paths whose closure it is in. */
+    std::vector<uint64_t> masks(nodes.size());
+    for (size_t first = 0; first < roots.size(); first += 64) {
+        const size_t count = std::min<size_t>(64, roots.size() - first);
+        std::fill(masks.begin(), masks.end(), 0);
+        for (size_t i = 0; i < count; i++) {
+            masks[roots[first + i]] |= uint64_t(1) << i;
+        }
+
+        for (auto node : order) {
+            for (auto ref : nodes[node].references) {
+                masks[ref] |= masks[node];
+            }
+        }
+
+        std::vector<ClosureSize> sizes(count);
+        for (size_t node = 1; node < nodes.size(); node++) {
+            for (auto mask = masks[node]; mask; mask &= mask - 1) {
+                auto & size = sizes[std::countr_zero(mask)];
+                size.narSize += nodes[node].narSize;
+                size.downloadSize += nodes[node].downloadSize;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            closureSizes.emplace(*paths[roots[first + i]], sizes[i]);
+        }
+    }
+
+    /* Unique sizes are the sizes of the subtrees of the dominator tree.
+       In a DAG, the immediate dominator of a path is the nearest common
+       dominator of the paths that refer to it, and those are final once
+       the path is reached in topological order. */
+    std::vector<uint32_t> idom(nodes.size(), 0);
+    std::vector<bool> seen(nodes.size(), false);
+    auto intersect = [&](uint32_t a, uint32_t b) {
+        while (a != b) {
+            while (position[a] > position[b]) {
+                a = idom[a];
+            }
+            while (position[b] > position[a]) {
+                b = idom[b];
+            }
+        }
+        return a;
+    };
+    for (auto node : order) {
+        for (auto ref : nodes[node].references) {
+            idom[ref] = seen[ref] ? intersect(idom[ref], node) : node;
+            seen[ref] = true;
+        }
+    }
+
+    std::vector<uint64_t> unique(nodes.size());
+    for (auto node : order | std::views::reverse) {
+        unique[node] += nodes[node].narSize;
+        if (node != 0) {
+            unique[idom[node]] += unique[node];
+        }
+    }
+
+    for (auto root : roots) {
+        closureSizes.at(*paths[root]).uniqueSize = unique[root];
+    }
+
+    co_return closureSizes;
 } catch (...) {
     co_return result::current_exception();
 }
@@ -1126,6 +1297,11 @@ try {
     for (auto & path : storePaths)
         pathsMap.insert_or_assign(path, path);
 
+    std::map<StorePath, StorePath> deltaBases;
+    if (!missing.empty() && TRY_AWAIT(dstStore.acceptsNarDeltas())) {
+        deltaBases = TRY_AWAIT(chooseNarDeltaBases(srcStore, dstStore, missing));
+    }
+
     Store::PathsSource pathsToCopy;
     std::shared_ptr<AsyncSemaphore> pathCopyRatelimiter = std::make_shared<AsyncSemaphore>(
         // Our maximum amount of copies at the same time is
@@ -1188,7 +1364,8 @@ try {
                          auto & srcStore,
                          auto & dstStore,
                          auto missingPath,
-                         auto info) -> kj::Promise<Result<box_ptr<AsyncInputStream>>> {
+                         auto info,
+                         std::optional<StorePath> deltaBase) -> kj::Promise<Result<box_ptr<AsyncInputStream>>> {
             try {
                 // We can reasonably assume that the copy will happen whenever we
                 // read the path, so log something about that at that point
@@ -1206,12 +1383,24 @@ try {
                 // Certain store implementations may open files which will count
                 // towards the open files limit.
                 auto token = co_await pathCopyRatelimiter->acquire();
-                co_return make_box_ptr<SinglePathStream>(
+                box_ptr<AsyncInputStream> nar = make_box_ptr<SinglePathStream>(
                     act,
                     std::move(token),
                     info->narSize,
                     TRY_AWAIT(srcStore.narFromPath(missingPath, act.get()))
                 );
+                if (deltaBase) {
+                    auto baseInfo = TRY_AWAIT(srcStore.queryPathInfo(*deltaBase));
+                    auto baseNar = std::make_shared<const std::string>(
+                        TRY_AWAIT(TRY_AWAIT(srcStore.narFromPath(*deltaBase))->drain())
+                    );
+                    nar = make_box_ptr<NarDeltaStream>(
+                        *deltaBase,
+                        baseInfo->narHash,
+                        makeDeltaEncodingStream(std::move(baseNar), std::move(nar))
+                    );
+                }
+                co_return nar;
             } catch (...) {
                 co_return result::current_exception();
             }
@@ -1224,7 +1413,10 @@ try {
                 std::ref(srcStore),
                 std::ref(dstStore),
                 missingPath,
-                info
+                info,
+                deltaBases.contains(missingPath)
+                    ? std::optional{deltaBases.at(missingPath)}
+                    : std::nullopt
             )
         });
     }
@@ -121,6 +121,33 @@ struct KeyedBuildResult;
 
 typedef std::map<StorePath, std::optional<ContentAddress>> StorePathCAMap;
 
+/**
+ * Sizes of the closure of a store path, as computed by
+ * `Store::getClosureSizes()`.
+ */
+struct ClosureSize
+{
+    /**
+     * Sum of the NAR sizes of all paths in the closure.
+     */
+    uint64_t narSize = 0;
+
+    /**
+     * Sum of the compressed NAR sizes of all paths in the closure, for
+     * paths that come from a binary cache.
+     */
+    uint64_t downloadSize = 0;
+
+    /**
+     * Sum of the NAR sizes of the paths in the closure that can only be
+     * reached through this path from the queried paths that no other path
+     * refers to, including the path itself. This is the space that would be
+     * freed if the path became unreachable and those queried paths were the
+     * only garbage collector roots.
+     */
+    uint64_t uniqueSize = 0;
+};
+
 struct StoreConfig : public Config
 {
     typedef std::map<std::string, std::string> Params;
@@ -437,6 +464,14 @@ public:
     virtual kj::Promise<Result<StorePathSet>> queryAllValidPaths()
     try { unsupported("queryAllValidPaths"); } catch (...) { return {result::current_exception()}; }
 
+    /**
+     * Query the valid paths whose name (the part after the hash) starts
+     * with `prefix`. Only supported by stores that can answer this without
+     * listing all their paths.
+     */
+    virtual kj::Promise<Result<StorePathSet>> queryValidPathsWithNamePrefix(std::string_view prefix)
+    try { unsupported("queryValidPathsWithNamePrefix"); } catch (...) { return {result::current_exception()}; }
+
     constexpr static const char * MissingName = "x";
 
     /**
@@ -462,6 +497,14 @@ public:
         return true;
     }
 
+    /**
+     * Check the signatures of many path infos at once before
+     * `pathInfoIsUntrusted` is called for each of them. This is only an
+     * optimisation, the results are remembered in the verified signature
+     * cache.
+     */
+    virtual void prepareTrustChecks(const std::vector<const ValidPathInfo *> & infos) {}
+
 protected:
 
     virtual kj::Promise<Result<std::shared_ptr<const ValidPathInfo>>>
@@ -563,6 +606,15 @@ public:
     using PathsSource = std::vector<
         std::pair<ValidPathInfo, std::function<kj::Promise<Result<box_ptr<AsyncInputStream>>>()>>>;
 
+    /**
+     * Whether the `PathsSource` passed to `addMultipleToStore` may return
+     * a `NarDeltaStream` instead of a NAR for some of the paths.
+     */
+    virtual kj::Promise<Result<bool>> acceptsNarDeltas()
+    {
+        return {result::success(false)};
+    }
+
     /**
      * Import multiple paths into the store.
      */
@@ -737,7 +789,7 @@ public:
      * registration time are included.
      *
      * @param showClosureSize If true, the closure size of each path is
-     * included.
+     * included, and its unique closure size with `includeImpureInfo`.
      */
     kj::Promise<Result<JSON>> pathInfoToJSON(
         const StorePathSet & storePaths,
@@ -748,11 +800,12 @@ public:
     );
 
     /**
-     * @return the size of the closure of the specified path, that is,
-     * the sum of the size of the NAR serialisation of each path in the
-     * closure.
+     * @return the sizes of the closures of the specified paths. The
+     * reference graph of all closures is loaded once, and the sizes of
+     * all paths are computed together.
      */
-    kj::Promise<Result<std::pair<uint64_t, uint64_t>>> getClosureSize(const StorePath & storePath);
+    kj::Promise<Result<std::map<StorePath, ClosureSize>>>
+    getClosureSizes(const StorePathSet & storePaths);
 
     /**
      * Optimise the disk space usage of the Nix store by hard-linking files
@@ -270,6 +270,7 @@ void TransferItem::maybeFinishSetup()
     }
 
     result.cached = status == 304;
+    result.partial = status == 206;
     if (successfulStatuses.contains(status)) {
         metadataPromise->fulfill(result);
         metadataReturned = true;
@@ -0,0 +1,70 @@
+#include "lix/libstore/transport-compression.hh"
+#include "lix/libstore/ssh-store.hh"
+#include "lix/libutil/error.hh"
+
+#include <algorithm>
+
+namespace nix {
+
+// upper half of the encoded value, ascii "Lx". the lower half is laid out as
+//   bit 0: zstd (the only method we currently support, always set)
+//   bit 1: parallel compression
+//   bit 2: nar deltas (not part of the compression, see TransportOffer)
+//   bits 8-15: compression level + 1, zero for the default level
+static constexpr uint32_t TAG = 0x4c780000;
+static constexpr uint32_t TAG_MASK = 0xffff0000;
+static constexpr uint32_t ZSTD = 1 << 0;
+static constexpr uint32_t PARALLEL = 1 << 1;
+static constexpr uint32_t NAR_DELTAS = 1 << 2;
+static constexpr unsigned LEVEL_SHIFT = 8;
+
+uint32_t TransportCompression::encode() const
+{
+    auto encodedLevel = static_cast<uint32_t>(std::clamp(level + 1, 0, 0xff));
+    return TAG | ZSTD | (parallel ? PARALLEL : 0) | (encodedLevel << LEVEL_SHIFT);
+}
+
+std::optional<TransportCompression> TransportCompression::decode(uint32_t value)
+{
+    if ((value & TAG_MASK) != TAG || !(value & ZSTD)) {
+        return std::nullopt;
+    }
+    return TransportCompression{
+        .parallel = bool(value & PARALLEL),
+        .level = static_cast<int>((value >> LEVEL_SHIFT) & 0xff) - 1,
+    };
+}
+
+uint32_t TransportOffer::encode() const
+{
+    return (compression ? compression->encode() : TAG) | (narDeltas ? NAR_DELTAS : 0);
+}
+
+std::optional<TransportOffer> TransportOffer::decode(uint32_t value)
+{
+    if ((value & TAG_MASK) != TAG) {
+        return std::nullopt;
+    }
+    return TransportOffer{
+        .compression = TransportCompression::decode(value),
+        .narDeltas = bool(value & NAR_DELTAS),
+    };
+}
+
+std::optional<TransportCompression>
+TransportCompression::fromConfig(const CommonSSHStoreConfig & config)
+{
+    const auto & requested = config.transportCompression.get();
+    if (requested == "none" || requested == "") {
+        return std::nullopt;
+    } else if (requested == method) {
+        return TransportCompression{
+            .parallel = config.parallelTransportCompression.get(),
+            .level = config.transportCompressionLevel.get(),
+        };
+    } else {
+        throw UsageError("unsupported transport compression method '%s'", requested);
+    }
+}
+
+}
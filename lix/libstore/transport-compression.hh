@@ -0,0 +1,78 @@
+#pragma once
+///@file
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+namespace nix {
+
+struct CommonSSHStoreConfig;
+
+/**
+ * Compression of NAR payloads, negotiated per connection by the worker and
+ * serve protocols.
+ *
+ * Both protocol versions are frozen, so clients offer compression through
+ * channels older peers ignore and only compress once the peer acknowledged
+ * the offer (see `WorkerProto` and `ServeProto` for the exact mechanisms).
+ * Payloads always use framed compression (`makeFramedCompressionSink`), so
+ * a reader knows where a payload ends without any additional length field.
+ */
+struct TransportCompression
+{
+    static inline const std::string method = "zstd";
+
+    /**
+     * Whether the sender should use multi-threaded compression.
+     */
+    bool parallel = false;
+
+    /**
+     * Compression level for the sender, `-1` for the default of `method`.
+     */
+    int level = -1;
+
+    /**
+     * Encode as the 32 bit value exchanged during the handshake.
+     */
+    uint32_t encode() const;
+
+    /**
+     * Decode a value produced by `encode()`. Returns `std::nullopt` for
+     * values that do not carry our tag, e.g. an actual CPU affinity.
+     */
+    static std::optional<TransportCompression> decode(uint32_t value);
+
+    /**
+     * The compression to offer for an SSH store, if any.
+     */
+    static std::optional<TransportCompression> fromConfig(const CommonSSHStoreConfig & config);
+};
+
+/**
+ * The transport features a worker protocol client offers, or a daemon
+ * accepted. Shares its encoding with `TransportCompression`, so daemons
+ * that only know about compression ignore the additional features.
+ */
+struct TransportOffer
+{
+    std::optional<TransportCompression> compression;
+
+    /**
+     * Whether store paths may be sent as deltas against other paths the
+     * receiver already has (see `LIX_NAR_DELTA`).
+     */
+    bool narDeltas = false;
+
+    bool empty() const
+    {
+        return !compression && !narDeltas;
+    }
+
+    uint32_t encode() const;
+
+    static std::optional<TransportOffer> decode(uint32_t value);
+};
+
+}
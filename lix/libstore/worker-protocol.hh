@@ -35,6 +35,29 @@ namespace nix {
 #define STDERR_STOP_ACTIVITY  0x53544f50
 #define STDERR_RESULT         0x52534c54
 
+/**
+ * Acknowledgement of a `TransportOffer`. Clients offer transport compression
+ * and NAR deltas in the otherwise unused CPU affinity slot of the handshake;
+ * a daemon that accepts the offer answers with this message followed by the
+ * encoded `TransportOffer` it accepted before the first `STDERR_LAST`.
+ * Daemons that do not know about the offer ignore the affinity value as they
+ * always did, and clients that make no offer never see this message. When
+ * compression is accepted, NAR payloads of `NarFromPath` and
+ * `AddMultipleToStore` use framed compression for the rest of the connection.
+ */
+#define STDERR_LIX_TRANSPORT_COMPRESSION 0x4c78545a
+
+/**
+ * When NAR deltas were accepted, every path sent by `AddMultipleToStore` is
+ * preceded by one of these tags. `LIX_NAR_DELTA` is followed by the base
+ * store path and its NAR hash, and the contents of the path are sent as a
+ * delta (see `binary-delta.hh`) against the NAR of the base instead of as a
+ * NAR. Compression, if any, applies to the delta. The receiver verifies the
+ * reconstructed NAR like any other NAR it is sent.
+ */
+#define LIX_NAR_FULL 0
+#define LIX_NAR_DELTA 1
+
 
 class Store;
 struct Source;
@@ -6,8 +6,10 @@
 #include <kj/async.h>
 #include <kj/common.h>
 #include <kj/exception.h>
-#include <kj/list.h>
 #include <kj/source-location.h>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
 #include <optional>
 
@@ -39,39 +41,49 @@ public:
     };
 
 private:
+    struct Waiter;
+
+    /**
+     * Waiters ordered by descending priority. Waiters with equal priority
+     * are kept in the order they were added, since `emplace` inserts them
+     * after all equivalent keys.
+     */
+    using WaiterQueue = std::multimap<uint64_t, Waiter *, std::greater<>>;
+
     struct Waiter
     {
         kj::PromiseFulfiller<Token> & fulfiller;
-        kj::ListLink<Waiter> link;
-        kj::List<Waiter, &Waiter::link> & list;
+        WaiterQueue & queue;
+        std::optional<WaiterQueue::iterator> pos;
 
-        Waiter(kj::PromiseFulfiller<Token> & fulfiller, kj::List<Waiter, &Waiter::link> & list)
+        Waiter(kj::PromiseFulfiller<Token> & fulfiller, WaiterQueue & queue, uint64_t priority)
             : fulfiller(fulfiller)
-            , list(list)
+            , queue(queue)
+            , pos(queue.emplace(priority, this))
         {
-            list.add(*this);
         }
 
         ~Waiter()
         {
-            if (link.isLinked()) {
-                list.remove(*this);
+            if (pos) {
+                queue.erase(*pos);
             }
         }
     };
 
     const unsigned capacity_;
     unsigned used_ = 0;
-    kj::List<Waiter, &Waiter::link> waiters;
+    WaiterQueue waiters;
 
     void unsafeRelease()
     {
         used_ -= 1;
         while (used_ < capacity_ && !waiters.empty()) {
             used_ += 1;
-            auto & w = waiters.front();
+            auto & w = *waiters.begin()->second;
+            waiters.erase(waiters.begin());
+            w.pos.reset();
             w.fulfiller.fulfill(Token{*this, {}});
-            waiters.remove(w);
         }
     }
 
@@ -95,12 +107,17 @@ public:
         }
     }
 
-    kj::Promise<Token> acquire()
+    /**
+     * Acquire a token, waiting until one is available. Waiters with a higher
+     * `priority` are served first, waiters with the same priority are served
+     * in the order they called `acquire`.
+     */
+    kj::Promise<Token> acquire(uint64_t priority = 0)
     {
         if (auto t = tryAcquire()) {
             return std::move(*t);
         } else {
-            return kj::newAdaptedPromise<Token, Waiter>(waiters);
+            return kj::newAdaptedPromise<Token, Waiter>(waiters, priority);
         }
     }
 
@@ -0,0 +1,304 @@
+#include "lix/libutil/binary-delta.hh"
+#include "lix/libutil/async.hh"
+#include "lix/libutil/result.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <unistd.h>
+
+namespace nix {
+
+/**
+ * Literal data is flushed in pieces of at most this size.
+ */
+static constexpr size_t MAX_DELTA_LITERAL = 64 * 1024;
+
+/**
+ * Give up looking for a block after comparing this many blocks with the
+ * same checksum. Repetitive data (e.g. runs of zeroes) has many identical
+ * blocks, and the first candidate matches in that case anyway.
+ */
+static constexpr size_t MAX_DELTA_CANDIDATES = 8;
+
+static constexpr uint32_t SUM_MASK = 0xffff;
+
+static std::pair<uint32_t, uint32_t> blockSums(std::string_view block)
+{
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < block.size(); i++) {
+        auto x = static_cast<unsigned char>(block[i]);
+        a += x;
+        b += (block.size() - i) * x;
+    }
+    return {a & SUM_MASK, b & SUM_MASK};
+}
+
+static uint32_t weakSum(uint32_t a, uint32_t b)
+{
+    return a | (b << 16);
+}
+
+DeltaBaseIndex::DeltaBaseIndex(std::string_view base) : base(base)
+{
+    for (size_t offset = 0; offset + DELTA_BLOCK_SIZE <= base.size(); offset += DELTA_BLOCK_SIZE) {
+        auto [a, b] = blockSums(base.substr(offset, DELTA_BLOCK_SIZE));
+        auto & candidates = blocks[weakSum(a, b)];
+        if (candidates.size() < MAX_DELTA_CANDIDATES) {
+            candidates.push_back(offset / DELTA_BLOCK_SIZE);
+        }
+    }
+}
+
+std::optional<uint64_t> DeltaBaseIndex::find(uint32_t weak, std::string_view window) const
+{
+    assert(window.size() == DELTA_BLOCK_SIZE);
+    auto it = blocks.find(weak);
+    if (it == blocks.end()) {
+        return std::nullopt;
+    }
+    for (auto block : it->second) {
+        uint64_t offset = uint64_t(block) * DELTA_BLOCK_SIZE;
+        if (memcmp(base.data() + offset, window.data(), DELTA_BLOCK_SIZE) == 0) {
+            return offset;
+        }
+    }
+    return std::nullopt;
+}
+
+void DeltaEncoderSink::operator()(std::string_view data)
+{
+    assert(!finished);
+    pending += data;
+    process();
+}
+
+void DeltaEncoderSink::flushCopy()
+{
+    if (pendingCopy) {
+        out << DELTA_COPY << pendingCopy->first << pendingCopy->second;
+        pendingCopy.reset();
+    }
+}
+
+void DeltaEncoderSink::emitCopy(uint64_t offset, uint64_t length)
+{
+    if (pendingCopy && pendingCopy->first + pendingCopy->second == offset) {
+        pendingCopy->second += length;
+    } else {
+        flushCopy();
+        pendingCopy = {offset, length};
+    }
+}
+
+void DeltaEncoderSink::emitLiteral(size_t end)
+{
+    if (end == literalStart) {
+        return;
+    }
+    flushCopy();
+    out << DELTA_DATA << uint64_t(end - literalStart);
+    out(std::string_view(pending).substr(literalStart, end - literalStart));
+    literalStart = end;
+}
+
+void DeltaEncoderSink::process()
+{
+    while (true) {
+        if (!haveSums) {
+            if (pending.size() - pos < DELTA_BLOCK_SIZE) {
+                break;
+            }
+            std::tie(a, b) = blockSums(std::string_view(pending).substr(pos, DELTA_BLOCK_SIZE));
+            haveSums = true;
+            checked = false;
+        }
+
+        if (!checked) {
+            auto window = std::string_view(pending).substr(pos, DELTA_BLOCK_SIZE);
+            if (auto offset = index.find(weakSum(a, b), window)) {
+                emitLiteral(pos);
+                emitCopy(*offset, DELTA_BLOCK_SIZE);
+                pos += DELTA_BLOCK_SIZE;
+                literalStart = pos;
+                haveSums = false;
+                continue;
+            }
+            checked = true;
+        }
+
+        // roll the window forward by one byte, if we have that byte yet
+        if (pos + DELTA_BLOCK_SIZE >= pending.size()) {
+            break;
+        }
+        uint32_t outByte = static_cast<unsigned char>(pending[pos]);
+        uint32_t inByte = static_cast<unsigned char>(pending[pos + DELTA_BLOCK_SIZE]);
+        a = (a - outByte + inByte) & SUM_MASK;
+        b = (b - DELTA_BLOCK_SIZE * outByte + a) & SUM_MASK;
+        pos++;
+        checked = false;
+
+        if (pos - literalStart >= MAX_DELTA_LITERAL) {
+            emitLiteral(pos);
+        }
+    }
+
+    // drop everything that has been written out already
+    if (literalStart >= MAX_DELTA_LITERAL) {
+        pending.erase(0, literalStart);
+        pos -= literalStart;
+        literalStart = 0;
+    }
+}
+
+void DeltaEncoderSink::finish()
+{
+    if (finished) {
+        return;
+    }
+    finished = true;
+    emitLiteral(pending.size());
+    flushCopy();
+    out << DELTA_END;
+}
+
+namespace {
+struct DeltaEncodingStream : AsyncInputStream
+{
+    std::shared_ptr<const std::string> base;
+    DeltaBaseIndex index;
+    box_ptr<AsyncInputStream> target;
+    StringSink encoded;
+    DeltaEncoderSink encoder;
+    size_t pos = 0;
+    bool eof = false;
+
+    DeltaEncodingStream(std::shared_ptr<const std::string> base, box_ptr<AsyncInputStream> target)
+        : base(std::move(base))
+        , index(*this->base)
+        , target(std::move(target))
+        , encoder(index, encoded)
+    {
+    }
+
+    kj::Promise<Result<std::optional<size_t>>> read(void * buffer, size_t size) override
+    try {
+        while (pos >= encoded.s.size()) {
+            if (eof) {
+                co_return std::nullopt;
+            }
+            encoded.s.clear();
+            pos = 0;
+
+            std::string chunk(MAX_DELTA_LITERAL, 0);
+            if (auto got = TRY_AWAIT(target->read(chunk.data(), chunk.size()))) {
+                encoder(std::string_view(chunk).substr(0, *got));
+            } else {
+                encoder.finish();
+                eof = true;
+            }
+        }
+
+        auto n = std::min(size, encoded.s.size() - pos);
+        memcpy(buffer, encoded.s.data() + pos, n);
+        pos += n;
+        co_return n;
+    } catch (...) {
+        co_return result::current_exception();
+    }
+};
+
+struct DeltaDecodingSource : Source
+{
+    using ReadBase = std::function<size_t(char * data, uint64_t offset, size_t len)>;
+
+    uint64_t baseSize;
+    ReadBase readBase;
+    Source & delta;
+    uint64_t copyOffset = 0, copyRemaining = 0, dataRemaining = 0;
+    bool eof = false;
+
+    DeltaDecodingSource(uint64_t baseSize, ReadBase readBase, Source & delta)
+        : baseSize(baseSize)
+        , readBase(std::move(readBase))
+        , delta(delta)
+    {
+    }
+
+    size_t read(char * data, size_t len) override
+    {
+        while (!copyRemaining && !dataRemaining) {
+            if (eof) {
+                throw EndOfFile("delta ended");
+            }
+            switch (readNum<uint64_t>(delta)) {
+            case DELTA_END:
+                eof = true;
+                break;
+            case DELTA_COPY:
+                copyOffset = readNum<uint64_t>(delta);
+                copyRemaining = readNum<uint64_t>(delta);
+                if (copyOffset > baseSize || copyRemaining > baseSize - copyOffset) {
+                    throw BadDelta("delta copies data past the end of its base");
+                }
+                break;
+            case DELTA_DATA:
+                dataRemaining = readNum<uint64_t>(delta);
+                break;
+            default:
+                throw BadDelta("unknown delta operation");
+            }
+        }
+
+        if (copyRemaining) {
+            auto n = readBase(data, copyOffset, std::min<uint64_t>(len, copyRemaining));
+            copyOffset += n;
+            copyRemaining -= n;
+            return n;
+        } else {
+            auto n = delta.read(data, std::min<uint64_t>(len, dataRemaining));
+            dataRemaining -= n;
+            return n;
+        }
+    }
+};
+}
+
+box_ptr<AsyncInputStream> makeDeltaEncodingStream(
+    std::shared_ptr<const std::string> base, box_ptr<AsyncInputStream> target
+)
+{
+    return make_box_ptr<DeltaEncodingStream>(std::move(base), std::move(target));
+}
+
+std::unique_ptr<Source> makeDeltaDecodingSource(std::string_view base, Source & delta)
+{
+    return std::make_unique<DeltaDecodingSource>(
+        base.size(),
+        [base](char * data, uint64_t offset, size_t len) {
+            memcpy(data, base.data() + offset, len);
+            return len;
+        },
+        delta
+    );
+}
+
+std::unique_ptr<Source> makeDeltaDecodingSource(int baseFd, uint64_t baseSize, Source & delta)
+{
+    return std::make_unique<DeltaDecodingSource>(
+        baseSize,
+        [baseFd](char * data, uint64_t offset, size_t len) -> size_t {
+            auto n = ::pread(baseFd, data, len, offset);
+            if (n < 0) {
+                throw SysError("reading delta base");
+            } else if (n == 0) {
+                throw EndOfFile("unexpected end of delta base");
+            }
+            return n;
+        },
+        delta
+    );
+}
+
+}
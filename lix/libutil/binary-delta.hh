@@ -0,0 +1,106 @@
+#pragma once
+///@file
+
+#include "lix/libutil/async-io.hh"
+#include "lix/libutil/box_ptr.hh"
+#include "lix/libutil/serialise.hh"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace nix {
+
+/**
+ * Binary deltas in the style of rsync. The target is described as a
+ * sequence of copies of blocks of a base both sides have, and literal data
+ * for everything that could not be found in the base. Blocks are matched
+ * at any offset in the target using a rolling checksum.
+ *
+ * On the wire a delta is a sequence of operations, each starting with a
+ * 64 bit tag: `DELTA_COPY` followed by a base offset and a length,
+ * `DELTA_DATA` followed by a length and that many bytes of data, and a
+ * final `DELTA_END`.
+ */
+constexpr size_t DELTA_BLOCK_SIZE = 4096;
+
+constexpr uint64_t DELTA_END = 0;
+constexpr uint64_t DELTA_COPY = 1;
+constexpr uint64_t DELTA_DATA = 2;
+
+/**
+ * Index of all full blocks of a delta base.
+ */
+class DeltaBaseIndex
+{
+    std::string_view base;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> blocks;
+
+public:
+    /**
+     * `base` must outlive the index.
+     */
+    explicit DeltaBaseIndex(std::string_view base);
+
+    /**
+     * Find a block of the base equal to `window`, which must be exactly
+     * `DELTA_BLOCK_SIZE` bytes long and have the rolling checksum `weak`.
+     * Returns the offset of the block in the base.
+     */
+    std::optional<uint64_t> find(uint32_t weak, std::string_view window) const;
+};
+
+/**
+ * Sink that writes a delta of everything written to it against the base
+ * of `index` to `out`.
+ */
+class DeltaEncoderSink : public FinishSink
+{
+    const DeltaBaseIndex & index;
+    Sink & out;
+
+    std::string pending;
+    size_t pos = 0, literalStart = 0;
+    uint32_t a = 0, b = 0;
+    bool haveSums = false, checked = false, finished = false;
+    std::optional<std::pair<uint64_t, uint64_t>> pendingCopy;
+
+    void process();
+    void emitCopy(uint64_t offset, uint64_t length);
+    void emitLiteral(size_t end);
+    void flushCopy();
+
+public:
+    DeltaEncoderSink(const DeltaBaseIndex & index, Sink & out) : index(index), out(out) {}
+
+    void operator()(std::string_view data) override;
+    void finish() override;
+};
+
+/**
+ * Delta-encode `target` against `base`.
+ */
+box_ptr<AsyncInputStream> makeDeltaEncodingStream(
+    std::shared_ptr<const std::string> base, box_ptr<AsyncInputStream> target
+);
+
+/**
+ * Reconstruct a target from `base` and a delta read from `delta`. The
+ * source ends after the `DELTA_END` operation; `delta` is not read past it.
+ */
+std::unique_ptr<Source> makeDeltaDecodingSource(std::string_view base, Source & delta);
+
+/**
+ * Like `makeDeltaDecodingSource(std::string_view, Source &)`, but reads the
+ * blocks of the base from the file `baseFd` of size `baseSize` as they are
+ * needed. `baseFd` must stay open until the source is done.
+ */
+std::unique_ptr<Source> makeDeltaDecodingSource(int baseFd, uint64_t baseSize, Source & delta);
+
+MakeError(BadDelta, Error);
+
+}
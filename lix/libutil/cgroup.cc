@@ -82,6 +82,12 @@ try {
         }
     }
 
+    auto memoryPeakPath = cgroup / "memory.peak";
+
+    if (pathExists(memoryPeakPath)) {
+        stats.memoryPeak = string2Int<uint64_t>(trim(readFile(memoryPeakPath)));
+    }
+
     return stats;
 } catch (...) {
     return result::current_exception();
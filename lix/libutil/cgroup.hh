@@ -98,6 +98,8 @@ CgroupAvailableFeatureSet detectAvailableCgroupFeatures();
 struct CgroupStats
 {
     std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+    /* Peak memory usage in bytes, from `memory.peak` (Linux 5.19+). */
+    std::optional<uint64_t> memoryPeak;
 };
 
 /**
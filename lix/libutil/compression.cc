@@ -10,6 +10,8 @@
 #include "lix/libutil/tarfile.hh"
 #include "lix/libutil/signals.hh"
 #include "lix/libutil/logging.hh"
+#include "lix/libutil/sync.hh"
+#include "lix/libutil/thread-pool.hh"
 #include "result.hh"
 #include "serialise.hh"
 
@@ -18,6 +20,7 @@
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 
 #include <brotli/decode.h>
 #include <brotli/encode.h>
@@ -532,4 +535,358 @@ std::string compress(const std::string & method, std::string_view in, const bool
     return std::move(ssink.s);
 }
 
+// compressed frames are at most a few bytes larger than the chunks they were made
+// from, anything much larger than that is a corrupted or malicious stream.
+static constexpr size_t MAX_COMPRESSED_FRAME_SIZE = 2 * FRAMED_COMPRESSION_CHUNK_SIZE;
+
+static void checkCompressedFrameSize(uint64_t size)
+{
+    if (size > MAX_COMPRESSED_FRAME_SIZE) {
+        throw CompressionError("compressed frame of %d bytes exceeds the size limit", size);
+    }
+}
+
+namespace {
+/**
+ * Compresses chunks into length-prefixed frames, either right away or, for
+ * parallel compression, on a thread pool. Frames are always handed out in
+ * the order their chunks were added in.
+ */
+struct FrameCompressor
+{
+    std::string method;
+    int level;
+
+    /**
+     * A frame that may still be compressing on the pool. The worker signals
+     * completion through `waiter` so async readers need not block on it.
+     */
+    struct Frame
+    {
+        std::promise<std::string> promise;
+        std::future<std::string> result = promise.get_future();
+
+        struct State
+        {
+            bool done = false;
+            std::optional<kj::Own<kj::CrossThreadPromiseFulfiller<void>>> waiter;
+        };
+        Sync<State> state;
+
+        void complete()
+        {
+            auto state_(state.lock());
+            state_->done = true;
+            if (state_->waiter) {
+                (*state_->waiter)->fulfill();
+            }
+        }
+    };
+
+    /// only used for parallel compression.
+    std::unique_ptr<ThreadPool> pool;
+    std::deque<std::shared_ptr<Frame>> inFlight;
+    size_t maxInFlight = 1;
+
+    FrameCompressor(std::string method, bool parallel, int level)
+        : method(std::move(method))
+        , level(level)
+    {
+        if (parallel) {
+            pool = std::make_unique<ThreadPool>("compression");
+            // enough frames to keep every core busy while the oldest frame
+            // is being written.
+            maxInFlight = 2 * std::max(1u, std::thread::hardware_concurrency());
+        }
+    }
+
+    static std::string compressFrame(const std::string & method, std::string_view chunk, int level)
+    {
+        StringSink frame;
+        auto compressed = compress(method, chunk, false, level);
+        frame << compressed.size();
+        frame(compressed);
+        return std::move(frame.s);
+    }
+
+    /**
+     * Whether `next()` must be called before more chunks can be added.
+     */
+    bool full() const
+    {
+        return inFlight.size() >= maxInFlight;
+    }
+
+    bool empty() const
+    {
+        return inFlight.empty();
+    }
+
+    void add(std::string chunk)
+    {
+        checkInterrupt();
+        auto frame = std::make_shared<Frame>();
+        inFlight.push_back(frame);
+        if (!pool) {
+            frame->promise.set_value(compressFrame(method, chunk, level));
+            frame->complete();
+            return;
+        }
+
+        // shared, since the pool copies its work items
+        auto input = std::make_shared<std::string>(std::move(chunk));
+        pool->enqueue([frame, input, method{method}, level{level}] {
+            try {
+                frame->promise.set_value(compressFrame(method, *input, level));
+            } catch (...) {
+                frame->promise.set_exception(std::current_exception());
+            }
+            frame->complete();
+        });
+    }
+
+    /**
+     * The oldest frame. Waits for it to be compressed if necessary.
+     */
+    std::string next()
+    {
+        auto frame = std::move(inFlight.front());
+        inFlight.pop_front();
+        return frame->result.get();
+    }
+
+    /**
+     * Like `next()`, but waits for the frame without blocking the event loop.
+     */
+    kj::Promise<Result<std::string>> nextAsync()
+    try {
+        auto frame = std::move(inFlight.front());
+        inFlight.pop_front();
+
+        std::optional<kj::Promise<void>> compressed;
+        {
+            auto state(frame->state.lock());
+            if (!state->done) {
+                auto pfp = kj::newPromiseAndCrossThreadFulfiller<void>();
+                state->waiter = std::move(pfp.fulfiller);
+                compressed = std::move(pfp.promise);
+            }
+        }
+        if (compressed) {
+            co_await *compressed;
+        }
+
+        co_return frame->result.get();
+    } catch (...) {
+        co_return result::current_exception();
+    }
+};
+
+struct FramedCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    FrameCompressor compressor;
+    std::string chunk;
+
+    FramedCompressionSink(std::string method, Sink & nextSink, bool parallel, int level)
+        : nextSink(nextSink)
+        , compressor(std::move(method), parallel, level)
+    {
+    }
+
+    void finish() override
+    {
+        flush();
+        if (!chunk.empty()) {
+            compressor.add(std::move(chunk));
+            chunk.clear();
+        }
+        while (!compressor.empty()) {
+            nextSink(compressor.next());
+        }
+        nextSink << 0;
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        while (!data.empty()) {
+            auto n = std::min(data.size(), FRAMED_COMPRESSION_CHUNK_SIZE - chunk.size());
+            chunk.append(data.substr(0, n));
+            data.remove_prefix(n);
+            if (chunk.size() == FRAMED_COMPRESSION_CHUNK_SIZE) {
+                if (compressor.full()) {
+                    nextSink(compressor.next());
+                }
+                compressor.add(std::move(chunk));
+                chunk.clear();
+            }
+        }
+    }
+};
+
+struct FramedCompressionStream : AsyncInputStream
+{
+    box_ptr<AsyncInputStream> inner;
+    FrameCompressor compressor;
+    std::string pending;
+    size_t pos = 0;
+    bool innerEof = false, eof = false;
+
+    FramedCompressionStream(
+        std::string method, box_ptr<AsyncInputStream> inner, bool parallel, int level
+    )
+        : inner(std::move(inner))
+        , compressor(std::move(method), parallel, level)
+    {
+    }
+
+    kj::Promise<Result<std::optional<size_t>>> read(void * buffer, size_t size) override
+    try {
+        while (pos >= pending.size()) {
+            if (eof) {
+                co_return std::nullopt;
+            }
+
+            // read ahead so that parallel compression has chunks to work on.
+            while (!innerEof && !compressor.full()) {
+                std::string chunk(FRAMED_COMPRESSION_CHUNK_SIZE, 0);
+                size_t filled = 0;
+                while (!innerEof && filled < chunk.size()) {
+                    auto got =
+                        TRY_AWAIT(inner->read(chunk.data() + filled, chunk.size() - filled));
+                    if (got) {
+                        filled += *got;
+                    } else {
+                        innerEof = true;
+                    }
+                }
+                if (filled) {
+                    chunk.resize(filled);
+                    compressor.add(std::move(chunk));
+                }
+            }
+
+            if (!compressor.empty()) {
+                pending = TRY_AWAIT(compressor.nextAsync());
+            } else {
+                StringSink frame;
+                frame << 0;
+                pending = std::move(frame.s);
+                eof = true;
+            }
+            pos = 0;
+        }
+
+        auto n = std::min(size, pending.size() - pos);
+        memcpy(buffer, pending.data() + pos, n);
+        pos += n;
+        co_return n;
+    } catch (...) {
+        co_return result::current_exception();
+    }
+};
+}
+
+ref<CompressionSink> makeFramedCompressionSink(
+    const std::string & method, Sink & nextSink, const bool parallel, int level
+)
+{
+    return make_ref<FramedCompressionSink>(method, nextSink, parallel, level);
+}
+
+std::unique_ptr<FramedDecompressionSource>
+makeFramedDecompressionSource(const std::string & method, Source & inner)
+{
+    return std::make_unique<FramedDecompressionSource>(method, inner);
+}
+
+box_ptr<AsyncInputStream> makeFramedCompressionStream(
+    const std::string & method, box_ptr<AsyncInputStream> inner, const bool parallel, int level
+)
+{
+    return make_box_ptr<FramedCompressionStream>(method, std::move(inner), parallel, level);
+}
+
+bool FramedDecompressionSource::nextFrame()
+{
+    auto n = readNum<uint64_t>(inner);
+    if (!n) {
+        eof = true;
+        return false;
+    }
+    checkCompressedFrameSize(n);
+    std::string frame(n, 0);
+    inner(frame.data(), n);
+    pending = decompress(method, frame);
+    pos = 0;
+    return true;
+}
+
+void FramedDecompressionSource::finish()
+{
+    while (!eof) {
+        nextFrame();
+    }
+}
+
+size_t FramedDecompressionSource::read(char * data, size_t len)
+{
+    while (pos >= pending.size()) {
+        if (eof || !nextFrame()) {
+            throw EndOfFile("reached end of compressed frames");
+        }
+    }
+
+    auto n = std::min(len, pending.size() - pos);
+    memcpy(data, pending.data() + pos, n);
+    pos += n;
+    return n;
+}
+
+kj::Promise<Result<bool>> AsyncFramedDecompressionStream::nextFrame()
+try {
+    auto n = TRY_AWAIT(readNum<uint64_t>(inner));
+    if (!n) {
+        eof = true;
+        co_return false;
+    }
+    checkCompressedFrameSize(n);
+    std::string frame(n, 0);
+    if (TRY_AWAIT(inner.readRange(frame.data(), n, n)) != n) {
+        throw EndOfFile("compressed frame ended unexpectedly");
+    }
+    pending = decompress(method, frame);
+    pos = 0;
+    co_return true;
+} catch (...) {
+    co_return result::current_exception();
+}
+
+kj::Promise<Result<void>> AsyncFramedDecompressionStream::finish()
+try {
+    while (!eof) {
+        TRY_AWAIT(nextFrame());
+    }
+    co_return result::success();
+} catch (...) {
+    co_return result::current_exception();
+}
+
+kj::Promise<Result<std::optional<size_t>>>
+AsyncFramedDecompressionStream::read(void * buffer, size_t size)
+try {
+    while (pos >= pending.size()) {
+        if (eof || !TRY_AWAIT(nextFrame())) {
+            co_return std::nullopt;
+        }
+    }
+
+    auto n = std::min(size, pending.size() - pos);
+    memcpy(buffer, pending.data() + pos, n);
+    pos += n;
+    co_return n;
+} catch (...) {
+    co_return result::current_exception();
+}
+
 }
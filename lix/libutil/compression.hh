@@ -31,6 +31,91 @@ std::string compress(const std::string & method, std::string_view in, const bool
 
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false, int level = -1);
 
+/**
+ * Size of the uncompressed chunks used by framed compression.
+ */
+constexpr size_t FRAMED_COMPRESSION_CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * Framed compression splits its input into chunks of at most
+ * `FRAMED_COMPRESSION_CHUNK_SIZE` bytes, compresses each chunk on its own and
+ * writes it as a length-prefixed frame. The stream is terminated by an empty
+ * frame. Unlike plain compressed streams the reader always knows where the
+ * stream ends, so framed compression can be embedded in protocol streams
+ * without an out-of-band length and without the decompressor consuming any
+ * bytes that belong to the next message.
+ */
+ref<CompressionSink> makeFramedCompressionSink(
+    const std::string & method, Sink & nextSink, const bool parallel = false, int level = -1
+);
+
+/**
+ * Read a stream written by `makeFramedCompressionSink`. The caller must call
+ * `finish()` once it is done with the source, even if it has not read all of
+ * its contents, to consume the remaining frames from `inner`.
+ */
+class FramedDecompressionSource : public Source
+{
+    std::string method;
+    Source & inner;
+    std::string pending;
+    size_t pos = 0;
+    bool eof = false;
+
+    bool nextFrame();
+
+public:
+    FramedDecompressionSource(std::string method, Source & inner)
+        : method(std::move(method))
+        , inner(inner)
+    {
+    }
+
+    void finish();
+
+    size_t read(char * data, size_t len) override;
+};
+
+std::unique_ptr<FramedDecompressionSource>
+makeFramedDecompressionSource(const std::string & method, Source & inner);
+
+/**
+ * Async variant of `makeFramedCompressionSink`, producing the framed
+ * compressed form of `inner`.
+ */
+box_ptr<AsyncInputStream> makeFramedCompressionStream(
+    const std::string & method,
+    box_ptr<AsyncInputStream> inner,
+    const bool parallel = false,
+    int level = -1
+);
+
+/**
+ * Async variant of `FramedDecompressionSource`. The caller must likewise call
+ * `finish()` once it is done with the stream.
+ */
+class AsyncFramedDecompressionStream : public AsyncInputStream
+{
+    std::string method;
+    AsyncInputStream & inner;
+    std::string pending;
+    size_t pos = 0;
+    bool eof = false;
+
+    kj::Promise<Result<bool>> nextFrame();
+
+public:
+    AsyncFramedDecompressionStream(std::string method, AsyncInputStream & inner)
+        : method(std::move(method))
+        , inner(inner)
+    {
+    }
+
+    kj::Promise<Result<void>> finish();
+
+    kj::Promise<Result<std::optional<size_t>>> read(void * buffer, size_t size) override;
+};
+
 MakeError(UnknownCompressionMethod, Error);
 
 MakeError(CompressionError, Error);
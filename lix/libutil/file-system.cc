@@ -354,6 +354,21 @@ std::string readFile(const Path & path)
 }
 
 
+std::string readFileRange(const Path & path, uint64_t offset, size_t length)
+{
+    AutoCloseFD fd{sys::open(path, O_RDONLY | O_CLOEXEC)};
+    if (!fd)
+        throw SysError("opening file '%1%'", path);
+
+    if (lseek(fd.get(), offset, SEEK_SET) != (off_t) offset)
+        throw SysError("seeking in '%s'", path);
+
+    std::string buf(length, 0);
+    readFull(fd.get(), buf.data(), length);
+    return buf;
+}
+
+
 Generator<Bytes> readFileSource(const Path & path)
 {
     AutoCloseFD fd{sys::open(path, O_RDONLY | O_CLOEXEC)};
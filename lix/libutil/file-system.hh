@@ -187,6 +187,11 @@ unsigned char getFileType(const Path & path);
 std::string readFile(const Path & path);
 Generator<Bytes> readFileSource(const Path & path);
 
+/**
+ * Read `length` bytes starting at `offset` from a file into a string.
+ */
+std::string readFileRange(const Path & path, uint64_t offset, size_t length);
+
 /**
  * Write a string to a file.
  */
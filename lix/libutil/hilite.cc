@@ -4,9 +4,10 @@
 
 namespace nix {
 
-std::string hiliteMatches(
+template<typename M>
+static std::string hilite(
     std::string_view s,
-    std::vector<std::smatch> matches,
+    std::vector<M> & matches,
     std::string_view prefix,
     std::string_view postfix)
 {
@@ -43,4 +44,22 @@ std::string hiliteMatches(
     return out;
 }
 
+std::string hiliteMatches(
+    std::string_view s,
+    std::vector<std::smatch> matches,
+    std::string_view prefix,
+    std::string_view postfix)
+{
+    return hilite(s, matches, prefix, postfix);
+}
+
+std::string hiliteMatches(
+    std::string_view s,
+    std::vector<regex::Match> matches,
+    std::string_view prefix,
+    std::string_view postfix)
+{
+    return hilite(s, matches, prefix, postfix);
+}
+
 }
@@ -1,6 +1,8 @@
 #pragma once
 ///@file
 
+#include "lix/libutil/regex.hh"
+
 #include <regex>
 #include <vector>
 #include <string>
@@ -20,4 +22,10 @@ std::string hiliteMatches(
     std::string_view prefix,
     std::string_view postfix);
 
+std::string hiliteMatches(
+    std::string_view s,
+    std::vector<regex::Match> matches,
+    std::string_view prefix,
+    std::string_view postfix);
+
 }
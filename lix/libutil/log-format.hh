@@ -25,6 +25,7 @@ struct LogFormat
         Raw,
         RawWithLogs,
         InternalJson,
+        InternalBinary,
         Bar,
         BarWithLogs,
         Multiline,
@@ -58,6 +59,8 @@ public:
             return RawWithLogs;
         } else if (str == "internal-json") {
             return InternalJson;
+        } else if (str == "internal-binary") {
+            return InternalBinary;
         } else if (str == "bar") {
             return Bar;
         } else if (str == "bar-with-logs") {
@@ -82,6 +85,8 @@ public:
             return "raw-with-logs";
         case InternalJson:
             return "internal-json";
+        case InternalBinary:
+            return "internal-binary";
         case Bar:
             return "bar";
         case BarWithLogs:
@@ -110,6 +115,8 @@ public:
         case Multiline:
             [[fallthrough]];
         case InternalJson:
+            [[fallthrough]];
+        case InternalBinary:
             return *this;
 
         case RawWithLogs:
@@ -133,6 +140,8 @@ public:
         case MultilineWithLogs:
             [[fallthrough]];
         case InternalJson:
+            [[fallthrough]];
+        case InternalBinary:
             return *this;
 
         case Raw:
@@ -1,45 +1,130 @@
 #include "logging-rpc.hh"
 #include "types-rpc.hh" // IWYU pragma: keep
+#include "finally.hh"
+#include "strings.hh"
 #include "sync.hh"
 #include "types.hh"
+#include <capnp/serialize-packed.h>
+#include <condition_variable>
 #include <cstdlib>
 #include <kj/exception.h>
+#include <kj/io.h>
+#include <thread>
 
 namespace nix {
 namespace {
-struct RpcLogger : Logger
+struct Log
 {
-    struct Log
-    {
-        Verbosity level;
-        std::string msg;
+    Verbosity level;
+    std::string msg;
+};
+struct LogEI
+{
+    ErrorInfo ei;
+};
+struct StartActivity
+{
+    Verbosity level;
+    uint64_t id;
+    ActivityType type;
+    std::string text;
+    uint64_t parent;
+    Logger::Fields fields;
+};
+struct StopActivity
+{
+    uint64_t id;
+};
+struct ActivityResult
+{
+    uint64_t id;
+    ResultType type;
+    Logger::Fields fields;
+};
+
+using Event = std::variant<Log, LogEI, StartActivity, StopActivity, ActivityResult>;
+
+size_t fieldSize(const Logger::Fields & fields)
+{
+    size_t size = 0;
+    for (auto & f : fields) {
+        size += sizeof(f) + f.s.size();
+    }
+    return size;
+}
+
+void fillEventArg(rpc::log::Event::Builder arg, const Event & e)
+{
+    overloaded handlers{
+        [&](const Log & l) {
+            arg.initLog().setLevel(rpc::Verbosity(l.level));
+            RPC_FILL(arg.getLog(), setMsg, l.msg);
+        },
+        [&](const LogEI & l) {
+            auto ei = arg.initLogEI();
+            RPC_FILL(ei, initInfo, l.ei);
+        },
+        [&](const StartActivity & s) {
+            auto sa = arg.initStartActivity();
+            sa.setLevel(rpc::Verbosity(s.level));
+            sa.setId(s.id);
+            sa.setType(rpc::log::to(s.type));
+            RPC_FILL(sa, setText, s.text);
+            sa.setParent(s.parent);
+            RPC_FILL(sa, initFields, s.fields);
+        },
+        [&](const StopActivity & s) { arg.initStopActivity().setId(s.id); },
+        [&](const ActivityResult & r) {
+            auto ar = arg.initResult();
+            ar.setId(r.id);
+            ar.setType(rpc::log::to(r.type));
+            RPC_FILL(ar, initFields, r.fields);
+        },
     };
-    struct LogEI
+    std::visit(handlers, e);
+}
+
+/// a logger that turns all calls into `Event`s for `push`.
+struct EventLogger : Logger
+{
+    virtual BufferState push(size_t extraSize, Event e) = 0;
+
+    BufferState log(Verbosity lvl, std::string_view s) override
     {
-        ErrorInfo ei;
-    };
-    struct StartActivity
+        return push(s.size(), Log{lvl, std::string(s)});
+    }
+
+    BufferState logEI(const ErrorInfo & ei) override
     {
-        Verbosity level;
-        uint64_t id;
-        ActivityType type;
-        std::string text;
-        uint64_t parent;
-        Logger::Fields fields;
-    };
-    struct StopActivity
+        // size is just a guess. errors are usually rare and small
+        return push(1024, LogEI{ei});
+    }
+
+    BufferState startActivityImpl(
+        ActivityId act,
+        Verbosity lvl,
+        ActivityType type,
+        const std::string & s,
+        const Fields & fields,
+        ActivityId parent
+    ) override
     {
-        uint64_t id;
-    };
-    struct ActivityResult
+        return push(fieldSize(fields), StartActivity{lvl, act, type, s, parent, fields});
+    }
+
+    BufferState stopActivityImpl(ActivityId act) override
     {
-        uint64_t id;
-        ResultType type;
-        Logger::Fields fields;
-    };
+        return push(0, StopActivity{act});
+    }
 
-    using Event = std::variant<Log, LogEI, StartActivity, StopActivity, ActivityResult>;
+    BufferState resultImpl(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        return push(fieldSize(fields), ActivityResult{act, type, fields});
+    }
+};
 
+struct RpcLogger : EventLogger
+{
     struct Buffer
     {
         std::vector<Event> items;
@@ -90,16 +175,7 @@ struct RpcLogger : Logger
 
     ~RpcLogger() noexcept = default;
 
-    static size_t fieldSize(const Logger::Fields & fields)
-    {
-        size_t size = 0;
-        for (auto & f : fields) {
-            size += sizeof(f) + f.s.size();
-        }
-        return size;
-    }
-
-    BufferState push(size_t extraSize, Event e)
+    BufferState push(size_t extraSize, Event e) override
     {
         auto buffer = this->buffer.lock();
         if (buffer->failure) {
@@ -111,39 +187,6 @@ struct RpcLogger : Logger
                                                                         : BufferState::HasSpace;
     }
 
-    BufferState log(Verbosity lvl, std::string_view s) override
-    {
-        return push(s.size(), Log{lvl, std::string(s)});
-    }
-
-    BufferState logEI(const ErrorInfo & ei) override
-    {
-        // size is just a guess. errors are usually rare and small
-        return push(1024, LogEI{ei});
-    }
-
-    BufferState startActivityImpl(
-        ActivityId act,
-        Verbosity lvl,
-        ActivityType type,
-        const std::string & s,
-        const Fields & fields,
-        ActivityId parent
-    ) override
-    {
-        return push(fieldSize(fields), StartActivity{lvl, act, type, s, parent, fields});
-    }
-
-    BufferState stopActivityImpl(ActivityId act) override
-    {
-        return push(0, StopActivity{act});
-    }
-
-    BufferState resultImpl(ActivityId act, ResultType type, const Fields & fields) override
-    {
-        return push(fieldSize(fields), ActivityResult{act, type, fields});
-    }
-
     kj::Promise<Result<void>> flush() override
     try {
         auto pfp = kj::newPromiseAndCrossThreadFulfiller<void>();
@@ -155,37 +198,6 @@ struct RpcLogger : Logger
         co_return result::current_exception();
     }
 
-    static void fillEventArg(rpc::log::Event::Builder arg, const Event & e)
-    {
-        overloaded handlers{
-            [&](const Log & l) {
-                arg.initLog().setLevel(rpc::Verbosity(l.level));
-                RPC_FILL(arg.getLog(), setMsg, l.msg);
-            },
-            [&](const LogEI & l) {
-                auto ei = arg.initLogEI();
-                RPC_FILL(ei, initInfo, l.ei);
-            },
-            [&](const StartActivity & s) {
-                auto sa = arg.initStartActivity();
-                sa.setLevel(rpc::Verbosity(s.level));
-                sa.setId(s.id);
-                sa.setType(rpc::log::to(s.type));
-                RPC_FILL(sa, setText, s.text);
-                sa.setParent(s.parent);
-                RPC_FILL(sa, initFields, s.fields);
-            },
-            [&](const StopActivity & s) { arg.initStopActivity().setId(s.id); },
-            [&](const ActivityResult & r) {
-                auto ar = arg.initResult();
-                ar.setId(r.id);
-                ar.setType(rpc::log::to(r.type));
-                RPC_FILL(ar, initFields, r.fields);
-            },
-        };
-        std::visit(handlers, e);
-    }
-
     kj::Promise<void> flushLoop()
     {
         auto req = co_await flushReq.lock();
@@ -263,6 +275,127 @@ struct RpcLogger : Logger
         flag->wait(true);
     }
 };
+
+/// writes batches of events to stderr as frames. frames are written from
+/// a background thread at least every 100ms so that batching never delays
+/// events for long, and when the process exits.
+struct FramedLogger : EventLogger
+{
+    static constexpr size_t frameSizeTarget = 64 * 1024;
+
+    struct Buffer
+    {
+        std::vector<Event> items;
+        /// same rough approximation as in RpcLogger.
+        size_t sizeEstimate = 0;
+    };
+
+    Sync<Buffer> buffer;
+
+    /// signalled when an event is pushed into an empty buffer.
+    std::condition_variable pushed;
+
+    /// held while a batch is serialized and written, so that frames are
+    /// written in the order their events were logged in.
+    std::mutex writeLock;
+
+    FramedLogger()
+    {
+        // the writer sleeps until there are events to write, then gives more
+        // events 100ms to arrive before writing them all as one frame.
+        std::thread([this] {
+            while (true) {
+                {
+                    auto buffer = this->buffer.lock();
+                    while (buffer->items.empty()) {
+                        buffer.wait(pushed);
+                    }
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                writeFrame();
+            }
+        }).detach();
+    }
+
+    bool isVerbose() override
+    {
+        return true;
+    }
+
+    BufferState push(size_t extraSize, Event e) override
+    {
+        bool full;
+        {
+            auto buffer = this->buffer.lock();
+            if (buffer->items.empty()) {
+                pushed.notify_one();
+            }
+            buffer->sizeEstimate += sizeof(e) + extraSize;
+            buffer->items.emplace_back(std::move(e));
+            full = buffer->sizeEstimate >= frameSizeTarget;
+        }
+        if (full) {
+            writeFrame();
+        }
+        return BufferState::HasSpace;
+    }
+
+    /// set while this thread writes a frame, so that `writeLogsToStderr` does
+    /// not try to write pending events before the frame that contains them.
+    static inline thread_local bool writingFrame = false;
+
+    void writeFrame()
+    {
+        if (writingFrame) {
+            return;
+        }
+
+        std::lock_guard _lock(writeLock);
+
+        std::vector<Event> items;
+        {
+            auto buffer = this->buffer.lock();
+            items = std::move(buffer->items);
+            buffer->items.clear();
+            buffer->sizeEstimate = 0;
+        }
+        if (items.empty()) {
+            return;
+        }
+
+        capnp::MallocMessageBuilder message;
+        auto events = message.initRoot<rpc::log::EventBatch>().initEvents(items.size());
+        for (size_t i = 0; i < items.size(); i++) {
+            fillEventArg(events[i], items[i]);
+        }
+
+        kj::VectorOutputStream out;
+        capnp::writePackedMessage(out, message);
+        auto frame = out.getArray();
+
+        writingFrame = true;
+        Finally _done([&] { writingFrame = false; });
+        writeLogsToStderr(
+            fmt("%s%s\n",
+                rpc::log::framePrefix,
+                base64Encode({frame.asChars().begin(), frame.size()}))
+        );
+    }
+
+    void writeToStdout(std::string_view s) override
+    {
+        // stdout and stderr often go to the same place, so anything logged
+        // before `s` must be written before it.
+        writeFrame();
+        Logger::writeToStdout(s);
+    }
+
+    kj::Promise<Result<void>> flush() override
+    {
+        writeFrame();
+        return {result::success()};
+    }
+};
 }
 }
 
@@ -272,11 +405,12 @@ Logger * makeRpcLoggerClient(LogStream::Client remote)
     return new RpcLogger(remote);
 }
 
-kj::Promise<void> RpcLoggerServer::push(PushContext context)
-try {
+Logger::BufferState handleEvent(
+    Event::Reader e, const Activity & parent, std::map<ActivityId, Activity> & activities
+)
+{
     auto state = Logger::BufferState::HasSpace;
 
-    auto e = context.getParams().getE();
     if (e.isStartActivity()) {
         auto args = e.getStartActivity();
         activities.emplace(
@@ -309,6 +443,77 @@ try {
         debug("got unintellegible log message %s", e.toString().flatten().cStr());
     }
 
+    return state;
+}
+
+Logger * makeFramedLogger()
+{
+    // there is nothing to configure, so all users share one logger and one
+    // exit handler that writes the events that are still buffered.
+    static FramedLogger * framed = new FramedLogger;
+    static bool flushAtExit = std::atexit([] { (void) framed->flush(); }) == 0;
+    (void) flushAtExit;
+    // everything else written to stderr must come after the events logged so far.
+    beforeWritingLogsToStderr = [] { framed->writeFrame(); };
+    return framed;
+}
+
+std::optional<Logger::BufferState> handleLogFrame(
+    std::string_view msg,
+    const Activity & act,
+    std::map<ActivityId, Activity> & activities,
+    std::string_view source
+)
+{
+    if (!msg.starts_with(framePrefix)) {
+        return std::nullopt;
+    }
+
+    try {
+        auto frame = base64Decode(msg.substr(framePrefix.size()));
+        kj::ArrayInputStream in(kj::arrayPtr(
+            reinterpret_cast<const kj::byte *>(frame.data()), frame.size()
+        ));
+        capnp::PackedMessageReader reader(in);
+
+        auto state = Logger::BufferState::HasSpace;
+        for (auto e : reader.getRoot<EventBatch>().getEvents()) {
+            if (handleEvent(e, act, activities) == Logger::BufferState::NeedsFlush) {
+                state = Logger::BufferState::NeedsFlush;
+            }
+        }
+        return state;
+    } catch (Error & e) {
+        printTaggedWarning(
+            "Unable to handle a log frame from %s: %s", Uncolored(source), e.what()
+        );
+    } catch (kj::Exception & e) { // NOLINT(lix-foreign-exceptions): capnp packet format errors
+        printTaggedWarning(
+            "Unable to handle a log frame from %s: %s",
+            Uncolored(source),
+            e.getDescription().cStr()
+        );
+    }
+    return std::nullopt;
+}
+
+std::optional<Logger::BufferState> handleStructuredLogMessage(
+    const std::string & msg,
+    const Activity & act,
+    std::map<ActivityId, Activity> & activities,
+    std::string_view source
+)
+{
+    if (auto state = handleLogFrame(msg, act, activities, source)) {
+        return state;
+    }
+    return handleJSONLogMessage(msg, act, activities, source);
+}
+
+kj::Promise<void> RpcLoggerServer::push(PushContext context)
+try {
+    auto state = handleEvent(context.getParams().getE(), parent, activities);
+
     if (state == Logger::BufferState::NeedsFlush) {
         TRY_AWAIT(parent.getLogger().flush());
     }
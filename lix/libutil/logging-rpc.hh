@@ -4,7 +4,9 @@
 #include "lix/libutil/logging.capnp.h"
 #include "logging.hh"
 #include "rpc.hh" // IWYU pragma: keep
+#include <map>
 #include <optional>
+#include <string_view>
 
 namespace nix::rpc::log {
 inline std::optional<nix::ActivityType> from(ActivityType at)
@@ -121,6 +123,59 @@ namespace nix::rpc::log {
  */
 Logger * makeRpcLoggerClient(LogStream::Client remote);
 
+/**
+ * handle an event sent by another process. activities started by the other
+ * process are started as children of `parent` and are kept in `activities`.
+ */
+Logger::BufferState handleEvent(
+    Event::Reader e, const Activity & parent, std::map<ActivityId, Activity> & activities
+);
+
+/**
+ * prefix of the lines written by the framed logger. it is followed by a packed
+ * `EventBatch` message in base64. the frames are binary, but armoring them as
+ * lines lets them pass through ptys, line splitters, and build logs just like
+ * the `@nix` json messages of `makeJSONLogger` do.
+ */
+constexpr std::string_view framePrefix = "@nix-frame ";
+
+/**
+ * create a logger that writes events to stderr in batches of log frames. it is
+ * a cheaper alternative to `makeJSONLogger` for logs read by other lix processes
+ * but not meant for anything else, since its format may change at any time. a
+ * batch is written once it reaches approximately 64 KiB, after at most 100ms,
+ * when the logger is flushed, and when the process exits.
+ */
+Logger * makeFramedLogger();
+
+/**
+ * handle a log frame written by the framed logger. returns `std::nullopt` if
+ * `msg` is not a log frame or cannot be decoded.
+ *
+ * @param source A noun phrase describing the source of the message, e.g. "the builder".
+ */
+[[nodiscard]]
+std::optional<Logger::BufferState> handleLogFrame(
+    std::string_view msg,
+    const Activity & act,
+    std::map<ActivityId, Activity> & activities,
+    std::string_view source
+);
+
+/**
+ * handle a log frame or a `@nix` json message, whichever `msg` is. returns
+ * `std::nullopt` if it is neither.
+ *
+ * @param source A noun phrase describing the source of the message, e.g. "the builder".
+ */
+[[nodiscard]]
+std::optional<Logger::BufferState> handleStructuredLogMessage(
+    const std::string & msg,
+    const Activity & act,
+    std::map<ActivityId, Activity> & activities,
+    std::string_view source
+);
+
 class RpcLoggerServer : public LogStream::Server
 {
 private:
@@ -410,8 +410,14 @@ Activity::~Activity()
     }
 }
 
+std::atomic<void (*)()> beforeWritingLogsToStderr = nullptr;
+
 void writeLogsToStderr(std::string_view s)
 {
+    if (auto before = beforeWritingLogsToStderr.load()) {
+        before();
+    }
+
     // NOTE: If this lock is a regular static item (and not something
     // indestructible), then it will be destructed when Nix shuts down. When
     // other threads are running, it becomes possible for a static to be
@@ -7,6 +7,7 @@
 #include "lix/libutil/log-format.hh" // IWYU pragma: keep
 #include "result.hh"
 #include "serialise.hh"
+#include <atomic>
 #include <kj/async.h>
 #include <optional>
 
@@ -433,6 +434,12 @@ extern LoggerSettings loggerSettings;
 
 void writeLogsToStderr(std::string_view s);
 
+/**
+ * Called by `writeLogsToStderr` before it writes anything. Loggers that hold
+ * back their output set this to write it first, so that stderr stays in order.
+ */
+extern std::atomic<void (*)()> beforeWritingLogsToStderr;
+
 /** Logs a fatal message as loudly as possible. This will go into syslog as well as stderr.
  * The purpose of this function is making failures with redirected stderr louder. */
 void logFatal(std::string const & s);
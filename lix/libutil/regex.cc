@@ -1,4 +1,10 @@
 #include "regex.hh"
+#include "lru-cache.hh"
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <limits>
+#include <map>
 #include <string>
 #include <regex>
 
@@ -28,4 +34,1166 @@ try {
         throw Error("invalid regular expression '%s': %s", re, e.what());
     }
 }
+
+/**
+ * Same as `_GLIBCXX_REGEX_STATE_LIMIT`, so that expressions that compiled
+ * with `std::regex` still compile.
+ */
+static constexpr size_t MAX_PROGRAM_SIZE = 100000;
+
+/**
+ * Nesting depth of groups, to bound the recursion of the parser.
+ */
+static constexpr unsigned MAX_NESTING = 1000;
+
+/**
+ * Lazily built DFAs are thrown away and started over once they reach this
+ * many states.
+ */
+static constexpr size_t MAX_DFA_STATES = 4096;
+
+/**
+ * How many of the innermost loops that can match the empty string are
+ * told apart when merging NFA threads.
+ */
+static constexpr unsigned LOOP_KEY_DEPTH = 2;
+
+/**
+ * Largest number of states (instructions times positions in the subject)
+ * for which submatches are found by backtracking instead of simulating
+ * the NFA, i.e. the size of the bitmap of visited states.
+ */
+static constexpr size_t MAX_BACKTRACK_STATES = 256 * 1024;
+
+static constexpr unsigned UNBOUNDED = std::numeric_limits<unsigned>::max();
+static constexpr size_t npos = std::string_view::npos;
+
+using ByteSet = std::bitset<256>;
+
+enum class Op : uint8_t {
+    /** Consume a byte in `bytes`. */
+    Bytes,
+    Match,
+    Jmp,
+    /** Continue at `x`, and with lower priority at `y`. */
+    Split,
+    /** Record the current position in `slot`. */
+    Save,
+    /** Only continue at the start of the subject. */
+    Begin,
+    /** Only continue at the end of the subject. */
+    End,
+    /**
+     * End of an iteration of a loop whose body can match the empty
+     * string: continue at `x` if the iteration consumed something (its
+     * start was saved to `slot`), otherwise leave the loop at `y`. This
+     * keeps empty iterations from looping forever and matches libstdc++,
+     * which enters such a body at most once without progress.
+     */
+    LoopCheck,
+};
+
+struct Program::Inst
+{
+    Op op;
+    uint32_t x = 0, y = 0, slot = 0;
+    ByteSet bytes;
+    /**
+     * Number of loops with nullable bodies this instruction is in.
+     */
+    uint32_t loopDepth = 0;
+};
+
+namespace {
+
+struct Node
+{
+    enum class Kind { Empty, Bytes, Begin, End, Group, Concat, Alt, Repeat } kind = Kind::Empty;
+    ByteSet bytes;
+    size_t group = 0;
+    unsigned min = 0, max = 0;
+    std::vector<Node> children;
+
+    bool nullable() const
+    {
+        switch (kind) {
+        case Kind::Bytes:
+            return false;
+        case Kind::Group:
+            return children[0].nullable();
+        case Kind::Concat:
+            return std::all_of(children.begin(), children.end(), [](auto & c) {
+                return c.nullable();
+            });
+        case Kind::Alt:
+            return std::any_of(children.begin(), children.end(), [](auto & c) {
+                return c.nullable();
+            });
+        case Kind::Repeat:
+            return min == 0 || children[0].nullable();
+        case Kind::Empty:
+        case Kind::Begin:
+        case Kind::End:
+            return true;
+        }
+        return true;
+    }
+};
+
+static void foldCase(ByteSet & set)
+{
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (set[c] || set[c - 'a' + 'A']) {
+            set[c] = set[c - 'a' + 'A'] = true;
+        }
+    }
+}
+
+static bool addClass(ByteSet & set, std::string_view name)
+{
+    bool (*pred)(unsigned char);
+    // ASCII only, like the C locale
+    if (name == "alpha") {
+        pred = [](unsigned char c) { return (c | 0x20) >= 'a' && (c | 0x20) <= 'z'; };
+    } else if (name == "digit" || name == "d") {
+        pred = [](unsigned char c) { return c >= '0' && c <= '9'; };
+    } else if (name == "alnum") {
+        pred = [](unsigned char c) {
+            return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || (c >= '0' && c <= '9');
+        };
+    } else if (name == "w") {
+        pred = [](unsigned char c) {
+            return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || (c >= '0' && c <= '9') || c == '_';
+        };
+    } else if (name == "upper") {
+        pred = [](unsigned char c) { return c >= 'A' && c <= 'Z'; };
+    } else if (name == "lower") {
+        pred = [](unsigned char c) { return c >= 'a' && c <= 'z'; };
+    } else if (name == "space" || name == "s") {
+        pred = [](unsigned char c) { return c == ' ' || (c >= '\t' && c <= '\r'); };
+    } else if (name == "blank") {
+        pred = [](unsigned char c) { return c == ' ' || c == '\t'; };
+    } else if (name == "cntrl") {
+        pred = [](unsigned char c) { return c < 0x20 || c == 0x7f; };
+    } else if (name == "print") {
+        pred = [](unsigned char c) { return c >= 0x20 && c < 0x7f; };
+    } else if (name == "graph") {
+        pred = [](unsigned char c) { return c > 0x20 && c < 0x7f; };
+    } else if (name == "punct") {
+        pred = [](unsigned char c) {
+            return c > 0x20 && c < 0x7f && !((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+                && !(c >= '0' && c <= '9');
+        };
+    } else if (name == "xdigit") {
+        pred = [](unsigned char c) {
+            return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+        };
+    } else {
+        return false;
+    }
+    for (unsigned c = 0; c < 256; c++) {
+        if (pred(c)) {
+            set[c] = true;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parser for POSIX extended regular expressions, accepting what
+ * `std::regex::extended` accepts: escaped characters are always literals,
+ * and backslashes in bracket expressions are not special.
+ */
+class Parser
+{
+    std::string_view re;
+    bool icase;
+    size_t pos = 0;
+    unsigned depth = 0;
+
+    [[noreturn]] void fail(std::string_view reason)
+    {
+        throw Error("invalid regular expression '%s': %s", re, reason);
+    }
+
+    bool at(char c) const
+    {
+        return pos < re.size() && re[pos] == c;
+    }
+
+    Node literal(unsigned char c)
+    {
+        Node n{.kind = Node::Kind::Bytes};
+        n.bytes[c] = true;
+        if (icase) {
+            foldCase(n.bytes);
+        }
+        return n;
+    }
+
+    unsigned number()
+    {
+        if (pos >= re.size() || !isdigit(static_cast<unsigned char>(re[pos]))) {
+            fail("invalid repetition count");
+        }
+        unsigned n = 0;
+        while (pos < re.size() && isdigit(static_cast<unsigned char>(re[pos]))) {
+            n = n * 10 + (re[pos++] - '0');
+            if (n > MAX_PROGRAM_SIZE) {
+                throw Error("memory limit exceeded by regular expression '%s'", re);
+            }
+        }
+        return n;
+    }
+
+    bool quantifier(Node & atom)
+    {
+        unsigned min, max;
+        if (at('*')) {
+            min = 0, max = UNBOUNDED;
+            pos++;
+        } else if (at('+')) {
+            min = 1, max = UNBOUNDED;
+            pos++;
+        } else if (at('?')) {
+            min = 0, max = 1;
+            pos++;
+        } else if (at('{')) {
+            pos++;
+            min = max = number();
+            if (at(',')) {
+                pos++;
+                max = at('}') ? UNBOUNDED : number();
+            }
+            if (!at('}')) {
+                fail("unterminated repetition count");
+            }
+            pos++;
+            if (max < min) {
+                fail("invalid repetition count");
+            }
+        } else {
+            return false;
+        }
+
+        Node repeat{.kind = Node::Kind::Repeat, .min = min, .max = max};
+        repeat.children.push_back(std::move(atom));
+        atom = std::move(repeat);
+        return true;
+    }
+
+    /**
+     * A single character of a bracket expression, possibly a collating
+     * element like `[.-.]`.
+     */
+    unsigned char bracketChar()
+    {
+        if (at('[') && pos + 1 < re.size() && (re[pos + 1] == '.' || re[pos + 1] == '=')) {
+            auto end = re.find(std::string{re[pos + 1], ']'}, pos + 2);
+            if (end == npos) {
+                fail("unterminated collating element");
+            }
+            if (end != pos + 3) {
+                fail("invalid collating element");
+            }
+            auto c = re[pos + 2];
+            pos = end + 2;
+            return c;
+        }
+        return re[pos++];
+    }
+
+    Node bracket()
+    {
+        Node n{.kind = Node::Kind::Bytes};
+        bool negate = false;
+        if (at('^')) {
+            negate = true;
+            pos++;
+        }
+
+        for (bool first = true;; first = false) {
+            if (pos >= re.size()) {
+                fail("unterminated bracket expression");
+            }
+            if (at(']') && !first) {
+                pos++;
+                break;
+            }
+
+            if (at('[') && pos + 1 < re.size() && re[pos + 1] == ':') {
+                auto end = re.find(":]", pos + 2);
+                if (end == npos) {
+                    fail("unterminated character class");
+                }
+                if (!addClass(n.bytes, re.substr(pos + 2, end - pos - 2))) {
+                    fail("invalid character class");
+                }
+                pos = end + 2;
+                continue;
+            }
+
+            auto lo = bracketChar();
+            if (at('-') && pos + 1 < re.size() && re[pos + 1] != ']') {
+                pos++;
+                if (at('[') && pos + 1 < re.size() && re[pos + 1] == ':') {
+                    fail("invalid range");
+                }
+                auto hi = bracketChar();
+                if (hi < lo) {
+                    fail("invalid range");
+                }
+                for (unsigned c = lo; c <= hi; c++) {
+                    n.bytes[c] = true;
+                }
+            } else {
+                n.bytes[lo] = true;
+            }
+        }
+
+        if (icase) {
+            foldCase(n.bytes);
+        }
+        if (negate) {
+            n.bytes.flip();
+        }
+        return n;
+    }
+
+    Node concat()
+    {
+        Node n{.kind = Node::Kind::Concat};
+
+        while (pos < re.size() && !at('|') && !(at(')') && depth > 0)) {
+            Node atom;
+            bool assertion = false;
+
+            switch (re[pos]) {
+            case '(': {
+                pos++;
+                if (++depth > MAX_NESTING) {
+                    fail("too many nested groups");
+                }
+                atom = {.kind = Node::Kind::Group, .group = ++groups};
+                atom.children.push_back(alternatives());
+                if (!at(')')) {
+                    fail("unmatched '('");
+                }
+                pos++;
+                depth--;
+                break;
+            }
+            case ')':
+                fail("unmatched ')'");
+            case '.':
+                pos++;
+                atom = {.kind = Node::Kind::Bytes};
+                atom.bytes.set();
+                atom.bytes[0] = false;
+                break;
+            case '[':
+                pos++;
+                atom = bracket();
+                break;
+            case '^':
+                pos++;
+                atom = {.kind = Node::Kind::Begin};
+                assertion = true;
+                break;
+            case '$':
+                pos++;
+                atom = {.kind = Node::Kind::End};
+                assertion = true;
+                break;
+            case '\\':
+                pos++;
+                if (pos >= re.size()) {
+                    fail("trailing backslash");
+                }
+                atom = literal(re[pos++]);
+                break;
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                fail("nothing to repeat");
+            default:
+                atom = literal(re[pos++]);
+                break;
+            }
+
+            if (assertion) {
+                if (at('*') || at('+') || at('?') || at('{')) {
+                    fail("nothing to repeat");
+                }
+            } else {
+                while (quantifier(atom)) {
+                }
+            }
+            n.children.push_back(std::move(atom));
+        }
+
+        return n;
+    }
+
+    Node alternatives()
+    {
+        Node n{.kind = Node::Kind::Alt};
+        n.children.push_back(concat());
+        while (at('|')) {
+            pos++;
+            n.children.push_back(concat());
+        }
+        if (n.children.size() == 1) {
+            return std::move(n.children[0]);
+        }
+        return n;
+    }
+
+public:
+    size_t groups = 0;
+
+    Parser(std::string_view re, bool icase) : re(re), icase(icase) {}
+
+    Node parse()
+    {
+        auto n = alternatives();
+        if (pos < re.size()) {
+            fail("unmatched ')'");
+        }
+        return n;
+    }
+};
+
+class Compiler
+{
+    std::string_view re;
+    size_t loopSlots;
+    unsigned loopDepth = 0;
+
+public:
+    std::vector<Program::Inst> program;
+    size_t slots;
+
+    Compiler(std::string_view re, size_t groups)
+        : re(re)
+        , loopSlots(2 * (groups + 1))
+        , slots(loopSlots)
+    {
+    }
+
+    uint32_t emit(Program::Inst inst)
+    {
+        if (program.size() >= MAX_PROGRAM_SIZE) {
+            throw Error("memory limit exceeded by regular expression '%s'", re);
+        }
+        inst.loopDepth = loopDepth;
+        program.push_back(std::move(inst));
+        return program.size() - 1;
+    }
+
+    uint32_t here() const
+    {
+        return program.size();
+    }
+
+    /**
+     * Loops only need their iteration start while they run, so loops that
+     * are not nested in each other share their slot.
+     */
+    void loop(const Node & body, bool atLeastOnce)
+    {
+        bool nullable = body.nullable();
+        uint32_t slot = loopSlots + loopDepth;
+        slots = std::max<size_t>(slots, slot + 1);
+
+        if (atLeastOnce) {
+            auto start = here();
+            if (nullable) {
+                emit({.op = Op::Save, .slot = slot});
+                loopDepth++;
+                compile(body);
+                auto check = emit({.op = Op::LoopCheck, .x = here() + 1, .slot = slot});
+                loopDepth--;
+                auto split = emit({.op = Op::Split, .x = start});
+                program[check].y = program[split].y = here();
+            } else {
+                compile(body);
+                emit({.op = Op::Split, .x = start, .y = here() + 1});
+            }
+        } else {
+            auto split = emit({.op = Op::Split, .x = here() + 1});
+            if (nullable) {
+                emit({.op = Op::Save, .slot = slot});
+                loopDepth++;
+                compile(body);
+                auto check = emit({.op = Op::LoopCheck, .x = split, .slot = slot});
+                loopDepth--;
+                program[check].y = here();
+            } else {
+                compile(body);
+                emit({.op = Op::Jmp, .x = split});
+            }
+            program[split].y = here();
+        }
+    }
+
+    void compile(const Node & n)
+    {
+        switch (n.kind) {
+        case Node::Kind::Empty:
+            break;
+        case Node::Kind::Bytes:
+            emit({.op = Op::Bytes, .bytes = n.bytes});
+            break;
+        case Node::Kind::Begin:
+            emit({.op = Op::Begin});
+            break;
+        case Node::Kind::End:
+            emit({.op = Op::End});
+            break;
+        case Node::Kind::Group:
+            emit({.op = Op::Save, .slot = uint32_t(2 * n.group)});
+            compile(n.children[0]);
+            emit({.op = Op::Save, .slot = uint32_t(2 * n.group + 1)});
+            break;
+        case Node::Kind::Concat:
+            for (auto & c : n.children) {
+                compile(c);
+            }
+            break;
+        case Node::Kind::Alt: {
+            std::vector<uint32_t> jumps;
+            for (size_t i = 0; i < n.children.size(); i++) {
+                if (i + 1 == n.children.size()) {
+                    compile(n.children[i]);
+                    break;
+                }
+                auto split = emit({.op = Op::Split, .x = here() + 1});
+                compile(n.children[i]);
+                jumps.push_back(emit({.op = Op::Jmp}));
+                program[split].y = here();
+            }
+            for (auto j : jumps) {
+                program[j].x = here();
+            }
+            break;
+        }
+        case Node::Kind::Repeat: {
+            auto & body = n.children[0];
+            if (n.max == UNBOUNDED) {
+                for (unsigned i = 1; i < n.min; i++) {
+                    compile(body);
+                }
+                loop(body, n.min > 0);
+            } else {
+                for (unsigned i = 0; i < n.min; i++) {
+                    compile(body);
+                }
+                std::vector<uint32_t> splits;
+                for (unsigned i = n.min; i < n.max; i++) {
+                    splits.push_back(emit({.op = Op::Split, .x = here() + 1}));
+                    compile(body);
+                }
+                for (auto s : splits) {
+                    program[s].y = here();
+                }
+            }
+            break;
+        }
+        }
+    }
+};
+
+}
+
+struct Program::Dfa
+{
+    /**
+     * The NFA instructions making up every state, sorted.
+     */
+    std::vector<std::vector<uint32_t>> states;
+    std::map<std::vector<uint32_t>, uint32_t> ids;
+    /**
+     * Transitions of every state on every byte class, `-1` if not yet known.
+     */
+    std::vector<int32_t> next;
+    std::vector<bool> hasMatch;
+    /**
+     * Whether the state matches at the end of a non-empty subject: -1
+     * if not yet known.
+     */
+    std::vector<int8_t> endMatch;
+    std::optional<uint32_t> start;
+    uint64_t resets = 0;
+
+    /**
+     * Scratch space for computing transitions.
+     */
+    std::vector<uint64_t> mark;
+    uint64_t stamp = 0;
+    std::vector<uint32_t> stack;
+};
+
+namespace {
+/**
+ * Add the instructions reachable from `pc` without consuming input to
+ * `out`. Anchors that do not hold yet at this position are added as well,
+ * `$` may still hold at the end of the subject.
+ */
+void closure(
+    const std::vector<Program::Inst> & program,
+    Program::Dfa & dfa,
+    std::vector<uint32_t> & out,
+    uint32_t pc,
+    bool atBegin,
+    bool atEnd
+)
+{
+    dfa.stack.push_back(pc);
+    while (!dfa.stack.empty()) {
+        pc = dfa.stack.back();
+        dfa.stack.pop_back();
+        if (dfa.mark[pc] == dfa.stamp) {
+            continue;
+        }
+        dfa.mark[pc] = dfa.stamp;
+
+        auto & inst = program[pc];
+        switch (inst.op) {
+        case Op::Jmp:
+            dfa.stack.push_back(inst.x);
+            break;
+        case Op::Split:
+        case Op::LoopCheck:
+            dfa.stack.push_back(inst.y);
+            dfa.stack.push_back(inst.x);
+            break;
+        case Op::Save:
+            dfa.stack.push_back(pc + 1);
+            break;
+        case Op::Begin:
+            if (atBegin) {
+                dfa.stack.push_back(pc + 1);
+            }
+            break;
+        case Op::End:
+            if (atEnd) {
+                dfa.stack.push_back(pc + 1);
+            } else {
+                out.push_back(pc);
+            }
+            break;
+        case Op::Bytes:
+        case Op::Match:
+            out.push_back(pc);
+            break;
+        }
+    }
+}
+}
+
+Program::Program(std::string_view re, bool icase)
+{
+    Parser parser(re, icase);
+    auto root = parser.parse();
+    groups_ = parser.groups;
+
+    Compiler compiler(re, groups_);
+    compiler.emit({.op = Op::Save, .slot = 0});
+    compiler.compile(root);
+    compiler.emit({.op = Op::Save, .slot = 1});
+    compiler.emit({.op = Op::Match});
+    program = std::move(compiler.program);
+    slots = compiler.slots;
+
+    ByteSet boundaries;
+    for (auto & inst : program) {
+        if (inst.op == Op::Bytes) {
+            boundaries |= inst.bytes ^ (inst.bytes << 1);
+        }
+    }
+    for (unsigned c = 1; c < 256; c++) {
+        byteClass[c] = byteClass[c - 1] + (boundaries[c] ? 1 : 0);
+    }
+    byteClasses = byteClass[255] + 1;
+
+    // Unless the expression can match the empty string, matches can only
+    // start at the bytes the NFA can consume first.
+    Dfa start;
+    start.mark.resize(program.size());
+    start.stamp = 1;
+    std::vector<uint32_t> first;
+    closure(program, start, first, 0, true, false);
+    if (std::all_of(first.begin(), first.end(), [&](auto pc) {
+            return program[pc].op == Op::Bytes;
+        }))
+    {
+        firstBytes.emplace();
+        for (auto pc : first) {
+            *firstBytes |= program[pc].bytes;
+        }
+    }
+
+    anchoredDfa = std::make_unique<Sync<Dfa>>();
+    searchDfa = std::make_unique<Sync<Dfa>>();
+}
+
+Program::~Program() = default;
+
+std::shared_ptr<const Program> Program::compile(std::string_view re, bool icase)
+{
+    return std::make_shared<const Program>(re, icase);
+}
+
+bool Program::runDfa(Sync<Dfa> & dfaSync, std::string_view subject, bool anchored) const
+{
+    auto dfa(dfaSync.lock());
+    if (dfa->mark.empty()) {
+        dfa->mark.resize(program.size());
+    }
+
+    auto intern = [&](std::vector<uint32_t> && set) -> uint32_t {
+        std::sort(set.begin(), set.end());
+        if (auto it = dfa->ids.find(set); it != dfa->ids.end()) {
+            return it->second;
+        }
+        if (dfa->states.size() >= MAX_DFA_STATES) {
+            dfa->states.clear();
+            dfa->ids.clear();
+            dfa->next.clear();
+            dfa->hasMatch.clear();
+            dfa->endMatch.clear();
+            dfa->start.reset();
+            dfa->resets++;
+        }
+        uint32_t id = dfa->states.size();
+        dfa->hasMatch.push_back(
+            std::any_of(set.begin(), set.end(), [&](auto pc) { return program[pc].op == Op::Match; })
+        );
+        dfa->endMatch.push_back(-1);
+        dfa->next.resize(dfa->next.size() + byteClasses, -1);
+        dfa->ids.emplace(set, id);
+        dfa->states.push_back(std::move(set));
+        return id;
+    };
+
+    auto matchesAtEnd = [&](uint32_t state, bool atBegin) {
+        std::vector<uint32_t> out;
+        dfa->stamp++;
+        for (auto pc : dfa->states[state]) {
+            if (program[pc].op == Op::End) {
+                closure(program, *dfa, out, pc + 1, atBegin, true);
+            }
+        }
+        return std::any_of(out.begin(), out.end(), [&](auto pc) {
+            return program[pc].op == Op::Match;
+        });
+    };
+
+    if (!dfa->start) {
+        std::vector<uint32_t> set;
+        dfa->stamp++;
+        closure(program, *dfa, set, 0, true, false);
+        dfa->start = intern(std::move(set));
+    }
+
+    auto state = *dfa->start;
+    if (subject.empty()) {
+        return dfa->hasMatch[state] || matchesAtEnd(state, true);
+    }
+
+    for (unsigned char c : subject) {
+        if (!anchored && dfa->hasMatch[state]) {
+            return true;
+        }
+
+        auto next = dfa->next[state * byteClasses + byteClass[c]];
+        if (next >= 0) {
+            state = next;
+        } else {
+            std::vector<uint32_t> set;
+            dfa->stamp++;
+            for (auto pc : dfa->states[state]) {
+                if (program[pc].op == Op::Bytes && program[pc].bytes[c]) {
+                    closure(program, *dfa, set, pc + 1, false, false);
+                }
+            }
+            if (!anchored) {
+                closure(program, *dfa, set, 0, false, false);
+            }
+            auto resets = dfa->resets;
+            auto id = intern(std::move(set));
+            // interning may have thrown away the whole cache, including
+            // the state we came from
+            if (dfa->resets == resets) {
+                dfa->next[state * byteClasses + byteClass[c]] = id;
+            }
+            state = id;
+        }
+
+        if (anchored && dfa->states[state].empty()) {
+            return false;
+        }
+    }
+
+    if (dfa->hasMatch[state]) {
+        return true;
+    }
+    if (dfa->endMatch[state] < 0) {
+        dfa->endMatch[state] = matchesAtEnd(state, false);
+    }
+    return dfa->endMatch[state];
+}
+
+namespace {
+struct Frame
+{
+    uint32_t pc;
+    /**
+     * If set, restore `slot` to `value` instead of following `pc`.
+     */
+    bool restore;
+    uint32_t slot;
+    size_t value;
+    size_t pos = 0;
+};
+
+/**
+ * Key for deduplicating NFA threads. Threads at the same instruction are
+ * merged, keeping the one with the highest priority, as their futures are
+ * the same. In the body of a loop that can match the empty string that is
+ * only true if they agree on whether the current iteration is empty, so
+ * that is part of the key for the innermost such loops.
+ */
+size_t threadKey(
+    const std::vector<Program::Inst> & program,
+    const std::vector<size_t> & scratch,
+    size_t loopSlots,
+    unsigned keyBits,
+    uint32_t pc,
+    size_t pos
+)
+{
+    size_t bits = 0;
+    auto depth = program[pc].loopDepth;
+    for (unsigned j = 0; j < std::min(depth, keyBits); j++) {
+        if (scratch[loopSlots + depth - 1 - j] == pos) {
+            bits |= size_t(1) << j;
+        }
+    }
+    return (size_t(pc) << keyBits) | bits;
+}
+}
+
+std::optional<Match> Program::runNfa(
+    std::string_view subject, size_t from, bool full, bool notEmpty, bool continuous
+) const
+{
+    auto loopSlots = 2 * (groups_ + 1);
+    unsigned keyBits = slots > loopSlots ? LOOP_KEY_DEPTH : 0;
+
+    if (((program.size() << keyBits) * (subject.size() - from + 1)) <= MAX_BACKTRACK_STATES) {
+        return runBacktrack(subject, from, full, notEmpty, continuous);
+    }
+
+    struct ThreadList
+    {
+        std::vector<uint32_t> pcs;
+        /**
+         * `slots` capture slots for every thread.
+         */
+        std::vector<size_t> caps;
+        std::vector<uint32_t> mark;
+        uint32_t stamp = 1;
+
+        void clear()
+        {
+            pcs.clear();
+            caps.clear();
+            stamp++;
+        }
+    };
+
+    std::vector<size_t> scratch(slots, npos);
+    auto key = [&](uint32_t pc, size_t pos) {
+        return threadKey(program, scratch, loopSlots, keyBits, pc, pos);
+    };
+
+    ThreadList lists[2];
+    lists[0].mark.resize(program.size() << keyBits);
+    lists[1].mark.resize(program.size() << keyBits);
+    auto * clist = &lists[0];
+    auto * nlist = &lists[1];
+
+    std::vector<Frame> stack;
+    std::optional<std::vector<size_t>> best;
+
+    // Follows all instructions that do not consume input in order of
+    // priority, with an explicit stack so that large programs cannot
+    // overflow the native one.
+    auto addThread = [&](ThreadList & list, uint32_t pc, size_t pos) {
+        stack.push_back({.pc = pc, .restore = false});
+        while (!stack.empty()) {
+            auto frame = stack.back();
+            stack.pop_back();
+            if (frame.restore) {
+                scratch[frame.slot] = frame.value;
+                continue;
+            }
+
+            for (pc = frame.pc; list.mark[key(pc, pos)] != list.stamp;) {
+                list.mark[key(pc, pos)] = list.stamp;
+                auto & inst = program[pc];
+                if (inst.op == Op::Jmp) {
+                    pc = inst.x;
+                } else if (inst.op == Op::Split) {
+                    stack.push_back({.pc = inst.y, .restore = false});
+                    pc = inst.x;
+                } else if (inst.op == Op::Save) {
+                    stack.push_back({.restore = true, .slot = inst.slot, .value = scratch[inst.slot]});
+                    scratch[inst.slot] = pos;
+                    pc++;
+                } else if (inst.op == Op::LoopCheck) {
+                    pc = scratch[inst.slot] == pos ? inst.y : inst.x;
+                } else if (inst.op == Op::Begin && pos == 0) {
+                    pc++;
+                } else if (inst.op == Op::End && pos == subject.size()) {
+                    pc++;
+                } else {
+                    if (inst.op == Op::Bytes || inst.op == Op::Match) {
+                        list.pcs.push_back(pc);
+                        list.caps.insert(list.caps.end(), scratch.begin(), scratch.end());
+                    }
+                    break;
+                }
+            }
+        }
+    };
+
+    for (size_t pos = from;; pos++) {
+        // Threads are kept in order of priority. Those started at earlier
+        // positions come first, so the first thread to match at a given
+        // position is the leftmost and, among those, the preferred one.
+        if (!best && (pos == from || !(full || continuous))) {
+            std::fill(scratch.begin(), scratch.end(), npos);
+            addThread(*clist, 0, pos);
+        }
+
+        nlist->clear();
+        for (size_t i = 0; i < clist->pcs.size(); i++) {
+            auto & inst = program[clist->pcs[i]];
+            auto caps = &clist->caps[i * slots];
+
+            if (best && caps[0] > (*best)[0]) {
+                continue;
+            }
+
+            if (inst.op == Op::Match) {
+                if ((full && pos != subject.size()) || (notEmpty && caps[0] == pos)) {
+                    continue;
+                }
+                if (!best || caps[0] < (*best)[0] || pos > (*best)[1]) {
+                    best.emplace(caps, caps + 2 * (groups_ + 1));
+                }
+                continue;
+            }
+
+            if (pos < subject.size() && inst.bytes[static_cast<unsigned char>(subject[pos])]) {
+                std::copy(caps, caps + slots, scratch.begin());
+                addThread(*nlist, clist->pcs[i] + 1, pos + 1);
+            }
+        }
+
+        if (pos >= subject.size() || (nlist->pcs.empty() && (best || full || continuous))) {
+            break;
+        }
+        std::swap(clist, nlist);
+
+        if (clist->pcs.empty() && firstBytes) {
+            // nothing is running, skip ahead to where a match could start
+            while (pos + 1 < subject.size()
+                   && !(*firstBytes)[static_cast<unsigned char>(subject[pos + 1])])
+            {
+                pos++;
+            }
+            if (pos + 1 >= subject.size()) {
+                break;
+            }
+        }
+    }
+
+    if (!best) {
+        return std::nullopt;
+    }
+    return Match{std::move(*best)};
+}
+
+/**
+ * Same as the NFA simulation, but following one thread at a time in order
+ * of priority, backtracking when it fails. Every state (instruction and
+ * position) only needs to be explored once: the first time it is reached
+ * it is reached with the highest priority, and everything that can follow
+ * it has been explored afterwards. This is much faster than running all
+ * threads in lockstep, but needs a bit for every state, so it is only
+ * used for short subjects.
+ */
+std::optional<Match> Program::runBacktrack(
+    std::string_view subject, size_t from, bool full, bool notEmpty, bool continuous
+) const
+{
+    auto loopSlots = 2 * (groups_ + 1);
+    unsigned keyBits = slots > loopSlots ? LOOP_KEY_DEPTH : 0;
+    auto positions = subject.size() - from + 1;
+
+    std::vector<bool> visited((program.size() << keyBits) * positions);
+    std::vector<size_t> scratch(slots);
+    std::vector<Frame> stack;
+    std::optional<std::vector<size_t>> best;
+
+    for (size_t start = from; start <= subject.size(); start++) {
+        if (start > from && (full || continuous)) {
+            break;
+        }
+        if (firstBytes
+            && (start == subject.size()
+                || !(*firstBytes)[static_cast<unsigned char>(subject[start])]))
+        {
+            continue;
+        }
+
+        std::fill(scratch.begin(), scratch.end(), npos);
+        stack.push_back({.pc = 0, .restore = false, .pos = start});
+        while (!stack.empty()) {
+            auto frame = stack.back();
+            stack.pop_back();
+            if (frame.restore) {
+                scratch[frame.slot] = frame.value;
+                continue;
+            }
+
+            auto pos = frame.pos;
+            for (auto pc = frame.pc;;) {
+                auto k = threadKey(program, scratch, loopSlots, keyBits, pc, pos) * positions
+                    + (pos - from);
+                if (visited[k]) {
+                    break;
+                }
+                visited[k] = true;
+
+                auto & inst = program[pc];
+                if (inst.op == Op::Bytes && pos < subject.size()
+                    && inst.bytes[static_cast<unsigned char>(subject[pos])])
+                {
+                    pc++;
+                    pos++;
+                } else if (inst.op == Op::Jmp) {
+                    pc = inst.x;
+                } else if (inst.op == Op::Split) {
+                    stack.push_back({.pc = inst.y, .restore = false, .pos = pos});
+                    pc = inst.x;
+                } else if (inst.op == Op::Save) {
+                    stack.push_back({.restore = true, .slot = inst.slot, .value = scratch[inst.slot]});
+                    scratch[inst.slot] = pos;
+                    pc++;
+                } else if (inst.op == Op::LoopCheck) {
+                    pc = scratch[inst.slot] == pos ? inst.y : inst.x;
+                } else if (inst.op == Op::Begin && pos == 0) {
+                    pc++;
+                } else if (inst.op == Op::End && pos == subject.size()) {
+                    pc++;
+                } else {
+                    if (inst.op == Op::Match && !(full && pos != subject.size())
+                        && !(notEmpty && pos == start) && (!best || pos > (*best)[1]))
+                    {
+                        best.emplace(scratch.begin(), scratch.begin() + loopSlots);
+                        if (full) {
+                            return Match{std::move(*best)};
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (best) {
+            break;
+        }
+    }
+
+    if (!best) {
+        return std::nullopt;
+    }
+    return Match{std::move(*best)};
+}
+
+bool Program::matches(std::string_view subject) const
+{
+    return runDfa(*anchoredDfa, subject, true);
+}
+
+bool Program::contains(std::string_view subject) const
+{
+    return runDfa(*searchDfa, subject, false);
+}
+
+std::optional<Match> Program::match(std::string_view subject) const
+{
+    if (!matches(subject)) {
+        return std::nullopt;
+    }
+    if (groups_ == 0) {
+        return Match{{0, subject.size()}};
+    }
+    return runNfa(subject, 0, true, false, false);
+}
+
+std::optional<Match>
+Program::search(std::string_view subject, size_t from, bool notEmpty, bool continuous) const
+{
+    return runNfa(subject, from, false, notEmpty, continuous);
+}
+
+std::vector<Match> Program::searchAll(std::string_view subject) const
+{
+    std::vector<Match> result;
+    if (!contains(subject)) {
+        return result;
+    }
+
+    // same as the increment of std::regex_iterator: after an empty match,
+    // look for a non-empty one at the same position before moving on.
+    auto m = search(subject);
+    while (m) {
+        auto end = m->position() + m->length();
+        bool empty = m->length() == 0;
+        result.push_back(std::move(*m));
+        if (empty) {
+            if (end == subject.size()) {
+                break;
+            }
+            if ((m = search(subject, end, true, true))) {
+                continue;
+            }
+            end++;
+        }
+        m = search(subject, end);
+    }
+    return result;
+}
+
+std::shared_ptr<const Program> cached(std::string_view re, bool icase)
+{
+    static Sync<LRUCache<std::pair<std::string, bool>, std::shared_ptr<const Program>>> cache{
+        std::in_place, 1024
+    };
+
+    std::pair key{std::string(re), icase};
+    if (auto program = cache.lock()->get(key)) {
+        return *program;
+    }
+    auto program = Program::compile(re, icase);
+    cache.lock()->upsert(key, program);
+    return program;
+}
 }
@@ -2,8 +2,16 @@
 ///@file
 
 #include "error.hh"
+#include "sync.hh"
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <regex>
+#include <vector>
 
 namespace nix::regex {
 class Error : public nix::Error
@@ -17,4 +25,148 @@ std::string quoteRegexChars(const std::string & raw);
 std::regex storePathRegex(const std::string & storeDir);
 
 std::regex parse(std::string_view re, std::regex::flag_type flags = std::regex::ECMAScript);
+
+/**
+ * The position of a match of a `Program` and its capture groups in the
+ * subject string. Group 0 is the whole match.
+ */
+struct Match
+{
+    /**
+     * Start and end offset of every group, `std::string_view::npos` for
+     * groups that did not take part in the match.
+     */
+    std::vector<size_t> offsets;
+
+    size_t groups() const
+    {
+        return offsets.size() / 2;
+    }
+
+    bool matched(size_t group) const
+    {
+        return offsets[2 * group] != std::string_view::npos;
+    }
+
+    size_t position(size_t group = 0) const
+    {
+        return offsets[2 * group];
+    }
+
+    size_t length(size_t group = 0) const
+    {
+        return offsets[2 * group + 1] - offsets[2 * group];
+    }
+
+    std::string_view str(std::string_view subject, size_t group = 0) const
+    {
+        return subject.substr(position(group), length(group));
+    }
+};
+
+/**
+ * A compiled POSIX extended regular expression, with the semantics of
+ * `std::regex::extended` in libstdc++ (leftmost-longest matches, the
+ * submatches of the first such match in greedy left-to-right order, `^`
+ * and `$` anchored to the ends of the subject), but matched in time
+ * linear in the length of the subject.
+ *
+ * Submatches are found by simulating the NFA of the expression with all
+ * threads in lockstep, or for short subjects by a backtracking search that
+ * visits every state at most once. Questions that need no submatches are
+ * answered by a DFA built lazily from the same NFA and cached in the
+ * program, which makes them cheap enough to filter out non-matching
+ * subjects first. Programs are immutable apart from that cache and can be
+ * shared between threads.
+ */
+class Program
+{
+public:
+    struct Inst;
+    struct Dfa;
+
+    /**
+     * Compile `re`, ignoring case for ASCII letters if `icase` is set.
+     * Throws `regex::Error` for invalid expressions.
+     */
+    static std::shared_ptr<const Program> compile(std::string_view re, bool icase = false);
+
+    Program(std::string_view re, bool icase);
+    ~Program();
+
+    /**
+     * Number of capture groups, not counting the whole match.
+     */
+    size_t groups() const
+    {
+        return groups_;
+    }
+
+    /**
+     * Whether the whole of `subject` matches.
+     */
+    bool matches(std::string_view subject) const;
+
+    /**
+     * Whether any part of `subject` matches.
+     */
+    bool contains(std::string_view subject) const;
+
+    /**
+     * Match the whole of `subject`, like `std::regex_match`.
+     */
+    std::optional<Match> match(std::string_view subject) const;
+
+    /**
+     * Find the leftmost-longest match starting at or after `from`, like
+     * `std::regex_search`. `notEmpty` rejects empty matches, and
+     * `continuous` only accepts matches starting at `from`.
+     */
+    std::optional<Match> search(
+        std::string_view subject, size_t from = 0, bool notEmpty = false, bool continuous = false
+    ) const;
+
+    /**
+     * All successive matches in `subject`, like `std::regex_iterator`.
+     */
+    std::vector<Match> searchAll(std::string_view subject) const;
+
+private:
+    std::vector<Inst> program;
+    size_t groups_ = 0;
+    /**
+     * Number of capture slots in NFA threads: two per group (including
+     * group 0), and one per nesting level of loops whose body can match
+     * the empty string, recording where the current iteration started.
+     */
+    size_t slots = 0;
+
+    /**
+     * Byte equivalence classes: bytes in the same class are matched by
+     * exactly the same instructions.
+     */
+    std::array<uint8_t, 256> byteClass{};
+    size_t byteClasses = 0;
+
+    /**
+     * The bytes a match can start with, unless a match can be empty.
+     */
+    std::optional<std::bitset<256>> firstBytes;
+
+    std::unique_ptr<Sync<Dfa>> anchoredDfa, searchDfa;
+
+    bool runDfa(Sync<Dfa> & dfa, std::string_view subject, bool anchored) const;
+
+    std::optional<Match>
+    runNfa(std::string_view subject, size_t from, bool full, bool notEmpty, bool continuous) const;
+
+    std::optional<Match> runBacktrack(
+        std::string_view subject, size_t from, bool full, bool notEmpty, bool continuous
+    ) const;
+};
+
+/**
+ * Compile `re` through a process-wide cache of recently used programs.
+ */
+std::shared_ptr<const Program> cached(std::string_view re, bool icase = false);
 }
@@ -5,6 +5,7 @@
 #include "async-io.hh"
 #include "file-descriptor.hh"
 #include "libutil/error.hh"
+#include "lix/libutil/archive.hh"
 #include "lix/libutil/c-calls.hh"
 #include "lix/libutil/charptr-cast.hh"
 #include "lix/libutil/file-system.hh"
@@ -12,6 +13,11 @@
 #include "lix/libutil/serialise.hh"
 #include "result.hh"
 #include "lix/libutil/tarfile.hh"
+#include "lix/libutil/strings.hh"
+
+#include <ctime>
+#include <map>
+#include <unistd.h>
 
 namespace nix {
 
@@ -173,4 +179,348 @@ void unpackTarfile(std::string name, const Path & tarFile, const Path & destDir)
     extract_archive(archive, destDir);
 }
 
+struct TarballTree::Node
+{
+    enum class Type { Directory, Regular, Symlink };
+
+    Type type = Type::Directory;
+    time_t mtime = 0;
+
+    bool executable = false;
+    uint64_t size = 0;
+    /**
+     * Contents of a regular file, unless it was spilled.
+     */
+    std::string contents;
+    std::optional<uint64_t> spillOffset;
+
+    std::string target;
+
+    std::map<std::string, std::unique_ptr<Node>> children;
+
+    std::unique_ptr<Node> copyFile() const
+    {
+        auto copy = std::make_unique<Node>();
+        copy->type = type;
+        copy->mtime = mtime;
+        copy->executable = executable;
+        copy->size = size;
+        copy->contents = contents;
+        copy->spillOffset = spillOffset;
+        copy->target = target;
+        return copy;
+    }
+};
+
+namespace {
+/**
+ * Builds a `TarballTree` the way `extract_archive` would lay out the same
+ * entries on disk.
+ */
+struct TreeBuilder
+{
+    TarArchive & archive;
+    TarballTree::Node & root;
+    std::function<AutoCloseFD()> & createSpillFile;
+    AutoCloseFD & spillFile;
+    uint64_t memoryBudget;
+    uint64_t spillSize = 0, inMemory = 0;
+
+    std::vector<std::string> splitPath(std::string_view path)
+    {
+        std::vector<std::string> components;
+        for (auto & component : tokenizeString<std::vector<std::string>>(path, "/")) {
+            if (component == ".") {
+                continue;
+            }
+            if (component == "..") {
+                throw ArchiveError(
+                    "archive '%s' contains a path with '..': '%s'", archive.name, path
+                );
+            }
+            components.push_back(std::move(component));
+        }
+        return components;
+    }
+
+    /**
+     * The directory that `components` (without its last element) points
+     * to, creating missing directories on the way.
+     */
+    TarballTree::Node & parentOf(const std::vector<std::string> & components, std::string_view path)
+    {
+        auto * dir = &root;
+        for (size_t i = 0; i + 1 < components.size(); i++) {
+            auto & child = dir->children[components[i]];
+            if (child && child->type != TarballTree::Node::Type::Directory) {
+                throw ArchiveError(
+                    "archive '%s' contains '%s', but '%s' is not a directory",
+                    archive.name,
+                    path,
+                    concatStringsSep(
+                        "/", std::vector(components.begin(), components.begin() + i + 1)
+                    )
+                );
+            }
+            if (!child) {
+                child = std::make_unique<TarballTree::Node>();
+                child->mtime = time(nullptr);
+            }
+            dir = child.get();
+        }
+        return *dir;
+    }
+
+    const TarballTree::Node & lookup(std::string_view path)
+    {
+        auto components = splitPath(path);
+        const auto * node = &root;
+        for (auto & component : components) {
+            auto child = node->children.find(component);
+            if (child == node->children.end()
+                || (&component != &components.back()
+                    && child->second->type != TarballTree::Node::Type::Directory))
+            {
+                throw ArchiveError(
+                    "archive '%s' contains a hard link to missing file '%s'", archive.name, path
+                );
+            }
+            node = child->second.get();
+        }
+        return *node;
+    }
+
+    void readContents(TarballTree::Node & node)
+    {
+        auto * a = archive.archive.get();
+        bool spill = inMemory + node.size > memoryBudget;
+        if (spill) {
+            if (!spillFile) {
+                spillFile = createSpillFile();
+            }
+            node.spillOffset = spillSize;
+        }
+
+        std::vector<char> buf(65536);
+        uint64_t got = 0;
+        while (true) {
+            auto n = archive_read_data(a, buf.data(), buf.size());
+            if (n < 0) {
+                archive.check(ARCHIVE_FATAL, "failed to read archive member (%s)");
+            }
+            if (n == 0) {
+                break;
+            }
+            std::string_view data{buf.data(), size_t(n)};
+            if (spill) {
+                writeFull(spillFile.get(), data);
+            } else {
+                node.contents += data;
+            }
+            got += n;
+        }
+
+        // sparse files and the like may have a size that differs from
+        // what the header claims; trust what we actually read.
+        node.size = got;
+        if (spill) {
+            spillSize += got;
+        } else {
+            inMemory += got;
+        }
+    }
+
+    void add(struct archive_entry * entry, std::string_view path)
+    {
+        auto components = splitPath(path);
+        if (components.empty()) {
+            // the root of the archive itself, only its metadata could change
+            return;
+        }
+
+        auto & parent = parentOf(components, path);
+        auto & slot = parent.children[components.back()];
+
+        if (auto hardlink = archive_entry_hardlink(entry)) {
+            auto & target = lookup(hardlink);
+            if (target.type == TarballTree::Node::Type::Directory) {
+                throw ArchiveError(
+                    "archive '%s' contains a hard link to directory '%s'", archive.name, hardlink
+                );
+            }
+            slot = target.copyFile();
+            return;
+        }
+
+        auto node = std::make_unique<TarballTree::Node>();
+        node->mtime = archive_entry_mtime(entry);
+
+        switch (archive_entry_filetype(entry)) {
+        case AE_IFDIR:
+            if (slot && slot->type == TarballTree::Node::Type::Directory) {
+                // extracting a directory twice keeps its contents
+                slot->mtime = node->mtime;
+                return;
+            }
+            break;
+        case AE_IFREG:
+            node->type = TarballTree::Node::Type::Regular;
+            node->executable = (archive_entry_mode(entry) & S_IXUSR) != 0;
+            node->size = archive_entry_size(entry);
+            readContents(*node);
+            break;
+        case AE_IFLNK:
+            node->type = TarballTree::Node::Type::Symlink;
+            if (auto target = archive_entry_symlink(entry)) {
+                node->target = target;
+            }
+            break;
+        default:
+            throw ArchiveError(
+                "archive '%s' contains '%s', which has an unsupported type", archive.name, path
+            );
+        }
+
+        if (slot && slot->type == TarballTree::Node::Type::Directory && !slot->children.empty()
+            && node->type != TarballTree::Node::Type::Directory)
+        {
+            throw ArchiveError(
+                "archive '%s' replaces non-empty directory '%s'", archive.name, path
+            );
+        }
+        slot = std::move(node);
+    }
+};
+}
+
+TarballTree::TarballTree(
+    TarArchive & archive, std::function<AutoCloseFD()> createSpillFile, uint64_t memoryBudget
+)
+    : name(archive.name)
+    , root(std::make_unique<Node>())
+{
+    TreeBuilder builder{archive, *root, createSpillFile, spillFile, memoryBudget};
+
+    for (;;) {
+        struct archive_entry * entry;
+        int r = archive_read_next_header(archive.archive.get(), &entry);
+        if (r == ARCHIVE_EOF) {
+            break;
+        }
+        auto path = archive_entry_pathname(entry);
+        if (!path) {
+            throw ArchiveError(
+                "cannot get archive member name: %s", archive_error_string(archive.archive.get())
+            );
+        }
+        if (r == ARCHIVE_WARN) {
+            printTaggedWarning("%1%", Uncolored(archive_error_string(archive.archive.get())));
+        } else {
+            archive.check(r);
+        }
+        builder.add(entry, path);
+    }
+
+    archive.close();
+}
+
+TarballTree::TarballTree(TarballTree &&) = default;
+TarballTree::~TarballTree() = default;
+
+const TarballTree::Node & TarballTree::topLevel() const
+{
+    if (root->children.size() != 1) {
+        throw Error("tarball '%s' contains an unexpected number of top-level files", name);
+    }
+    return *root->children.begin()->second;
+}
+
+time_t TarballTree::lastModified() const
+{
+    return topLevel().mtime;
+}
+
+static Generator<Bytes> spilledContents(int fd, uint64_t offset, uint64_t size)
+{
+    std::vector<char> buf(65536);
+    while (size > 0) {
+        auto n = ::pread(fd, buf.data(), std::min<uint64_t>(size, buf.size()), offset);
+        if (n < 0) {
+            throw SysError("reading unpacked archive contents");
+        } else if (n == 0) {
+            throw EndOfFile("unexpected end of unpacked archive contents");
+        }
+        offset += n;
+        size -= n;
+        co_yield std::span{buf.data(), size_t(n)};
+    }
+}
+
+static Generator<Bytes> memoryContents(std::string_view contents)
+{
+    co_yield std::span{contents.data(), contents.size()};
+}
+
+static nar::Entry toNar(const TarballTree::Node & node, int spillFd)
+{
+    switch (node.type) {
+    case TarballTree::Node::Type::Regular:
+        return nar::File{
+            node.executable,
+            node.size,
+            node.spillOffset ? spilledContents(spillFd, *node.spillOffset, node.size)
+                             : memoryContents(node.contents),
+        };
+    case TarballTree::Node::Type::Symlink:
+        return nar::Symlink{node.target};
+    case TarballTree::Node::Type::Directory:
+        break;
+    }
+
+    auto contents = [](const TarballTree::Node & node,
+                       int spillFd) -> Generator<std::pair<const std::string &, nar::Entry>> {
+        for (auto & [name, child] : node.children) {
+            co_yield std::pair(std::cref(name), toNar(*child, spillFd));
+        }
+    };
+    return nar::Directory(contents(node, spillFd));
+}
+
+WireFormatGenerator TarballTree::dump() const
+{
+    co_yield nar::dump(toNar(topLevel(), spillFile.get()));
+}
+
+kj::Promise<Result<TarballTree>> readTarball(
+    std::string name, AsyncInputStream & source, std::function<AutoCloseFD()> createSpillFile
+)
+try {
+    Pipe pipe;
+    pipe.create();
+
+    auto thr = std::async(
+        std::launch::async,
+        [&](AutoCloseFD fd) {
+            FdSource source(fd.get());
+            auto archive = TarArchive(name, source);
+            return TarballTree(archive, createSpillFile);
+        },
+        std::move(pipe.readSide)
+    );
+
+    AsyncFdIoStream sink{std::move(pipe.writeSide)};
+    TRY_AWAIT(source.drainInto(sink));
+    co_return thr.get();
+} catch (...) {
+    co_return result::current_exception();
+}
+
+TarballTree readTarball(
+    std::string name, const Path & tarFile, std::function<AutoCloseFD()> createSpillFile
+)
+{
+    auto archive = TarArchive(tarFile, name);
+    return TarballTree(archive, std::move(createSpillFile));
+}
+
 }
@@ -2,8 +2,11 @@
 ///@file
 
 #include "async-io.hh"
+#include "lix/libutil/file-descriptor.hh"
 #include "lix/libutil/serialise.hh"
 #include <archive.h>
+#include <functional>
+#include <memory>
 
 namespace nix {
 
@@ -31,4 +34,61 @@ struct TarArchive
 kj::Promise<Result<void>> unpackTarfile(std::string name, AsyncInputStream & source, const Path & destDir);
 
 void unpackTarfile(std::string name, const Path & tarFile, const Path & destDir);
+
+/**
+ * Archive contents read by `TarballTree` are kept in memory until they add
+ * up to this many bytes, everything after that goes to the spill file.
+ */
+constexpr uint64_t TARBALL_MEMORY_BUDGET = 256 * 1024 * 1024;
+
+/**
+ * The contents of an archive with a single top-level member, read without
+ * unpacking it to disk. File contents are kept in memory up to a budget and
+ * in a spill file beyond that. `dump()` produces the same NAR as unpacking
+ * the archive with `unpackTarfile` and dumping its top-level member.
+ */
+class TarballTree
+{
+public:
+    struct Node;
+
+    /**
+     * Read all entries of `archive`. `createSpillFile` is called at most
+     * once, if the archive does not fit in memory, and must return an empty
+     * file opened for reading and writing.
+     */
+    TarballTree(
+        TarArchive & archive,
+        std::function<AutoCloseFD()> createSpillFile,
+        uint64_t memoryBudget = TARBALL_MEMORY_BUDGET
+    );
+    TarballTree(TarballTree &&);
+    ~TarballTree();
+
+    /**
+     * NAR serialisation of the top-level member. The tree must outlive the
+     * returned generator.
+     */
+    WireFormatGenerator dump() const;
+
+    /**
+     * Modification time the top-level member has after unpacking.
+     */
+    time_t lastModified() const;
+
+private:
+    std::string name;
+    std::unique_ptr<Node> root;
+    AutoCloseFD spillFile;
+
+    const Node & topLevel() const;
+};
+
+kj::Promise<Result<TarballTree>> readTarball(
+    std::string name, AsyncInputStream & source, std::function<AutoCloseFD()> createSpillFile
+);
+
+TarballTree readTarball(
+    std::string name, const Path & tarFile, std::function<AutoCloseFD()> createSpillFile
+);
 }
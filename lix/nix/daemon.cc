@@ -445,6 +445,17 @@ try {
         sockets.emplace_back(socket, createUnixDomainSocket(socket.path, 0666));
     }
 
+    /* The database may have changed while no daemon was running, without
+       the shared path info cache noticing. */
+    try {
+        auto store = TRY_AWAIT(openUncachedStore(AllowDaemon::Disallow));
+        if (auto local = dynamic_cast<LocalStore *>(&*store); local) {
+            local->clearSharedPathInfoCache();
+        }
+    } catch (Error & e) {
+        printTaggedWarning("could not reset the shared path info cache: %s", e.what());
+    }
+
     //  Get rid of children automatically; don't let them become zombies.
     setSigChldAction(true);
 
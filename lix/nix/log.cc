@@ -3,12 +3,56 @@
 #include "lix/libmain/shared.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libstore/log-store.hh"
+#include "lix/libutil/strings.hh"
 #include "log.hh"
 
 namespace nix {
 
 struct CmdLog : InstallableCommand
 {
+    BuildLogSelection selection;
+
+    CmdLog()
+    {
+        addFlag({
+            .longName = "tail",
+            .description = "Only print the last *n* lines of the log.",
+            .labels = {"n"},
+            .handler = {&selection.tail},
+        });
+
+        addFlag({
+            .longName = "lines",
+            .description = "Only print the lines *from* to *to* (inclusive, counting from 1) of the log. "
+                           "*to* may be omitted to print all lines starting at *from*.",
+            .labels = {"from-to"},
+            .handler = {[&](std::string range) {
+                auto dash = range.find('-');
+                auto from = string2Int<uint64_t>(range.substr(0, dash));
+                if (!from || *from == 0) {
+                    throw UsageError("invalid line range '%s'", range);
+                }
+                selection.firstLine = *from - 1;
+                if (dash == std::string::npos) {
+                    selection.endLine = *from;
+                } else if (dash + 1 < range.size()) {
+                    auto to = string2Int<uint64_t>(range.substr(dash + 1));
+                    if (!to || *to < *from) {
+                        throw UsageError("invalid line range '%s'", range);
+                    }
+                    selection.endLine = *to;
+                }
+            }},
+        });
+
+        addFlag({
+            .longName = "grep",
+            .description = "Only print lines of the log that contain *string*.",
+            .labels = {"string"},
+            .handler = {&selection.grep},
+        });
+    }
+
     std::string description() override
     {
         return "show the build log of the specified packages or paths, if available";
@@ -52,7 +96,7 @@ struct CmdLog : InstallableCommand
                 }
                 auto & logSub = *logSubP;
 
-                auto log = aio().blockOn(logSub.getBuildLog(path));
+                auto log = aio().blockOn(logSub.getBuildLogLines(path, selection));
                 if (!log) {
                     continue;
                 }
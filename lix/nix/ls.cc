@@ -137,9 +137,14 @@ struct CmdLsStore : StoreCommand, MixLs
                 );
                 JSON j = json::parse(std::move(file), "a nar content listing");
                 if (j["version"] == 1) {
-                    accessor = makeLazyNarAccessor(j["root"].dump(), [](uint64_t, uint64_t) -> std::string {
-                        throw Error("attempted to read NAR content during listing");
-                    });
+                    accessor = makeLazyNarAccessor(
+                        j["root"].dump(),
+                        [](uint64_t, uint64_t) -> kj::Promise<Result<std::string>> {
+                            return {result::failure(std::make_exception_ptr(
+                                Error("attempted to read NAR content during listing")
+                            ))};
+                        }
+                    );
                     path = restPath;
                 }
             }
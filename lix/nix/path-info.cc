@@ -14,6 +14,7 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 {
     bool showSize = false;
     bool showClosureSize = false;
+    bool showUniqueSize = false;
     bool humanReadable = false;
     bool showSigs = false;
 
@@ -33,10 +34,16 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
             .handler = {&showClosureSize, true},
         });
 
+        addFlag({
+            .longName = "unique-size",
+            .description = "Print the sum of the sizes of the NAR serialisations of the paths in the closure of each path that can only be reached through it from the outermost given paths.",
+            .handler = {&showUniqueSize, true},
+        });
+
         addFlag({
             .longName = "human-readable",
             .shortName = 'h',
-            .description = "With `-s` and `-S`, print sizes in a human-friendly format such as `5.67G`.",
+            .description = "With `-s`, `-S` and `--unique-size`, print sizes in a human-friendly format such as `5.67G`.",
             .handler = {&humanReadable, true},
         });
 
@@ -148,7 +155,7 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
                                  // FIXME: preserve order?
                                  StorePathSet(storePaths.begin(), storePaths.end()),
                                  true,
-                                 showClosureSize,
+                                 showClosureSize || showUniqueSize,
                                  HashFormat::SRI,
                                  AllowInvalid
                              ))
@@ -157,20 +164,30 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 
         else {
 
+            std::map<StorePath, ClosureSize> closureSizes;
+            if (showClosureSize || showUniqueSize) {
+                closureSizes = aio().blockOn(
+                    store->getClosureSizes(StorePathSet(storePaths.begin(), storePaths.end()))
+                );
+            }
+
             for (auto & storePath : storePaths) {
                 auto info = aio().blockOn(store->queryPathInfo(storePath));
                 auto storePathS = store->printStorePath(info->path);
 
                 std::cout << storePathS;
 
-                if (showSize || showClosureSize || showSigs)
+                if (showSize || showClosureSize || showUniqueSize || showSigs)
                     std::cout << std::string(std::max(0, (int) pathLen - (int) storePathS.size()), ' ');
 
                 if (showSize)
                     printSize(info->narSize);
 
                 if (showClosureSize)
-                    printSize(aio().blockOn(store->getClosureSize(info->path)).first);
+                    printSize(closureSizes.at(info->path).narSize);
+
+                if (showUniqueSize)
+                    printSize(closureSizes.at(info->path).uniqueSize);
 
                 if (showSigs) {
                     std::cout << '\t';
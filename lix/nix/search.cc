@@ -12,9 +12,10 @@
 #include "lix/libutil/hilite.hh"
 #include "lix/libutil/json.hh"
 #include "lix/libutil/regex.hh"
+#include "lix/libutil/serialise.hh"
+#include "lix/libutil/users.hh"
 #include "search.hh"
 
-#include <regex>
 #include <fstream>
 
 namespace nix {
@@ -24,6 +25,91 @@ std::string wrap(std::string prefix, std::string s)
     return concatStrings(prefix, s, ANSI_NORMAL);
 }
 
+/**
+ * A package found by `nix search`, before matching it against the query.
+ */
+struct SearchEntry
+{
+    std::string attrPath;
+    std::string pname;
+    std::string version;
+    std::string description;
+};
+
+static constexpr std::string_view SEARCH_INDEX_MAGIC = "lix-search-index-1";
+
+/**
+ * The search index of the packages under `attrPath` in the evaluation
+ * cache with the given fingerprint, stored next to that cache.
+ */
+static Path searchIndexPath(const Hash & fingerprint, std::string_view attrPath)
+{
+    return getCacheDir() + "/nix/search-index-v1/" + base16Encode(fingerprint) + "-"
+        + hashString(HashType::SHA256, attrPath).to_string(HashFormat::Base32, false) + ".idx";
+}
+
+/**
+ * Search indices store the entries column by column: all attribute paths,
+ * then all package names, and so on, each as a length-prefixed string.
+ */
+static constexpr std::string SearchEntry::* searchIndexColumns[] = {
+    &SearchEntry::attrPath,
+    &SearchEntry::pname,
+    &SearchEntry::version,
+    &SearchEntry::description,
+};
+
+static std::optional<std::vector<SearchEntry>> readSearchIndex(const Path & path)
+{
+    if (!pathExists(path)) {
+        return std::nullopt;
+    }
+
+    try {
+        auto data = readFile(path);
+        StringSource source{data};
+        if (readString(source) != SEARCH_INDEX_MAGIC) {
+            return std::nullopt;
+        }
+        auto size = readNum<uint64_t>(source);
+        // every entry takes at least one length field per column
+        if (size > data.size() / 8) {
+            throw Error("too many entries");
+        }
+        std::vector<SearchEntry> entries(size);
+        for (auto column : searchIndexColumns) {
+            for (auto & entry : entries) {
+                entry.*column = readString(source);
+            }
+        }
+        return entries;
+    } catch (Error & e) {
+        debug("ignoring unreadable search index '%s': %s", path, e.msg());
+        return std::nullopt;
+    }
+}
+
+static void writeSearchIndex(const Path & path, const std::vector<SearchEntry> & entries)
+{
+    try {
+        StringSink sink;
+        sink << SEARCH_INDEX_MAGIC << entries.size();
+        for (auto column : searchIndexColumns) {
+            for (auto & entry : entries) {
+                sink << entry.*column;
+            }
+        }
+
+        auto dir = dirOf(path);
+        createDirs(dir);
+        auto tmp = makeTempPath(dir);
+        writeFile(tmp, sink.s);
+        renameFile(tmp, path);
+    } catch (Error & e) {
+        debug("could not write search index '%s': %s", path, e.msg());
+    }
+}
+
 struct CmdSearch : InstallableCommand, MixJSON
 {
     std::vector<std::string> res;
@@ -74,16 +160,16 @@ struct CmdSearch : InstallableCommand, MixJSON
         if (res.empty())
             throw UsageError("Must provide at least one regex! To match all packages, use '%s'.", "nix search <installable> ^");
 
-        std::vector<std::regex> regexes;
-        std::vector<std::regex> excludeRegexes;
+        std::vector<std::shared_ptr<const nix::regex::Program>> regexes;
+        std::vector<std::shared_ptr<const nix::regex::Program>> excludeRegexes;
         regexes.reserve(res.size());
         excludeRegexes.reserve(excludeRes.size());
 
         for (auto & re : res)
-            regexes.push_back(nix::regex::parse(re, std::regex::extended | std::regex::icase));
+            regexes.push_back(nix::regex::cached(re, true));
 
         for (auto & re : excludeRes)
-            excludeRegexes.emplace_back(nix::regex::parse(re, std::regex::extended | std::regex::icase));
+            excludeRegexes.emplace_back(nix::regex::cached(re, true));
 
         auto evaluator = getEvaluator();
         auto state = evaluator->begin(aio());
@@ -93,6 +179,64 @@ struct CmdSearch : InstallableCommand, MixJSON
 
         uint64_t results = 0;
 
+        auto show = [&](const SearchEntry & entry) {
+            std::vector<nix::regex::Match> attrPathMatches;
+            std::vector<nix::regex::Match> descriptionMatches;
+            std::vector<nix::regex::Match> nameMatches;
+            bool found = false;
+
+            for (auto & regex : excludeRegexes) {
+                if (
+                    regex->contains(entry.attrPath)
+                    || regex->contains(entry.pname)
+                    || regex->contains(entry.description))
+                    return;
+            }
+
+            for (auto & regex : regexes) {
+                found = false;
+                auto addAll = [&found](std::vector<nix::regex::Match> matches, std::vector<nix::regex::Match> & vec) {
+                    for (auto & match : matches) {
+                        vec.push_back(std::move(match));
+                        found = true;
+                    }
+                };
+
+                addAll(regex->searchAll(entry.attrPath), attrPathMatches);
+                addAll(regex->searchAll(entry.pname), nameMatches);
+                addAll(regex->searchAll(entry.description), descriptionMatches);
+
+                if (!found)
+                    break;
+            }
+
+            if (found)
+            {
+                results++;
+                if (json) {
+                    (*jsonOut)[entry.attrPath] = {
+                        {"pname", entry.pname},
+                        {"version", entry.version},
+                        {"description", entry.description},
+                    };
+                } else {
+                    if (results > 1) logger->cout("");
+                    logger->cout(
+                        "* %s%s",
+                        wrap("\e[0;1m", hiliteMatches(entry.attrPath, attrPathMatches, ANSI_GREEN, "\e[0;1m")),
+                        entry.version != "" ? " (" + entry.version + ")" : "");
+                    if (entry.description != "")
+                        logger->cout(
+                            "  %s", hiliteMatches(entry.description, descriptionMatches, ANSI_GREEN, ANSI_NORMAL));
+                }
+            }
+        };
+
+        std::vector<SearchEntry> entries;
+        // errors under legacyPackages are skipped, but the packages found in
+        // such a walk must not be indexed as all the packages of the cursor.
+        bool skippedErrors = false;
+
         std::function<void(eval_cache::AttrCursor & cursor, const std::vector<std::string> & attrPath, bool initialRecurse)> visit;
 
         visit = [&](eval_cache::AttrCursor & cursor,
@@ -119,59 +263,14 @@ struct CmdSearch : InstallableCommand, MixJSON
                     auto aDescription = aMeta ? aMeta->maybeGetAttr(*state, "description") : nullptr;
                     auto description = aDescription ? aDescription->getString(*state) : "";
                     std::replace(description.begin(), description.end(), '\n', ' ');
-                    auto attrPath2 = concatStringsSep(".", attrPath);
-
-                    std::vector<std::smatch> attrPathMatches;
-                    std::vector<std::smatch> descriptionMatches;
-                    std::vector<std::smatch> nameMatches;
-                    bool found = false;
-
-                    for (auto & regex : excludeRegexes) {
-                        if (
-                            std::regex_search(attrPath2, regex)
-                            || std::regex_search(name.name, regex)
-                            || std::regex_search(description, regex))
-                            return;
-                    }
-
-                    for (auto & regex : regexes) {
-                        found = false;
-                        auto addAll = [&found](std::sregex_iterator it, std::vector<std::smatch> & vec) {
-                            const auto end = std::sregex_iterator();
-                            while (it != end) {
-                                vec.push_back(*it++);
-                                found = true;
-                            }
-                        };
-
-                        addAll(std::sregex_iterator(attrPath2.begin(), attrPath2.end(), regex), attrPathMatches);
-                        addAll(std::sregex_iterator(name.name.begin(), name.name.end(), regex), nameMatches);
-                        addAll(std::sregex_iterator(description.begin(), description.end(), regex), descriptionMatches);
-
-                        if (!found)
-                            break;
-                    }
 
-                    if (found)
-                    {
-                        results++;
-                        if (json) {
-                            (*jsonOut)[attrPath2] = {
-                                {"pname", name.name},
-                                {"version", name.version},
-                                {"description", description},
-                            };
-                        } else {
-                            if (results > 1) logger->cout("");
-                            logger->cout(
-                                "* %s%s",
-                                wrap("\e[0;1m", hiliteMatches(attrPath2, attrPathMatches, ANSI_GREEN, "\e[0;1m")),
-                                name.version != "" ? " (" + name.version + ")" : "");
-                            if (description != "")
-                                logger->cout(
-                                    "  %s", hiliteMatches(description, descriptionMatches, ANSI_GREEN, ANSI_NORMAL));
-                        }
-                    }
+                    entries.push_back({
+                        .attrPath = concatStringsSep(".", attrPath),
+                        .pname = name.name,
+                        .version = name.version,
+                        .description = description,
+                    });
+                    show(entries.back());
                 }
 
                 else if (
@@ -192,11 +291,39 @@ struct CmdSearch : InstallableCommand, MixJSON
             } catch (EvalError & e) {
                 if (!(attrPath.size() > 0 && attrPath[0] == "legacyPackages"))
                     throw;
+                skippedErrors = true;
             }
         };
 
-        for (auto & cursor : installableValue->getCursors(*state))
-            visit(*cursor, cursor->getAttrPath(*state), true);
+        for (auto & cursor : installableValue->getCursors(*state)) {
+            auto attrPath = cursor->getAttrPath(*state);
+
+            // The packages under a cursor only depend on what the cache
+            // fingerprint covers, so they can be searched again without
+            // walking the attribute tree.
+            auto fingerprint = cursor->getCacheFingerprint();
+            std::optional<Path> indexPath;
+            if (fingerprint) {
+                indexPath = searchIndexPath(*fingerprint, concatStringsSep(".", attrPath));
+                if (auto indexed = readSearchIndex(*indexPath)) {
+                    debug("using search index '%s'", *indexPath);
+                    for (auto & entry : *indexed) {
+                        show(entry);
+                    }
+                    continue;
+                }
+            }
+
+            entries.clear();
+            skippedErrors = false;
+            visit(*cursor, attrPath, true);
+
+            if (indexPath && skippedErrors) {
+                debug("not writing search index '%s', some packages failed to evaluate", *indexPath);
+            } else if (indexPath) {
+                writeSearchIndex(*indexPath, entries);
+            }
+        }
 
         if (json)
             logger->cout("%s", *jsonOut);
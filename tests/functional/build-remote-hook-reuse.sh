@@ -0,0 +1,54 @@
+source common.sh
+
+requireSandboxSupport
+[[ $busybox =~ busybox ]] || skipTest "no busybox"
+
+# Avoid store dir being inside sandbox build-dir
+unset NIX_STORE_DIR
+
+# Every connection to the builder runs this wrapper, which records the pid of
+# the `nix-store --serve` process answering it.
+cat > "$TEST_ROOT/serve.sh" <<EOF
+#!$shell
+echo \$\$ >> "$TEST_ROOT/serve-pids"
+exec nix-store "\$@"
+EOF
+chmod +x "$TEST_ROOT/serve.sh"
+
+builder="ssh://localhost?remote-program=$TEST_ROOT/serve.sh&remote-store=$TEST_ROOT/machine1 - - 1 1"
+
+# A chain of derivations, so the builds run one after another.
+expr='{ busybox }:
+  let
+    step = name: dep: derivation {
+      inherit name;
+      system = builtins.currentSystem;
+      builder = busybox;
+      args = [ "sh" "-c" "echo ${dep} > $out" ];
+    };
+  in step "hook-reuse-c" (step "hook-reuse-b" (step "hook-reuse-a" ""))'
+
+buildChain() {
+    chmod -R +w "$TEST_ROOT"/machine* || true
+    rm -rf "$TEST_ROOT"/machine* "$TEST_ROOT/serve-pids"
+    nix-build --no-out-link --expr "$expr" --arg busybox "$busybox" \
+        --store "$TEST_ROOT/machine0" \
+        --max-jobs 0 \
+        --builders "$builder" \
+        "$@"
+}
+
+# All three builds go through one hook and its connection to the builder.
+buildChain
+[[ $(wc -l < "$TEST_ROOT/serve-pids") -eq 1 ]]
+
+# Builders may go away between builds. The reused hook notices that its
+# connection is dead and reconnects instead of failing the next build.
+cat > "$TEST_ROOT/kill-serve.sh" <<EOF
+#!$shell
+kill \$(tail -n 1 "$TEST_ROOT/serve-pids")
+EOF
+chmod +x "$TEST_ROOT/kill-serve.sh"
+
+buildChain --post-build-hook "$TEST_ROOT/kill-serve.sh"
+[[ $(wc -l < "$TEST_ROOT/serve-pids") -eq 3 ]]
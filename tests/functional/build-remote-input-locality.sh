@@ -0,0 +1,42 @@
+source common.sh
+
+requireSandboxSupport
+[[ $busybox =~ busybox ]] || skipTest "no busybox"
+
+# Avoid store dir being inside sandbox build-dir
+unset NIX_STORE_DIR
+
+chmod -R +w "$TEST_ROOT"/machine* || true
+rm -rf "$TEST_ROOT"/machine* || true
+
+# An input that only the second machine already has.
+head -c 1048576 /dev/urandom > "$TEST_ROOT/blob"
+blob=$(nix store add-path --store "$TEST_ROOT/machine0" "$TEST_ROOT/blob")
+nix copy --no-check-sigs --from "$TEST_ROOT/machine0" --to "$TEST_ROOT/machine2" "$blob"
+
+expr='{ busybox, blob, name }:
+  derivation {
+    inherit name;
+    system = builtins.currentSystem;
+    builder = busybox;
+    args = [ "sh" "-c" "cat ${blob} > $out" ];
+  }'
+
+buildOn() {
+    nix-build --no-out-link --expr "$expr" \
+        --arg busybox "$busybox" --arg blob "$TEST_ROOT/blob" --argstr name "$1" \
+        --store "$TEST_ROOT/machine0" \
+        --max-jobs 0 \
+        --builders "$TEST_ROOT/machine1 - - 1 1; $TEST_ROOT/machine2 - - 1 1" \
+        "${@:2}"
+}
+
+# Both machines are idle, but only the second one has the input.
+buildOn by-locality --option builders-input-locality 1
+nix path-info --store "$TEST_ROOT/machine2" --all | grepQuiet by-locality
+nix path-info --store "$TEST_ROOT/machine1" --all | grepQuietInverse by-locality
+
+# Without locality the first machine is chosen.
+buildOn by-load
+nix path-info --store "$TEST_ROOT/machine1" --all | grepQuiet by-load
+nix path-info --store "$TEST_ROOT/machine2" --all | grepQuietInverse by-load
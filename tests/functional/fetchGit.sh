@@ -221,3 +221,41 @@ path13=$(nix eval --impure --raw --expr "(builtins.fetchGit { url = \"file://$re
 
 path14=$(nix eval --impure --raw --expr "(builtins.fetchGit { url = \"file://$repo\"; ref = \"refs/tags/branch\"; }).outPath")
 [[ "$path14" = "$path12" ]]
+
+# trees read directly from git objects must match what git archive produces
+repo="$TEST_ROOT/git-tree"
+rm -rf "$repo"
+git init "$repo"
+git -C "$repo" config user.email "foobar@example.com"
+git -C "$repo" config user.name "Foobar"
+mkdir -p "$repo/dir/sub"
+echo content > "$repo/dir/sub/file"
+echo '#!/bin/sh' > "$repo/exec" && chmod +x "$repo/exec"
+ln -s dir/sub/file "$repo/link"
+echo "a-b" > "$repo/a-b"
+git -C "$repo" add .
+git -C "$repo" commit -m 'tree'
+path15=$(nix eval --impure --raw --expr "(builtins.fetchGit \"file://$repo\").outPath")
+[[ -x "$path15/exec" ]]
+[[ "$(readlink "$path15/link")" = dir/sub/file ]]
+[[ "$(nix-hash --type sha256 "$path15")" = "$(git -C "$repo" archive HEAD | (mkdir "$TEST_ROOT/git-tree-unpacked" && tar -x -C "$TEST_ROOT/git-tree-unpacked") && nix-hash --type sha256 "$TEST_ROOT/git-tree-unpacked")" ]]
+
+# commits that keep the tree reuse the imported store path
+git -C "$repo" commit --allow-empty -m 'metadata only'
+path16=$(nix eval --impure --raw --expr "(builtins.fetchGit \"file://$repo\").outPath")
+[[ "$path16" = "$path15" ]]
+
+# attributes configured outside the tree bypass the cached import of the tree
+mkdir -p "$repo/.git/info"
+echo "exec export-ignore" > "$repo/.git/info/attributes"
+git -C "$repo" commit --allow-empty -m 'metadata only again'
+path16a=$(nix eval --impure --raw --expr "(builtins.fetchGit \"file://$repo\").outPath")
+[[ ! -e "$path16a/exec" ]]
+rm "$repo/.git/info/attributes"
+
+# .gitattributes still applies
+echo "exec export-ignore" > "$repo/.gitattributes"
+git -C "$repo" add .gitattributes
+git -C "$repo" commit -m 'attributes'
+path17=$(nix eval --impure --raw --expr "(builtins.fetchGit \"file://$repo\").outPath")
+[[ ! -e "$path17/exec" ]]
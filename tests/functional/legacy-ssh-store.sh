@@ -7,3 +7,9 @@ nix --store "$store_uri" store ping --json | jq -e 'has("trusted") | not'
 
 # Suppress grumpiness about multiple nixes on PATH
 (nix --store "$store_uri" doctor || true) 2>&1 | grep 'You are unknown trust'
+
+# Closures are queried with all their path infos at once
+outPath=$(nix-build --no-out-link dependencies.nix)
+nix copy --to "$store_uri" "$outPath"
+nix path-info --store "$store_uri" -r "$outPath" --debug 2>&1 | grepQuietInverse "querying remote host '.*' for info on"
+[[ $(nix path-info --store "$store_uri" -r "$outPath" | wc -l) == $(nix path-info -r "$outPath" | wc -l) ]]
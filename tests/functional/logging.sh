@@ -13,6 +13,24 @@ rm -rf $NIX_LOG_DIR
 (! nix-store -l $path)
 nix-build dependencies.nix --no-out-link --compress-build-log
 [ "$(nix-store -l $path)" = FOO ]
+# compressed logs are written as bzip2 unless indexed logs are enabled.
+find "$NIX_LOG_DIR/drvs" -name '*.bz2' | grepQuiet .
+find "$NIX_LOG_DIR/drvs" -name '*.zst' | grepQuietInverse .
+
+clearStore
+rm -rf $NIX_LOG_DIR
+nix-build dependencies.nix --no-out-link --compress-build-log --index-build-logs
+[ "$(nix-store -l $path)" = FOO ]
+[ "$(nix log --tail 1 $path)" = FOO ]
+find "$NIX_LOG_DIR/drvs" -name '*.zst' | grepQuiet .
+find "$NIX_LOG_DIR/drvs" -name '*.bz2' | grepQuietInverse .
+
+# rebuilding replaces the log in the other format instead of leaving it behind.
+clearStore
+nix-build dependencies.nix --no-out-link --compress-build-log
+[ "$(nix-store -l $path)" = FOO ]
+find "$NIX_LOG_DIR/drvs" -name '*.bz2' | grepQuiet .
+find "$NIX_LOG_DIR/drvs" -name '*.zst' | grepQuietInverse .
 
 # test whether empty logs work fine with `nix log`.
 builder="$(realpath "$(mktemp)")"
@@ -108,3 +108,46 @@ if canWriteNonUtf8Inodes; then
     # Confirm that there's no more than one `.ls` in the `$cacheDir` because non-UTF8 inodes cannot have `.ls` generated for them.
     [[ $(find $cacheDir -type f -name '*.ls' | wc -l) -eq 1 ]] || (echo "Expected at most one listing file in $cacheDir, found more"; exit -1)
 fi
+
+unset _NIX_FORCE_HTTP
+
+# Test reading single files from uncompressed NARs with range requests. All
+# of the NAR except the contents of foo/data is blanked, so reading it only
+# works if the rest of the NAR is never fetched.
+rangeCacheDir="$TEST_ROOT/range-cache"
+nix copy --to "file://$rangeCacheDir?compression=none&write-nar-listing=true" $storePath
+rangeNar=$(echo "$rangeCacheDir/nar/"*.nar)
+mv "$rangeNar" "$rangeNar.orig"
+{
+    head -c 736 /dev/zero
+    tail -c +737 "$rangeNar.orig" | head -c 58
+    head -c $(( $(wc -c < "$rangeNar.orig") - 794 )) /dev/zero
+} > "$rangeNar"
+nix store cat $storePath/foo/data --store "file://$rangeCacheDir" > data.cat-range
+diff -u data.cat-range $storePath/foo/data
+mv "$rangeNar.orig" "$rangeNar"
+
+# curl has no range requests for files, so this falls back to the whole NAR
+_NIX_FORCE_HTTP=1 nix store cat $storePath/foo/data --store "file://$rangeCacheDir" > data.cat-range
+diff -u data.cat-range $storePath/foo/data
+
+# the whole NAR then ends up in the local NAR cache, like without a listing
+rangeNarCache="$TEST_ROOT/range-nar-cache"
+_NIX_FORCE_HTTP=1 nix store cat $storePath/foo/data --store "file://$rangeCacheDir?local-nar-cache=$rangeNarCache" > data.cat-range
+diff -u data.cat-range $storePath/foo/data
+[[ $(find "$rangeNarCache" -type f -name '*.nar' | wc -l) -eq 1 ]]
+mv "$rangeCacheDir/nar" "$rangeCacheDir/nar.away"
+_NIX_FORCE_HTTP=1 nix store cat $storePath/foo/data --store "file://$rangeCacheDir?local-nar-cache=$rangeNarCache" > data.cat-range
+diff -u data.cat-range $storePath/foo/data
+mv "$rangeCacheDir/nar.away" "$rangeCacheDir/nar"
+
+# Test reading single files from NARs compressed in chunks
+seekableCacheDir="$TEST_ROOT/seekable-cache"
+nix copy --to "file://$seekableCacheDir?compression=zstd&seekable-compression=true&write-nar-listing=true" $storePath
+jq -e '.chunks.compression == "zstd" and (.chunks.offsets | length) == 2' "$seekableCacheDir/"*.ls
+nix store cat $storePath/foo/data --store "file://$seekableCacheDir" > data.cat-seekable
+diff -u data.cat-seekable $storePath/foo/data
+
+# chunked NARs are still valid zstd files
+_NIX_FORCE_HTTP=1 nix store cat $storePath/foo/data --store "file://$seekableCacheDir" > data.cat-seekable
+diff -u data.cat-seekable $storePath/foo/data
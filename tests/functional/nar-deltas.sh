@@ -0,0 +1,27 @@
+source common.sh
+
+# Check that paths are sent as deltas against an older version of the same
+# package that the remote store already has.
+
+clearStore
+
+mkdir -p $TEST_ROOT/delta-v1 $TEST_ROOT/delta-v2
+head -c $((256 * 1024)) /dev/urandom > $TEST_ROOT/delta-v1/delta-test-1.0
+{ cat $TEST_ROOT/delta-v1/delta-test-1.0; echo "a new line"; } > $TEST_ROOT/delta-v2/delta-test-1.1
+old=$(nix-store --add $TEST_ROOT/delta-v1/delta-test-1.0)
+new=$(nix-store --add $TEST_ROOT/delta-v2/delta-test-1.1)
+
+storeQueryParam="store=${NIX_STORE_DIR}"
+remoteRoot="$TEST_ROOT/stores/nar-deltas"
+chmod -R u+w "$remoteRoot" || true
+rm -rf "$remoteRoot"
+remoteStore="ssh-ng://localhost?${storeQueryParam}&remote-store=${remoteRoot}%3f${storeQueryParam}%26real=${remoteRoot}${NIX_STORE_DIR}&nar-deltas=true"
+
+# nothing to base the first version on
+nix copy --debug --no-check-sigs --to "$remoteStore" "$old" 2> $TEST_ROOT/log
+grepQuietInverse "as a delta against" $TEST_ROOT/log
+cmp "$old" "${remoteRoot}${old}"
+
+nix copy --debug --no-check-sigs --to "$remoteStore" "$new" 2> $TEST_ROOT/log
+grepQuiet "sending '$new' as a delta against '$old'" $TEST_ROOT/log
+cmp "$new" "${remoteRoot}${new}"
@@ -0,0 +1,30 @@
+source common.sh
+
+clearStore
+
+echo 'shared-path-info-cache = true' >> $NIX_CONF_DIR/nix.conf
+
+restartDaemon
+
+# Every command below runs in its own process (or daemon worker), so the only
+# path infos they share are the ones in the shared cache.
+echo hello > $TEST_ROOT/hello
+path=$(nix-store --add $TEST_ROOT/hello)
+
+nix path-info "$path"
+[[ -e $NIX_STATE_DIR/db/path-info-cache ]]
+
+# signatures added by another process are not hidden by the cached info
+nix-store --generate-binary-cache-key cache1.example.org $TEST_ROOT/sk1 $TEST_ROOT/pk1
+nix path-info --sigs "$path" | grepQuietInverse cache1.example.org
+nix store sign --key-file $TEST_ROOT/sk1 "$path"
+nix path-info --sigs "$path" | grepQuiet cache1.example.org
+
+# neither is a deletion
+nix-store --delete "$path"
+expect 1 nix-store --check-validity "$path"
+
+# nor are paths that were cached as invalid becoming valid
+nix-store --add $TEST_ROOT/hello
+nix-store --check-validity "$path"
+nix path-info --sigs "$path" | grepQuietInverse cache1.example.org
@@ -0,0 +1,39 @@
+source common.sh
+
+# Check that transport compression is negotiated with both kinds of ssh
+# stores, in both directions, and with parallel compression of multiple frames.
+
+clearStore
+
+# several compression frames, and not a multiple of the frame size
+head -c $((3 * 1024 * 1024 + 17)) /dev/urandom > $TEST_ROOT/random
+base64 -w 76 $TEST_ROOT/random > $TEST_ROOT/compressible
+path=$(nix-store --add $TEST_ROOT/compressible)
+
+storeQueryParam="store=${NIX_STORE_DIR}"
+
+for proto in ssh ssh-ng; do
+    for parallel in false true; do
+        remoteRoot="$TEST_ROOT/stores/compressed-$proto-$parallel"
+        chmod -R u+w "$remoteRoot" || true
+        rm -rf "$remoteRoot"
+
+        remoteStore="${proto}://localhost?${storeQueryParam}&remote-store=${remoteRoot}%3f${storeQueryParam}%26real=${remoteRoot}${NIX_STORE_DIR}"
+        remoteStore+="&transport-compression=zstd&parallel-transport-compression=$parallel"
+
+        nix copy --debug --no-check-sigs --to "$remoteStore" "$path" 2> $TEST_ROOT/log
+        grepQuiet "accepted zstd transport compression" $TEST_ROOT/log
+        cmp "$path" "${remoteRoot}${path}"
+
+        clearStore
+        nix copy --debug --no-check-sigs --from "$remoteStore" "$path" 2> $TEST_ROOT/log
+        grepQuiet "accepted zstd transport compression" $TEST_ROOT/log
+        cmp "$TEST_ROOT/compressible" "$path"
+    done
+done
+
+# without an offer, nothing is compressed
+clearStore
+remoteStore="ssh-ng://localhost?${storeQueryParam}&remote-store=${remoteRoot}%3f${storeQueryParam}%26real=${remoteRoot}${NIX_STORE_DIR}"
+nix copy --debug --no-check-sigs --from "$remoteStore" "$path" 2> $TEST_ROOT/log
+grepQuietInverse "transport compression" $TEST_ROOT/log
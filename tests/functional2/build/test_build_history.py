@@ -0,0 +1,41 @@
+import sqlite3
+
+import pytest
+from testlib.fixtures.file_helper import File, with_files
+from testlib.fixtures.nix import Nix
+from testlib.utils import get_global_asset
+
+pytestmark = pytest.mark.no_daemon
+
+chain = """
+  with import ./config.nix;
+  let
+    step = name: input: mkDerivation {
+      inherit name input;
+      buildCommand = ''
+        touch $out
+      '';
+    };
+  in step "history-top-1.0" (step "history-middle-2.0" (step "history-leaf-3.0" null))
+"""
+
+
+@with_files({"config.nix": get_global_asset("config.nix"), "default.nix": File(chain)})
+def test_build_history_records_builds(nix: Nix):
+    result = nix.nix_build(["-v", "--no-out-link"]).run().ok()
+
+    # with no history all builds are assumed to take one second, so the chain
+    # starting with the leaf is estimated to take three
+    assert "the longest chain of builds started with" in result.stderr_s
+    assert "-history-leaf-3.0.drv' and was estimated to take 3.0s" in result.stderr_s
+
+    db = sqlite3.connect(nix.env.dirs.xdg_cache_home / "nix" / "build-history.sqlite")
+    names = {name for (name,) in db.execute("select name from Builds")}
+    assert names == {"history-top", "history-middle", "history-leaf"}
+
+
+@pytest.mark.nix_settings(build_history=False)
+@with_files({"config.nix": get_global_asset("config.nix"), "default.nix": File(chain)})
+def test_build_history_disabled(nix: Nix):
+    nix.nix_build(["--no-out-link"]).run().ok()
+    assert not (nix.env.dirs.xdg_cache_home / "nix" / "build-history.sqlite").exists()
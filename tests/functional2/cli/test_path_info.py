@@ -1,6 +1,8 @@
-from testlib.fixtures.file_helper import with_files
+import json
+
+from testlib.fixtures.file_helper import File, with_files
 from testlib.fixtures.nix import Nix
-from testlib.utils import get_global_asset_pack
+from testlib.utils import get_global_asset, get_global_asset_pack
 
 
 @with_files({"simple": get_global_asset_pack("simple-drv")})
@@ -19,3 +21,80 @@ def test_path_info_all(nix: Nix):
     paths = nix.nix(["path-info", "--all"]).run().ok().stdout_s.splitlines()
     assert len(paths) == 3
     assert path in paths
+
+
+graph = """
+  with import ./config.nix;
+  let
+    node = name: deps: mkDerivation {
+      inherit name deps;
+      buildCommand = ''
+        echo ${name} $deps > $out
+      '';
+    };
+  in rec {
+    common = node "common" [];
+    only-a = node "only-a" [];
+    a = node "a" [ common only-a ];
+    b = node "b" [ common ];
+    top = node "top" [ a b ];
+  }
+"""
+
+
+@with_files({"config.nix": get_global_asset("config.nix"), "default.nix": File(graph)})
+def test_closure_sizes(nix: Nix):
+    nix.settings.add_xp_feature("nix-command")
+
+    def build(attr: str) -> str:
+        return nix.nix_build(["--no-out-link", "-A", attr]).run().ok().stdout_plain
+
+    paths = {attr: build(attr) for attr in ["common", "only-a", "a", "b", "top"]}
+    size = {
+        attr: int(nix.nix_store(["-q", "--size", path]).run().ok().stdout_plain)
+        for attr, path in paths.items()
+    }
+
+    def query(flag: str, *attrs: str) -> list[int]:
+        result = nix.nix_store(["-q", flag, *(paths[a] for a in attrs)]).run().ok()
+        return [int(line) for line in result.stdout_s.splitlines()]
+
+    closure_a = size["a"] + size["common"] + size["only-a"]
+    closure_b = size["b"] + size["common"]
+    closure_top = size["top"] + size["a"] + size["b"] + size["common"] + size["only-a"]
+
+    assert query("--closure-size", "a", "b", "top") == [closure_a, closure_b, closure_top]
+
+    # `common` is shared by `a` and `b`, so neither frees it
+    assert query("--unique-size", "a", "b") == [size["a"] + size["only-a"], size["b"]]
+    # ... but it is only reachable through `top`
+    assert query("--unique-size", "top") == [closure_top]
+    # `a` is referenced by `top`, so only the paths below it count
+    assert query("--unique-size", "top", "a") == [closure_top, size["a"] + size["only-a"]]
+
+    infos = {
+        info["path"]: info
+        for info in json.loads(
+            nix.nix(["path-info", "--json", "--closure-size", "--recursive", paths["top"]])
+            .run()
+            .ok()
+            .stdout_s
+        )
+    }
+    assert infos[paths["top"]]["closureSize"] == closure_top
+    assert infos[paths["top"]]["uniqueClosureSize"] == closure_top
+    assert infos[paths["a"]]["closureSize"] == closure_a
+    assert infos[paths["a"]]["uniqueClosureSize"] == size["a"] + size["only-a"]
+    assert infos[paths["common"]]["uniqueClosureSize"] == size["common"]
+
+    lines = (
+        nix.nix(["path-info", "--closure-size", "--unique-size", paths["a"], paths["b"]])
+        .run()
+        .ok()
+        .stdout_s.splitlines()
+    )
+    columns = {path: rest for path, *rest in (line.split() for line in lines)}
+    assert columns == {
+        paths["a"]: [str(closure_a), str(size["a"] + size["only-a"])],
+        paths["b"]: [str(closure_b), str(size["b"])],
+    }
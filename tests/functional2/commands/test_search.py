@@ -3,7 +3,7 @@ import re
 
 import pytest
 
-from testlib.fixtures.file_helper import CopyFile, with_files
+from testlib.fixtures.file_helper import CopyFile, File, with_files
 from testlib.fixtures.nix import Nix
 from testlib.utils import get_global_asset
 
@@ -121,3 +121,74 @@ def test_exclude_foo_multiple_args(nix: Nix):
 def test_exclude_bar(nix: Nix):
     res = nix.nix([*_exclude_args, "", "^", "-e", "bar", "--json"]).run().ok()
     assert json.loads(res.stdout_plain).keys() == {"foo", "hello"}
+
+
+@with_files(
+    {
+        "flake.nix": File("""{
+            outputs = a: {
+                packages.system = {
+                    hello = {
+                        type = "derivation";
+                        name = "hello-0.1";
+                        meta.description = "Empty file";
+                    };
+                    bar = {
+                        type = "derivation";
+                        name = "bar-3";
+                        meta.description = "broken bar";
+                    };
+                };
+            };
+        }""")
+    }
+)
+def test_search_index(nix: Nix):
+    nix.settings.add_xp_feature("flakes")
+    nix.settings.system = "system"
+
+    first = nix.nix(["search", "--debug", ".#", "^", "--json"]).run().ok()
+    assert "using search index" not in first.stderr_plain
+
+    # the second search must be served from the index, without evaluating
+    nix.env.set_env("NIX_ALLOW_EVAL", "0")
+    second = nix.nix(["search", "--debug", ".#", "bar", "--json"]).run().ok()
+    assert "using search index" in second.stderr_plain
+    assert json.loads(second.stdout_plain) == {
+        "packages.system.bar": {"pname": "bar", "version": "3", "description": "broken bar"}
+    }
+    assert json.loads(first.stdout_plain).keys() == {
+        "packages.system.hello",
+        "packages.system.bar",
+    }
+
+
+@with_files(
+    {
+        "flake.nix": File("""{
+            outputs = a: {
+                legacyPackages.system = {
+                    hello = {
+                        type = "derivation";
+                        name = "hello-0.1";
+                        meta.description = "Empty file";
+                    };
+                    broken = throw "broken package";
+                };
+            };
+        }""")
+    }
+)
+def test_search_index_incomplete(nix: Nix):
+    nix.settings.add_xp_feature("flakes")
+    nix.settings.system = "system"
+
+    # packages that failed to evaluate are skipped, so the walk is incomplete
+    # and must not be saved as the index of the flake
+    first = nix.nix(["search", "--debug", ".#", "^", "--json"]).run().ok()
+    assert "not writing search index" in first.stderr_plain
+    assert json.loads(first.stdout_plain).keys() == {"legacyPackages.system.hello"}
+
+    second = nix.nix(["search", "--debug", ".#", "^", "--json"]).run().ok()
+    assert "using search index" not in second.stderr_plain
+    assert json.loads(second.stdout_plain).keys() == {"legacyPackages.system.hello"}
@@ -0,0 +1,38 @@
+import json
+from pathlib import Path
+
+from testlib.fixtures.nix import Nix
+
+# allocates well over 64 MiB of values
+BIG = "builtins.length (builtins.concatLists (builtins.genList (x: [ x x ]) 3000000))"
+
+
+def test_arena_allocator(nix: Nix, tmp_path: Path):
+    stats = tmp_path / "stats.json"
+    nix.env.set_env("NIX_SHOW_STATS", "1")
+    nix.env.set_env("NIX_SHOW_STATS_PATH", str(stats))
+    res = nix.nix_instantiate(
+        ["--eval-allocator", "arena", "--eval", "--expr", "builtins.length (builtins.genList (x: x) 1000)"]
+    ).run().ok()
+    assert res.stdout_plain == "1000"
+
+    arena = json.loads(stats.read_text())["arena"]
+    assert 0 < arena["bytes"] <= arena["reserved"]
+
+
+def test_arena_memory_limit(nix: Nix):
+    res = nix.nix_instantiate(
+        [
+            "--eval-allocator",
+            "arena",
+            "--eval-memory-limit",
+            str(64 * 1024 * 1024),
+            "--eval",
+            "--expr",
+            BIG,
+        ]
+    ).run().expect(1)
+    assert "allowed by 'eval-memory-limit'" in res.stderr_plain
+
+    # without the limit the same evaluation succeeds
+    nix.nix_instantiate(["--eval-allocator", "arena", "--eval", "--expr", BIG]).run().ok()
@@ -0,0 +1,58 @@
+import gzip
+from pathlib import Path
+
+import pytest
+
+from testlib.fixtures.nix import Nix
+
+# keeps the evaluator busy for a while in a named function called by a builtin
+BUSY = """
+let
+  step = x: builtins.length (builtins.genList (y: y * x) 20) > 5;
+in
+  builtins.length (builtins.filter step (builtins.genList (x: x) 200000))
+"""
+
+
+@pytest.mark.parametrize("name", ["eval.folded", "eval.pprof"])
+def test_eval_profile(nix: Nix, tmp_path: Path, name: str):
+    profile = tmp_path / name
+    nix.nix_instantiate(
+        [
+            "--eval-profile",
+            str(profile),
+            "--eval-profile-frequency",
+            "1000",
+            "--eval",
+            "--expr",
+            BUSY,
+        ]
+    ).run().ok()
+
+    if name.endswith(".pprof"):
+        data = gzip.decompress(profile.read_bytes())
+        assert b"step at \xc2\xabstring\xc2\xbb:3:10" in data
+        assert b"nanoseconds" in data
+        return
+
+    lines = profile.read_text().splitlines()
+    assert lines
+    samples = 0
+    for line in lines:
+        stack, count = line.rsplit(" ", 1)
+        frames = stack.split(";")
+        assert frames[0] == "«toplevel»"
+        assert all(frame == "step at «string»:3:10" for frame in frames if frame.startswith("step"))
+        samples += int(count)
+    assert samples > 0
+    assert any(";builtins.filter;step at «string»:3:10" in line for line in lines)
+
+
+def test_eval_profile_unwritable(nix: Nix, tmp_path: Path):
+    profile = tmp_path / "missing" / "eval.folded"
+    result = (
+        nix.nix_instantiate(["--eval-profile", str(profile), "--eval", "--expr", BUSY]).run().ok()
+    )
+    assert result.stdout_plain == "200000"
+    assert "could not write the evaluation profile" in result.stderr_s
+    assert not profile.exists()
@@ -0,0 +1,52 @@
+import pytest
+
+from testlib.fixtures.file_helper import File, with_files
+from testlib.fixtures.nix import Nix
+
+_files = {
+    "flake.nix": File("""{
+        outputs = a: {
+            packages.system = builtins.listToAttrs (builtins.genList (i: {
+                name = "pkg${toString i}";
+                value = { type = "derivation"; name = "pkg-${toString i}"; };
+            }) 100);
+        };
+    }""")
+}
+
+
+@pytest.mark.parametrize("fmt", ["sqlite", "binary"])
+@with_files(_files)
+def test_eval_cache_format(nix: Nix, fmt: str):
+    nix.settings.add_xp_feature("nix-command", "flakes")
+    nix.settings.system = "system"
+    args = ["flake", "show", "--json", "--eval-cache-format", fmt, "."]
+
+    first = nix.nix(args).run().ok().json()
+    assert len(first["packages"]["system"]) == 100
+    assert first["packages"]["system"]["pkg42"]["name"] == "pkg-42"
+
+    # everything needed must now come from the cache
+    nix.env.set_env("NIX_ALLOW_EVAL", "0")
+    assert nix.nix(args).run().ok().json() == first
+
+
+@with_files(_files)
+def test_eval_cache_binary_interrupted_write(nix: Nix):
+    nix.settings.add_xp_feature("nix-command", "flakes")
+    nix.settings.system = "system"
+    args = ["flake", "show", "--json", "--eval-cache-format", "binary", "."]
+
+    first = nix.nix(args).run().ok().json()
+
+    # without the marker that ends the write, none of its rows are trusted
+    (cache,) = (nix.env.dirs.xdg_cache_home / "nix" / "eval-cache-v5").glob("*.attrs")
+    data = cache.read_bytes()
+    assert data.endswith(b"\0" * 4)
+    cache.write_bytes(data[:-4])
+
+    nix.env.set_env("NIX_ALLOW_EVAL", "0")
+    nix.nix(args).run().expect(1)
+
+    nix.env.set_env("NIX_ALLOW_EVAL", "1")
+    assert nix.nix(args).run().ok().json() == first
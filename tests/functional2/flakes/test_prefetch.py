@@ -0,0 +1,58 @@
+import json
+from pathlib import Path
+
+import pytest
+
+from testlib.fixtures.nix import Nix
+from testlib.fixtures.git import Git
+from testlib.fixtures.file_helper import with_files
+from testlib.utils import get_global_asset_pack
+
+pytestmark = pytest.mark.no_daemon
+
+
+@pytest.fixture(autouse=True)
+def setup_env(nix: Nix):
+    nix.settings.add_xp_feature("nix-command", "flakes")
+
+
+@with_files(
+    {
+        "leaf": get_global_asset_pack(".git"),
+        "mid": get_global_asset_pack(".git"),
+        "data": get_global_asset_pack(".git"),
+        "top": {},
+    }
+)
+def test_lock_file_independent_of_prefetching(nix: Nix, git: Git, files: Path):
+    def commit(name: str, path: str, contents: str):
+        (files / name / path).write_text(contents)
+        git(files / name, "add", ".")
+        git(files / name, "commit", "-m", "init")
+
+    commit("leaf", "flake.nix", "{ outputs = _: { }; }")
+    # mid has no lock file, so its inputs are fetched while locking top
+    commit(
+        "mid",
+        "flake.nix",
+        f"""{{
+          inputs.leaf.url = "git+file://{files}/leaf";
+          outputs = _: {{ }};
+        }}""",
+    )
+    commit("data", "file", "data\n")
+    (files / "top" / "flake.nix").write_text(f"""{{
+      inputs.mid.url = "git+file://{files}/mid";
+      inputs.leaf.url = "git+file://{files}/leaf";
+      inputs.data = {{ url = "git+file://{files}/data"; flake = false; }};
+      outputs = _: {{ }};
+    }}""")
+    lock_file = files / "top" / "flake.lock"
+
+    nix.nix(["flake", "lock", files / "top", "--option", "max-flake-fetch-jobs", "0"]).run().ok()
+    serial = json.loads(lock_file.read_text())
+    lock_file.unlink()
+
+    nix.nix(["flake", "lock", files / "top", "--option", "max-flake-fetch-jobs", "8"]).run().ok()
+    assert json.loads(lock_file.read_text()) == serial
+    assert {"root", "mid", "leaf", "data"} <= set(serial["nodes"])
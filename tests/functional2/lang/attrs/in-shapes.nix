@@ -0,0 +1,21 @@
+let
+  # every call produces a set of the same shape
+  mk = n: { a = n; b = n + 1; c = [ n ]; };
+  x = mk 1;
+  y = mk 2;
+  withOverrides = rec { a = 1; b = a; __overrides = { a = 2; d = 3; }; };
+in
+[
+  (x // y)
+  (y // x)
+  (x // y // { d = 4; })
+  (x == mk 1)
+  (x == y)
+  (x == { a = 1; b = 2; c = [ 1 ]; })
+  (x.b + y.b)
+  (x ? d)
+  (x.d or "none")
+  (builtins.attrNames (x // { ${"e"} = 5; }))
+  withOverrides
+  (withOverrides // { b = 0; })
+]
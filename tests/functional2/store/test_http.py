@@ -147,3 +147,46 @@ def test_http_simple(nix: Nix, store: HTTPStore, files: Path):
         assert nar_entries[0]["hashPart"] == hash_part
         assert nar_entries[0]["namePart"] == "test-file"
         assert nar_entries[0]["url"] == store.uploaded_nars[hash_part]["URL"]
+
+
+@with_files({"test-file": File("hello world")})
+@with_diverted_store
+def test_http_range_reads(nix: Nix, files: Path):
+    result = nix.nix(cmd=["store", "add-file", files / "test-file"], flake=True).run()
+    result.ok()
+    store_path = result.stdout_plain
+
+    cache_dir = files / "cache"
+    nix.nix(
+        cmd=[
+            "copy",
+            "--from",
+            nix.settings.store,
+            "--to",
+            f"file://{cache_dir}?compression=none&write-nar-listing=true",
+            store_path,
+        ],
+        flake=True,
+    ).run().ok()
+
+    nar_requests: list[str | None] = []
+
+    async def serve(req: web.Request) -> web.StreamResponse:
+        path = cache_dir / req.match_info["path"]
+        if not path.is_file():
+            return web.Response(text="", status=404)
+        if req.match_info["path"].startswith("nar/"):
+            nar_requests.append(req.headers.get("Range"))
+        return web.FileResponse(path)
+
+    app = web.Application()
+    app.add_routes([web.get("/{path:.+}", serve)])
+
+    with http_server(app) as httpd:
+        url = f"http://localhost:{httpd.port}"
+        result = nix.nix(cmd=["store", "cat", "--store", url, store_path], flake=True).run()
+        assert result.ok().stdout_plain == "hello world"
+
+    # only the contents of the file were fetched, not the whole NAR
+    assert nar_requests
+    assert all(r is not None and r.startswith("bytes=") for r in nar_requests)
@@ -44,6 +44,36 @@ class TestOptimizeStore:
     def test_optimise_store(self, nix: Nix):
         self._test_optimise_store(nix)
 
+    def test_optimise_store_incremental(self, nix: Nix):
+        def build(name: str) -> Path:
+            expr = f"""
+                with import ./config.nix; mkDerivation {{
+                    name = "{name}";
+                    builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo";
+                }}
+            """
+
+            result = nix.nix_build(["-E", expr, "--no-out-link", "--no-auto-optimise-store"]).run().ok()
+            return Path(result.stdout_plain)
+
+        out1 = build("foo1")
+        out2 = build("foo2")
+        nix.nix_store(["--optimise"]).run().ok()
+        assert (out1 / "foo").samefile(out2 / "foo")
+
+        # undo the link behind the optimiser's back; since out2 was recorded
+        # as optimised, the next run does not look at it again
+        out2.chmod(0o755)
+        (out2 / "foo.tmp").write_text("hello\n")
+        (out2 / "foo.tmp").chmod(0o444)
+        (out2 / "foo.tmp").replace(out2 / "foo")
+        out2.chmod(0o555)
+
+        out3 = build("foo3")
+        nix.nix_store(["--optimise"]).run().ok()
+        assert (out1 / "foo").samefile(out3 / "foo")
+        assert not (out1 / "foo").samefile(out2 / "foo")
+
     def test_optimise_store_daemon(self, nix: Nix, daemon: NixDaemon):
         nix.settings.auto_optimise_store = True
         with daemon(nix, [], {"trusted-users": "*"}) as inner:
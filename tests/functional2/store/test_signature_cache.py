@@ -0,0 +1,106 @@
+import sqlite3
+import time
+from pathlib import Path
+
+import pytest
+from testlib.fixtures.file_helper import with_files
+from testlib.fixtures.nix import Nix
+from testlib.utils import get_global_asset
+
+pytestmark = pytest.mark.no_daemon
+
+expr = """
+    with import ./config.nix; mkDerivation {
+        name = "signed";
+        builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo";
+    }
+"""
+
+
+def build_signed(nix: Nix, tmp_path: Path) -> str:
+    nix.settings.add_xp_feature("nix-command")
+
+    sk = tmp_path / "sk"
+    pk = tmp_path / "pk"
+    nix.nix_store(["--generate-binary-cache-key", "cache.example.org", sk, pk]).run().ok()
+    nix.settings.trusted_public_keys = pk.read_text()
+
+    out = nix.nix_build(["-E", expr, "--no-out-link"]).run().ok().stdout_plain
+    nix.nix(["store", "sign", "--key-file", sk, out]).run().ok()
+    return out
+
+
+def copy(nix: Nix, tmp_path: Path, store: str, out: str):
+    return nix.nix(["copy", "--to", f"local?root={tmp_path / store}", out]).run()
+
+
+def cache_db(nix: Nix) -> Path:
+    return nix.env.dirs.xdg_cache_home / "nix" / "verified-signatures.sqlite"
+
+
+def verified_signatures(nix: Nix) -> int:
+    db = sqlite3.connect(cache_db(nix))
+    ((count,),) = db.execute("select count(*) from VerifiedSignatures")
+    return count
+
+
+def set_timestamps(nix: Nix, timestamp: int):
+    with sqlite3.connect(cache_db(nix)) as db:
+        db.execute("update VerifiedSignatures set timestamp = ?", (timestamp,))
+
+
+def timestamps(nix: Nix) -> list[int]:
+    db = sqlite3.connect(cache_db(nix))
+    return [t for (t,) in db.execute("select timestamp from VerifiedSignatures")]
+
+
+@with_files({"config.nix": get_global_asset("config.nix")})
+def test_signature_cache(nix: Nix, tmp_path: Path):
+    out = build_signed(nix, tmp_path)
+
+    copy(nix, tmp_path, "first", out).ok()
+    assert verified_signatures(nix) == 1
+
+    # copying again uses the cached verification. Verifying the signature
+    # again would have reset the timestamp of its entry.
+    marker = int(time.time()) - 3600
+    set_timestamps(nix, marker)
+    copy(nix, tmp_path, "second", out).ok()
+    assert timestamps(nix) == [marker]
+
+    # signatures by keys that are no longer trusted are not accepted
+    nix.settings.trusted_public_keys = ""
+    copy(nix, tmp_path, "third", out).expect(1)
+
+
+@with_files({"config.nix": get_global_asset("config.nix")})
+def test_signature_cache_disabled(nix: Nix, tmp_path: Path):
+    out = build_signed(nix, tmp_path)
+    nix.settings.verified_signature_cache = False
+
+    copy(nix, tmp_path, "first", out).ok()
+    assert not cache_db(nix).exists()
+
+
+@with_files({"config.nix": get_global_asset("config.nix")})
+def test_signature_cache_writable_by_others(nix: Nix, tmp_path: Path):
+    out = build_signed(nix, tmp_path)
+    cache_db(nix).parent.mkdir(parents=True, exist_ok=True)
+    cache_db(nix).parent.chmod(0o777)
+
+    copy(nix, tmp_path, "first", out).ok()
+    assert not cache_db(nix).exists()
+
+
+@with_files({"config.nix": get_global_asset("config.nix")})
+def test_signature_cache_db_writable_by_others(nix: Nix, tmp_path: Path):
+    out = build_signed(nix, tmp_path)
+
+    copy(nix, tmp_path, "first", out).ok()
+    assert verified_signatures(nix) == 1
+
+    # the cache is ignored, so the signature is verified without it
+    cache_db(nix).chmod(0o666)
+    set_timestamps(nix, 0)
+    copy(nix, tmp_path, "second", out).ok()
+    assert timestamps(nix) == [0]
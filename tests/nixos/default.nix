@@ -176,6 +176,8 @@ in
 
   nix-upgrade-nix = runNixOSTestFor "x86_64-linux" ./nix-upgrade-nix.nix;
 
+  optimise-store-reflink = runNixOSTestFor "x86_64-linux" ./optimise-store-reflink.nix;
+
   nssPreload = runNixOSTestFor "x86_64-linux" ./nss-preload.nix;
 
   githubFlakes = runNixOSTestFor "x86_64-linux" ./github-flakes.nix;
@@ -0,0 +1,67 @@
+# Checks that `nix-store --optimise` with `optimise-method = auto` deduplicates
+# with reflinks on file systems that support them and falls back to hard links
+# on those that do not. Each file system is a loopback image holding a chroot
+# store.
+{ pkgs, ... }:
+
+{
+  name = "optimise-store-reflink";
+
+  nodes.machine = {
+    environment.systemPackages = [
+      pkgs.btrfs-progs
+      pkgs.xfsprogs
+      pkgs.e2fsprogs
+    ];
+    virtualisation.memorySize = 2048;
+  };
+
+  testScript = ''
+    start_all()
+
+    def make_store(fs, mkfs):
+        machine.succeed(f"truncate -s 1G /tmp/{fs}.img")
+        machine.succeed(f"{mkfs} /tmp/{fs}.img")
+        machine.succeed(f"mkdir -p /mnt/{fs} && mount -o loop /tmp/{fs}.img /mnt/{fs}")
+        store = f"local?root=/mnt/{fs}"
+        machine.succeed("head -c 1048576 /dev/urandom > /tmp/data")
+        a = machine.succeed(f"cp /tmp/data /tmp/a && nix-store --store '{store}' --add /tmp/a").strip()
+        b = machine.succeed(f"cp /tmp/data /tmp/b && nix-store --store '{store}' --add /tmp/b").strip()
+        return store, f"/mnt/{fs}{a}", f"/mnt/{fs}{b}"
+
+    def first_extent(path):
+        # the physical offset of the first extent
+        return machine.succeed(f"filefrag -v {path} | awk '$1 == \"0:\" {{ print $4 }}'").strip()
+
+    def inode(path):
+        return machine.succeed(f"stat -c %i {path}").strip()
+
+    for fs, mkfs in [("btrfs", "mkfs.btrfs"), ("xfs", "mkfs.xfs -m reflink=1")]:
+        with subtest(f"reflinks on {fs}"):
+            store, a, b = make_store(fs, mkfs)
+            assert first_extent(a) != first_extent(b)
+
+            machine.succeed(f"nix-store --store '{store}' --option optimise-method auto --optimise")
+
+            assert first_extent(a) == first_extent(b), f"{a} and {b} do not share data"
+            assert inode(a) != inode(b)
+            machine.succeed(f"test -z \"$(ls -A /mnt/{fs}/nix/store/.links)\"")
+
+            # deleting the source of the shared data keeps the other file intact
+            machine.succeed(f"nix-store --store '{store}' --delete {a.removeprefix(f'/mnt/{fs}')}")
+            machine.succeed(f"cmp /tmp/data {b}")
+
+    with subtest("hard links on ext4"):
+        store, a, b = make_store("ext4", "mkfs.ext4 -q")
+        machine.succeed(f"nix-store --store '{store}' --option optimise-method reflink --optimise 2>&1 | grep 'does not support reflinks'")
+
+        machine.succeed(f"nix-store --store '{store}' --option optimise-method auto --optimise")
+        assert inode(a) == inode(b)
+
+    with subtest("hard links by default"):
+        machine.succeed("umount /mnt/btrfs")
+        store, a, b = make_store("btrfs", "mkfs.btrfs -f")
+        machine.succeed(f"nix-store --store '{store}' --optimise")
+        assert inode(a) == inode(b)
+  '';
+}
@@ -3,6 +3,7 @@
 
 #include "lix/libexpr/eval-settings.hh"
 
+#include "lix/libutil/finally.hh"
 #include "lix/libutil/logging.hh"
 #include "tests/libexpr.hh"
 
@@ -841,6 +842,23 @@ namespace nix {
         ASSERT_THAT(third, IsStringEq(" "));
     }
 
+    TEST_F(PrimOpTest, splitLinearRegex) {
+        // std::regex takes the first way `c?` and `(c.?)?` can match at a
+        // position, the linear-regex engine takes the longest. evaluation
+        // results must not change unless the feature is enabled.
+        auto v = eval("builtins.split \"c?(c.?)?\" \"cbc\"");
+        ASSERT_THAT(v, IsListOfSize(9));
+        ASSERT_THAT(v.listElems()[1].listElems()[0], IsNull());
+
+        auto oldFeatures = featureSettings.experimentalFeatures.get();
+        Finally restoreFeatures([&] { featureSettings.experimentalFeatures.override(oldFeatures); });
+        featureSettings.set("experimental-features", "linear-regex", true);
+
+        v = eval("builtins.split \"c?(c.?)?\" \"cbc\"");
+        ASSERT_THAT(v, IsListOfSize(7));
+        ASSERT_THAT(v.listElems()[1].listElems()[0], IsStringEq("cb"));
+    }
+
     TEST_F(PrimOpTest, match1) {
         auto v = eval("builtins.match \"ab\" \"abc\"");
         ASSERT_THAT(v, IsNull());
@@ -1,4 +1,6 @@
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
 
 #include "lix/libexpr/eval.hh"
 #include "lix/libmain/progress-bar.hh"
@@ -41,4 +43,87 @@ namespace nix
 
         ASSERT_EQ(renderedStatus, EXPECTED);
     }
+
+    // Build log lines make activities without text shown, but never ones that
+    // are hidden on purpose, like "daemon connection".
+    TEST(ProgressBar, logLinesOfHiddenActivities) {
+        for (bool multiline : {false, true}) {
+            ProgressBar progressBar(false);
+            progressBar.setPrintMultiline(multiline);
+
+            auto hidden = progressBar.startActivity(lvlDebug, actUnknown, "daemon connection");
+            auto untitled = progressBar.startActivity(lvlDebug, actUnknown, "");
+            auto shown = progressBar.startActivity(lvlDebug, actUnknown, "shown");
+
+            for (auto * act : {&hidden, &untitled, &shown}) {
+                (void) act->result(resBuildLogLine, "a line");
+                (void) act->result(resBuildLogLine, "another line");
+            }
+
+            {
+                auto state = progressBar.state_.lock();
+                ASSERT_EQ(state->activities.size(), 2);
+                ASSERT_EQ(state->hiddenActivities.size(), 1);
+                ASSERT_EQ(state->hiddenActivities.front().s, "daemon connection");
+            }
+
+            hidden = progressBar.startActivity(lvlDebug, actUnknown, "");
+            untitled = progressBar.startActivity(lvlDebug, actUnknown, "");
+            shown = progressBar.startActivity(lvlDebug, actUnknown, "");
+
+            auto state = progressBar.state_.lock();
+            ASSERT_EQ(state->activities.size(), 0);
+            ASSERT_EQ(state->hiddenActivities.size(), 3);
+        }
+    }
+
+    // A synthetic flood of short activities started by many threads while many
+    // others are running, like during a large `nix copy`.
+    TEST(ProgressBar, activityFlood) {
+        constexpr uint64_t MiB = 1024 * 1024;
+        constexpr size_t THREADS = 8;
+        constexpr size_t FLOOD_PER_THREAD = 20'000;
+        constexpr size_t RUNNING = 10'000;
+
+        testing::internal::CaptureStderr();
+        {
+            ProgressBar progressBar(true);
+            progressBar.setPrintMultiline(true);
+
+            auto copyPaths = progressBar.startActivity(actCopyPaths);
+            std::vector<Activity> running;
+            for (size_t i = 0; i < RUNNING; i++) {
+                running.push_back(copyPaths.addChild(lvlDebug, actCopyPath, fmt("copying %d", i)));
+                (void) running.back().progress(0, MiB);
+            }
+
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < THREADS; t++) {
+                threads.emplace_back([&] {
+                    for (size_t i = 0; i < FLOOD_PER_THREAD; i++) {
+                        auto act = copyPaths.addChild(lvlDebug, actCopyPath, "copying a path");
+                        (void) act.progress(MiB / 2, MiB);
+                        (void) act.progress(MiB, MiB);
+                    }
+                });
+            }
+            for (auto & thread : threads) {
+                thread.join();
+            }
+
+            EXPECT_EQ(
+                progressBar.getStatus(*progressBar.state_.lock()),
+                fmt("0 copied (" ANSI_GREEN "%d.0" ANSI_NORMAL "/%d.0 MiB)",
+                    THREADS * FLOOD_PER_THREAD,
+                    THREADS * FLOOD_PER_THREAD + RUNNING)
+            );
+
+            running.clear();
+            EXPECT_EQ(
+                progressBar.getStatus(*progressBar.state_.lock()),
+                fmt("0 copied (" ANSI_GREEN "%d.0" ANSI_NORMAL " MiB)", THREADS * FLOOD_PER_THREAD)
+            );
+        }
+        testing::internal::GetCapturedStderr();
+    }
 }
@@ -0,0 +1,109 @@
+#include "lix/libstore/build/build-admission.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+static constexpr uint64_t GiB = 1024 * 1024 * 1024;
+
+static SystemResources idleMachine()
+{
+    return {
+        .cores = 16,
+        .loadAverage = 0.0,
+        .memoryTotal = 32 * GiB,
+        .memoryAvailable = 30 * GiB,
+        .memoryPressure = 0.0,
+    };
+}
+
+TEST(BuildAdmission, firstBuildIsAlwaysAdmitted)
+{
+    BuildAdmission admission;
+    auto resources = idleMachine();
+    resources.memoryAvailable = 1 * GiB;
+    resources.memoryPressure = 90.0;
+
+    auto token = admission.tryAdmit(resources, 64 * GiB, 4, 10);
+    ASSERT_TRUE(token);
+    ASSERT_EQ(token->cores(), 4);
+    ASSERT_EQ(admission.running(), 1);
+
+    token.reset();
+    ASSERT_EQ(admission.running(), 0);
+}
+
+TEST(BuildAdmission, memoryPressure)
+{
+    BuildAdmission admission;
+    auto resources = idleMachine();
+    auto first = admission.tryAdmit(resources, 0, 0, 10);
+    ASSERT_TRUE(first);
+
+    resources.memoryPressure = 15.0;
+    ASSERT_FALSE(admission.tryAdmit(resources, 0, 0, 10));
+    // a limit of 0 disables the check
+    ASSERT_TRUE(admission.tryAdmit(resources, 0, 0, 0));
+
+    resources.memoryPressure = 5.0;
+    ASSERT_TRUE(admission.tryAdmit(resources, 0, 0, 10));
+}
+
+TEST(BuildAdmission, reservesMemory)
+{
+    BuildAdmission admission;
+    auto resources = idleMachine();
+
+    auto first = admission.tryAdmit(resources, 20 * GiB, 0, 10);
+    ASSERT_TRUE(first);
+
+    // enough memory is available right now, but not once the first build
+    // reaches its expected peak
+    ASSERT_FALSE(admission.tryAdmit(resources, 16 * GiB, 0, 10));
+    auto second = admission.tryAdmit(resources, 8 * GiB, 0, 10);
+    ASSERT_TRUE(second);
+
+    // builds must also fit into the memory that is available now
+    resources.memoryAvailable = 2 * GiB;
+    ASSERT_FALSE(admission.tryAdmit(resources, 3 * GiB, 0, 10));
+
+    first.reset();
+    resources.memoryAvailable = 30 * GiB;
+    ASSERT_TRUE(admission.tryAdmit(resources, 16 * GiB, 0, 10));
+}
+
+TEST(BuildAdmission, idleCores)
+{
+    BuildAdmission admission;
+    auto resources = idleMachine();
+    auto start = std::chrono::steady_clock::time_point{};
+
+    auto first = admission.tryAdmit(resources, 0, 10, 0, start);
+    ASSERT_TRUE(first);
+    ASSERT_EQ(first->cores(), 10);
+
+    // the load average does not know about the first build yet
+    auto second = admission.tryAdmit(resources, 0, 10, 0, start);
+    ASSERT_TRUE(second);
+    ASSERT_EQ(second->cores(), 6);
+
+    // no cores are idle, but builds always get at least one
+    auto third = admission.tryAdmit(resources, 0, 10, 0, start);
+    ASSERT_TRUE(third);
+    ASSERT_EQ(third->cores(), 1);
+
+    // later only the load average counts
+    resources.loadAverage = 4.5;
+    auto later = start + BuildAdmission::coreReservationTime;
+    auto fourth = admission.tryAdmit(resources, 0, 0, 0, later);
+    ASSERT_TRUE(fourth);
+    ASSERT_EQ(fourth->cores(), 11);
+
+    // without a load average the cores of all running builds are busy
+    resources.loadAverage = std::nullopt;
+    auto fifth = admission.tryAdmit(resources, 0, 0, 0, later);
+    ASSERT_TRUE(fifth);
+    ASSERT_EQ(fifth->cores(), 1);
+}
+
+}
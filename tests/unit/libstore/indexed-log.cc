@@ -0,0 +1,90 @@
+#include "lix/libstore/indexed-log.hh"
+#include "lix/libstore/temporary-dir.hh"
+#include "lix/libutil/compression.hh"
+#include "lix/libutil/file-system.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+static std::string makeLog(size_t lines)
+{
+    std::string log;
+    for (size_t i = 0; i < lines; i++) {
+        log += fmt("line %d: %s\n", i, std::string(i % 97, i % 7 == 0 ? 'x' : 'y'));
+    }
+    return log;
+}
+
+static std::string writeIndexedLog(std::string_view log, size_t writeSize = 4096)
+{
+    StringSink out;
+    IndexedLogSink sink(out);
+    for (size_t i = 0; i < log.size(); i += writeSize) {
+        sink(log.substr(i, writeSize));
+    }
+    sink.finish();
+    return std::move(out.s);
+}
+
+TEST(selectLogLines, selections)
+{
+    std::string log = "a\nbb\nccc\ndd\ne";
+
+    ASSERT_EQ(selectLogLines(log, {}), log);
+    ASSERT_EQ(selectLogLines(log, {.tail = 2}), "dd\ne");
+    ASSERT_EQ(selectLogLines(log, {.firstLine = 1, .endLine = 3}), "bb\nccc\n");
+    ASSERT_EQ(selectLogLines(log, {.grep = "c"}), "ccc\n");
+    ASSERT_EQ(selectLogLines(log, {.endLine = 4, .grep = "d", .tail = 1}), "dd\n");
+    ASSERT_EQ(selectLogLines(log, {.tail = 0}), "");
+}
+
+TEST(IndexedLog, isPlainZstd)
+{
+    auto log = makeLog(100000);
+    ASSERT_EQ(decompress("zstd", writeIndexedLog(log)), log);
+}
+
+TEST(IndexedLog, readSelections)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path logPath = tmpDir + "/log.zst";
+
+    // a few frames, ending in an unterminated line and containing a line
+    // too long to fit into a single frame
+    auto log = makeLog(60000) + std::string(20 * 1024 * 1024, 'z') + "\n" + makeLog(30000)
+        + "unterminated";
+    writeFile(logPath, writeIndexedLog(log));
+
+    auto reader = IndexedLogReader::open(logPath);
+    ASSERT_TRUE(reader);
+    ASSERT_GT(reader->frames().size(), 3);
+
+    for (BuildLogSelection selection : {
+             BuildLogSelection{},
+             BuildLogSelection{.tail = 10},
+             BuildLogSelection{.tail = 30001},
+             BuildLogSelection{.firstLine = 59990, .endLine = 60010},
+             BuildLogSelection{.firstLine = 60000, .endLine = 60001},
+             BuildLogSelection{.firstLine = 12345, .endLine = 54321, .tail = 5},
+             BuildLogSelection{.grep = "line 4242:"},
+             BuildLogSelection{.grep = "xxx", .tail = 3},
+             BuildLogSelection{.firstLine = 1000000},
+         })
+    {
+        ASSERT_EQ(reader->read(selection), selectLogLines(log, selection));
+    }
+}
+
+TEST(IndexedLog, missingIndex)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path logPath = tmpDir + "/log.zst";
+
+    writeFile(logPath, compress("zstd", makeLog(1000)));
+    ASSERT_FALSE(IndexedLogReader::open(logPath));
+}
+
+}
@@ -46,14 +46,15 @@ static ref<FSAccessor> makeMockAccessor()
 
     return makeLazyNarAccessor(
         listing.dump(),
-        [narOffset, sshContent](uint64_t offset, uint64_t length) {
+        [narOffset, sshContent](uint64_t offset, uint64_t length)
+            -> kj::Promise<Result<std::string>> {
             if (offset == narOffset) {
                 assert(length <= sshContent.size());
-                return sshContent.substr(0, length);
+                return {sshContent.substr(0, length)};
             } else {
-                throw Error(
+                return {result::failure(std::make_exception_ptr(Error(
                     "Invalid offset '%llu' in mock NAR (looking for: %llu)", offset, narOffset
-                );
+                )))};
             }
         }
     );
@@ -0,0 +1,167 @@
+#include "lix/libstore/shared-path-info-cache.hh"
+#include "lix/libstore/content-address.hh"
+#include "lix/libutil/c-calls.hh"
+#include "lix/libutil/file-system.hh"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+namespace nix {
+
+static const StorePath foo{"g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-foo"};
+static const StorePath bar{"4kmkv2phhwv0dy2zb3qqbyb4yrb9rxal-bar"};
+
+static std::shared_ptr<const ValidPathInfo> makeInfo()
+{
+    auto info = std::make_shared<ValidPathInfo>(foo, hashString(HashType::SHA256, "foo"));
+    info->id = 42;
+    info->deriver = StorePath{"g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-foo.drv"};
+    info->references = {foo, bar};
+    info->registrationTime = 1700000000;
+    info->narSize = 1234;
+    info->ultimate = true;
+    info->sigs = {"cache.example.org-1:c2ln"};
+    info->ca = ContentAddress{
+        .method = FileIngestionMethod::Recursive,
+        .hash = hashString(HashType::SHA256, "(...)"),
+    };
+    return info;
+}
+
+TEST(SharedPathInfoCache, create)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path path = tmpDir + "/cache";
+
+    ASSERT_EQ(SharedPathInfoCache::open(path, false), nullptr);
+    ASSERT_NE(SharedPathInfoCache::open(path, true, 64), nullptr);
+
+    // the size of an existing cache wins
+    auto cache = SharedPathInfoCache::open(path, false);
+    ASSERT_NE(cache, nullptr);
+    cache->insert(foo, nullptr, cache->generation());
+    ASSERT_EQ(SharedPathInfoCache::open(path, true)->lookup(foo), nullptr);
+
+    writeFile(path, "garbage");
+    ASSERT_THROW(SharedPathInfoCache::open(path, false), Error);
+}
+
+TEST(SharedPathInfoCache, roundTrip)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    auto writer = SharedPathInfoCache::open(tmpDir + "/cache", true, 64);
+    auto reader = SharedPathInfoCache::open(tmpDir + "/cache", false);
+
+    ASSERT_EQ(reader->lookup(foo), std::nullopt);
+
+    auto info = makeInfo();
+    writer->insert(foo, info, writer->generation());
+    auto cached = reader->lookup(foo);
+    ASSERT_TRUE(cached && *cached);
+    ASSERT_EQ(**cached, *info);
+    ASSERT_EQ((*cached)->id, info->id);
+
+    writer->insert(bar, nullptr, writer->generation());
+    ASSERT_EQ(reader->lookup(bar), nullptr);
+
+    // paths are only found under their own name
+    ASSERT_EQ(reader->lookup(StorePath{"g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-bar"}), std::nullopt);
+}
+
+TEST(SharedPathInfoCache, invalidate)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    auto cache = SharedPathInfoCache::open(tmpDir + "/cache", true, 64);
+
+    cache->insert(foo, makeInfo(), cache->generation());
+    cache->insert(bar, nullptr, cache->generation());
+
+    auto generation = cache->generation();
+    cache->invalidate({foo});
+    ASSERT_EQ(cache->lookup(foo), std::nullopt);
+    ASSERT_EQ(cache->lookup(bar), nullptr);
+
+    // info read before the invalidation is not cached
+    cache->insert(foo, makeInfo(), generation);
+    ASSERT_EQ(cache->lookup(foo), std::nullopt);
+
+    cache->insert(foo, nullptr, cache->generation());
+    ASSERT_EQ(cache->lookup(foo), nullptr);
+}
+
+TEST(SharedPathInfoCache, clear)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    auto cache = SharedPathInfoCache::open(tmpDir + "/cache", true, 64);
+
+    cache->insert(foo, makeInfo(), cache->generation());
+    cache->insert(bar, nullptr, cache->generation());
+    SharedPathInfoCache::open(tmpDir + "/cache", false)->clear();
+    ASSERT_EQ(cache->lookup(foo), std::nullopt);
+    ASSERT_EQ(cache->lookup(bar), std::nullopt);
+}
+
+TEST(SharedPathInfoCache, insertAfterClear)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    // with as many slots as probes every path may be stored in every slot
+    auto cache =
+        SharedPathInfoCache::open(tmpDir + "/cache", true, SharedPathInfoCache::probeLength);
+
+    for (size_t i = 0; i < SharedPathInfoCache::probeLength; i++) {
+        auto path = StorePath(fmt("g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3%d-fill", i));
+        cache->insert(path, nullptr, cache->generation());
+        ASSERT_EQ(cache->lookup(path), nullptr);
+    }
+    cache->clear();
+
+    // the cleared slots are free again instead of being evicted in turn
+    auto generation = cache->generation();
+    cache->insert(foo, nullptr, generation);
+    cache->insert(bar, nullptr, generation);
+    ASSERT_EQ(cache->lookup(foo), nullptr);
+    ASSERT_EQ(cache->lookup(bar), nullptr);
+}
+
+TEST(SharedPathInfoCache, otherBoot)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path path = tmpDir + "/cache";
+    auto cache = SharedPathInfoCache::open(path, true, 64);
+    cache->insert(foo, nullptr, cache->generation());
+
+    // pretend the entries were cached before a reboot, the boot is the fifth
+    // field of the header
+    {
+        AutoCloseFD fd{sys::open(path, O_RDWR | O_CLOEXEC)};
+        ASSERT_TRUE(fd);
+        uint64_t boot = 1;
+        ASSERT_EQ(pwrite(fd.get(), &boot, sizeof(boot), 4 * sizeof(uint64_t)), ssize_t(sizeof(boot)));
+    }
+
+    ASSERT_EQ(SharedPathInfoCache::open(path, false)->lookup(foo), std::nullopt);
+    ASSERT_EQ(cache->lookup(foo), std::nullopt);
+}
+
+TEST(SharedPathInfoCache, largeEntries)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    auto cache = SharedPathInfoCache::open(tmpDir + "/cache", true, 64);
+
+    auto info = std::make_shared<ValidPathInfo>(*makeInfo());
+    for (int i = 0; i < 100; i++) {
+        info->references.insert(StorePath(fmt("4kmkv2phhwv0dy2zb3qqbyb4yrb9rxal-bar-%d", i)));
+    }
+    cache->insert(foo, info, cache->generation());
+    ASSERT_EQ(cache->lookup(foo), std::nullopt);
+}
+
+}
@@ -71,4 +71,35 @@ TEST(AsyncSemaphore, cancelledWaiter)
     ASSERT_TRUE(c.poll(waitScope));
 }
 
+TEST(AsyncSemaphore, priority)
+{
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+
+    AsyncSemaphore sem(1);
+
+    auto a = kj::evalNow([&] { return sem.acquire(); });
+    auto low = kj::evalNow([&] { return sem.acquire(1); });
+    auto high1 = kj::evalNow([&] { return sem.acquire(5); });
+    auto high2 = kj::evalNow([&] { return sem.acquire(5); });
+    auto none = kj::evalNow([&] { return sem.acquire(); });
+
+    ASSERT_TRUE(a.poll(waitScope));
+
+    a = nullptr;
+    ASSERT_TRUE(high1.poll(waitScope));
+    ASSERT_FALSE(high2.poll(waitScope));
+
+    high1 = nullptr;
+    ASSERT_TRUE(high2.poll(waitScope));
+    ASSERT_FALSE(low.poll(waitScope));
+
+    high2 = nullptr;
+    ASSERT_TRUE(low.poll(waitScope));
+    ASSERT_FALSE(none.poll(waitScope));
+
+    low = nullptr;
+    ASSERT_TRUE(none.poll(waitScope));
+}
+
 }
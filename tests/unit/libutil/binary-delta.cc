@@ -0,0 +1,119 @@
+#include "lix/libstore/temporary-dir.hh"
+#include "lix/libutil/binary-delta.hh"
+#include "lix/libutil/async-io.hh"
+#include "lix/libutil/async.hh"
+#include "lix/libutil/box_ptr.hh"
+#include "lix/libutil/c-calls.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/serialise.hh"
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <random>
+
+namespace nix {
+
+static std::string randomData(size_t size, unsigned seed)
+{
+    std::mt19937 gen(seed);
+    std::string data(size, 0);
+    for (auto & c : data) {
+        c = char(gen());
+    }
+    return data;
+}
+
+static std::string encode(std::string_view base, std::string_view target, size_t writeSize)
+{
+    DeltaBaseIndex index(base);
+    StringSink delta;
+    DeltaEncoderSink encoder(index, delta);
+    for (size_t i = 0; i < target.size(); i += writeSize) {
+        encoder(target.substr(i, writeSize));
+    }
+    encoder.finish();
+    return std::move(delta.s);
+}
+
+static std::string decode(std::string_view base, std::string_view delta)
+{
+    StringSource source{delta};
+    auto decoded = makeDeltaDecodingSource(base, source)->drain();
+    EXPECT_EQ(source.drain(), "") << "delta not fully consumed";
+    return decoded;
+}
+
+TEST(binaryDelta, roundTrips)
+{
+    auto base = randomData(300 * 1024, 1);
+
+    // insertions, deletions and replacements at unaligned offsets
+    auto target = base;
+    target.insert(12345, "some inserted text");
+    target.erase(100000, 777);
+    target.replace(200001, 5000, randomData(5000, 2));
+    target += randomData(1234, 3);
+
+    for (size_t writeSize : {1u, 1000u, 65536u, 1u << 20}) {
+        auto delta = encode(base, target, writeSize);
+        ASSERT_EQ(decode(base, delta), target);
+        // only the changed parts should be sent literally
+        ASSERT_LT(delta.size(), 32 * 1024);
+    }
+}
+
+TEST(binaryDelta, unrelatedAndEmpty)
+{
+    auto base = randomData(64 * 1024, 4);
+    auto target = randomData(100 * 1024 + 3, 5);
+
+    ASSERT_EQ(decode(base, encode(base, target, 4096)), target);
+    ASSERT_EQ(decode("", encode("", target, 4096)), target);
+    ASSERT_EQ(decode(base, encode(base, "", 4096)), "");
+}
+
+TEST(binaryDelta, asyncEncoding)
+{
+    AsyncIoRoot aio;
+
+    auto base = std::make_shared<const std::string>(randomData(100 * 1024, 6));
+    auto target = base->substr(1000) + "tail";
+
+    auto delta = aio.blockOn(
+        makeDeltaEncodingStream(base, make_box_ptr<AsyncStringInputStream>(target))->drain()
+    );
+    ASSERT_EQ(decode(*base, delta), target);
+}
+
+TEST(binaryDelta, decodingFromFile)
+{
+    auto base = randomData(200 * 1024, 7);
+    auto target = base.substr(50000) + randomData(3000, 8) + base.substr(0, 50000);
+    auto delta = encode(base, target, 65536);
+
+    auto tmpDir = createTempDir();
+    AutoDelete _delete(tmpDir);
+    writeFile(tmpDir + "/base", base);
+    auto fd = sys::open(tmpDir + "/base", O_RDONLY | O_CLOEXEC);
+    ASSERT_TRUE(fd);
+
+    StringSource source{delta};
+    ASSERT_EQ(makeDeltaDecodingSource(fd.get(), base.size(), source)->drain(), target);
+    ASSERT_EQ(source.drain(), "");
+
+    // the base size is checked before the file is read
+    StringSink badDelta;
+    badDelta << DELTA_COPY << base.size() - 10 << 100 << DELTA_END;
+    StringSource badSource{badDelta.s};
+    ASSERT_THROW(makeDeltaDecodingSource(fd.get(), base.size(), badSource)->drain(), BadDelta);
+}
+
+TEST(binaryDelta, rejectsCopiesOutOfBounds)
+{
+    StringSink delta;
+    delta << DELTA_COPY << 10 << 100 << DELTA_END;
+    StringSource source{delta.s};
+    ASSERT_THROW(makeDeltaDecodingSource("short base", source)->drain(), BadDelta);
+}
+
+}
@@ -149,6 +149,84 @@ TEST_P(PerTypeCompressionTest, sinkAndAsyncStream)
     ASSERT_STREQ(aio.blockOn(decompressionStream->drain()).c_str(), inputString);
 }
 
+TEST_P(PerTypeCompressionTest, framedSinkAndSource)
+{
+    auto method = GetParam();
+    // more than one frame, and not a multiple of the frame size
+    std::string input;
+    for (size_t i = 0; input.size() < FRAMED_COMPRESSION_CHUNK_SIZE * 5 / 2; i++) {
+        input += std::to_string(i);
+    }
+
+    StringSink strSink;
+    auto sink = makeFramedCompressionSink(method, strSink);
+    (*sink)(input);
+    sink->finish();
+    strSink << "trailer";
+
+    StringSource source{strSink.s};
+    {
+        auto decompressed = makeFramedDecompressionSource(method, source);
+        std::string prefix(100, 0);
+        (*decompressed)(prefix.data(), prefix.size());
+        ASSERT_EQ(prefix, input.substr(0, 100));
+        // finishing early must still consume all frames
+        decompressed->finish();
+    }
+    ASSERT_EQ(readString(source), "trailer");
+
+    StringSource again{strSink.s};
+    ASSERT_EQ(makeFramedDecompressionSource(method, again)->drain(), input);
+}
+
+TEST_P(PerTypeCompressionTest, framedParallel)
+{
+    AsyncIoRoot aio;
+
+    auto method = GetParam();
+    // many frames with different contents, so that reordering them shows
+    std::string input;
+    for (size_t i = 0; input.size() < FRAMED_COMPRESSION_CHUNK_SIZE * 40 + 3; i++) {
+        input += std::to_string(i);
+    }
+
+    StringSink compressed;
+    auto sink = makeFramedCompressionSink(method, compressed, true);
+    (*sink)(input);
+    sink->finish();
+    StringSource source{compressed.s};
+    ASSERT_EQ(makeFramedDecompressionSource(method, source)->drain(), input);
+
+    auto stream =
+        makeFramedCompressionStream(method, make_box_ptr<AsyncStringInputStream>(input), true);
+    StringSource streamed{aio.blockOn(stream->drain())};
+    ASSERT_EQ(makeFramedDecompressionSource(method, streamed)->drain(), input);
+}
+
+TEST_P(PerTypeCompressionTest, framedAsyncStreams)
+{
+    AsyncIoRoot aio;
+
+    auto method = GetParam();
+    auto input = std::string(FRAMED_COMPRESSION_CHUNK_SIZE + 17, 'x');
+
+    auto compressed = aio.blockOn(
+        makeFramedCompressionStream(method, make_box_ptr<AsyncStringInputStream>(input))->drain()
+    );
+
+    StringSource syncSource{compressed};
+    ASSERT_EQ(makeFramedDecompressionSource(method, syncSource)->drain(), input);
+
+    StringSink withTrailer;
+    withTrailer(compressed);
+    withTrailer << "trailer";
+    AsyncStringInputStream raw{withTrailer.s};
+    AsyncFramedDecompressionStream stream{method, raw};
+    ASSERT_EQ(aio.blockOn(stream.drain()), input);
+    aio.blockOn(stream.finish());
+    ASSERT_EQ(aio.blockOn(readString(raw)), "trailer");
+}
+
 /* ---------------------------------------
  * Non null compression types
  * --------------------------------------- */
@@ -64,4 +64,18 @@ namespace nix {
                     "legacyPackages.x86_64-lin(ux.git-crypt)"
         );
     }
+
+    TEST(hiliteMatches, programMatches) {
+        std::string str = "legacyPackages.x86_64-linux.git-crypt";
+        std::vector<regex::Match> matches;
+        for (auto re : {"t-cry", "ux\\.git-cry", "git-c", "pt"}) {
+            for (auto & m : regex::Program::compile(re)->searchAll(str)) {
+                matches.push_back(m);
+            }
+        }
+        ASSERT_STREQ(
+                    hiliteMatches(str, matches, "(", ")").c_str(),
+                    "legacyPackages.x86_64-lin(ux.git-crypt)"
+        );
+    }
 }
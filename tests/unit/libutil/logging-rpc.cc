@@ -0,0 +1,122 @@
+#include "lix/libutil/logging-rpc.hh"
+#include "lix/libutil/finally.hh"
+#include "lix/libutil/strings.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+/* Records what the events of a log frame turned into. */
+struct RecordingLogger : Logger
+{
+    std::vector<std::string> events;
+
+    BufferState log(Verbosity lvl, std::string_view s) override
+    {
+        events.push_back(fmt("log %d %s", lvl, s));
+        return BufferState::HasSpace;
+    }
+
+    BufferState logEI(const ErrorInfo & ei) override
+    {
+        events.push_back(fmt("logEI %d", ei.level));
+        return BufferState::HasSpace;
+    }
+
+    BufferState startActivityImpl(
+        ActivityId act,
+        Verbosity lvl,
+        ActivityType type,
+        const std::string & s,
+        const Fields & fields,
+        ActivityId parent
+    ) override
+    {
+        events.push_back(fmt("start %d %s %d", type, s, fields.size()));
+        return BufferState::HasSpace;
+    }
+
+    BufferState stopActivityImpl(ActivityId act) override
+    {
+        events.push_back("stop");
+        return BufferState::HasSpace;
+    }
+
+    BufferState resultImpl(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        events.push_back(fmt("result %d %s", type, fields.at(0).s));
+        return BufferState::HasSpace;
+    }
+};
+
+TEST(FramedLogger, roundTrip)
+{
+    auto framed = rpc::log::makeFramedLogger();
+
+    testing::internal::CaptureStderr();
+    {
+        auto act = framed->startActivity(lvlInfo, actBuild, "building foo", {"foo", 1});
+        (void) act.result(resBuildLogLine, "a line");
+        (void) framed->log(lvlWarn, "a warning");
+    }
+    (void) framed->flush();
+    auto frames = tokenizeString<Strings>(testing::internal::GetCapturedStderr(), "\n");
+    ASSERT_FALSE(frames.empty());
+
+    RecordingLogger recorder;
+    auto prevLogger = logger;
+    logger = &recorder;
+    Finally restoreLogger([&] { logger = prevLogger; });
+
+    {
+        auto parent = recorder.startActivity(lvlInfo, actBuilds, "parent");
+        std::map<ActivityId, Activity> activities;
+        for (auto & frame : frames) {
+            ASSERT_TRUE(frame.starts_with(rpc::log::framePrefix));
+            ASSERT_TRUE(rpc::log::handleLogFrame(frame, parent, activities, "the test"));
+        }
+        ASSERT_TRUE(activities.empty());
+    }
+
+    ASSERT_EQ(
+        recorder.events,
+        (std::vector<std::string>{
+            fmt("start %d parent 0", actBuilds),
+            fmt("start %d building foo 2", actBuild),
+            fmt("result %d a line", resBuildLogLine),
+            "stop",
+            fmt("log %d a warning", lvlWarn),
+            "stop",
+        })
+    );
+}
+
+TEST(FramedLogger, otherMessages)
+{
+    RecordingLogger recorder;
+    auto prevLogger = logger;
+    logger = &recorder;
+    Finally restoreLogger([&] { logger = prevLogger; });
+
+    auto parent = recorder.startActivity(lvlInfo, actBuilds, "parent");
+    std::map<ActivityId, Activity> activities;
+
+    ASSERT_EQ(rpc::log::handleLogFrame("a line", parent, activities, "the test"), std::nullopt);
+    ASSERT_EQ(
+        rpc::log::handleLogFrame("@nix {}", parent, activities, "the test"), std::nullopt
+    );
+    ASSERT_EQ(recorder.events.size(), 1);
+
+    // broken frames are reported, but are not fatal
+    ASSERT_EQ(
+        rpc::log::handleLogFrame("@nix-frame !!!", parent, activities, "the test"), std::nullopt
+    );
+    ASSERT_EQ(recorder.events.size(), 2);
+
+    // json messages are still understood
+    ASSERT_TRUE(rpc::log::handleStructuredLogMessage(
+        "@nix {\"action\":\"msg\",\"level\":1,\"msg\":\"hi\"}", parent, activities, "the test"
+    ));
+}
+
+}
@@ -0,0 +1,166 @@
+#include "lix/libutil/regex.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+using Groups = std::vector<std::optional<std::string>>;
+
+static std::optional<Groups> match(std::string_view re, std::string_view subject)
+{
+    auto m = regex::Program::compile(re)->match(subject);
+    if (!m) {
+        return std::nullopt;
+    }
+    Groups groups;
+    for (size_t i = 0; i < m->groups(); i++) {
+        groups.push_back(m->matched(i) ? std::optional(std::string(m->str(subject, i))) : std::nullopt);
+    }
+    return groups;
+}
+
+static std::optional<Groups> stdMatch(std::string_view re, std::string_view subject)
+{
+    std::cmatch m;
+    if (!std::regex_match(
+            subject.begin(), subject.end(), m, std::regex(re.begin(), re.end(), std::regex::extended)
+        ))
+    {
+        return std::nullopt;
+    }
+    Groups groups;
+    for (size_t i = 0; i < m.size(); i++) {
+        groups.push_back(m[i].matched ? std::optional(m[i].str()) : std::nullopt);
+    }
+    return groups;
+}
+
+static std::vector<std::string> split(std::string_view re, std::string_view subject)
+{
+    std::vector<std::string> result;
+    size_t last = 0;
+    for (auto & m : regex::Program::compile(re)->searchAll(subject)) {
+        result.emplace_back(subject.substr(last, m.position() - last));
+        result.emplace_back(m.str(subject));
+        last = m.position() + m.length();
+    }
+    result.emplace_back(subject.substr(last));
+    return result;
+}
+
+static std::vector<std::string> stdSplit(std::string_view re, std::string_view subject)
+{
+    std::vector<std::string> result;
+    std::regex r(re.begin(), re.end(), std::regex::extended);
+    size_t last = 0;
+    for (auto it = std::cregex_iterator(subject.begin(), subject.end(), r);
+         it != std::cregex_iterator();
+         ++it)
+    {
+        result.emplace_back(subject.substr(last, it->position() - last));
+        result.emplace_back(it->str());
+        last = it->position() + it->length();
+    }
+    result.emplace_back(subject.substr(last));
+    return result;
+}
+
+TEST(regex, matchesLikeStdRegex)
+{
+    std::vector<std::string> patterns = {
+        "",
+        "a",
+        "abc",
+        "a*",
+        "(a*)*",
+        "(a|ab)(c|bcd)(d*)",
+        "(a+|b)*",
+        "(a+|b){0,}",
+        "(a+|b)+",
+        "(a+|b)?",
+        "(b|)*",
+        "([^-]*)-(.*)",
+        "(.*)\\.nix",
+        "([0-9]+)\\.([0-9]+)(\\.([0-9]+))?(.*)",
+        "[[:alpha:]_][[:alnum:]_'-]*",
+        "x{2}",
+        "x{2,}",
+        "x{1,3}y",
+        "(a|b)c|a(b|c)",
+        "[]a]+",
+        "[^]a]+",
+        "[a-c-]+",
+        "[\\]+",
+        "\\.\\*\\[",
+        "^a$",
+        "(^a|b$)+",
+        "((a)|b)+",
+        "(a*)+b",
+        "(()|a)+",
+    };
+    std::vector<std::string> subjects = {
+        "", "a", "aa", "ab", "abc", "abcd", "ba", "bab", "aab", "foo-bar-baz", "foo.nix",
+        "1.2.3-pre", "xx", "xxxy", "]a]", "a-c", "\\\\", ".*[", "b", "ac",
+    };
+
+    for (auto & re : patterns) {
+        for (auto & subject : subjects) {
+            EXPECT_EQ(match(re, subject), stdMatch(re, subject)) << re << " on '" << subject << "'";
+            EXPECT_EQ(split(re, subject), stdSplit(re, subject)) << re << " on '" << subject << "'";
+        }
+    }
+}
+
+TEST(regex, longestMatch)
+{
+    ASSERT_EQ(split("a|ab", "xabx"), (std::vector<std::string>{"x", "ab", "x"}));
+    // libstdc++ stops at "c" here, POSIX wants the longest match
+    ASSERT_EQ(split("c?(c.?)?", "cbc"), (std::vector<std::string>{"", "cb", "", "c", "", "", ""}));
+    ASSERT_NE(split("c?(c.?)?", "cbc"), stdSplit("c?(c.?)?", "cbc"));
+    ASSERT_EQ(match("(a|ab)(c|bcd)(d*)", "abcd"), (Groups{"abcd", "a", "bcd", ""}));
+}
+
+TEST(regex, linearTime)
+{
+    // exponential for backtracking matchers, and deep enough to overflow their stack
+    std::string subject(1'000'000, 'a');
+    auto program = regex::Program::compile("(a*)*b");
+    ASSERT_FALSE(program->match(subject));
+    ASSERT_TRUE(program->searchAll(subject).empty());
+
+    auto m = regex::Program::compile("((a|b)*)c?")->match(subject);
+    ASSERT_TRUE(m);
+    ASSERT_EQ(m->length(1), subject.size());
+    ASSERT_EQ(m->position(2), subject.size() - 1);
+}
+
+TEST(regex, ignoreCase)
+{
+    auto program = regex::Program::compile("hello-[a-z]+", true);
+    ASSERT_TRUE(program->contains("say HELLO-World"));
+    ASSERT_FALSE(program->contains("say hello_world"));
+    ASSERT_FALSE(regex::Program::compile("hello")->contains("HELLO"));
+}
+
+TEST(regex, errors)
+{
+    ASSERT_THROW(regex::Program::compile("(.*"), regex::Error);
+    ASSERT_THROW(regex::Program::compile("f(o*o"), regex::Error);
+    ASSERT_THROW(regex::Program::compile("a)"), regex::Error);
+    ASSERT_THROW(regex::Program::compile("*a"), regex::Error);
+    ASSERT_THROW(regex::Program::compile("[a"), regex::Error);
+    ASSERT_THROW(regex::Program::compile("a\\"), regex::Error);
+    ASSERT_THROW(regex::Program::compile("a{2,1}"), regex::Error);
+    ASSERT_THROW(regex::Program::compile("[[:foo:]]"), regex::Error);
+    ASSERT_THROW(regex::Program::compile("(((a{1000}){1000}){1000})"), regex::Error);
+}
+
+TEST(regex, cache)
+{
+    auto a = regex::cached("a+b");
+    ASSERT_EQ(a, regex::cached("a+b"));
+    ASSERT_NE(a, regex::cached("a+b", true));
+    ASSERT_NE(a, regex::cached("a+c"));
+}
+
+}
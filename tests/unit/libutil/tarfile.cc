@@ -4,6 +4,7 @@
 
 #include "lix/libutil/tarfile.hh"
 #include "lix/libstore/temporary-dir.hh"
+#include "lix/libutil/archive.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/file-system.hh"
 #include "lix/libutil/serialise.hh"
@@ -168,6 +169,11 @@ struct TarFixture : testing::Test
     }
 
     FileChecker extract();
+
+    /**
+     * NAR of the single top-level member, read without unpacking.
+     */
+    std::string streamNar(uint64_t memoryBudget = TARBALL_MEMORY_BUDGET);
 };
 
 FileChecker TarFixture::extract()
@@ -182,6 +188,24 @@ FileChecker TarFixture::extract()
     return FileChecker{tmpDir};
 }
 
+std::string TarFixture::streamNar(uint64_t memoryBudget)
+{
+    finish();
+
+    StringSource source{sink.s};
+    TarArchive archive("test", source);
+    TarballTree tree(
+        archive,
+        [] {
+            auto [fd, path] = createTempFile();
+            deletePath(path);
+            return std::move(fd);
+        },
+        memoryBudget
+    );
+    return GeneratorSource(tree.dump()).drain();
+}
+
 TEST_F(TarFixture, readTrivial)
 {
     writer->dir("foo");
@@ -250,4 +274,69 @@ TEST_F(TarFixture, badHardlinkTraversalOverFile)
     ASSERT_THROW(extract(), ArchiveError);
 }
 
+TEST_F(TarFixture, streamingMatchesUnpacking)
+{
+    writer->dir("top", 0755);
+    writer->file("top/zzz", "last", 0644);
+    writer->file("top/exec", "#!/bin/sh", 0755);
+    writer->file("top/implicit/parents/file", "nested");
+    writer->symlink("top/link", "zzz");
+    writer->hardlink("top/hardlink", "top/exec");
+    writer->file("top/a-b", "sorts before a/");
+    writer->dir("top/a", 0755);
+    writer->file("top/a/b", "in a directory");
+    writer->file("top/zzz", "overwritten", 0644);
+
+    auto streamed = streamNar();
+    auto spilled = streamNar(4);
+    extract();
+    auto unpacked = GeneratorSource(dumpPath(tmpDir + "/top")).drain();
+
+    ASSERT_EQ(streamed, unpacked);
+    ASSERT_EQ(spilled, unpacked);
+}
+
+TEST_F(TarFixture, streamingSingleFile)
+{
+    writer->file("./only", "contents", 0755);
+
+    auto streamed = streamNar();
+    extract();
+    ASSERT_EQ(streamed, GeneratorSource(dumpPath(tmpDir + "/only")).drain());
+}
+
+TEST_F(TarFixture, streamingRejectsMultipleTopLevelMembers)
+{
+    writer->file("one", "1");
+    writer->file("two", "2");
+
+    ASSERT_THROW(streamNar(), Error);
+}
+
+TEST_F(TarFixture, streamingRejectsDotdot)
+{
+    writer->dir("../foo");
+    writer->file("../foo/bar", "blah");
+
+    ASSERT_THROW(streamNar(), ArchiveError);
+}
+
+TEST_F(TarFixture, streamingRejectsBadHardlinks)
+{
+    writer->dir("somedir");
+    writer->hardlink("somedir/link", "somedir/somefile");
+    writer->file("somedir/somefile", "mrrp");
+
+    ASSERT_THROW(streamNar(), ArchiveError);
+}
+
+TEST_F(TarFixture, streamingRejectsFileOnTopOfFile)
+{
+    writer->dir("somedir");
+    writer->file("somedir/file", "ohno");
+    writer->file("somedir/file/mrrp", "mrrp");
+
+    ASSERT_THROW(streamNar(), ArchiveError);
+}
+
 }